@@ -1,7 +1,29 @@
-﻿#include "config.h"
+﻿/* Linux 固有のシステムコール (syscall(2) など) の宣言を得るために必要 */
+#if !defined( _GNU_SOURCE )
+#define _GNU_SOURCE 1
+#endif /* !defined( _GNU_SOURCE ) */
+
+#include "config.h"
 #include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#if defined( HAVE_SYS_PIDFD_H )
+#include <sys/pidfd.h>
+#endif /* defined( HAVE_SYS_PIDFD_H ) */
+#if defined( HAVE_SYS_PRCTL_H )
+#include <sys/prctl.h>
+#endif /* defined( HAVE_SYS_PRCTL_H ) */
+#if defined( __linux__ )
+#include <sys/syscall.h>
+#endif /* defined( __linux__ ) */
 #include "alternative.h"
 
+#if !defined( CLOSE_RANGE_CLOEXEC )
+#define CLOSE_RANGE_CLOEXEC ( 1U << 2 )
+#endif /* !defined( CLOSE_RANGE_CLOEXEC ) */
+
 /**
    fdatasync は、プラットホーム依存なところがあるので、それの吸収用のプロシージャ
    
@@ -32,4 +54,150 @@ int x_fdatasync( int fd )
   return result;
 }
 
+/**
+   pidfd_open(2) は glibc 2.36 から関数が用意されているので、
+   関数が無い場合には syscall(2) で直接呼び出す。
+   カーネルが対応していない場合( 5.3 より前 ) は ENOSYS が返る。
+ */
+int x_pidfd_open( pid_t pid )
+{
+#if defined( HAVE_PIDFD_OPEN )
+  return pidfd_open( pid , 0 );
+#elif defined( SYS_pidfd_open )
+  return (int)syscall( SYS_pidfd_open , pid , 0 );
+#else /* defined( HAVE_PIDFD_OPEN ) */
+  (void)pid;
+  errno = ENOSYS;
+  return -1;
+#endif /* defined( HAVE_PIDFD_OPEN ) */
+}
+
+/**
+   pidfd_send_signal(2) も glibc 2.36 から関数が用意されているので、
+   関数が無い場合には syscall(2) で直接呼び出す。 ( カーネルは 5.1 から )
+ */
+int x_pidfd_send_signal( int pidfd , int signo )
+{
+#if defined( HAVE_PIDFD_SEND_SIGNAL )
+  return pidfd_send_signal( pidfd , signo , NULL , 0 );
+#elif defined( SYS_pidfd_send_signal )
+  return (int)syscall( SYS_pidfd_send_signal , pidfd , signo , NULL , 0 );
+#else /* defined( HAVE_PIDFD_SEND_SIGNAL ) */
+  (void)pidfd;
+  (void)signo;
+  errno = ENOSYS;
+  return -1;
+#endif /* defined( HAVE_PIDFD_SEND_SIGNAL ) */
+}
+
+/**
+   F_SETPIPE_SZ は Linux 2.6.35 から
+   /proc/sys/fs/pipe-max-size を超える大きさは、特権が無いと EPERM になる。
+ */
+int x_set_pipe_size( int fd , int size )
+{
+#if defined( F_SETPIPE_SZ )
+  return fcntl( fd , F_SETPIPE_SZ , size );
+#else /* defined( F_SETPIPE_SZ ) */
+  (void)fd;
+  (void)size;
+  errno = ENOSYS;
+  return -1;
+#endif /* defined( F_SETPIPE_SZ ) */
+}
+
+/**
+   PR_SET_CHILD_SUBREAPER は Linux 3.4 から
+ */
+int x_set_child_subreaper( void )
+{
+#if defined( HAVE_SYS_PRCTL_H ) && defined( PR_SET_CHILD_SUBREAPER )
+  return prctl( PR_SET_CHILD_SUBREAPER , 1UL , 0UL , 0UL , 0UL );
+#else /* defined( HAVE_SYS_PRCTL_H ) && defined( PR_SET_CHILD_SUBREAPER ) */
+  errno = ENOSYS;
+  return -1;
+#endif /* defined( HAVE_SYS_PRCTL_H ) && defined( PR_SET_CHILD_SUBREAPER ) */
+}
+
+/**
+   posix_fadvise(3) は errno を設定せずに、エラー番号を返す
+ */
+int x_fadvise_cache( int fd , int need )
+{
+#if defined( HAVE_POSIX_FADVISE ) && defined( POSIX_FADV_WILLNEED )
+  const int err = posix_fadvise( fd , 0 , 0 , ( need ) ? POSIX_FADV_WILLNEED : POSIX_FADV_DONTNEED );
+  if( 0 != err ){
+    errno = err;
+    return -1;
+  }
+  return 0;
+#else /* defined( HAVE_POSIX_FADVISE ) && defined( POSIX_FADV_WILLNEED ) */
+  (void)fd;
+  (void)need;
+  errno = ENOSYS;
+  return -1;
+#endif /* defined( HAVE_POSIX_FADVISE ) && defined( POSIX_FADV_WILLNEED ) */
+}
 
+/**
+   close_range(2) の CLOSE_RANGE_CLOEXEC は Linux 5.11 から ( それより前は EINVAL か ENOSYS )
+   /proc/self/fd は opendir(3) が malloc(3) するので、 getdents64(2) をスタックのバッファで直接呼ぶ。
+   RLIMIT_NOFILE まで一つずつ fcntl(2) するのは、上限が大きいと遅すぎるので行わない。
+ */
+int x_set_cloexec_from( int first )
+{
+#if defined( SYS_close_range )
+  if( 0 == syscall( SYS_close_range , (unsigned int)first , ~0U , CLOSE_RANGE_CLOEXEC ) ){
+    return 0;
+  }
+#endif /* defined( SYS_close_range ) */
+#if defined( SYS_getdents64 )
+  const int dir = open( "/proc/self/fd" , O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+  if( -1 == dir ){
+    return -1;
+  }
+  /* struct linux_dirent64 の d_reclen と d_name の位置 */
+  enum{ RECLEN_OFFSET = 16 , NAME_OFFSET = 19 };
+  int result = 0;
+  for(;;){
+    union{
+      char bytes[4096];
+      unsigned long long align;
+    } buffer;
+    const long length = syscall( SYS_getdents64 , dir , buffer.bytes , sizeof( buffer.bytes ) );
+    if( length <= 0 ){
+      result = ( 0 == length ) ? 0 : -1;
+      break;
+    }
+    for( long offset = 0 ; offset < length ; ){
+      const char* const entry = buffer.bytes + offset;
+      unsigned short reclen = 0;
+      memcpy( &reclen , entry + RECLEN_OFFSET , sizeof( reclen ) );
+      if( 0 == reclen ){
+        break;
+      }
+      int fd = 0;
+      const char* p = entry + NAME_OFFSET;
+      for( ; '0' <= *p && *p <= '9' ; ++p ){
+        fd = fd * 10 + ( *p - '0' );
+      }
+      /* "." と ".." は数字で始まらない */
+      if( p != entry + NAME_OFFSET && '\0' == *p && first <= fd && dir != fd ){
+        const int flags = fcntl( fd , F_GETFD );
+        if( -1 != flags && !( flags & FD_CLOEXEC ) ){
+          (void)fcntl( fd , F_SETFD , flags | FD_CLOEXEC );
+        }
+      }
+      offset += reclen;
+    }
+  }
+  const int err = errno;
+  (void)close( dir );
+  errno = err;
+  return result;
+#else /* defined( SYS_getdents64 ) */
+  (void)first;
+  errno = ENOSYS;
+  return -1;
+#endif /* defined( SYS_getdents64 ) */
+}
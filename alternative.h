@@ -1,9 +1,55 @@
 ﻿#if ! defined( ALTERNATIVE_H_HEADER_GUARD )
 #define ALTERNATIVE_H_HEADER_GUARD 1
 
+#include <sys/types.h>
+
 /**
    fdatasync の OS 依存wrapper
  */
 int x_fdatasync( int fd );
 
+/**
+   pidfd_open(2) の OS 依存wrapper
+   pidfd が使えない環境では -1 を返し、 errno に ENOSYS を設定する。
+   戻り値のファイルディスクリプタには、 close-on-exec が設定されている。
+ */
+int x_pidfd_open( pid_t pid );
+
+/**
+   pidfd_send_signal(2) の OS 依存wrapper
+   pidfd が使えない環境では -1 を返し、 errno に ENOSYS を設定する。
+   プロセスがすでに終了している場合は ESRCH になる。 ( PID が再利用されていても、別のプロセスには届かない )
+ */
+int x_pidfd_send_signal( int pidfd , int signo );
+
+/**
+   パイプの容量を変更する fcntl( fd , F_SETPIPE_SZ ) の OS 依存wrapper
+   F_SETPIPE_SZ が無い環境では -1 を返し、 errno に ENOSYS を設定する。
+   @return 変更後のパイプの容量 ( カーネルがページ単位に切り上げる ) 失敗した場合は -1
+ */
+int x_set_pipe_size( int fd , int size );
+
+/**
+   prctl( PR_SET_CHILD_SUBREAPER ) の OS 依存wrapper
+   呼び出したプロセスの子孫が孤児になった時に、 init ではなく、呼び出したプロセスの子プロセスにする。
+   PR_SET_CHILD_SUBREAPER が無い環境 ( Linux 3.4 より前を含む ) では -1 を返し、 errno に ENOSYS を設定する。
+ */
+int x_set_child_subreaper( void );
+
+/**
+   posix_fadvise( fd , 0 , 0 , POSIX_FADV_WILLNEED か POSIX_FADV_DONTNEED ) の OS 依存wrapper
+   need が 0 以外の場合はファイル全体の先読みを頼んで、読み終わるのを待たずに戻る。
+   0 の場合はファイルのページをページキャッシュから追い出す。 ( マップされているページは残る )
+   posix_fadvise(3) が無い環境では -1 を返し、 errno に ENOSYS を設定する。
+ */
+int x_fadvise_cache( int fd , int need );
+
+/**
+   first 以上の全ての fd に close-on-exec を付ける
+   close_range( first , ~0U , CLOSE_RANGE_CLOEXEC ) を使い、使えない場合は /proc/self/fd を辿る。
+   fork(2) や vfork の子プロセスから呼べるように、非同期シグナル安全な関数だけを使う。
+   どちらも使えない環境では -1 を返し、 errno に ENOSYS を設定する。
+ */
+int x_set_cloexec_from( int first );
+
 #endif /* ALTERNATIVE_H_HEADER_GUARD */
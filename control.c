@@ -0,0 +1,602 @@
+﻿/**
+   コントロールソケット ( 長さを前置したバイナリのフレームで、要求と応答をやり取りする )
+ */
+
+/* accept4(2) の宣言を得るために必要 */
+#if !defined( _GNU_SOURCE )
+#define _GNU_SOURCE 1
+#endif /* !defined( _GNU_SOURCE ) */
+
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif /* defined(HAVE_CONFIG_H) */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <assert.h>
+
+#include "verify.h"
+#include "eventloop.h"
+#include "control.h"
+
+enum{
+  /** フレームの長さの部分の大きさ */
+  CONTROL_HEADER_SIZE = 4,
+  /** 同時に接続できるクライアントの数 これを超えた接続はすぐに閉じる */
+  CONTROL_MAX_CLIENTS = 1024
+};
+
+/** クライアントが読まずに溜まった応答がこの大きさを超えたら、そのクライアントの要求の処理を止める */
+#define CONTROL_OUTPUT_HIGH_WATER ( (size_t)256 * 1024 )
+
+/** 接続しているクライアント一つ分 */
+struct control_client{
+  struct control_server* server;
+  int fd;
+  /** 登録しているイベントの種類 */
+  unsigned int events;
+  /** 相手が書き込み側を閉じたかどうか */
+  int eof;
+  /** 受け取った要求 ( 一つ分のフレームが収まる ) */
+  unsigned char input[CONTROL_HEADER_SIZE + CONTROL_REQUEST_MAX];
+  size_t input_length;
+  /** 送っていない応答 */
+  struct control_buffer output;
+  size_t output_offset;
+  struct control_client* prev;
+  struct control_client* next;
+};
+
+struct control_server{
+  struct event_loop* loop;
+  int fd;
+  char* path;
+  control_server_handler handler;
+  void* context;
+  /** 応答の本体を組み立てる領域 ( 全てのクライアントで使いまわす ) */
+  struct control_buffer scratch;
+  struct control_client* clients;
+  size_t client_count;
+};
+
+/**
+   待ち受けているソケットが読み込み可能になった時のハンドラ EAGAIN になるまで accept(2) する
+ */
+static void control_server_on_accept( struct event_loop* loop , int fd , unsigned int events , void* context );
+
+/**
+   クライアントのソケットのハンドラ
+ */
+static void control_client_on_event( struct event_loop* loop , int fd , unsigned int events , void* context );
+
+/**
+   溜まった応答を送り、受け取った要求を処理して、続きを読む
+   どれも進まなくなったら、必要なイベントを登録しなおす。 クライアントを閉じることがある。
+ */
+static void control_client_service( struct control_client* client );
+
+/**
+   input の先頭にあるフレームの本体の長さ
+   @return 一つ分のフレームが揃っていない場合は 0 長さが不正な場合は SIZE_MAX
+ */
+static size_t control_client_frame_length( const struct control_client* client );
+
+/**
+   要求を一つ handler に渡して、応答をフレームにして output に追加する
+ */
+static void control_client_dispatch( struct control_client* client , const unsigned char* request , size_t length );
+
+/**
+   クライアントをイベントループから外して閉じ、解放する
+ */
+static void control_client_close( struct control_client* client );
+
+/**
+   buffer の領域を、少なくとも length バイト追加できるように広げる
+   @return 成功した場合は 0 失敗した場合は -1 ( failed を立てる )
+ */
+static int control_buffer_reserve( struct control_buffer* buffer , size_t length );
+
+/**
+   length バイトを全て送る ( クライアント )
+   @return 成功した場合は 0 失敗した場合は -1
+ */
+static int control_send_all( int fd , const void* data , size_t length );
+
+/**
+   length バイトを全て受け取る ( クライアント )
+   @return 成功した場合は 0 失敗した場合は -1 ( 途中で閉じられた場合は ECONNRESET )
+ */
+static int control_recv_all( int fd , void* data , size_t length );
+
+/************************* 実装 **************************/
+
+struct control_server* control_server_create( struct event_loop* loop , const char* path ,
+                                              control_server_handler handler , void* context )
+{
+  assert( loop );
+  assert( path );
+  assert( handler );
+  struct sockaddr_un addr;
+  memset( &addr , 0 , sizeof( addr ) );
+  if( sizeof( addr.sun_path ) <= strlen( path ) ){
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  addr.sun_family = AF_UNIX;
+  memcpy( addr.sun_path , path , strlen( path ) + 1 );
+
+  struct control_server* const server = calloc( 1 , sizeof( struct control_server ) );
+  if( NULL == server ){
+    return NULL;
+  }
+  server->loop = loop;
+  server->fd = -1;
+  server->handler = handler;
+  server->context = context;
+  server->path = strdup( path );
+  if( NULL == server->path ){
+    goto ERROR_HANDLE_SOCKET;
+  }
+  server->fd = socket( AF_UNIX , SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK , 0 );
+  if( -1 == server->fd ){
+    goto ERROR_HANDLE_SOCKET;
+  }
+  (void)unlink( path );
+  if( -1 == bind( server->fd , (const struct sockaddr*)&addr , sizeof( addr ) ) ){
+    goto ERROR_HANDLE_SOCKET;
+  }
+  /* サービスを止められるので、同じユーザ以外は接続できないようにする */
+  if( -1 == chmod( path , S_IRUSR | S_IWUSR ) ||
+      -1 == listen( server->fd , SOMAXCONN ) ||
+      0 != event_loop_add_fd( loop , server->fd , EVENT_LOOP_READ , control_server_on_accept , server ) ){
+    const int err = errno;
+    (void)unlink( path );
+    errno = err;
+    goto ERROR_HANDLE_SOCKET;
+  }
+  return server;
+
+ERROR_HANDLE_SOCKET:
+  {
+    const int err = errno;
+    if( 0 <= server->fd ){
+      VERIFY( 0 == close( server->fd ) );
+    }
+    free( server->path );
+    free( server );
+    errno = err;
+  }
+  return NULL;
+}
+
+void control_server_destroy( struct control_server* server )
+{
+  if( NULL == server ){
+    return;
+  }
+  while( server->clients ){
+    control_client_close( server->clients );
+  }
+  VERIFY( 0 == event_loop_remove_fd( server->loop , server->fd ) );
+  VERIFY( 0 == close( server->fd ) );
+  (void)unlink( server->path );
+  control_buffer_free( &(server->scratch) );
+  free( server->path );
+  free( server );
+  return;
+}
+
+static void control_server_on_accept( struct event_loop* loop , int fd , unsigned int events , void* context )
+{
+  (void)events;
+  struct control_server* const server = context;
+  assert( server );
+  for(;;){
+    const int client_fd = accept4( fd , NULL , NULL , SOCK_NONBLOCK | SOCK_CLOEXEC );
+    if( -1 == client_fd ){
+      if( EINTR == errno || ECONNABORTED == errno ){
+        continue;
+      }
+      break; /* EAGAIN ( あるいは EMFILE など 接続はキューに残る ) */
+    }
+    struct control_client* const client =
+      ( server->client_count < CONTROL_MAX_CLIENTS ) ? calloc( 1 , sizeof( struct control_client ) ) : NULL;
+    if( NULL == client ){
+      VERIFY( 0 == close( client_fd ) );
+      continue;
+    }
+    client->server = server;
+    client->fd = client_fd;
+    client->events = EVENT_LOOP_READ;
+    if( 0 != event_loop_add_fd( loop , client_fd , client->events , control_client_on_event , client ) ){
+      VERIFY( 0 == close( client_fd ) );
+      free( client );
+      continue;
+    }
+    client->next = server->clients;
+    if( server->clients ){
+      server->clients->prev = client;
+    }
+    server->clients = client;
+    ++(server->client_count);
+  }
+  return;
+}
+
+static void control_client_on_event( struct event_loop* loop , int fd , unsigned int events , void* context )
+{
+  (void)loop;
+  (void)fd;
+  (void)events;
+  struct control_client* const client = context;
+  assert( client );
+  control_client_service( client );
+  return;
+}
+
+static void control_client_service( struct control_client* client )
+{
+  for(;;){
+    int progress = 0;
+    /* 溜まっている応答を送る */
+    while( client->output_offset < client->output.length ){
+      const ssize_t length = send( client->fd , client->output.data + client->output_offset ,
+                                   client->output.length - client->output_offset , MSG_NOSIGNAL );
+      if( -1 == length ){
+        if( EINTR == errno ){
+          continue;
+        }
+        if( EAGAIN == errno || EWOULDBLOCK == errno ){
+          break;
+        }
+        control_client_close( client );
+        return;
+      }
+      client->output_offset += (size_t)length;
+      progress = 1;
+    }
+    if( client->output_offset == client->output.length ){
+      client->output.length = 0;
+      client->output_offset = 0;
+    }
+    /* 受け取った要求を処理する 応答が溜まりすぎている間は、クライアントが読むのを待つ */
+    while( client->output.length - client->output_offset < CONTROL_OUTPUT_HIGH_WATER ){
+      const size_t length = control_client_frame_length( client );
+      if( SIZE_MAX == length ){
+        control_client_close( client ); /* 大きすぎる要求 ( プロトコルが違う ) */
+        return;
+      }
+      if( 0 == length ){
+        break;
+      }
+      control_client_dispatch( client , client->input + CONTROL_HEADER_SIZE , length );
+      if( client->output.failed ){
+        control_client_close( client );
+        return;
+      }
+      const size_t consumed = CONTROL_HEADER_SIZE + length;
+      memmove( client->input , client->input + consumed , client->input_length - consumed );
+      client->input_length -= consumed;
+      progress = 1;
+    }
+    const int pending = ( client->output_offset < client->output.length );
+    if( client->eof && !pending && 0 == control_client_frame_length( client ) ){
+      control_client_close( client );
+      return;
+    }
+    /* 続きを読む */
+    if( !client->eof && client->output.length - client->output_offset < CONTROL_OUTPUT_HIGH_WATER ){
+      const ssize_t length = recv( client->fd , client->input + client->input_length ,
+                                   sizeof( client->input ) - client->input_length , 0 );
+      if( 0 < length ){
+        client->input_length += (size_t)length;
+        progress = 1;
+      }else if( 0 == length ){
+        client->eof = 1;
+        progress = 1;
+      }else if( EINTR == errno ){
+        progress = 1;
+      }else if( EAGAIN != errno && EWOULDBLOCK != errno ){
+        control_client_close( client );
+        return;
+      }
+    }
+    if( !progress ){
+      break;
+    }
+  }
+  /* 読まない間は READ を外しておく ( select(2) 版で読めるままのソケットに起こされ続けないように ) */
+  const int pending = ( client->output_offset < client->output.length );
+  const unsigned int events =
+    ( ( !client->eof && client->output.length - client->output_offset < CONTROL_OUTPUT_HIGH_WATER ) ? EVENT_LOOP_READ : 0 ) |
+    ( ( pending ) ? EVENT_LOOP_WRITE : 0 );
+  if( events != client->events ){
+    VERIFY( 0 == event_loop_modify_fd( client->server->loop , client->fd , events ) );
+    client->events = events;
+  }
+  return;
+}
+
+static size_t control_client_frame_length( const struct control_client* client )
+{
+  if( client->input_length < CONTROL_HEADER_SIZE ){
+    return 0;
+  }
+  struct control_reader reader = { client->input , CONTROL_HEADER_SIZE , 0 , 0 };
+  const uint32_t length = control_reader_get_u32( &reader );
+  if( length < 2 || CONTROL_REQUEST_MAX < length ){
+    return SIZE_MAX;
+  }
+  return ( CONTROL_HEADER_SIZE + length <= client->input_length ) ? (size_t)length : 0;
+}
+
+static void control_client_dispatch( struct control_client* client , const unsigned char* request , size_t length )
+{
+  struct control_server* const server = client->server;
+  struct control_buffer* const response = &(server->scratch);
+  response->length = 0;
+  response->failed = 0;
+  control_buffer_put_u8( response , request[0] );
+  control_buffer_put_u8( response , 0 );
+  server->handler( server , request , length , response , server->context );
+  if( response->failed ){
+    /* 応答を組み立てられなかったことだけを返す */
+    response->length = 0;
+    response->failed = 0;
+    control_buffer_put_u8( response , request[0] );
+    control_buffer_put_u8( response , ENOMEM );
+  }
+  control_buffer_put_u32( &(client->output) , (uint32_t)response->length );
+  control_buffer_put_bytes( &(client->output) , response->data , response->length );
+  return;
+}
+
+static void control_client_close( struct control_client* client )
+{
+  struct control_server* const server = client->server;
+  VERIFY( 0 == event_loop_remove_fd( server->loop , client->fd ) );
+  VERIFY( 0 == close( client->fd ) );
+  if( client->prev ){
+    client->prev->next = client->next;
+  }else{
+    server->clients = client->next;
+  }
+  if( client->next ){
+    client->next->prev = client->prev;
+  }
+  assert( 0 < server->client_count );
+  --(server->client_count);
+  control_buffer_free( &(client->output) );
+  free( client );
+  return;
+}
+
+static int control_buffer_reserve( struct control_buffer* buffer , size_t length )
+{
+  if( buffer->failed ){
+    return -1;
+  }
+  if( length <= buffer->capacity - buffer->length ){
+    return 0;
+  }
+  size_t capacity = ( buffer->capacity ) ? buffer->capacity : 256;
+  while( capacity - buffer->length < length ){
+    if( SIZE_MAX / 2 < capacity ){
+      buffer->failed = 1;
+      return -1;
+    }
+    capacity *= 2;
+  }
+  unsigned char* const data = realloc( buffer->data , capacity );
+  if( NULL == data ){
+    buffer->failed = 1;
+    return -1;
+  }
+  buffer->data = data;
+  buffer->capacity = capacity;
+  return 0;
+}
+
+void control_buffer_put_u8( struct control_buffer* buffer , uint8_t value )
+{
+  control_buffer_put_bytes( buffer , &value , 1 );
+  return;
+}
+
+void control_buffer_put_u32( struct control_buffer* buffer , uint32_t value )
+{
+  const unsigned char bytes[4] = { (unsigned char)( value >> 24 ) , (unsigned char)( value >> 16 ) ,
+                                   (unsigned char)( value >> 8 ) , (unsigned char)value };
+  control_buffer_put_bytes( buffer , bytes , sizeof( bytes ) );
+  return;
+}
+
+void control_buffer_put_u64( struct control_buffer* buffer , uint64_t value )
+{
+  control_buffer_put_u32( buffer , (uint32_t)( value >> 32 ) );
+  control_buffer_put_u32( buffer , (uint32_t)value );
+  return;
+}
+
+void control_buffer_put_bytes( struct control_buffer* buffer , const void* data , size_t length )
+{
+  assert( buffer );
+  if( 0 == length || 0 != control_buffer_reserve( buffer , length ) ){
+    return;
+  }
+  memcpy( buffer->data + buffer->length , data , length );
+  buffer->length += length;
+  return;
+}
+
+void control_buffer_set_status( struct control_buffer* buffer , int status )
+{
+  assert( buffer );
+  if( 2 <= buffer->length ){
+    buffer->data[1] = (unsigned char)status;
+  }
+  return;
+}
+
+void control_buffer_free( struct control_buffer* buffer )
+{
+  assert( buffer );
+  free( buffer->data );
+  buffer->data = NULL;
+  buffer->length = 0;
+  buffer->capacity = 0;
+  buffer->failed = 0;
+  return;
+}
+
+uint8_t control_reader_get_u8( struct control_reader* reader )
+{
+  const unsigned char* const bytes = control_reader_get_bytes( reader , 1 );
+  return ( bytes ) ? bytes[0] : 0;
+}
+
+uint32_t control_reader_get_u32( struct control_reader* reader )
+{
+  const unsigned char* const bytes = control_reader_get_bytes( reader , 4 );
+  if( NULL == bytes ){
+    return 0;
+  }
+  return ( (uint32_t)bytes[0] << 24 ) | ( (uint32_t)bytes[1] << 16 ) | ( (uint32_t)bytes[2] << 8 ) | (uint32_t)bytes[3];
+}
+
+uint64_t control_reader_get_u64( struct control_reader* reader )
+{
+  const uint64_t high = control_reader_get_u32( reader );
+  return ( high << 32 ) | control_reader_get_u32( reader );
+}
+
+const unsigned char* control_reader_get_bytes( struct control_reader* reader , size_t length )
+{
+  assert( reader );
+  if( reader->failed || reader->length - reader->offset < length ){
+    reader->failed = 1;
+    return NULL;
+  }
+  const unsigned char* const bytes = reader->data + reader->offset;
+  reader->offset += length;
+  return bytes;
+}
+
+int control_connect( const char* path )
+{
+  assert( path );
+  struct sockaddr_un addr;
+  memset( &addr , 0 , sizeof( addr ) );
+  if( sizeof( addr.sun_path ) <= strlen( path ) ){
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  addr.sun_family = AF_UNIX;
+  memcpy( addr.sun_path , path , strlen( path ) + 1 );
+  const int fd = socket( AF_UNIX , SOCK_STREAM | SOCK_CLOEXEC , 0 );
+  if( -1 == fd ){
+    return -1;
+  }
+  if( -1 == connect( fd , (const struct sockaddr*)&addr , sizeof( addr ) ) ){
+    const int err = errno;
+    VERIFY( 0 == close( fd ) );
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+int control_call( int fd , uint8_t command , uint8_t argument , const char* name ,
+                  struct control_buffer* response )
+{
+  assert( response );
+  const size_t name_length = ( name ) ? strlen( name ) : 0;
+  if( CONTROL_REQUEST_MAX - 2 < name_length ){
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  struct control_buffer request = { NULL , 0 , 0 , 0 };
+  control_buffer_put_u32( &request , (uint32_t)( 2 + name_length ) );
+  control_buffer_put_u8( &request , command );
+  control_buffer_put_u8( &request , argument );
+  control_buffer_put_bytes( &request , name , name_length );
+  if( request.failed ){
+    control_buffer_free( &request );
+    errno = ENOMEM;
+    return -1;
+  }
+  const int sent = control_send_all( fd , request.data , request.length );
+  control_buffer_free( &request );
+  if( 0 != sent ){
+    return -1;
+  }
+
+  unsigned char header[CONTROL_HEADER_SIZE];
+  if( 0 != control_recv_all( fd , header , sizeof( header ) ) ){
+    return -1;
+  }
+  struct control_reader reader = { header , sizeof( header ) , 0 , 0 };
+  const uint32_t length = control_reader_get_u32( &reader );
+  if( length < 2 || CONTROL_RESPONSE_MAX < length ){
+    errno = EPROTO;
+    return -1;
+  }
+  response->length = 0;
+  if( 0 != control_buffer_reserve( response , length ) ){
+    errno = ENOMEM;
+    return -1;
+  }
+  if( 0 != control_recv_all( fd , response->data , length ) ){
+    return -1;
+  }
+  response->length = length;
+  if( command != response->data[0] ){
+    errno = EPROTO;
+    return -1;
+  }
+  return 0;
+}
+
+static int control_send_all( int fd , const void* data , size_t length )
+{
+  size_t offset = 0;
+  while( offset < length ){
+    const ssize_t sent = send( fd , (const char*)data + offset , length - offset , MSG_NOSIGNAL );
+    if( -1 == sent ){
+      if( EINTR == errno ){
+        continue;
+      }
+      return -1;
+    }
+    offset += (size_t)sent;
+  }
+  return 0;
+}
+
+static int control_recv_all( int fd , void* data , size_t length )
+{
+  size_t offset = 0;
+  while( offset < length ){
+    const ssize_t received = recv( fd , (char*)data + offset , length - offset , 0 );
+    if( -1 == received ){
+      if( EINTR == errno ){
+        continue;
+      }
+      return -1;
+    }
+    if( 0 == received ){
+      errno = ECONNRESET;
+      return -1;
+    }
+    offset += (size_t)received;
+  }
+  return 0;
+}
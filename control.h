@@ -0,0 +1,134 @@
+﻿#if ! defined( CONTROL_H_HEADER_GUARD )
+#define CONTROL_H_HEADER_GUARD 1
+
+/**
+   コントロールソケット
+   コントロールプロセスの状態の問い合わせと、操作 ( 停止 リロード シグナルの転送 ) を、
+   unix ドメインのストリームソケットで受け付ける。 コントロールプロセスのイベントループで動くので、
+   多くのクライアントが同時に接続しても、サービスの監視は止まらない。
+
+   プロトコルは、長さを前置したバイナリのフレームで、整数は全てネットワークバイトオーダーである。
+     フレーム   : u32 length ( 続く本体のバイト数 ) , 本体
+     要求の本体 : u8 command ( enum control_command ) , u8 argument , サービスの名前 ( 残り全て 空の場合は全てのサービス )
+     応答の本体 : u8 command , u8 status ( 0 は成功 それ以外は errno ) , 内容 ( command 毎 )
+   一つの接続で、要求と応答を何度でも交互にやり取りできる。 応答を待たずに続けて要求を送ってもよく、
+   応答は要求の順番に返る。 要求の本体が CONTROL_REQUEST_MAX を超えた場合は、接続を閉じる。
+
+   要求毎の argument と、応答の内容 :
+     CONTROL_STATUS  : サービス毎に u8 名前の長さ ( SERVICE_NAME_MAX まで ) , 名前 , u8 state ( enum service_state ) ,
+                       u8 exit_code , i32 exit_status , u32 pid , u32 standby_pid ,
+                       u32 reloading_pid , u32 draining_pid , u32 restart_attempts , u64 uptime_us
+     CONTROL_STATS   : サービス毎に u8 名前の長さ ( SERVICE_NAME_MAX まで ) , 名前 , 標準出力と標準エラー出力のそれぞれについて
+                       u64 read_bytes , u64 sent_lines , u64 dropped_lines , u64 dropped_bytes , u64 congestions
+     CONTROL_STOP    : 内容なし ( SIGINT を受け取った時と同じ )
+     CONTROL_RELOAD  : 内容なし ( SIGHUP を受け取った時と同じ ) 前のリロードが終わっていない場合などは EBUSY
+     CONTROL_SIGNAL  : argument のシグナルをサービスの実行中のプロセスへ送る 内容なし
+     CONTROL_REAPER  : 名前は使わない u8 subreaper ( 子孫を引き取っている場合は 1 ) , u64 reaped , u64 batches ,
+                       u32 max_batch , u64 descendants , u64 descendants_failed , u64 descendants_killed
+                       ( struct service_reap_stats )
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct event_loop;
+struct control_server;
+
+/** 要求の本体の最大の大きさ */
+#define CONTROL_REQUEST_MAX ( (size_t)512 )
+
+/** クライアントが受け取る、応答の本体の最大の大きさ */
+#define CONTROL_RESPONSE_MAX ( (size_t)16 * 1024 * 1024 )
+
+/** 要求の種類 */
+enum control_command{
+  CONTROL_STATUS = 1,
+  CONTROL_STATS ,
+  CONTROL_STOP ,
+  CONTROL_RELOAD ,
+  CONTROL_SIGNAL ,
+  CONTROL_REAPER
+};
+
+/**
+   フレームの本体を組み立てるバッファ
+   領域が確保できなかった場合は failed を立てて、以降の追加を無視する。
+ */
+struct control_buffer{
+  unsigned char* data;
+  size_t length;
+  size_t capacity;
+  int failed;
+};
+
+/**
+   フレームの本体を先頭から読むカーソル
+   足りない場合は failed を立てて、以降は 0 を読む。
+ */
+struct control_reader{
+  const unsigned char* data;
+  size_t length;
+  size_t offset;
+  int failed;
+};
+
+/**
+   要求を一つ受け取った時に呼ばれるハンドラ
+   response には、すでに u8 command と u8 status ( 0 ) が入っているので、内容を続けて追加する。
+   失敗を返す場合は control_buffer_set_status で status を書き換える。
+   @param request 要求の本体 ( u8 command から )
+ */
+typedef void (*control_server_handler)( struct control_server* server , const unsigned char* request , size_t length ,
+                                        struct control_buffer* response , void* context );
+
+/**
+   path で要求を受け付けるソケットを作成して、イベントループに登録する
+   path に古いファイルがある場合は削除してから作り、作成したユーザだけが接続できるようにする。
+   @return 失敗した場合は NULL を返し、理由を errno に保存する。
+ */
+struct control_server* control_server_create( struct event_loop* loop , const char* path ,
+                                              control_server_handler handler , void* context );
+
+/**
+   全ての接続を閉じて、ソケットをイベントループから外して閉じ、パスを削除する
+ */
+void control_server_destroy( struct control_server* server );
+
+/** buffer に追加する ( 整数はネットワークバイトオーダー ) */
+void control_buffer_put_u8( struct control_buffer* buffer , uint8_t value );
+void control_buffer_put_u32( struct control_buffer* buffer , uint32_t value );
+void control_buffer_put_u64( struct control_buffer* buffer , uint64_t value );
+void control_buffer_put_bytes( struct control_buffer* buffer , const void* data , size_t length );
+
+/** 応答の status を書き換える */
+void control_buffer_set_status( struct control_buffer* buffer , int status );
+
+/** buffer の領域を解放する */
+void control_buffer_free( struct control_buffer* buffer );
+
+/** reader から読む ( 整数はネットワークバイトオーダー ) */
+uint8_t control_reader_get_u8( struct control_reader* reader );
+uint32_t control_reader_get_u32( struct control_reader* reader );
+uint64_t control_reader_get_u64( struct control_reader* reader );
+
+/**
+   reader から length バイトを読む
+   @return 読んだ領域の先頭 足りない場合は NULL
+ */
+const unsigned char* control_reader_get_bytes( struct control_reader* reader , size_t length );
+
+/**
+   コントロールソケットに接続する ( クライアント )
+   @return 成功した場合はソケット 失敗した場合は -1 を返し、理由を errno に保存する。
+ */
+int control_connect( const char* path );
+
+/**
+   要求を一つ送って、応答を受け取るまで待つ ( クライアント )
+   @return 成功した場合は 0 失敗した場合は -1 を返し、理由を errno に保存する。
+   @param response 応答の本体 ( u8 command から ) 呼び出し側が control_buffer_free で解放する
+ */
+int control_call( int fd , uint8_t command , uint8_t argument , const char* name ,
+                  struct control_buffer* response );
+
+#endif /* CONTROL_H_HEADER_GUARD */
@@ -4,30 +4,37 @@
    制御を戻さないプログラムをデーモンのように動作させるためのプログラ
    ムである。実行を行うと、このプログラム自体は、 fork(2) を使って、子
    プロセスを生成した後にすぐに制御を返す。
+   ( 子プロセスが全てのサービスを exec するまでは待ち、 exec の失敗は
+   ソケットで受け取って、終了ステータスで呼び出し元へ知らせる )
    
-   子プロセスは、/usr/bin/logger を exec するプロセスと、ターゲットプ
-   ログラムの実行をする子プロセスをフォークしたのち、ターゲットプログ
-   ラムを制御し、PID ファイルを管理するプロセス（便宜上 コントロールプ
-   ロセスと呼ぶ）がselect(2) でターゲットプロセスの停止と、コントロー
-   ルプログラムに送られるシグナルを待つ。
+   子プロセスは、ターゲットプログラムの実行をする子プロセスをフォーク
+   したのち、ターゲットプログラムを制御し、PID ファイルを管理するプロ
+   セス（便宜上 コントロールプロセスと呼ぶ）がイベントループ( epoll(7)
+   もしくは select(2) ) でターゲットプロセスの停止と、ターゲットプロセ
+   スの出力と、コントロールプログラムに送られるシグナルを待つ。
 
    コントロールプロセスのPID は、PID ファイルに書き込まれ
    if [ -f /tmp/daemonlize.pid ] ; then kill -INT `cat /tmp/daemonlize.pid` ; fi
    でプロセスに INT シグナルをスクリプトを書きやすくする。
 
    ターゲットプロセスの標準入力は、/dev/null につなげられ、標準出力と
-   標準エラー出力は、/usr/bin/logger へパイプでつなげられる。
+   標準エラー出力は、コントロールプロセスへパイプでつなげられる。
+   コントロールプロセスは、パイプから読んだ行を syslog のソケット
+   ( /dev/log ) へ直接送る。 ( logsink.c )
    
-   コントロールプロセスが、INT シグナル（と HUP シグナル）を受け取った
+   コントロールプロセスが、INT シグナル（と TERM シグナル）を受け取った
    時には、ターゲットプロセスに対して、INTシグナルを送り、プロセスの終
-   了を待って終了する。
+   了を待って終了する。 HUP シグナルを受け取った時には、新しい世代の
+   ターゲットプロセスを起動して、準備ができてから古い世代と入れ替える。
 
    ターゲットプロセスが、先に終了した場合にも本プロセスは終了する。
 
 
+   イベントループの実装は eventloop.c にある。 Linux では signalfd(2)
+   と pidfd_open(2) を epoll(7) で待ち、それ以外の環境では、従来通り
    "self-pipe technique": pipe に対してPOSIX.1-2001 では、 PIPE_BUF バ
    イト以下の write(2) は atomic に行われることを利用してselect(2) を
-   起こす方法
+   起こす方法 を使う。
 
 */
 
@@ -56,18 +63,30 @@
 #include <syslog.h>
 #include <string.h>
 #include <locale.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/wait.h>
-#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <poll.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdint.h>
 #include <assert.h>
 
 #include "verify.h"
 #include "alternative.h"
+#include "eventloop.h"
+#include "service.h"
+#include "logsink.h"
+#include "procspawn.h"
+#include "listensock.h"
+#include "notify.h"
+#include "control.h"
+#include "warmup.h"
 
 #if !defined( VERIFY )
 #if defined( NDEBUG )
@@ -89,15 +108,39 @@ enum{
   WRITE_SIDE = 1
 };
 
-/** SIGCHLD を通知する self-pipe で使うファイルディスクリプタを格納した sig_atomic_t */
-static volatile sig_atomic_t sig_child_pipe = -1;
-/** SIGINTR を通知する self-pipe で使うファイルディスクリプタを格納した sig_atomic_t */
-static volatile sig_atomic_t sig_intr_pipe = -1;
+enum{
+  /** 終了時に、サービスの出力を syslog へ送りきるのを待つ最大の時間 ( ミリ秒 ) */
+  LOG_DRAIN_TIMEOUT_MS = 3000,
+  /** 標準出力を溜めてまとめて syslog へ送る時間の既定値 ( マイクロ秒 ) */
+  DEFAULT_STDOUT_BATCH_US = 10000,
+  /** 最初の再起動までの時間と、その上限の既定値 ( ミリ秒 ) */
+  DEFAULT_RESTART_DELAY_MS = 100,
+  DEFAULT_RESTART_MAX_DELAY_MS = 30000,
+  /** crash loop と判定する、再起動の回数と秒数の既定値 */
+  DEFAULT_RESTART_BURST = 5,
+  DEFAULT_RESTART_INTERVAL_S = 60,
+  /** リロードで、古い世代の終了を待つ時間の既定値 ( ミリ秒 ) 過ぎたら SIGKILL を送る */
+  DEFAULT_DRAIN_TIMEOUT_MS = 10000,
+  /** 終了要求で、サービスに SIGINT を送ってから SIGTERM を送るまでと、 SIGTERM から SIGKILL までの時間の既定値 ( ミリ秒 ) */
+  DEFAULT_STOP_INTERRUPT_MS = 10000,
+  DEFAULT_STOP_TERMINATE_MS = 5000,
+  /** daemonic stop で、コントロールプロセスの終了を待ってから SIGKILL を送るまでの時間の既定値 ( ミリ秒 ) */
+  DEFAULT_STOP_TIMEOUT_MS = 30000,
+  /** daemonic stop の時間切れで、コントロールソケットにサービスの PID を問い合わせる時間 ( ミリ秒 ) */
+  STOP_CONTROL_TIMEOUT_MS = 2000
+};
 
+/** コントロールソケットのパス ( PID ファイルのパスに付ける ) */
+#define CONTROL_SOCKET_SUFFIX ".ctl"
 
-#if ( 201112L <=__STDC_VERSION__ )
-static_assert( sizeof(int) == sizeof(volatile sig_atomic_t ), "" );
-#endif /* ( 201112L <=__STDC_VERSION__ ) */
+/* シグナル番号の上限 _XOPEN_SOURCE だけでは NSIG が定義されないことがある ( eventloop.c と同じ ) */
+#if defined( NSIG )
+#define HOST_NSIG NSIG
+#elif defined( _NSIG )
+#define HOST_NSIG _NSIG
+#else /* defined( NSIG ) */
+#define HOST_NSIG 65
+#endif /* defined( NSIG ) */
 
 /**
    パスの最大値となる値を返す
@@ -122,41 +165,160 @@ int pathconf_path_max( size_t* length );
 */
 char* get_absolute_path( const char* path );
 
-/** 
-    SIGCHLD: signal_handler 
+/**
+   start_process で使用するパラメータのパック
+*/
+struct process_param;
+/**
+   fork して、全てのサービスの開始と、SIGINT をサービスへ送るプロセスへ送る
+   全てのサービスが、終了するまで、この関数は制御を返さない
+
+   @return 成功した場合は EXIT_SUCCESS を返す 失敗した場合はそれ以外の値を返す
+   @param param start_process へ渡すパラメータをパックした構造体
+   @param table 起動するサービスの表
 */
-static void sig_child_handler(int sig);
+int start_process( struct process_param param, struct service_table* table );
 
 /**
-   SIGINT: signal_handler 
+   サービスの起動の結果を、 start_process から呼び出し元のプロセスへ知らせる記録
+   呼び出し元は、サービスの数だけ受け取るか、コントロールプロセスが終了するまで待ってから制御を返す。
+   param->ready_wait_us が指定されている場合は、 exec の結果の代わりに、準備ができた ( READY=1 ) かどうかを知らせる。
 */
-static void sig_intr_handler(int sig);
+struct start_report{
+  /** 0 の場合は成功 それ以外は失敗した理由の errno */
+  int error;
+  /** 0 以外の場合は、準備ができるのを待っている間に失敗した ( error が ETIMEDOUT なら時間切れ それ以外は終了した ) */
+  int waited_ready;
+  /** 起動したサービスの PID 失敗した場合は 0 */
+  pid_t pid;
+  /** サービスの名前 サービスを起動する前に失敗した場合は、失敗したもの ( PID ファイルなど ) の名前 */
+  char name[256];
+};
 
 /**
-   sigaction に signal(2) 形式ののシグナルハンドラを設定する コンビニエンスメソッド
+   start_report を一つ呼び出し元へ送る
+   呼び出し元が先に終了していても、 SIGPIPE で止まらないように MSG_NOSIGNAL で送る。 errno は変えない
+   @param fd 呼び出し元へつながるソケット -1 の場合は何もしない
+   @param waited_ready start_report の waited_ready
 */
-static void set_signal_handler( struct sigaction* sigact , void (* const signal_handler)(int) );
+static void send_start_report( int fd , const char* name , pid_t pid , int error , int waited_ready );
 
 /**
-   start_process で使用するパラメータのパック
+   呼び出し元のプロセスで、 count 個の start_report を受け取るか、コントロールプロセスが終了するまで待ち、
+   失敗したものを標準エラー出力に出力する
+   @return 全て起動した場合は EXIT_SUCCESS そうでない場合は EXIT_FAILURE
 */
-struct process_param;
+static int wait_start_report( int fd , size_t count );
+
+/**
+   サービスの標準出力と標準エラー出力を open_service_output でつなげる
+   @return 成功した場合は 0 失敗した場合は -1 ( つなげた分は閉じる )
+*/
+static int open_service_log( struct event_loop* loop , const struct process_param* param ,
+                             struct log_sink* sink , struct service* service );
+
 /**
-   fork して、ターゲットプロセスの開始と、SIGINT をターゲットプロセスへ送るプロセスへ送る
-   ターゲットプロセスが、終了するまで、この関数は制御を返さない
+   -i で、サービスの標準出力と標準エラー出力に、このプロセスのものをそのまま渡す
+   close_service_log で閉じられるように、 close-on-exec を付けて複製したものを service->logs[].fd に保存する。
+   @return 成功した場合は 0 失敗した場合は -1 ( 複製した分は閉じる )
+*/
+static int open_service_passthrough( struct service* service );
 
-   @return 成功した場合は EXIT_SUCCESS を返す 失敗した場合はそれ以外の値を返す
-   @param param start_process へ渡すパラメータをパックした構造体
-   @param path 実行ファイルへのパス
-   @param argv execvl へ渡す引数の配列。終端を表すために、配列の最後の要素は、NULL で終端されていなければならい
+/**
+   -H で、全てのサービスのプログラムと、その動的リンカと共有ライブラリの先読みを頼む
+   プログラムは service->executable に開いておき、 spawn_service_process はそれをそのまま使う。
+   掛かった時間と先読みしたファイルは syslog へ記録する。
+*/
+static void warm_service_executables( struct service_table* table );
+
+/**
+   -i で、このプロセスの終了ステータスにする、サービスの終了ステータスを返す
+   表の中で最初の、 0 以外で終了したサービス ( 無ければ最初のサービス ) の終了コードを返し、
+   シグナルで終了した場合はシェルと同じ 128 + シグナル番号 を返す。
+*/
+static int init_exit_status( const struct service_table* table );
+
+/**
+   サービスの出力一つ分をつなげるパイプを作り、読み込み側を log_stream として sink へつなげる
+   param->log_directory が指定されている場合は、 sink の代わりに
+   "log_directory/サービス名.log" ( 標準エラー出力は "サービス名.err.log" ) へ書き込む
+   log_sink を作って、そちらへつなげる。
+   書き込み側は service->logs[output].fd に保存される。
+   @return 成功した場合は 0 失敗した場合は -1
+*/
+static int open_service_output( struct event_loop* loop , const struct process_param* param ,
+                                struct log_sink* sink , struct service* service , enum service_output output );
+
+/**
+   全てのサービスのパイプの書き込み側を閉じて、読み込み側に残っている出力を送りきるまで、
+   LOG_DRAIN_TIMEOUT_MS を上限にイベントループを回す
+   ( syslogd が詰まっていても、サービスが終了する直前の出力を失わないようにする )
+*/
+static void drain_service_logs( struct event_loop* loop , struct service_table* table );
+
+/**
+   open_service_log で作ったパイプを閉じて、残っている出力を送ってから log_stream を破棄する
+   つなげていない出力は無視するので、途中まで開いたサービスにも使える。
+*/
+static void close_service_log( struct service* service );
+
+/**
+   param->spawn_backend で、サービスを一つ起動する
+   @return 成功した場合は 0 失敗した場合は -1
+*/
+static int spawn_service( struct event_loop* loop , const struct process_param* param ,
+                          struct service_table* table , struct service* service );
+
+/**
+   param->spawn_backend で、サービスのプログラムを一つ起動する ( spawn_service と予備のプロセスで共有する )
+   param->listen_fds を PROC_SPAWN_PASS_FDS_START から順に渡し、 standby_gate があればその後ろに渡す。
+   @return 成功した場合は子プロセスの PID 失敗した場合は -1 を返し、理由を errno に保存する。
+   @param standby_gate 予備のプロセスに渡すゲート ( param->standby_env を使う ) 予備のプロセスでなければ -1
+*/
+static pid_t spawn_service_process( struct event_loop* loop , const struct process_param* param ,
+                                    struct service* service , int standby_gate );
+
+/**
+   デーモン化したプロセスをホストするメインループ
+   この関数は、デーモン化した全ての子プロセスが終了して、再起動を待っているものも無くなるまで、制御を返さない。
+*/
+int host_daemonlize_process( struct event_loop* loop , const struct process_param* param ,
+                             struct service_table* table , struct notify_socket* notify , int report_fd );
+
+/**
+   addresses の全てで待ち受けるソケットを listen_socket_open で作成する
+   @return 成功した場合はソケットの配列 ( close_listen_sockets で閉じる ) 失敗した場合は NULL ( 理由は標準エラー出力に出力済み )
+*/
+static int* open_listen_sockets( const char* const* addresses , size_t count );
+
+/**
+   open_listen_sockets で作成したソケットを閉じて、配列を解放する
+*/
+static void close_listen_sockets( int* fds , size_t count );
+
+/**
+   argv[0] のファイル名から、 PID ファイルのパス "/tmp/ファイル名.pid" を作る
+   @return 成功した場合は 0 path に収まらない場合は -1
+*/
+static int default_pid_file_path( const char* self_path , char* path , size_t size );
+
+/**
+   "daemonic ctl" コントロールソケットで、コントロールプロセスに要求を一つ送って、応答を標準出力に出力する
+   @return 成功した場合は EXIT_SUCCESS そうでない場合は EXIT_FAILURE
+   @param argv argv[0] は "ctl"
 */
-int start_process( struct process_param param,  const char* path , char * argv[]);
+static int control_main( const char* self_path , int argc , char* argv[] );
 
 /**
-   最終的な 子プロセスを execvp(2) で実行する。
-   この関数は、制御を戻さない
+   "daemonic stop" PID ファイルのコントロールプロセスにシグナルを送って、終了するまで待つ
+   PID ファイルに書き込みロックを掛けているのが書かれている PID のプロセスであることを確かめてから、
+   pidfd_open(2) で開いたプロセスへ pidfd_send_signal(2) で送り、 pidfd を poll(2) で待つ。
+   ロックされていない PID ファイルは、クラッシュなどで残ったものとみなして何も送らない。
+   時間切れの場合は、サービスのプロセスグループとコントロールプロセスに SIGKILL を送る。
+   @return 終了した ( もともと居なかった ) 場合は EXIT_SUCCESS SIGKILL で止めた場合や失敗した場合は EXIT_FAILURE
+   @param argv argv[0] は "stop"
 */
-void take_over_for_child_process( int logger_fd , const char* path , char* argv[] );
+static int stop_main( const char* self_path , int argc , char* argv[] );
 
 /** 
     実質的なエントリーポイント
@@ -165,6 +327,10 @@ int entry_point( int argc , char* argv[] );
 
 /************************* 実装 **************************/
 
+/** 出力の種類毎の名前 ( ログの出力に使う ) */
+static const char* const service_output_names[SERVICE_OUTPUT_COUNT] = { "stdout" , "stderr" };
+
+
 int pathconf_path_max( size_t* length )
 {
 #if defined( PATH_MAX )
@@ -203,474 +369,2973 @@ char* get_absolute_path( const char* path )
   return absolute_path;
 }
 
-static void sig_child_handler(int sig)
-{
-#if defined( __GNUC__ )
-  __sync_synchronize(); 
-#endif /* defined( __GNUC__ ) */
-  int fd = (int)sig_child_pipe;
-  if( 0 < fd ){
-    char b[1] = {0};
-    if( sizeof( b ) != write( fd , b , sizeof( b ) ) ){
-      abort();
-    }
-  }
-  return;
+/**
+   サービスへ渡す環境変数 ( environ に LISTEN_FDS などを加えたもの )
+*/
+struct service_environ{
+  /** NULL の場合は environ をそのまま引き継ぐ */
+  char** envp;
+  /** LISTEN_PID の値を子プロセスが書き込む場所 ( proc_spawn_request の envp_pid ) 無い場合は NULL */
+  char* pid;
 };
 
-static void sig_intr_handler(int sig)
-{
-#if defined( __GNUC__ )
-  __sync_synchronize(); 
-#endif /* defined( __GNUC__ ) */
-  int fd = (int)sig_intr_pipe;
-  if( 0 < fd ){
-    char b[1] = {0};
-    if( sizeof( b ) != write( fd , b , sizeof( b ) )){
-      abort();
-    }
-  }
-  return;
+struct process_param{
+  const char* syslog_path; // ターゲットプロセスの出力を送る syslog のソケットへのパス
+  const char* log_directory; // 出力をファイルへ書き込む場合のディレクトリ syslog へ送る場合は NULL
+  int pipe_size; // 出力をつなげるパイプの容量 0 の場合は変更しない
+  unsigned long long rotate_bytes; // ファイルをローテーションする大きさ 0 の場合は行わない
+  unsigned int rotate_age; // ファイルをローテーションする間隔 ( 秒 ) 0 の場合は行わない
+  unsigned int rotate_flags; // log_sink_set_rotation の flags
+  int durable; // 0 以外の場合は -o のファイルを durable モードにする
+  unsigned long long durable_window_us; // log_sink_set_durable の window_us
+  unsigned long long durable_bytes; // log_sink_set_durable の max_bytes 0 の場合は既定値
+  enum log_stream_overflow overflow; // syslog が詰まってバッファが一杯になった時の扱い
+  size_t log_buffer_size; // log_stream のバッファの大きさ 0 の場合は既定値
+  unsigned int sample_rate; // LOG_STREAM_OVERFLOW_SAMPLE で、何行に一行を残すか
+  int priorities[SERVICE_OUTPUT_COUNT]; // 標準出力と標準エラー出力の syslog の facility と priority
+  unsigned long long stdout_batch_us; // 標準出力を溜めてまとめて送る時間 ( マイクロ秒 ) 0 の場合はすぐに送る
+  int classify; // 0 以外の場合は、行の先頭の "ERROR" などの印から level を推定する
+  enum proc_spawn_backend spawn_backend; // サービスを起動する方法
+  int warmup; // 0 以外の場合は、起動する前にプログラムと共有ライブラリの先読みを頼む ( -H )
+  int report_fd; // 起動の結果を呼び出し元へ知らせるソケット 全てのサービスを起動したら ( 準備ができたら ) 閉じる
+  struct service_restart_policy restart; // 終了したサービスを再起動する方針
+  enum service_standby_mode standby; // 予備のプロセスの待たせ方 SERVICE_STANDBY_NONE の場合は使わない
+  const int* listen_fds; // サービスへ渡す、待ち受けているソケット
+  size_t listen_fd_count;
+  struct service_environ service_env; // サービスの環境変数 start_process で作る
+  struct service_environ standby_env; // 予備のプロセス ( SERVICE_STANDBY_GATE ) の環境変数 start_process で作る
+  unsigned long long ready_timeout_us; // リロードで新しい世代の READY=1 を待つ時間 0 の場合は exec できたら入れ替える
+  unsigned long long drain_timeout_us; // リロードで古い世代の終了を待つ時間 過ぎたら SIGKILL を送る
+  unsigned long long ready_wait_us; // 呼び出し元へ知らせる前に、起動したサービスの READY=1 を待つ時間 0 の場合は待たない
+  unsigned long long stop_interrupt_us; // 終了要求で SIGINT を送ってから SIGTERM を送るまでの時間 0 の場合は送らない
+  unsigned long long stop_terminate_us; // SIGTERM を送ってから SIGKILL を送るまでの時間 0 の場合は送らない
+  int adopt; // 0 以外の場合は、 PR_SET_CHILD_SUBREAPER で孤児になった子孫を引き取る ( -A , -i では既定 )
+  int subreaper; // 0 以外の場合は、孤児になった子孫を引き取っている start_process で設定する
+  int init; // 0 以外の場合は、コンテナの PID 1 として前面で動く ( -i ) PID ファイルを作らず、出力をそのまま引き継ぐ
+  const char* pid_file_path; // 出力するPID ファイルへのパス
 };
 
+struct host_state;
+
+/** 再起動やリロードのタイマーのハンドラに渡す、サービス一つ分の context */
+struct host_restart{
+  struct host_state* state;
+  struct service* service;
+  /** 呼び出し元へ知らせるために、 READY=1 を待っているかどうか */
+  int awaiting_ready;
+};
 
 /**
-   最終的な 子プロセスを execvp(2) で実行する。
-   この関数は、制御を戻さない
+   host_daemonlize_process のイベントハンドラで共有する状態
 */
-void take_over_for_child_process( int logger_fd , const char* path , char* argv[] )
-{
-  int null_in = open( "/dev/null" , O_RDONLY );
-  assert( 0 <= null_in );
+struct host_state{
+  struct event_loop* loop;
+  const struct process_param* param;
+  /** 監視するサービスの表 */
+  struct service_table* table;
+  /** サービス毎の再起動のタイマーの context ( table->services と同じ添字 ) */
+  struct host_restart* restarts;
+  /** 最後に子プロセスの終了を知った時刻 ( CLOCK_MONOTONIC のマイクロ秒 ) 入れ替えに掛かった時間を計る */
+  unsigned long long child_event_us;
+  /** 終了要求を受けたかどうか */
+  int stopping;
+  /** 準備ができたことを呼び出し元へ知らせるソケット 全て知らせたら閉じて -1 にする */
+  int report_fd;
+  /** READY=1 を待っているサービスの数 */
+  size_t unready;
+  /** READY=1 を待つタイマー 無い場合は 0 */
+  event_loop_timer_id ready_timer;
+  /** 終了要求で最後に送ったシグナル ( SIGINT SIGTERM SIGKILL の順に強める ) */
+  int stop_signal;
+  /** 次のシグナルを送るタイマー 無い場合は 0 */
+  event_loop_timer_id stop_timer;
+};
 
-  VERIFY( dup2( null_in , STDIN_FILENO ) == STDIN_FILENO );
-  VERIFY( dup2( logger_fd , STDOUT_FILENO ) == STDOUT_FILENO );
-  VERIFY( dup2( logger_fd , STDERR_FILENO ) == STDERR_FILENO );
-  VERIFY( 0 == close(null_in ) );
-  VERIFY( 0 == close(logger_fd) );
+/** CLOCK_MONOTONIC の現在時刻 ( マイクロ秒 ) */
+static unsigned long long host_now_us( void );
 
-  if( -1 == execvp( path , argv ) ){
-    int err = errno;
-    syslog( LOG_ERR , "%m, execvp(2) faild , path = \"%s\"",path);
-    errno = err;
-    perror("execlp");
-  }
-  _exit( EXIT_FAILURE );
-}
+/**
+   サービスのプロセスに、プロセスグループごとシグナルを送る
+   サービスは proc_spawn で自分の PID を ID とするプロセスグループに入れてあるので、
+   プログラムが起動した子プロセス ( 孫 ) にも届く。
+   @return 成功した場合は 0 失敗した場合は -1 を返し、理由を errno に保存する。
+*/
+static int host_kill( pid_t pid , int signo );
 
 /**
-   sigaction に signal(2) 形式ののシグナルハンドラを設定する コンビニエンスメソッド
+   environ に、待ち受けているソケットがあれば LISTEN_FDS と LISTEN_PID を、
+   standby_fd が 0 以上であれば SERVICE_STANDBY_FD_ENV を、 notify_path があれば NOTIFY_SOCKET_ENV を加えた環境変数を作る
+   environ にある同じ名前の変数 ( daemonic 自身が受け取ったもの ) は取り除く。
+   ( NOTIFY_SOCKET_ENV は、 notify_path で置き換える場合だけ取り除く )
+   加えるものが無い場合は、 environ をそのまま引き継ぐように env->envp を NULL にする。
+   @return 成功した場合は 0 失敗した場合は -1 解放は free_service_environ で行う
 */
-static void set_signal_handler( struct sigaction* sigact , void (* const signal_handler)(int) )
-{
-  assert( NULL != sigact );
-  assert( NULL != signal_handler );
-  sigact->sa_handler = signal_handler;
-  VERIFY( 0 == sigemptyset( &(sigact->sa_mask ) ) );
-  sigact->sa_flags = 0;
-  return;
-}
+static int create_service_environ( struct service_environ* env , size_t listen_fd_count , int standby_fd ,
+                                   const char* notify_path );
+
+/** create_service_environ で作った環境変数を解放する */
+static void free_service_environ( struct service_environ* env );
 
 /**
-   select(2) で fd_set を使用する際に、ファイルディスクリプタの最大値に+1をした数が必要なので
-   それを算出するためのラッピング構造体
+   サービスの予備のプロセスを起動する
+   SERVICE_STANDBY_STOP では起動した直後に SIGSTOP で止め、 SERVICE_STANDBY_GATE では
+   socketpair(2) の片側を PROC_SPAWN_PASS_FDS_START に渡して、もう片側をゲートとして持つ。
+   @return 成功した場合は 0 失敗した場合は -1
 */
-typedef struct fd_set_wrap_tag{
-  /** ファイルディスクリプタ集合へのポインタ */
-  fd_set * const fds; 
-  /** ファイルディスクリプタ集合 の中で最大の ファイルディスクリプタ 
-      ファイルディスクリプタが空集合の場合は-1 である。*/
-  int maxfd; 
-} fd_set_wrap;
+static int host_spawn_standby( struct host_state* state , struct service* service );
 
 /**
-   select(2) の第一引数 を得るために、引数 readfds , writefds ,
-   exceptfds の三つの ファイルディスクリプタ集合のうち
-   最大のファイルディスクリプタに１を加えたものを返す。
-   
-   @return 引数 readfds , writefds ,  exceptfds の三つの ファイルディスクリプタ集合のうち最大のファイルディスクリプタに１を加えたものを返す。 
+   delay_us 後に予備のプロセスを起動するタイマーを登録する
+   予備のプロセスやタイマーがすでにある場合は何もしない。
 */
-int fd_set_wrap_get_maximum_fd( const fd_set_wrap* readfds , const fd_set_wrap* writefds , const fd_set_wrap* exceptfds )
-{
-  int result = -1;
-  if( readfds ){
-    if( result < readfds->maxfd ){
-      result = readfds->maxfd;
-    }
-  }
-  if( writefds ){
-    if( result < writefds->maxfd ){
-      result = writefds->maxfd;
-    }
-  }
-  if( exceptfds ){
-    if( result < exceptfds->maxfd ){
-      result = exceptfds->maxfd;
-    }
-  }
-  // 一つも含まれていない場合は、負の数を返す
-  return ( result < 0 ) ? -1 : ( result + 1 ); 
-}
+static void host_schedule_standby( struct host_state* state , struct service* service , unsigned long long delay_us );
 
 /**
-   fd_set_wrap が指し示す ファイルディスクリプタ集合を消去して、一つも含まれていない状態にする。
-   FD_ZERO を fd_set_wrap に合わせた関数
+   予備のプロセスを起動するタイマーのハンドラ
 */
-void fd_set_wrap_clear( fd_set_wrap* fds )
-{
-  assert( fds );
-  assert( fds->fds );
-  fds->maxfd = -1;
-  FD_ZERO( fds->fds  );
-  return;
-}
+static void host_on_standby_timer( struct event_loop* loop , event_loop_timer_id id , void* context );
 
 /**
-   引数 ファイルディスクリプタ fd  を  fd_set_wrap が指し示すファイルディスクリプタ集合から消去する。
+   予備のプロセスを動かして、サービスの実行中のプロセスにする
+   @return 成功した場合は 0 予備のプロセスがすでに終了していた場合は -1
 */
-void fd_set_wrap_set( int fd, fd_set_wrap* fds )
-{
-  assert( fds );
-  assert( fds->fds );
-  fds->maxfd = ( fds->maxfd < fd ) ? fd : fds->maxfd ;
-  FD_SET( fd , fds->fds );
-  return;
-}
+static int host_activate_standby( struct host_state* state , struct service* service );
 
 /**
-   fd_set_wrap の内容を 第二引数 src から 第一引数 dst へディープコピーを行う
-   ディープコピーなので、dst->fds のポインタ値は変更されず中身がコピーされる。
-   dst と src が 同じポインタの場合には、何もせずに dst が返される
-   
-   @return 成功した時には、dst のポインタ値が戻される。
-   @param dst コピー先の fd_set_wrap へのポインタ ( NULL は許容されない )
-   @param src コピー元の fd_set_wrap へのポインタ
-*/
-fd_set_wrap* fd_set_wrap_copy(fd_set_wrap* dst ,const fd_set_wrap *src){
-  assert( dst );
-  assert( dst->fds );
-  if( dst != src ){
-    if( src &&  src->fds ){
-      assert( dst->fds );
-      assert( src->fds );
-      *(dst->fds) = *(src->fds);
-      dst->maxfd = src->maxfd;
-    }else{
-      fd_set_wrap_clear( dst );
-    }
-  }
-  return dst;
-}
+   要らなくなった予備のプロセスに SIGINT を送り ( 止めてある場合は SIGCONT も送る ) 、ゲートを閉じる
+   予備のプロセスを起動するタイマーも取り消す。 回収は service_table_reap で行う。
+*/
+static void host_retire_standby( struct host_state* state , struct service* service );
 
 /**
-   デーモン化したプロセスをホストするメインループ
-   この関数は、デーモン化した子プロセスが終了するまで、制御を返さない。
+   予備のプロセスが終了した時に host_on_process_exit から呼ばれる
+   動かす前に終了した場合は、 param->restart の max_delay_us 後に起動しなおす。
+   host_retire_standby で終了させたものは、 initial_delay_us 後に起動しなおす。
+*/
+static void host_on_standby_exit( struct host_state* state , struct service* service , pid_t pid );
 
-   @return 子プロセスの終了コード
-   @param child_pid 子プロセスのプロセスID 
-   @param sigchld_selfpipe SIGCHLD を受けた時に読み込み可能になるパイプのファイルディスクリプタ self-pipe テクニックを使う
-   @param sigint_selfpipe SIGINT を受けた時に読み込み可能になるパイプのファイルディスクリプタ self-pipe テクニックを使う
+/**
+   サービスを blue/green でリロードする
+   実行中のプロセスを残したまま、同じソケットを渡して新しい世代のプロセスを起動する。
+   param->ready_timeout_us が 0 の場合はすぐに host_finish_reload で入れ替え、
+   そうでない場合は、新しい世代から READY=1 が届くまで待つ。
+   実行中でないサービスや、前のリロードが終わっていないサービスは、何もしない。
+   @return 新しい世代を起動した場合は 0 そうでない場合は -1
 */
-int host_daemonlize_process(pid_t const child_pid ,int const sigchld_selfpipe ,int const sigint_selfpipe)
-{
-  /*
-    このプロセスを終了させようと、SIGINT が送られてきたときには、
-    まずシグナルハンドラでsigint_selfpipe に 1byte が書き込まる。
-    書き込まれると、 sigint_selfpipe が読み込み可能になり、 select(2) が制御を戻す。
-    次に、kill( child_pid , SIGINT ) で子プロセスの終了が図られて、次のループへ入り、
-    select(2) で 制御が一度止まる。
-    
-    子プロセスが終了した時には、 SIGCHLD が発生し、 sigchld_selfpipe に 1byte が書き込まれる
-    すると、 sig_child_pipe が読み込み可能になり、select(2) が制御を返す。
-    子プロセスが終了したので、この関数は waitpidで、子プロセスの終了状態を取得して、
-    制御を返す。
-  */
-  fd_set next_readfds_v = {{0}};
-  fd_set_wrap next_readfds = { &next_readfds_v , -1 };
+static int host_start_reload( struct host_state* state , struct service* service );
 
-  fd_set_wrap_clear( &next_readfds );
-  fd_set_wrap_set( sigchld_selfpipe , &next_readfds );
-  fd_set_wrap_set( sigint_selfpipe , &next_readfds );
-  
-  for(;;){
-    fd_set readfds_v      = {{0}}; 
-    fd_set writefds_v     = {{0}};
-    fd_set exceptfds_v    = {{0}};
-    fd_set_wrap readfds   = { &readfds_v , -1 };
-    fd_set_wrap writefds  = { &writefds_v , -1 };
-    fd_set_wrap exceptfds = { &exceptfds_v , -1 };
-
-    fd_set_wrap_clear( &readfds );
-    fd_set_wrap_clear( &writefds );
-    fd_set_wrap_clear( &exceptfds );
-
-    fd_set_wrap_copy( &readfds , &next_readfds );
-    const int nfds = fd_set_wrap_get_maximum_fd( &readfds , &writefds , &exceptfds );
-    if( select( nfds , readfds.fds , writefds.fds , exceptfds.fds , NULL ) < 0){
-      /* select にエラーが起きた時には readfds の状態は不明なので ここで continue しないと、下の read がブロックする */
-      const int err = errno;
-      if( EINTR == errno ){
-        continue;
-      }
-      syslog( LOG_ERR , "%m, select(2) faild" );
-      errno = err;
-      abort(); // なんかよくわからないことが起きた
-    }
+/**
+   準備ができた新しい世代を実行中のプロセスにして、古い世代を host_drain_process で終了させる
+   予備のプロセスは古い世代のプログラムなので、入れ替えて起動しなおす。
+*/
+static void host_finish_reload( struct host_state* state , struct service* service );
 
-    fd_set_wrap_clear( &next_readfds );
-    
-    if( FD_ISSET( sigchld_selfpipe , readfds.fds ) ){ /* 子プロセスがお亡くなりになった */
-      char b[1] = {0};
-      VERIFY( sizeof(b) == read( sigchld_selfpipe , b , sizeof( b ) ) );
-      int status = 0;
-      waitpid( child_pid , &status , 0 );
-      return status;
-    }else{
-      fd_set_wrap_set( sigchld_selfpipe , &next_readfds );
-    }
-    
-    if( FD_ISSET( sigint_selfpipe , readfds.fds ) ){ /* 自分自身に終了要求が来ている */
-      char b[1] = {0};
-      /* TODO 
-         もし、この下の read がブロックしてしまうような場合があった場合に備える必要がある
-         と思われる。
-      */
-      VERIFY( sizeof(b) == read( sigint_selfpipe  , b , sizeof( b ) ) );
-      VERIFY( 0 ==  kill( child_pid , SIGINT ) );
-    }else{
-      fd_set_wrap_set( sigint_selfpipe , &next_readfds );
-    }
-  } // end of for(;;)
-  return 0;
-}
+/**
+   準備ができなかった新しい世代を、 host_drain_process で終了させる
+*/
+static void host_abort_reload( struct host_state* state , struct service* service );
 
-struct process_param{
-  int logger_pipe;
-  const char* pid_file_path; // 出力するPID ファイルへのパス
-};
+/**
+   service->draining_pid の古い世代に SIGINT を送り、 param->drain_timeout_us 後に SIGKILL を送るタイマーを登録する
+*/
+static void host_drain_process( struct host_state* state , struct service* service );
 
 /**
-   fork して、ターゲットプロセスの開始と、SIGINT をターゲットプロセスへ送るプロセスへ送る
-   ターゲットプロセスが、終了するまで、この関数は制御を返さない
+   新しい世代の準備を待つタイマーのハンドラ 期限までに READY=1 が届かなければ、リロードを取りやめる
+*/
+static void host_on_reload_timeout( struct event_loop* loop , event_loop_timer_id id , void* context );
 
-   @return 成功した場合は EXIT_SUCCESS を返す 失敗した場合はそれ以外の値を返す
-   @param param start_process へ渡すパラメータをパックした構造体
-   @param path 実行ファイルへのパス
-   @param argv execvl へ渡す引数の配列。終端を表すために、配列の最後の要素は、NULL で終端されていなければならい
+/**
+   古い世代の終了を待つタイマーのハンドラ まだ終了していなければ SIGKILL を送る
 */
-int start_process( struct process_param param,  const char* path , char * argv[])
-{
-  /* 自分自身のPID を 書き出して、kill -INT に備える ための PID ファイルを作成する */
-  /* 書き出すファイルへのパス */
-  const char* const pid_file_path = param.pid_file_path;
-  {
-    /* PID を 書き出すファイルへのファイルディスクリプタ */
-    int fd = open( pid_file_path  , O_WRONLY | O_EXCL | O_CREAT , S_IRUSR | S_IWUSR | S_IWOTH );
-    if( fd < 0 ){
-      perror( "open( pid_file_path  , O_WRONLY | O_EXCL | O_CREAT , S_IRUSR | S_IWUSR | S_IWOTH )");
-      return EXIT_FAILURE;
-    }else{
-      char pidnum[16] = {0}; // 多分 6桁あればいいと思うが、15桁分用意する。
-      const ssize_t len =
-        snprintf( pidnum , sizeof( pidnum ) / sizeof( pidnum[0] ) ,
-                  "%d\n" , (int)(getpid()) );
-      if( 0 < len ){
-        const ssize_t write_result = write( fd , pidnum , len );
-        if( len != write_result ){
-          perror("write( fd , pidnum , len )" );
-        }else{
-          VERIFY(0 == x_fdatasync( fd ) );
-        }
-      }
-      VERIFY( 0 == close( fd ) );
-    }
-  }
+static void host_on_drain_timeout( struct event_loop* loop , event_loop_timer_id id , void* context );
 
-  int result = EXIT_SUCCESS;
+/**
+   READY=1 を待っているサービスについて、呼び出し元へ結果を知らせる
+   全てのサービスについて知らせたら、ソケットを閉じて ( 呼び出し元はここで制御を返す ) タイマーを取り消す。
+   @param error 0 の場合は準備ができた ETIMEDOUT の場合は時間切れ それ以外は準備の前に終了した
+*/
+static void host_report_ready( struct host_state* state , struct service* service , int error );
 
-  /* シグナルマスクして fork() してから、
-     子 シグナルマスクの解除
-     親 sigaction() して、シグナルマスクの解除 処置後に sigaction()
-     したほうが多分よい  */
-  // シグナルを禁止する。
-  sigset_t oldset = {0};
-  sigset_t sigset = {0};
-  sigemptyset( &oldset );
-  sigemptyset( &sigset );
-  VERIFY( 0 == sigaddset(&sigset, SIGCHLD ) );
+/**
+   READY=1 を待つタイマーのハンドラ まだ準備ができていないサービスを、時間切れとして知らせる
+*/
+static void host_on_ready_timeout( struct event_loop* loop , event_loop_timer_id id , void* context );
 
-  if( -1 == sigprocmask( SIG_BLOCK , &sigset, &oldset ) ){
-    return EXIT_FAILURE;
-  }
-  
-  const pid_t child_pid = fork();
-  if( -1 == child_pid ){
-    //const int fork_errno = errno;
-    perror( "fork" );
-    VERIFY( 0 == sigprocmask( SIG_SETMASK , &oldset , NULL ) );
-    result = EXIT_FAILURE;
-  }else if( 0 == child_pid ){
-    VERIFY( 0 == sigprocmask( SIG_SETMASK , &oldset , NULL ) );
-    take_over_for_child_process( param.logger_pipe, path , argv );
-    _exit( EXIT_FAILURE );
+/**
+   自分自身に終了要求 ( SIGINT , SIGTERM あるいはコントロールソケットの CONTROL_STOP ) が来た時のハンドラ
+*/
+static void host_on_interrupt( struct event_loop* loop , int signo , unsigned int count , void* context );
+
+/**
+   -i で PID 1 として受け取ったシグナルのハンドラ
+   SIGINT , SIGTERM , SIGQUIT は終了要求として、 host_on_interrupt でそのままサービスのプロセスグループへ送る。
+   それ以外は、実行中のサービスのプロセスへそのまま送る。
+*/
+static void host_on_forward( struct event_loop* loop , int signo , unsigned int count , void* context );
+
+/**
+   -i で受け取ってサービスへ転送するシグナルかどうか
+   捕まえられない SIGKILL SIGSTOP 、自分の子の回収に使う SIGCHLD 、
+   自分自身の fault で同期的に起きる SEGV BUS ILL FPE TRAP SYS と、
+   自分の書き込みや端末の操作で起きる PIPE TTIN TTOU は転送しない
+*/
+static int host_is_forwarded_signal( int signo );
+
+/**
+   終了要求から param->stop_interrupt_us ( SIGTERM の後は param->stop_terminate_us ) が過ぎた時のハンドラ
+   まだ終了していないサービスのプロセス ( 予備とリロードの世代を含む ) に、一段強いシグナルを送る。
+*/
+static void host_on_stop_timeout( struct event_loop* loop , event_loop_timer_id id , void* context );
+
+/**
+   コントロールソケットで要求を受け取った時のハンドラ ( プロトコルは control.h )
+   名前を指定した要求は、そのサービスだけを対象にする。
+*/
+static void host_on_control( struct control_server* server , const unsigned char* request , size_t length ,
+                             struct control_buffer* response , void* context );
+
+/**
+   サービスから通知が届いた時のハンドラ
+   起動したサービスからの READY=1 であれば呼び出し元へ知らせ、
+   リロードの新しい世代からの READY=1 であれば、入れ替える。
+*/
+static void host_on_notify( struct notify_socket* notify , pid_t pid , const char* message , void* context );
+
+/**
+   終了したサービスを param->restart に従って、タイマーで再起動する
+   crash loop と判定した場合は、 syslog に出力して諦める
+*/
+static void host_schedule_restart( struct host_state* state , struct service* service );
+
+/**
+   再起動のタイマーのハンドラ
+   起動できなかった場合も、すぐに終了したものとして次の再起動を予定する
+*/
+static void host_on_restart( struct event_loop* loop , event_loop_timer_id id , void* context );
+
+/**
+   子プロセスが終了した時のハンドラ
+*/
+static void host_on_child( struct event_loop* loop , pid_t pid , void* context );
+
+/**
+   service_table_reap で見つけた表に無い子プロセスを、イベントループで監視していれば ( gzip(1) の圧縮 ) 、
+   その監視のハンドラに回収させる
+   @return 監視のハンドラに任せた場合は 1 引き取った子孫の場合は 0
+*/
+static int host_on_foreign_child( pid_t pid , void* context );
+
+/**
+   サービスのプロセスが終了した時に service_table_reap から呼ばれるハンドラ
+   プロセスの役割毎に、それぞれの処理へ振り分ける
+*/
+static void host_on_process_exit( struct service_table* table , struct service* service ,
+                                  enum service_process_role role , pid_t pid , void* context );
+
+/**
+   サービスの実行中のプロセスが終了した時に host_on_process_exit から呼ばれる
+*/
+static void host_on_service_exit( struct host_state* state , struct service* service , pid_t pid )
+{
+  host_report_ready( state , service , ECHILD );
+  if( CLD_EXITED == service->exit_code ){
+    syslog( LOG_INFO , "service \"%s\" (pid %d) exited with status %d" ,
+            service->name , (int)pid , service->exit_status );
   }else{
-    
-    /* このパイプは、親プロセスの中で使うのみである。 */
-    int child_pipe[2] = {-1,-1}; /* SIGCHLD をうける self-pipe */
-    int intr_pipe[2]  = {-1,-1}; /* SIGINTR をうける self-pipe */
-    
-    VERIFY( 0 == pipe( child_pipe ) );
-    VERIFY( 0 == pipe( intr_pipe ) );
-    
-    /* int は、 sig_atomic_t に納まる */
-    struct type_static_assert{ int expression[ sizeof( sig_atomic_t ) <=  sizeof(int) ? 1 : -1 ]; };
-    sig_child_pipe = (sig_atomic_t)child_pipe[WRITE_SIDE];
-    sig_intr_pipe  = (sig_atomic_t)intr_pipe[WRITE_SIDE];
-    
-#if defined( __GNUC__ )
-    /* sig_atomic_t への代入が終わったので、ダメ押しで、メモリバリアを張っておく 
-       必要は無いはずである。*/
-    __sync_synchronize(); 
-#endif /* defined( __GNUC__ ) */
-    
-    /* シグナルハンドラの準備 */
-    struct sigaction sig_child_act_store = {{0}};
-    struct sigaction sig_intr_act_store = {{0}};
-    struct sigaction sig_hup_act_store = {{0}};
-    struct sigaction sig_term_act_store = {{0}};
-    {
-      struct sigaction sig_child_act = {{0}};
-      set_signal_handler( & sig_child_act , sig_child_handler );
-      VERIFY( 0 == sigaction( SIGCHLD , &sig_child_act , &sig_child_act_store  ));
-    }
-    {
-      struct sigaction sig_intr_act = {{0}};
-      set_signal_handler( &sig_intr_act , sig_intr_handler );
-      VERIFY( 0 == sigaction( SIGINT , &sig_intr_act , &sig_intr_act_store ));
-      VERIFY( 0 == sigaction( SIGHUP , &sig_intr_act , &sig_hup_act_store  ));
-      VERIFY( 0 == sigaction( SIGTERM, &sig_intr_act , &sig_term_act_store )); 
-    }
-    VERIFY( 0 == sigprocmask( SIG_SETMASK , &oldset , NULL ) );
-    
-    host_daemonlize_process( child_pid , child_pipe[READ_SIDE] , intr_pipe[READ_SIDE] );
-    
-    VERIFY( 0 == sigaction( SIGHUP , &sig_hup_act_store , NULL ) );
-    VERIFY( 0 == sigaction( SIGINT , &sig_intr_act_store ,NULL) );        
-    VERIFY( 0 == sigaction( SIGCHLD , &sig_child_act_store ,NULL ) );
-    VERIFY( 0 == sigaction( SIGTERM , &sig_term_act_store , NULL ));
-    sig_child_pipe = (sig_atomic_t)-1;
-    sig_intr_pipe  = (sig_atomic_t)-1;
-#if defined( __GNUC__ )
-    /* sig_atomic_t への代入が終わったので、ダメ押しで、メモリバリアを張っておく 
-       必要は無いはずである。*/
-    __sync_synchronize(); 
-#endif /* defined( __GNUC__ ) */
-    VERIFY( 0 == close( child_pipe[WRITE_SIDE] ) );
-    VERIFY( 0 == close( child_pipe[READ_SIDE] ) );
-    VERIFY( 0 == close( intr_pipe[WRITE_SIDE] ) );
-    VERIFY( 0 == close( intr_pipe[READ_SIDE] ));
-    result = EXIT_SUCCESS;
-  }
-  VERIFY( 0 == unlink( pid_file_path ) );
-  return result;
+    syslog( LOG_INFO , "service \"%s\" (pid %d) killed by signal %d" ,
+            service->name , (int)pid , service->exit_status );
+  }
+  host_schedule_restart( state , service );
+  return;
 }
 
-
-void exec_logger_process( int readfd )
+static void host_schedule_restart( struct host_state* state , struct service* service )
 {
-  int null_out = open( "/dev/null" , O_WRONLY );
-  int err_fd = dup( STDERR_FILENO );
-  if( -1 == fcntl( err_fd , F_SETFD , FD_CLOEXEC )){
-    perror( "fcntl( err_fd , F_SETFD , FD_CLOEXEC )" );
+  const struct service_restart_policy* const policy = &(state->param->restart);
+  if( state->stopping || !service_needs_restart( policy , service ) ){
+    host_retire_standby( state , service );
+    return;
+  }
+  unsigned long long delay_us = 0;
+  if( 0 != service_schedule_restart( state->table , policy , service , &delay_us ) ){
+    syslog( LOG_ERR , "service \"%s\" restarted %u times within %llu seconds , giving up" ,
+            service->name , policy->burst , policy->interval_us / 1000000ULL );
+    host_retire_standby( state , service );
+    return;
   }
-  VERIFY( dup2( readfd , STDIN_FILENO ) == STDIN_FILENO );
-  VERIFY( dup2( null_out , STDOUT_FILENO ) ==STDOUT_FILENO );
-  VERIFY( dup2( null_out , STDERR_FILENO ) == STDERR_FILENO );
-  VERIFY( 0 == close( null_out ) );
-  if( -1 == execl( "/usr/bin/logger" ,
-                   "/usr/bin/logger" , "-t" , "daemonlize" , "-i" , NULL ) ){
-    int err = errno;
-    char buffer[80];
-    strerror_r( err , buffer , sizeof( buffer )/ sizeof( buffer[0] ));
-    write( err_fd , buffer , strlen( buffer ) );
-    VERIFY( 0 == close( err_fd ) );
-    abort();
+  /* 予備のプロセスがあれば、バックオフを待たずに入れ替える ( crash loop の判定は同じように数える ) */
+  if( 0 < service->standby_pid && 0 == host_activate_standby( state , service ) ){
+    syslog( LOG_NOTICE , "service \"%s\" failed over to standby (pid %d) in %llu us" ,
+            service->name , (int)service->pid , service->started_us - state->child_event_us );
+    /* 入れ替えたプロセスの初期化に CPU を譲ってから、次の予備のプロセスを起動する */
+    host_schedule_standby( state , service , policy->initial_delay_us );
+    return;
   }
+  struct host_restart* const restart = &(state->restarts[ service - state->table->services ]);
+  service->restart_timer = event_loop_add_timer( state->loop , delay_us , 0 , host_on_restart , restart );
+  if( 0 == service->restart_timer ){
+    syslog( LOG_ERR , "%m, event_loop_add_timer() faild , service = \"%s\"" , service->name );
+    service_cancel_restart( state->table , service );
+    return;
+  }
+  syslog( LOG_NOTICE , "service \"%s\" will be restarted in %llu ms" , service->name , delay_us / 1000ULL );
   return;
 }
 
-void print_help_text(const char* self_path)
+static void host_on_restart( struct event_loop* loop , event_loop_timer_id id , void* context )
 {
-  fprintf( stdout, "%s daemonlize_program [daemonlize_program_args...]\n" , self_path );
-  fprintf( stdout, " 起動するプログラムは ./sampledaemon とパスを記述するか、絶対パスにする必要があります。\n");
+  (void)id;
+  struct host_restart* const restart = context;
+  assert( restart );
+  struct host_state* const state = restart->state;
+  struct service* const service = restart->service;
+  service->restart_timer = 0; /* 一度だけのタイマーなので、すでに登録は外れている */
+  if( 0 == spawn_service( loop , state->param , state->table , service ) ){
+    syslog( LOG_INFO , "service \"%s\" restarted (pid %d)" , service->name , (int)service->pid );
+    VERIFY( 0 == event_loop_add_child( loop , service->pid , host_on_child , state ) );
+    host_schedule_standby( state , service , state->param->restart.initial_delay_us );
+    return;
+  }
+  service_start_failed( state->table , service );
+  host_schedule_restart( state , service );
   return;
 }
 
-int entry_point( int argc , char* argv[] )
+/**
+   子プロセスが終了した時のハンドラ
+   どの子プロセスの通知であっても、終了している子プロセスを全てまとめて回収する
+*/
+static void host_on_child( struct event_loop* loop , pid_t pid , void* context )
 {
-  if( ! ( 1 < argc ) ){
-    /* オプションが足りない */
-    print_help_text(argv[0]);
-    return EXIT_SUCCESS;
-  }
+  (void)loop;
+  (void)pid;
+  struct host_state* const state = context;
+  assert( state );
+  state->child_event_us = host_now_us();
+  service_table_reap( state->table , host_on_process_exit , host_on_foreign_child , state );
+  return;
+}
 
-  /* まず一段階目のfork では SIGCHLD を 無視する  */
-  {
-    struct sigaction sa = {{0}}; 
-    sa.sa_handler = SIG_IGN;
-    sa.sa_flags = SA_NOCLDWAIT;
-    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
-      return EXIT_FAILURE;
-    }
-  }
+static int host_on_foreign_child( pid_t pid , void* context )
+{
+  struct host_state* const state = context;
+  assert( state );
+  return event_loop_dispatch_child( state->loop , pid );
+}
 
-  {
-    const pid_t pid = fork();
-    if( pid < 0 ){ // fork fail.
-      perror( "fork faild" );
-      return EXIT_FAILURE;
-    }
-    
-    if( 0 != pid ){
-      return EXIT_SUCCESS;
+static void host_on_process_exit( struct service_table* table , struct service* service ,
+                                  enum service_process_role role , pid_t pid , void* context )
+{
+  (void)table;
+  struct host_state* const state = context;
+  assert( state );
+  VERIFY( 0 == event_loop_remove_child( state->loop , pid ) );
+  switch( role ){
+  case SERVICE_PROCESS_STANDBY:
+    host_on_standby_exit( state , service , pid );
+    break;
+  case SERVICE_PROCESS_RELOADING:
+    if( 0 != service->reload_timer ){
+      VERIFY( 0 == event_loop_remove_timer( state->loop , service->reload_timer ) );
+      service->reload_timer = 0;
     }
-
-    /* セッショングループを作り直して端末グループから外れる  */
-    assert( 0 == pid && "the process is child process.");
-    if( -1 == setsid() ){
-      perror("create new session");
+    syslog( LOG_WARNING , "new process of service \"%s\" (pid %d) exited before ready , reload aborted" ,
+            service->name , (int)pid );
+    break;
+  case SERVICE_PROCESS_DRAINING:
+    if( 0 != service->drain_timer ){
+      VERIFY( 0 == event_loop_remove_timer( state->loop , service->drain_timer ) );
+      service->drain_timer = 0;
     }
+    syslog( LOG_INFO , "draining process of service \"%s\" (pid %d) exited" , service->name , (int)pid );
+    break;
+  default:
+    host_on_service_exit( state , service , pid );
+    break;
+  }
+  return;
+}
+
+static unsigned long long host_now_us( void )
+{
+  struct timespec now = {0};
+  VERIFY( 0 == clock_gettime( CLOCK_MONOTONIC , &now ) );
+  return (unsigned long long)now.tv_sec * 1000000ULL + (unsigned long long)now.tv_nsec / 1000ULL;
+}
+
+static int host_kill( pid_t pid , int signo )
+{
+  assert( 0 < pid );
+  return kill( -pid , signo );
+}
+
+static int create_service_environ( struct service_environ* env , size_t listen_fd_count , int standby_fd ,
+                                   const char* notify_path )
+{
+  extern char** environ;
+  static const char* const names[] = { LISTEN_SOCKET_FDS_ENV , LISTEN_SOCKET_PID_ENV ,
+                                       LISTEN_SOCKET_FDNAMES_ENV , SERVICE_STANDBY_FD_ENV , NOTIFY_SOCKET_ENV };
+  env->envp = NULL;
+  env->pid = NULL;
+  if( 0 == listen_fd_count && standby_fd < 0 && NULL == notify_path ){
+    return 0;
+  }
+  size_t count = 0;
+  while( environ[count] ){
+    ++count;
+  }
+  /* 加える変数は、一つの領域にまとめて確保して envp の先頭に置く */
+  enum{ ENTRY_SIZE = 64 };
+  const size_t notify_size = ( notify_path ) ? strlen( NOTIFY_SOCKET_ENV ) + strlen( notify_path ) + 2 : 0;
+  char** const envp = calloc( count + 5 , sizeof( char* ) );
+  char* const entries = calloc( 1 , 3 * ENTRY_SIZE + notify_size );
+  if( NULL == envp || NULL == entries ){
+    free( envp );
+    free( entries );
+    return -1;
+  }
+  size_t j = 0;
+  char* entry = entries;
+  if( 0 < listen_fd_count ){
+    VERIFY( 0 < snprintf( entry , ENTRY_SIZE , "%s=%zu" , LISTEN_SOCKET_FDS_ENV , listen_fd_count ) );
+    envp[j++] = entry;
+    entry += ENTRY_SIZE;
+    /* 値は子プロセスが exec(3) の前に自分の PID で書き換える */
+    const int length = snprintf( entry , ENTRY_SIZE , "%s=0" , LISTEN_SOCKET_PID_ENV );
+    VERIFY( 0 < length && length + PROC_SPAWN_PID_BUFFER_SIZE < ENTRY_SIZE );
+    env->pid = entry + length - 1;
+    envp[j++] = entry;
+    entry += ENTRY_SIZE;
+  }
+  if( 0 <= standby_fd ){
+    VERIFY( 0 < snprintf( entry , ENTRY_SIZE , "%s=%d" , SERVICE_STANDBY_FD_ENV , standby_fd ) );
+    envp[j++] = entry;
+    entry += ENTRY_SIZE;
+  }
+  if( notify_path ){
+    VERIFY( 0 < snprintf( entry , notify_size , "%s=%s" , NOTIFY_SOCKET_ENV , notify_path ) );
+    envp[j++] = entry;
+  }
+  /* daemonic 自身が受け取った NOTIFY_SOCKET は、置き換えない限りそのまま渡す */
+  const size_t strip_count = sizeof( names ) / sizeof( names[0] ) - ( ( notify_path ) ? 0 : 1 );
+  for( size_t i = 0 ; i < count ; ++i ){
+    int inherited = 1;
+    for( size_t k = 0 ; k < strip_count ; ++k ){
+      const size_t length = strlen( names[k] );
+      if( 0 == strncmp( environ[i] , names[k] , length ) && '=' == environ[i][length] ){
+        inherited = 0;
+        break;
+      }
+    }
+    if( inherited ){
+      envp[j++] = environ[i];
+    }
+  }
+  envp[j] = NULL;
+  env->envp = envp;
+  return 0;
+}
+
+static void free_service_environ( struct service_environ* env )
+{
+  if( env->envp ){
+    free( env->envp[0] ); /* 加えた変数をまとめた領域 他は environ のもの */
+    free( env->envp );
+  }
+  env->envp = NULL;
+  env->pid = NULL;
+  return;
+}
+
+static int host_spawn_standby( struct host_state* state , struct service* service )
+{
+  assert( 0 == service->standby_pid );
+  int gate[2] = { -1 , -1 };
+  pid_t pid = -1;
+  if( SERVICE_STANDBY_GATE == state->param->standby ){
+    if( -1 == socketpair( AF_UNIX , SOCK_STREAM | SOCK_CLOEXEC , 0 , gate ) ){
+      syslog( LOG_ERR , "%m, socketpair() faild , service = \"%s\"" , service->name );
+      return -1;
+    }
+    pid = spawn_service_process( state->loop , state->param , service , gate[1] );
+    VERIFY( 0 == close( gate[1] ) );
+    if( -1 == pid ){
+      VERIFY( 0 == close( gate[0] ) );
+      return -1;
+    }
+  }else{
+    pid = spawn_service_process( state->loop , state->param , service , -1 );
+    if( -1 == pid ){
+      return -1;
+    }
+    /* exec(3) は終わっているので、プログラムが動き出す前 ( あるいは直後 ) に止める */
+    VERIFY( 0 == host_kill( pid , SIGSTOP ) );
+  }
+  service_standby_started( state->table , service , pid , gate[0] );
+  VERIFY( 0 == event_loop_add_child( state->loop , pid , host_on_child , state ) );
+  syslog( LOG_INFO , "standby of service \"%s\" started (pid %d)" , service->name , (int)pid );
+  return 0;
+}
+
+static void host_schedule_standby( struct host_state* state , struct service* service , unsigned long long delay_us )
+{
+  if( SERVICE_STANDBY_NONE == state->param->standby || state->stopping ||
+      0 < service->standby_pid || 0 != service->standby_timer ){
+    return;
+  }
+  struct host_restart* const restart = &(state->restarts[ service - state->table->services ]);
+  service->standby_timer = event_loop_add_timer( state->loop , delay_us , 0 , host_on_standby_timer , restart );
+  if( 0 == service->standby_timer ){
+    syslog( LOG_ERR , "%m, event_loop_add_timer() faild , service = \"%s\"" , service->name );
+  }
+  return;
+}
+
+static void host_on_standby_timer( struct event_loop* loop , event_loop_timer_id id , void* context )
+{
+  (void)loop;
+  (void)id;
+  struct host_restart* const restart = context;
+  assert( restart );
+  struct service* const service = restart->service;
+  service->standby_timer = 0; /* 一度だけのタイマーなので、すでに登録は外れている */
+  if( SERVICE_STATE_RUNNING != service->state || 0 < service->standby_pid ){
+    return;
+  }
+  if( 0 != host_spawn_standby( restart->state , service ) ){
+    syslog( LOG_WARNING , "standby of service \"%s\" could not be started" , service->name );
+  }
+  return;
+}
+
+static int host_activate_standby( struct host_state* state , struct service* service )
+{
+  assert( 0 < service->standby_pid );
+  if( 0 <= service->standby_gate ){
+    static const char go = 1;
+    ssize_t length = 0;
+    do{
+      length = send( service->standby_gate , &go , sizeof( go ) , MSG_NOSIGNAL );
+    }while( -1 == length && EINTR == errno );
+    if( (ssize_t)sizeof( go ) != length ){
+      /* 予備のプロセスは、もう居ない */
+      return -1;
+    }
+    VERIFY( 0 == close( service->standby_gate ) );
+    service->standby_gate = -1;
+  }else if( -1 == host_kill( service->standby_pid , SIGCONT ) ){
+    return -1;
+  }
+  for( size_t i = 0 ; i < SERVICE_OUTPUT_COUNT ; ++i ){
+    if( service->logs[i].stream ){
+      log_stream_set_pid( service->logs[i].stream , service->standby_pid );
+    }
+  }
+  service_promote_standby( state->table , service );
+  return 0;
+}
+
+static void host_retire_standby( struct host_state* state , struct service* service )
+{
+  if( 0 != service->standby_timer ){
+    VERIFY( 0 == event_loop_remove_timer( state->loop , service->standby_timer ) );
+    service->standby_timer = 0;
+  }
+  if( 0 <= service->standby_gate ){
+    /* ゲートで EOF を読んだプログラムは、動かずに終了する */
+    VERIFY( 0 == close( service->standby_gate ) );
+    service->standby_gate = -1;
+  }
+  if( 0 < service->standby_pid ){
+    service->standby_retired = 1;
+    VERIFY( 0 == host_kill( service->standby_pid , SIGINT ) );
+    if( SERVICE_STANDBY_STOP == state->param->standby ){
+      VERIFY( 0 == host_kill( service->standby_pid , SIGCONT ) );
+    }
+  }
+  return;
+}
+
+static void host_on_standby_exit( struct host_state* state , struct service* service , pid_t pid )
+{
+  const int retired = service->standby_retired;
+  service->standby_retired = 0;
+  if( 0 <= service->standby_gate ){
+    VERIFY( 0 == close( service->standby_gate ) );
+    service->standby_gate = -1;
+  }
+  if( state->stopping || SERVICE_STATE_RUNNING != service->state ){
+    return;
+  }
+  if( retired ){
+    /* リロードで入れ替えたので、新しい世代のプログラムで起動しなおす */
+    host_schedule_standby( state , service , state->param->restart.initial_delay_us );
+    return;
+  }
+  syslog( LOG_WARNING , "standby of service \"%s\" (pid %d) exited before activation" , service->name , (int)pid );
+  host_schedule_standby( state , service , state->param->restart.max_delay_us );
+  return;
+}
+
+static int host_start_reload( struct host_state* state , struct service* service )
+{
+  if( SERVICE_STATE_RUNNING != service->state ){
+    syslog( LOG_WARNING , "service \"%s\" is not running , reload skipped" , service->name );
+    return -1;
+  }
+  if( 0 < service->reloading_pid || 0 < service->draining_pid ){
+    syslog( LOG_WARNING , "previous reload of service \"%s\" is in progress , reload skipped" , service->name );
+    return -1;
+  }
+  /* 待ち受けているソケットはコントロールプロセスが持っているので、新しい世代にも同じものを渡せる */
+  const pid_t pid = spawn_service_process( state->loop , state->param , service , -1 );
+  if( -1 == pid ){
+    syslog( LOG_WARNING , "service \"%s\" could not be reloaded" , service->name );
+    return -1;
+  }
+  service_reload_started( state->table , service , pid );
+  VERIFY( 0 == event_loop_add_child( state->loop , pid , host_on_child , state ) );
+  syslog( LOG_INFO , "service \"%s\" reloading (pid %d)" , service->name , (int)pid );
+  if( 0 == state->param->ready_timeout_us ){
+    host_finish_reload( state , service );
+    return 0;
+  }
+  struct host_restart* const restart = &(state->restarts[ service - state->table->services ]);
+  service->reload_timer = event_loop_add_timer( state->loop , state->param->ready_timeout_us , 0 ,
+                                                host_on_reload_timeout , restart );
+  if( 0 == service->reload_timer ){
+    syslog( LOG_ERR , "%m, event_loop_add_timer() faild , service = \"%s\"" , service->name );
+    host_abort_reload( state , service );
+    return -1;
+  }
+  return 0;
+}
+
+static void host_finish_reload( struct host_state* state , struct service* service )
+{
+  const pid_t old_pid = service_reload_ready( state->table , service );
+  for( size_t i = 0 ; i < SERVICE_OUTPUT_COUNT ; ++i ){
+    if( service->logs[i].stream ){
+      log_stream_set_pid( service->logs[i].stream , service->pid );
+    }
+  }
+  host_retire_standby( state , service );
+  host_schedule_standby( state , service , state->param->restart.initial_delay_us );
+  host_drain_process( state , service );
+  syslog( LOG_NOTICE , "service \"%s\" reloaded (pid %d -> %d)" , service->name , (int)old_pid , (int)service->pid );
+  return;
+}
+
+static void host_abort_reload( struct host_state* state , struct service* service )
+{
+  if( 0 != service->reload_timer ){
+    VERIFY( 0 == event_loop_remove_timer( state->loop , service->reload_timer ) );
+    service->reload_timer = 0;
+  }
+  (void)service_reload_abort( state->table , service );
+  host_drain_process( state , service );
+  return;
+}
+
+static void host_drain_process( struct host_state* state , struct service* service )
+{
+  assert( 0 < service->draining_pid );
+  assert( 0 == service->drain_timer );
+  /* 古い世代は SIGINT で新しい接続の受け付けをやめ、処理中のものを終えてから終了する */
+  VERIFY( 0 == host_kill( service->draining_pid , SIGINT ) );
+  struct host_restart* const restart = &(state->restarts[ service - state->table->services ]);
+  service->drain_timer = event_loop_add_timer( state->loop , state->param->drain_timeout_us , 0 ,
+                                               host_on_drain_timeout , restart );
+  if( 0 == service->drain_timer ){
+    syslog( LOG_ERR , "%m, event_loop_add_timer() faild , service = \"%s\"" , service->name );
+  }
+  return;
+}
+
+static void host_on_reload_timeout( struct event_loop* loop , event_loop_timer_id id , void* context )
+{
+  (void)loop;
+  (void)id;
+  struct host_restart* const restart = context;
+  assert( restart );
+  struct service* const service = restart->service;
+  service->reload_timer = 0; /* 一度だけのタイマーなので、すでに登録は外れている */
+  syslog( LOG_WARNING , "new process of service \"%s\" (pid %d) was not ready in %llu ms , reload aborted" ,
+          service->name , (int)service->reloading_pid , restart->state->param->ready_timeout_us / 1000ULL );
+  host_abort_reload( restart->state , service );
+  return;
+}
+
+static void host_on_drain_timeout( struct event_loop* loop , event_loop_timer_id id , void* context )
+{
+  (void)loop;
+  (void)id;
+  struct host_restart* const restart = context;
+  assert( restart );
+  struct service* const service = restart->service;
+  service->drain_timer = 0; /* 一度だけのタイマーなので、すでに登録は外れている */
+  if( 0 < service->draining_pid ){
+    syslog( LOG_WARNING , "draining process of service \"%s\" (pid %d) did not exit in %llu ms , killed" ,
+            service->name , (int)service->draining_pid , restart->state->param->drain_timeout_us / 1000ULL );
+    VERIFY( 0 == host_kill( service->draining_pid , SIGKILL ) );
+  }
+  return;
+}
+
+static void host_report_ready( struct host_state* state , struct service* service , int error )
+{
+  struct host_restart* const restart = &(state->restarts[ service - state->table->services ]);
+  if( !restart->awaiting_ready ){
+    return;
+  }
+  restart->awaiting_ready = 0;
+  assert( 0 < state->unready );
+  --(state->unready);
+  send_start_report( state->report_fd , service->name , service->pid , error , 1 );
+  if( 0 == error ){
+    syslog( LOG_INFO , "service \"%s\" (pid %d) is ready in %llu us after exec" ,
+            service->name , (int)service->pid , host_now_us() - service->started_us );
+  }
+  if( 0 == state->unready ){
+    if( 0 != state->ready_timer ){
+      VERIFY( 0 == event_loop_remove_timer( state->loop , state->ready_timer ) );
+      state->ready_timer = 0;
+    }
+    VERIFY( 0 == close( state->report_fd ) );
+    state->report_fd = -1;
+  }
+  return;
+}
+
+static void host_on_ready_timeout( struct event_loop* loop , event_loop_timer_id id , void* context )
+{
+  (void)loop;
+  (void)id;
+  struct host_state* const state = context;
+  assert( state );
+  state->ready_timer = 0; /* 一度だけのタイマーなので、すでに登録は外れている */
+  for( size_t i = 0 ; i < state->table->count && 0 < state->unready ; ++i ){
+    struct service* const service = &(state->table->services[i]);
+    if( state->restarts[i].awaiting_ready ){
+      /* サービスは止めない 呼び出し元が失敗を見て、止めるかどうかを決める */
+      syslog( LOG_WARNING , "service \"%s\" was not ready in %llu ms" ,
+              service->name , state->param->ready_wait_us / 1000ULL );
+      host_report_ready( state , service , ETIMEDOUT );
+    }
+  }
+  return;
+}
+
+static void host_on_control( struct control_server* server , const unsigned char* request , size_t length ,
+                             struct control_buffer* response , void* context )
+{
+  (void)server;
+  struct host_state* const state = context;
+  assert( state );
+  struct control_reader reader = { request , length , 0 , 0 };
+  const uint8_t command = control_reader_get_u8( &reader );
+  const uint8_t argument = control_reader_get_u8( &reader );
+  /* 名前は NUL 終端していないので、長さも比べる */
+  const char* const name = (const char*)( request + reader.offset );
+  const size_t name_length = length - reader.offset;
+
+  if( command < CONTROL_STATUS || CONTROL_REAPER < command ||
+      ( CONTROL_SIGNAL == command && ( 0 == argument || HOST_NSIG <= argument ) ) ){
+    control_buffer_set_status( response , EINVAL );
+    return;
+  }
+  if( CONTROL_STOP == command ){
+    host_on_interrupt( state->loop , SIGINT , 1 , state );
+    return;
+  }
+  if( CONTROL_REAPER == command ){
+    const struct service_reap_stats* const stats = &(state->table->reap_stats);
+    control_buffer_put_u8( response , ( state->param->subreaper ) ? 1 : 0 );
+    control_buffer_put_u64( response , stats->reaped );
+    control_buffer_put_u64( response , stats->batches );
+    control_buffer_put_u32( response , ( UINT32_MAX < stats->max_batch ) ? UINT32_MAX : (uint32_t)stats->max_batch );
+    control_buffer_put_u64( response , stats->descendants );
+    control_buffer_put_u64( response , stats->descendants_failed );
+    control_buffer_put_u64( response , stats->descendants_killed );
+    return;
+  }
+  if( CONTROL_RELOAD == command && state->stopping ){
+    control_buffer_set_status( response , EBUSY );
+    return;
+  }
+  const unsigned long long now_us = host_now_us();
+  size_t matched = 0;
+  size_t signalled = 0;
+  int status = 0;
+  for( size_t i = 0 ; i < state->table->count ; ++i ){
+    struct service* const service = &(state->table->services[i]);
+    const size_t service_name_length = strlen( service->name );
+    if( 0 < name_length && ( service_name_length != name_length || 0 != memcmp( service->name , name , name_length ) ) ){
+      continue;
+    }
+    ++matched;
+    switch( command ){
+    case CONTROL_STATUS:
+      /* service_table_add が SERVICE_NAME_MAX までに制限しているので、 u8 に収まる */
+      control_buffer_put_u8( response , (uint8_t)service_name_length );
+      control_buffer_put_bytes( response , service->name , service_name_length );
+      control_buffer_put_u8( response , service->state );
+      control_buffer_put_u8( response , service->exit_code );
+      control_buffer_put_u32( response , (uint32_t)service->exit_status );
+      control_buffer_put_u32( response , (uint32_t)service->pid );
+      control_buffer_put_u32( response , (uint32_t)service->standby_pid );
+      control_buffer_put_u32( response , (uint32_t)service->reloading_pid );
+      control_buffer_put_u32( response , (uint32_t)service->draining_pid );
+      control_buffer_put_u32( response , service->restart_attempts );
+      control_buffer_put_u64( response , ( SERVICE_STATE_RUNNING == service->state ) ? now_us - service->started_us : 0 );
+      break;
+    case CONTROL_STATS:
+      control_buffer_put_u8( response , (uint8_t)service_name_length );
+      control_buffer_put_bytes( response , service->name , service_name_length );
+      for( size_t j = 0 ; j < SERVICE_OUTPUT_COUNT ; ++j ){
+        struct log_stream_stats stats;
+        memset( &stats , 0 , sizeof( stats ) );
+        if( service->logs[j].stream ){
+          log_stream_get_stats( service->logs[j].stream , &stats );
+        }
+        control_buffer_put_u64( response , stats.read_bytes );
+        control_buffer_put_u64( response , stats.sent_lines );
+        control_buffer_put_u64( response , stats.dropped_lines );
+        control_buffer_put_u64( response , stats.dropped_bytes );
+        control_buffer_put_u64( response , stats.congestions );
+      }
+      break;
+    case CONTROL_RELOAD:
+      if( 0 != host_start_reload( state , service ) ){
+        status = EBUSY;
+      }
+      break;
+    default: /* CONTROL_SIGNAL */
+      if( SERVICE_STATE_RUNNING == service->state ){
+        if( -1 == kill( service->pid , argument ) ){
+          status = errno;
+        }else{
+          ++signalled;
+        }
+      }
+      break;
+    }
+  }
+  if( 0 < name_length && 0 == matched ){
+    status = ENOENT;
+  }else if( CONTROL_SIGNAL == command && 0 == status && 0 == signalled ){
+    status = ESRCH;
+  }
+  if( 0 != status ){
+    control_buffer_set_status( response , status );
+  }
+  return;
+}
+
+static void host_on_notify( struct notify_socket* notify , pid_t pid , const char* message , void* context )
+{
+  (void)notify;
+  struct host_state* const state = context;
+  assert( state );
+  if( pid <= 0 || !notify_message_has( message , "READY=1" ) ){
+    return;
+  }
+  for( size_t i = 0 ; i < state->table->count ; ++i ){
+    struct service* const service = &(state->table->services[i]);
+    if( pid == service->pid && SERVICE_STATE_RUNNING == service->state ){
+      host_report_ready( state , service , 0 );
+      return;
+    }
+    if( pid != service->reloading_pid ){
+      continue;
+    }
+    if( 0 != service->reload_timer ){
+      VERIFY( 0 == event_loop_remove_timer( state->loop , service->reload_timer ) );
+      service->reload_timer = 0;
+    }
+    if( state->stopping || SERVICE_STATE_RUNNING != service->state ){
+      /* 入れ替える相手が居ない ( 終了した あるいは終了させている ) */
+      host_abort_reload( state , service );
+    }else{
+      host_finish_reload( state , service );
+    }
+    return;
+  }
+  return;
+}
+
+/**
+   SIGHUP が来た時のハンドラ
+   全てのサービスを host_start_reload でリロードする
+*/
+static void host_on_reload( struct event_loop* loop , int signo , unsigned int count , void* context )
+{
+  (void)loop;
+  (void)signo;
+  (void)count;
+  struct host_state* const state = context;
+  assert( state );
+  if( state->stopping ){
+    return;
+  }
+  for( size_t i = 0 ; i < state->table->count ; ++i ){
+    (void)host_start_reload( state , &(state->table->services[i]) );
+  }
+  return;
+}
+
+/**
+   SIGUSR1 が来た時のハンドラ
+   logrotate(8) などで外からファイルを rename した後に、出力先のファイルを開きなおす
+*/
+static void host_on_reopen( struct event_loop* loop , int signo , unsigned int count , void* context )
+{
+  (void)loop;
+  (void)signo;
+  (void)count;
+  struct host_state* const state = context;
+  assert( state );
+  for( size_t i = 0 ; i < state->table->count ; ++i ){
+    const struct service* const service = &(state->table->services[i]);
+    for( size_t j = 0 ; j < SERVICE_OUTPUT_COUNT ; ++j ){
+      if( service->logs[j].sink && 0 != log_sink_reopen( service->logs[j].sink ) ){
+        syslog( LOG_WARNING , "%m, reopen log faild , service = \"%s\" , %s" ,
+                service->name , service_output_names[j] );
+      }
+    }
+  }
+  return;
+}
+
+/**
+   自分自身に終了要求( SIGINT , SIGTERM ) が来た時のハンドラ
+   実行中の全てのサービス ( リロードの世代を含む ) のプロセスグループに SIGINT ( -i の場合は受け取ったシグナル ) を送り、
+   最初の終了要求では、終了しないサービスへ一段強いシグナルを送るタイマーを登録する
+*/
+static void host_on_interrupt( struct event_loop* loop , int signo , unsigned int count , void* context )
+{
+  (void)count;
+  struct host_state* const state = context;
+  assert( state );
+  const int stop_signo = ( state->param->init ) ? signo : SIGINT;
+  if( !state->stopping && 0 < state->param->stop_interrupt_us ){
+    state->stop_signal = stop_signo;
+    state->stop_timer = event_loop_add_timer( loop , state->param->stop_interrupt_us , 0 , host_on_stop_timeout , state );
+    if( 0 == state->stop_timer ){
+      syslog( LOG_ERR , "%m, event_loop_add_timer() faild" );
+    }
+  }
+  state->stopping = 1;
+  for( size_t i = 0 ; i < state->table->count ; ++i ){
+    struct service* const service = &(state->table->services[i]);
+    host_retire_standby( state , service );
+    if( 0 < service->reloading_pid ){
+      if( 0 != service->reload_timer ){
+        VERIFY( 0 == event_loop_remove_timer( loop , service->reload_timer ) );
+        service->reload_timer = 0;
+      }
+      VERIFY( 0 == host_kill( service->reloading_pid , stop_signo ) );
+    }
+    if( 0 < service->draining_pid ){
+      VERIFY( 0 == host_kill( service->draining_pid , stop_signo ) );
+    }
+    if( SERVICE_STATE_RUNNING == service->state ){
+      VERIFY( 0 == host_kill( service->pid , stop_signo ) );
+    }else if( SERVICE_STATE_BACKOFF == service->state ){
+      /* 再起動を待っているサービスは、再起動を取り消す */
+      VERIFY( 0 == event_loop_remove_timer( loop , service->restart_timer ) );
+      service_cancel_restart( state->table , service );
+    }
+  }
+  return;
+}
+
+static void host_on_forward( struct event_loop* loop , int signo , unsigned int count , void* context )
+{
+  struct host_state* const state = context;
+  assert( state );
+  if( SIGINT == signo || SIGTERM == signo || SIGQUIT == signo ){
+    host_on_interrupt( loop , signo , count , context );
+    return;
+  }
+  for( size_t i = 0 ; i < state->table->count ; ++i ){
+    const struct service* const service = &(state->table->services[i]);
+    if( SERVICE_STATE_RUNNING == service->state ){
+      VERIFY( 0 == kill( service->pid , signo ) );
+    }
+  }
+  return;
+}
+
+static int host_is_forwarded_signal( int signo )
+{
+  switch( signo ){
+  case SIGKILL: case SIGSTOP: case SIGCHLD:
+  case SIGSEGV: case SIGBUS: case SIGILL: case SIGFPE: case SIGTRAP: case SIGSYS:
+  case SIGPIPE: case SIGTTIN: case SIGTTOU:
+    return 0;
+  default:
+    return 1;
+  }
+}
+
+static void host_on_stop_timeout( struct event_loop* loop , event_loop_timer_id id , void* context )
+{
+  (void)id;
+  struct host_state* const state = context;
+  assert( state );
+  state->stop_timer = 0; /* 一度だけのタイマーなので、すでに登録は外れている */
+  const int signo = ( SIGINT == state->stop_signal ) ? SIGTERM : SIGKILL;
+  const char* const signal_name = ( SIGTERM == signo ) ? "SIGTERM" : "SIGKILL";
+  state->stop_signal = signo;
+  for( size_t i = 0 ; i < state->table->count ; ++i ){
+    const struct service* const service = &(state->table->services[i]);
+    const pid_t pids[] = { service->standby_pid , service->reloading_pid , service->draining_pid ,
+                           ( SERVICE_STATE_RUNNING == service->state ) ? service->pid : 0 };
+    for( size_t j = 0 ; j < sizeof( pids ) / sizeof( pids[0] ) ; ++j ){
+      if( pids[j] <= 0 ){
+        continue;
+      }
+      syslog( LOG_WARNING , "service \"%s\" (pid %d) did not stop , sending %s to its process group" ,
+              service->name , (int)pids[j] , signal_name );
+      VERIFY( 0 == host_kill( pids[j] , signo ) );
+    }
+  }
+  if( SIGTERM == signo && 0 < state->param->stop_terminate_us ){
+    state->stop_timer = event_loop_add_timer( loop , state->param->stop_terminate_us , 0 , host_on_stop_timeout , state );
+    if( 0 == state->stop_timer ){
+      syslog( LOG_ERR , "%m, event_loop_add_timer() faild" );
+    }
+  }
+  return;
+}
+
+/**
+   デーモン化したプロセスをホストするメインループ
+   この関数は、デーモン化した全ての子プロセスが終了して、再起動を待っているものも無くなるまで、制御を返さない。
+
+   @return 常に EXIT_SUCCESS ( 再起動のための領域を確保できない場合は EXIT_FAILURE )
+   @param loop イベントループ
+   @param param 再起動の方針と、再起動に使う起動の方法
+   @param table 起動済みのサービスの表
+   @param notify サービスからの通知を受け取るソケット 使わない場合は NULL
+   @param report_fd 準備ができたことを呼び出し元へ知らせるソケット ( この関数が閉じる ) 知らせない場合は -1
+*/
+int host_daemonlize_process( struct event_loop* loop , const struct process_param* param ,
+                             struct service_table* table , struct notify_socket* notify , int report_fd )
+{
+  /*
+    このプロセスを終了させようと、SIGINT が送られてきたときには、
+    イベントループから host_on_interrupt が呼ばれ、
+    kill( -pid , SIGINT ) で全てのサービスのプロセスグループの終了が図られて、次のループへ入る。
+    param->stop_interrupt_us 後にまだ終了していなければ host_on_stop_timeout が SIGTERM を、
+    さらに param->stop_terminate_us 後に SIGKILL を送るので、終了に掛かる時間には上限がある。
+    
+    子プロセスが終了した時には、 pidfd が読み込み可能になる（もしくは SIGCHLD が発生する）ので
+    host_on_child で waitid( P_ALL ) して、終了した子プロセスをまとめて回収する。
+    再起動するサービスは、 host_schedule_restart がタイマーを登録して、
+    期限が来たら host_on_restart で起動する。 ( イベントループの中では待たない )
+    SIGHUP が送られてきたときには、 host_on_reload で新しい世代を起動して、
+    準備ができたら ( host_on_notify ) 入れ替え、古い世代を終了させる。
+    全てのサービスが終了して、再起動を待っているものも無くなったら、制御を返す。
+  */
+  struct host_restart* const restarts = calloc( table->count , sizeof( struct host_restart ) );
+  if( NULL == restarts ){
+    syslog( LOG_ERR , "%m, calloc() faild" );
+    if( 0 <= report_fd ){
+      VERIFY( 0 == close( report_fd ) );
+    }
+    return EXIT_FAILURE;
+  }
+  struct host_state state = { loop , param , table , restarts , 0 , 0 , report_fd , 0 , 0 , 0 , 0 };
+  for( size_t i = 0 ; i < table->count ; ++i ){
+    restarts[i].state = &state;
+    restarts[i].service = &(table->services[i]);
+    /* 起動できたサービスは、 READY=1 が届くか、時間切れになるか、終了したら呼び出し元へ知らせる */
+    if( 0 <= report_fd && SERVICE_STATE_RUNNING == table->services[i].state ){
+      restarts[i].awaiting_ready = 1;
+      ++(state.unready);
+    }
+  }
+  if( 0 < state.unready ){
+    state.ready_timer = event_loop_add_timer( loop , param->ready_wait_us , 0 , host_on_ready_timeout , &state );
+    if( 0 == state.ready_timer ){
+      syslog( LOG_ERR , "%m, event_loop_add_timer() faild" );
+      host_on_ready_timeout( loop , 0 , &state );
+    }
+  }else if( 0 <= report_fd ){
+    VERIFY( 0 == close( report_fd ) );
+    state.report_fd = -1;
+  }
+  static const int intr_signals[] = { SIGINT , SIGTERM };
+  /* PID 1 として動く場合は、受け取ったシグナルをリアルタイムシグナルまで含めてサービスへ転送する
+     ( SIGHUP のリロードと SIGUSR1 の開きなおしはしない ) 。登録できたものを init_signals に覚えておく */
+  sigset_t init_signals;
+  VERIFY( 0 == sigemptyset( &init_signals ) );
+  if( param->init ){
+    for( int signo = 1 ; signo <= SIGRTMAX ; ++signo ){
+      /* libc が内部で使うシグナル ( glibc の 32 , 33 ) は sigaddset(3) が EINVAL で断る */
+      if( !host_is_forwarded_signal( signo ) || 0 != sigaddset( &init_signals , signo ) ){
+        continue;
+      }
+      if( 0 != event_loop_add_signal( loop , signo , host_on_forward , &state ) ){
+        if( EINVAL != errno ){
+          syslog( LOG_WARNING , "%m, event_loop_add_signal(%d) faild" , signo );
+        }
+        VERIFY( 0 == sigdelset( &init_signals , signo ) );
+      }
+    }
+  }else{
+    for( size_t i = 0 ; i < sizeof( intr_signals ) / sizeof( intr_signals[0] ) ; ++i ){
+      VERIFY( 0 == event_loop_add_signal( loop , intr_signals[i] , host_on_interrupt , &state ) );
+    }
+    VERIFY( 0 == event_loop_add_signal( loop , SIGUSR1 , host_on_reopen , &state ) );
+    VERIFY( 0 == event_loop_add_signal( loop , SIGHUP , host_on_reload , &state ) );
+  }
+  if( notify ){
+    notify_socket_set_handler( notify , host_on_notify , &state );
+  }
+  /* 状態の問い合わせと操作は "PID ファイル.ctl" で受け付ける 作れなくても監視は続ける
+     -i の場合は PID ファイルを作らないので、同じパスを使っている別の daemonic のソケットを奪わないように作らない */
+  struct control_server* control = NULL;
+  if( !param->init ){
+    char control_path[PATH_MAX];
+    if( (int)sizeof( control_path ) <= snprintf( control_path , sizeof( control_path ) , "%s%s" ,
+                                                 param->pid_file_path , CONTROL_SOCKET_SUFFIX ) ){
+      errno = ENAMETOOLONG;
+    }else{
+      control = control_server_create( loop , control_path , host_on_control , &state );
+    }
+    if( NULL == control ){
+      syslog( LOG_WARNING , "%m, control_server_create() faild , path = \"%s\"" , control_path );
+    }
+  }
+  for( size_t i = 0 ; i < table->count ; ++i ){
+    const struct service* const service = &(table->services[i]);
+    if( SERVICE_STATE_RUNNING == service->state ){
+      VERIFY( 0 == event_loop_add_child( loop , service->pid , host_on_child , &state ) );
+    }
+  }
+  /* 引き取った子孫は PID を知らないので、どの子プロセスが終了しても host_on_child でまとめて回収する
+     ( 子孫の終了はループの条件に入らないので、サービスの終了だけが終了を決める ) */
+  if( param->subreaper ){
+    VERIFY( 0 == event_loop_add_child( loop , EVENT_LOOP_ANY_CHILD , host_on_child , &state ) );
+  }
+  /* 起動したサービス毎に、予備のプロセスを一つずつ用意しておく */
+  for( size_t i = 0 ; i < table->count ; ++i ){
+    struct service* const service = &(table->services[i]);
+    if( SERVICE_STANDBY_NONE != param->standby && SERVICE_STATE_RUNNING == service->state &&
+        0 != host_spawn_standby( &state , service ) ){
+      syslog( LOG_WARNING , "standby of service \"%s\" could not be started" , service->name );
+    }
+  }
+
+  while( 0 < table->running || 0 < table->pending || 0 < table->standbys ||
+         0 < table->reloading || 0 < table->draining ){
+    if( event_loop_run_once( loop , -1 ) < 0 ){
+      syslog( LOG_ERR , "%m, event loop (%s) faild" , event_loop_backend_name() );
+      abort(); // なんかよくわからないことが起きた
+    }
+  }
+
+  if( param->init ){
+    for( int signo = 1 ; signo <= SIGRTMAX ; ++signo ){
+      if( 1 == sigismember( &init_signals , signo ) ){
+        VERIFY( 0 == event_loop_remove_signal( loop , signo ) );
+      }
+    }
+  }else{
+    for( size_t i = 0 ; i < sizeof( intr_signals ) / sizeof( intr_signals[0] ) ; ++i ){
+      VERIFY( 0 == event_loop_remove_signal( loop , intr_signals[i] ) );
+    }
+    VERIFY( 0 == event_loop_remove_signal( loop , SIGUSR1 ) );
+    VERIFY( 0 == event_loop_remove_signal( loop , SIGHUP ) );
+  }
+  if( param->subreaper ){
+    VERIFY( 0 == event_loop_remove_child( loop , EVENT_LOOP_ANY_CHILD ) );
+    /* 終了している子孫を回収しておく まだ動いているものは、このプロセスが終了した後に init が引き取る */
+    (void)service_table_reap( table , NULL , host_on_foreign_child , &state );
+    if( 0 < table->reap_stats.descendants ){
+      syslog( LOG_INFO , "reaped %llu orphaned descendants ( %llu failed , %llu killed by signal )" ,
+              table->reap_stats.descendants , table->reap_stats.descendants_failed ,
+              table->reap_stats.descendants_killed );
+    }
+  }
+  if( notify ){
+    notify_socket_set_handler( notify , NULL , NULL );
+  }
+  control_server_destroy( control );
+  if( 0 != state.ready_timer ){
+    VERIFY( 0 == event_loop_remove_timer( loop , state.ready_timer ) );
+  }
+  if( 0 != state.stop_timer ){
+    VERIFY( 0 == event_loop_remove_timer( loop , state.stop_timer ) );
+  }
+  if( 0 <= state.report_fd ){
+    VERIFY( 0 == close( state.report_fd ) );
+  }
+  free( restarts );
+  return EXIT_SUCCESS;
+}
+
+static void send_start_report( int fd , const char* name , pid_t pid , int error , int waited_ready )
+{
+  if( fd < 0 ){
+    return;
+  }
+  const int err = errno;
+  struct start_report report;
+  memset( &report , 0 , sizeof( report ) );
+  report.error = error;
+  report.pid = pid;
+  report.waited_ready = waited_ready;
+  VERIFY( 0 <= snprintf( report.name , sizeof( report.name ) , "%s" , name ) );
+  size_t offset = 0;
+  while( offset < sizeof( report ) ){
+    const ssize_t length = send( fd , (const char*)&report + offset , sizeof( report ) - offset , MSG_NOSIGNAL );
+    if( -1 == length ){
+      if( EINTR == errno ){
+        continue;
+      }
+      break; /* 呼び出し元が終了している */
+    }
+    offset += (size_t)length;
+  }
+  errno = err;
+  return;
+}
+
+static int wait_start_report( int fd , size_t count )
+{
+  int failed = 0;
+  for( size_t received = 0 ; received < count ; ++received ){
+    struct start_report report;
+    size_t offset = 0;
+    while( offset < sizeof( report ) ){
+      const ssize_t length = read( fd , (char*)&report + offset , sizeof( report ) - offset );
+      if( -1 == length && EINTR == errno ){
+        continue;
+      }
+      if( length <= 0 ){
+        break;
+      }
+      offset += (size_t)length;
+    }
+    if( offset < sizeof( report ) ){
+      /* 失敗を知らせてから終了した場合は、その出力だけで十分 */
+      if( !failed ){
+        fprintf( stderr , "the control process exited before starting all services\n" );
+      }
+      return EXIT_FAILURE;
+    }
+    report.name[ sizeof( report.name ) - 1 ] = '\0';
+    if( 0 != report.error ){
+      if( report.waited_ready ){
+        fprintf( stderr , "%s: %s\n" , report.name ,
+                 ( ETIMEDOUT == report.error ) ? "not ready before the timeout" : "exited before ready" );
+      }else{
+        fprintf( stderr , "%s: %s\n" , report.name , strerror( report.error ) );
+      }
+      failed = 1;
+    }
+  }
+  return ( failed ) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int open_service_log( struct event_loop* loop , const struct process_param* param ,
+                             struct log_sink* sink , struct service* service )
+{
+  for( size_t i = 0 ; i < SERVICE_OUTPUT_COUNT ; ++i ){
+    if( 0 != open_service_output( loop , param , sink , service , (enum service_output)i ) ){
+      close_service_log( service );
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void warm_service_executables( struct service_table* table )
+{
+  const char** const paths = calloc( table->count , sizeof( char* ) );
+  if( NULL == paths ){
+    syslog( LOG_WARNING , "%m, calloc() faild , warmup skipped" );
+    return;
+  }
+  size_t count = 0;
+  for( size_t i = 0 ; i < table->count ; ++i ){
+    struct service* const service = &(table->services[i]);
+    /* 開けないプログラムは、起動した時に失敗として報告する */
+    if( -1 != proc_spawn_executable_prepare( &(service->executable) , service->argv[0] ) ){
+      paths[count++] = service->executable.path;
+    }
+  }
+  struct exec_warmup_stats stats = {0};
+  if( 0 < count && 0 == exec_warmup( paths , count , 0 , &stats ) ){
+    syslog( LOG_INFO , "warmed up %zu files (%llu bytes) in %llu us , %zu libraries not found" ,
+            stats.files , stats.bytes , stats.elapsed_us , stats.unresolved );
+  }else if( 0 < count ){
+    syslog( LOG_WARNING , "%m, exec_warmup() faild" );
+  }
+  free( paths );
+  return;
+}
+
+static int open_service_passthrough( struct service* service )
+{
+  static const int fds[SERVICE_OUTPUT_COUNT] = { STDOUT_FILENO , STDERR_FILENO };
+  for( size_t i = 0 ; i < SERVICE_OUTPUT_COUNT ; ++i ){
+    /* 子プロセスでは dup2(2) で 1 と 2 になり、パイプも log_stream も挟まない */
+    service->logs[i].fd = fcntl( fds[i] , F_DUPFD_CLOEXEC , STDERR_FILENO + 1 );
+    if( -1 == service->logs[i].fd ){
+      syslog( LOG_ERR , "%m, F_DUPFD_CLOEXEC faild , service = \"%s\" , %s" , service->name , service_output_names[i] );
+      close_service_log( service );
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int init_exit_status( const struct service_table* table )
+{
+  const struct service* chosen = NULL;
+  for( size_t i = 0 ; i < table->count ; ++i ){
+    const struct service* const service = &(table->services[i]);
+    if( NULL == chosen ){
+      chosen = service;
+    }
+    if( CLD_EXITED != service->exit_code || 0 != service->exit_status ){
+      chosen = service;
+      break;
+    }
+  }
+  if( NULL == chosen ){
+    return EXIT_FAILURE;
+  }
+  return ( CLD_EXITED == chosen->exit_code ) ? ( chosen->exit_status & 0xff ) : 128 + chosen->exit_status;
+}
+
+static int open_service_output( struct event_loop* loop , const struct process_param* param ,
+                                struct log_sink* sink , struct service* service , enum service_output output )
+{
+  struct service_log* const log = &(service->logs[output]);
+  const char* const output_name = service_output_names[output];
+  int pipes[2] = {-1,-1};
+  if( pipe( pipes ) ){
+    syslog( LOG_ERR , "%m, pipe(2) faild , service = \"%s\" , %s" , service->name , output_name );
+    return -1;
+  }
+  /* 他のサービスに、このパイプが継承されないようにする */
+  VERIFY( -1 != fcntl( pipes[READ_SIDE] , F_SETFD , FD_CLOEXEC ) );
+  VERIFY( -1 != fcntl( pipes[WRITE_SIDE] , F_SETFD , FD_CLOEXEC ) );
+
+  /* 出力が一気に来ても、子プロセスの write(2) が止まらないように パイプを大きくしておく
+     大きくできなくても、既定の容量で動作は続ける */
+  if( 0 < param->pipe_size && -1 == x_set_pipe_size( pipes[WRITE_SIDE] , param->pipe_size ) ){
+    syslog( LOG_WARNING , "%m, F_SETPIPE_SZ faild , service = \"%s\" , size = %d" ,
+            service->name , param->pipe_size );
+  }
+
+  if( param->log_directory ){
+    /* 標準出力は "サービス名.log" 標準エラー出力は "サービス名.err.log" */
+    char path[PATH_MAX];
+    if( (int)sizeof( path ) <= snprintf( path , sizeof( path ) , "%s/%s%s.log" , param->log_directory , service->name ,
+                                         ( SERVICE_OUTPUT_STDERR == output ) ? ".err" : "" ) ){
+      errno = ENAMETOOLONG;
+    }else{
+      log->sink = log_sink_create_file( loop , path , 0 );
+    }
+    if( NULL == log->sink ){
+      syslog( LOG_ERR , "%m, log_sink_create_file() faild , path = \"%s\"" , path );
+      VERIFY( 0 == close( pipes[READ_SIDE] ) );
+      VERIFY( 0 == close( pipes[WRITE_SIDE] ) );
+      return -1;
+    }
+    if( ( 0 < param->rotate_bytes || 0 < param->rotate_age ) &&
+        0 != log_sink_set_rotation( log->sink , param->rotate_bytes , param->rotate_age , param->rotate_flags ) ){
+      syslog( LOG_WARNING , "%m, log_sink_set_rotation() faild , service = \"%s\"" , service->name );
+    }
+    if( param->durable &&
+        0 != log_sink_set_durable( log->sink , param->durable_window_us , param->durable_bytes ) ){
+      syslog( LOG_WARNING , "%m, log_sink_set_durable() faild , service = \"%s\"" , service->name );
+    }
+    sink = log->sink;
+  }
+
+  log->stream = log_stream_create( loop , sink , pipes[READ_SIDE] , service->name , param->priorities[output] );
+  if( NULL == log->stream ){
+    syslog( LOG_ERR , "%m, log_stream_create() faild , service = \"%s\" , %s" , service->name , output_name );
+    VERIFY( 0 == close( pipes[READ_SIDE] ) );
+    VERIFY( 0 == close( pipes[WRITE_SIDE] ) );
+    log_sink_destroy( log->sink );
+    log->sink = NULL;
+    return -1;
+  }
+  if( NULL == param->log_directory ){
+    if( ( LOG_STREAM_OVERFLOW_BLOCK != param->overflow || 0 < param->log_buffer_size ) &&
+        0 != log_stream_set_overflow( log->stream , param->overflow , param->log_buffer_size , param->sample_rate ) ){
+      syslog( LOG_WARNING , "%m, log_stream_set_overflow() faild , service = \"%s\"" , service->name );
+    }
+    /* 標準出力はまとめて送り、標準エラー出力はすぐに送る */
+    if( SERVICE_OUTPUT_STDOUT == output && 0 < param->stdout_batch_us &&
+        0 != log_stream_set_batch( log->stream , param->stdout_batch_us ) ){
+      syslog( LOG_WARNING , "%m, log_stream_set_batch() faild , service = \"%s\"" , service->name );
+    }
+    if( param->classify && 0 != log_stream_set_classify( log->stream , 1 ) ){
+      syslog( LOG_WARNING , "%m, log_stream_set_classify() faild , service = \"%s\"" , service->name );
+    }
+  }
+  log->fd = pipes[WRITE_SIDE];
+  return 0;
+}
+
+static void drain_service_logs( struct event_loop* loop , struct service_table* table )
+{
+  for( size_t i = 0 ; i < table->count ; ++i ){
+    struct service* const service = &(table->services[i]);
+    for( size_t j = 0 ; j < SERVICE_OUTPUT_COUNT ; ++j ){
+      if( 0 <= service->logs[j].fd ){
+        VERIFY( 0 == close( service->logs[j].fd ) );
+        service->logs[j].fd = -1;
+      }
+    }
+  }
+
+  struct timespec start = {0};
+  VERIFY( 0 == clock_gettime( CLOCK_MONOTONIC , &start ) );
+  for(;;){
+    int drained = 1;
+    for( size_t i = 0 ; drained && i < table->count ; ++i ){
+      const struct service* const service = &(table->services[i]);
+      for( size_t j = 0 ; j < SERVICE_OUTPUT_COUNT ; ++j ){
+        if( service->logs[j].stream && !log_stream_is_drained( service->logs[j].stream ) ){
+          drained = 0;
+          break;
+        }
+      }
+    }
+    if( drained ){
+      break;
+    }
+    struct timespec now = {0};
+    VERIFY( 0 == clock_gettime( CLOCK_MONOTONIC , &now ) );
+    const long elapsed_ms = (long)( now.tv_sec - start.tv_sec ) * 1000 + ( now.tv_nsec - start.tv_nsec ) / 1000000;
+    if( LOG_DRAIN_TIMEOUT_MS <= elapsed_ms ){
+      break; /* 出力をつないだままの孫プロセスがいるか、 syslogd が応答しない */
+    }
+    if( event_loop_run_once( loop , (int)( LOG_DRAIN_TIMEOUT_MS - elapsed_ms ) ) < 0 ){
+      break;
+    }
+  }
+  return;
+}
+
+static void close_service_log( struct service* service )
+{
+  for( size_t i = 0 ; i < SERVICE_OUTPUT_COUNT ; ++i ){
+    struct service_log* const log = &(service->logs[i]);
+    if( 0 <= log->fd ){
+      VERIFY( 0 == close( log->fd ) );
+      log->fd = -1;
+    }
+    if( log->stream ){
+      struct log_stream_stats stats;
+      log_stream_get_stats( log->stream , &stats );
+      if( 0 < stats.dropped_lines ){
+        syslog( LOG_WARNING , "service = \"%s\" , %lu lines (%llu bytes) of %s were dropped , "
+                "%lu congestions , buffer high water %zu bytes" ,
+                service->name , stats.dropped_lines , stats.dropped_bytes , service_output_names[i] ,
+                stats.congestions , stats.buffer_high_water );
+      }
+    }
+    log_stream_destroy( log->stream );
+    log->stream = NULL;
+    log_sink_destroy( log->sink );
+    log->sink = NULL;
+  }
+  return;
+}
+
+/**
+   param->spawn_backend で、サービスを一つ起動する
+   標準入力は /dev/null に、標準出力と標準エラー出力は open_service_log のパイプにつなげる。
+   プログラムは service->executable に開いておいたものを fd で exec し、入れ替えられていれば開きなおす。
+   @return 成功した場合は 0 失敗した場合は -1
+*/
+static pid_t spawn_service_process( struct event_loop* loop , const struct process_param* param ,
+                                    struct service* service , int standby_gate )
+{
+  /* 開けなかった場合は、 path で exec して、その失敗を proc_spawn で報告する */
+  const int prepared = proc_spawn_executable_prepare( &(service->executable) , service->argv[0] );
+  if( 1 == prepared && 1 < service->executable.opens ){
+    syslog( LOG_INFO , "service = \"%s\" , executable \"%s\" was replaced , reopened" ,
+            service->name , service->executable.path );
+  }
+  const int exec_fd = ( -1 == prepared ) ? -1 : service->executable.fd;
+
+  /* 待ち受けているソケットの後ろに、ゲートを並べる */
+  const size_t pass_fd_count = param->listen_fd_count + ( ( 0 <= standby_gate ) ? 1 : 0 );
+  int* pass_fds = NULL;
+  if( 0 < pass_fd_count ){
+    pass_fds = calloc( pass_fd_count , sizeof( int ) );
+    if( NULL == pass_fds ){
+      syslog( LOG_ERR , "%m, calloc() faild , service = \"%s\"" , service->name );
+      return -1;
+    }
+    for( size_t i = 0 ; i < param->listen_fd_count ; ++i ){
+      pass_fds[i] = param->listen_fds[i];
+    }
+    if( 0 <= standby_gate ){
+      pass_fds[ param->listen_fd_count ] = standby_gate;
+    }
+  }
+  const struct service_environ* const env = ( 0 <= standby_gate ) ? &(param->standby_env) : &(param->service_env);
+
+  /* 子プロセスには、イベントループがシグナルをブロックする前のマスクを引き継ぐ */
+  sigset_t saved_sigmask;
+  event_loop_saved_sigmask( loop , &saved_sigmask );
+  const struct proc_spawn_request request = { service->argv[0] , service->argv ,
+                                         service->logs[SERVICE_OUTPUT_STDOUT].fd ,
+                                         service->logs[SERVICE_OUTPUT_STDERR].fd ,
+                                         &saved_sigmask , pass_fds , pass_fd_count , env->envp , env->pid , 1 , exec_fd };
+  const pid_t child_pid = proc_spawn( param->spawn_backend , &request );
+  const int err = errno;
+  free( pass_fds );
+  errno = err;
+  if( -1 == child_pid ){
+    syslog( LOG_ERR , "%m, proc_spawn(%s) faild , service = \"%s\" , path = \"%s\"" ,
+            proc_spawn_backend_name( param->spawn_backend ) , service->name , service->argv[0] );
+    errno = err;
+  }
+  return child_pid;
+}
+
+static int spawn_service( struct event_loop* loop , const struct process_param* param ,
+                          struct service_table* table , struct service* service )
+{
+  const pid_t child_pid = spawn_service_process( loop , param , service , -1 );
+  if( -1 == child_pid ){
+    return -1;
+  }
+  for( size_t i = 0 ; i < SERVICE_OUTPUT_COUNT ; ++i ){
+    if( service->logs[i].stream ){
+      log_stream_set_pid( service->logs[i].stream , child_pid );
+    }
+  }
+  service_started( table , service , child_pid );
+  return 0;
+}
+
+/**
+   start_process が作った PID ファイルを消して、ロックを手放す
+   @param fd PID ファイルの fd 作っていない ( -i ) 場合は -1
+*/
+static void remove_pid_file( const char* path , int fd )
+{
+  if( 0 <= fd ){
+    /* 消してからロックを外すので、ロックを外した後にこのパスで開けるのは、次に起動したものの PID ファイルだけ */
+    VERIFY( 0 == unlink( path ) );
+    VERIFY( 0 == close( fd ) );
+  }
+  return;
+}
+
+/**
+   fork して、全てのサービスの開始と、SIGINT をサービスへ送るプロセスへ送る
+   全てのサービスが、終了するまで、この関数は制御を返さない
+
+   @return 成功した場合は EXIT_SUCCESS を返す 失敗した場合はそれ以外の値を返す
+   @param param start_process へ渡すパラメータをパックした構造体
+   @param table 起動するサービスの表
+*/
+int start_process( struct process_param param, struct service_table* table )
+{
+  /* 自分自身のPID を 書き出して、kill -INT に備える ための PID ファイルを作成する */
+  /* 書き出すファイルへのパス */
+  const char* const pid_file_path = param.pid_file_path;
+  /* PID を 書き出すファイルへのファイルディスクリプタ
+     終了するまで開いたまま、ファイル全体に書き込みロックを掛けておく。 "daemonic stop" は F_GETLK で
+     ロックしているプロセスが書かれている PID と同じかを確かめるので、クラッシュや SIGKILL で残った
+     PID ファイルの PID が再利用されていても、別のプロセスにシグナルを送らない */
+  int pid_file_fd = -1;
+  /* -i の場合は、 PID 1 なので書き出さない ( 通知とコントロールのソケットも作らない ) */
+  if( !param.init ){
+    int fd = open( pid_file_path  , O_WRONLY | O_EXCL | O_CREAT | O_CLOEXEC , S_IRUSR | S_IWUSR | S_IWOTH );
+    if( fd < 0 ){
+      send_start_report( param.report_fd , pid_file_path , 0 , errno , 0 );
+      perror( "open( pid_file_path  , O_WRONLY | O_EXCL | O_CREAT , S_IRUSR | S_IWUSR | S_IWOTH )");
+      return EXIT_FAILURE;
+    }
+    struct flock lock;
+    memset( &lock , 0 , sizeof( lock ) );
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    if( -1 == fcntl( fd , F_SETLK , &lock ) ){
+      send_start_report( param.report_fd , pid_file_path , 0 , errno , 0 );
+      perror( "fcntl( fd , F_SETLK , F_WRLCK )" );
+      VERIFY( 0 == unlink( pid_file_path ) );
+      VERIFY( 0 == close( fd ) );
+      return EXIT_FAILURE;
+    }else{
+      char pidnum[16] = {0}; // 多分 6桁あればいいと思うが、15桁分用意する。
+      const ssize_t len =
+        snprintf( pidnum , sizeof( pidnum ) / sizeof( pidnum[0] ) ,
+                  "%d\n" , (int)(getpid()) );
+      if( 0 < len ){
+        const ssize_t write_result = write( fd , pidnum , len );
+        if( len != write_result ){
+          perror("write( fd , pidnum , len )" );
+        }else{
+          VERIFY(0 == x_fdatasync( fd ) );
+        }
+      }
+      pid_file_fd = fd;
+    }
+  }
+
+  int result = EXIT_SUCCESS;
+
+  struct event_loop* const loop = event_loop_create();
+  if( NULL == loop ){
+    send_start_report( param.report_fd , "event_loop_create()" , 0 , errno , 0 );
+    perror( "event_loop_create()" );
+    remove_pid_file( pid_file_path , pid_file_fd );
+    return EXIT_FAILURE;
+  }
+
+  /* ターゲットプロセスの出力は、このプロセスのイベントループで syslog へ送る */
+  struct log_sink* const sink = ( param.init ) ? NULL : log_sink_create_syslog( loop , param.syslog_path );
+  if( NULL == sink && !param.init ){
+    send_start_report( param.report_fd , param.syslog_path , 0 , errno , 0 );
+    syslog( LOG_ERR , "%m, log_sink_create_syslog() faild , path = \"%s\"" , param.syslog_path );
+    event_loop_destroy( loop );
+    remove_pid_file( pid_file_path , pid_file_fd );
+    return EXIT_FAILURE;
+  }
+
+  /* 起動したサービスやリロードで新しい世代の準備を待つ場合は、
+     READY=1 を受け取るソケットを "PID ファイル.notify" に作る */
+  struct notify_socket* notify = NULL;
+  if( 0 < param.ready_timeout_us || 0 < param.ready_wait_us ){
+    char notify_path[PATH_MAX];
+    if( (int)sizeof( notify_path ) <= snprintf( notify_path , sizeof( notify_path ) , "%s.notify" , pid_file_path ) ){
+      errno = ENAMETOOLONG;
+    }else{
+      notify = notify_socket_create( loop , notify_path );
+    }
+    if( NULL == notify ){
+      send_start_report( param.report_fd , "notify socket" , 0 , errno , 0 );
+      syslog( LOG_ERR , "%m, notify_socket_create() faild , path = \"%s\"" , notify_path );
+      log_sink_destroy( sink );
+      event_loop_destroy( loop );
+      remove_pid_file( pid_file_path , pid_file_fd );
+      return EXIT_FAILURE;
+    }
+  }
+  const char* const notify_path = ( notify ) ? notify_socket_path( notify ) : NULL;
+
+  /* サービスへ渡す環境変数 ( LISTEN_FDS など ) を作っておく */
+  const int standby_fd =
+    ( SERVICE_STANDBY_GATE == param.standby ) ? PROC_SPAWN_PASS_FDS_START + (int)param.listen_fd_count : -1;
+  if( 0 != create_service_environ( &param.service_env , param.listen_fd_count , -1 , notify_path ) ||
+      0 != create_service_environ( &param.standby_env , param.listen_fd_count , standby_fd , notify_path ) ){
+    send_start_report( param.report_fd , "environ" , 0 , errno , 0 );
+    syslog( LOG_ERR , "%m, create_service_environ() faild" );
+    free_service_environ( &param.service_env );
+    free_service_environ( &param.standby_env );
+    notify_socket_destroy( notify );
+    log_sink_destroy( sink );
+    event_loop_destroy( loop );
+    remove_pid_file( pid_file_path , pid_file_fd );
+    return EXIT_FAILURE;
+  }
+
+  /* 一段階目の fork で SIGCHLD を SIG_IGN にしているので、このままでは
+     子プロセスが自動的に回収されてしまう。ここで元に戻しておく */
+  struct sigaction sig_child_act_store = {{0}};
+  {
+    struct sigaction sig_child_act = {{0}};
+    sig_child_act.sa_handler = SIG_DFL;
+    VERIFY( 0 == sigemptyset( &(sig_child_act.sa_mask) ) );
+    sig_child_act.sa_flags = 0;
+    VERIFY( 0 == sigaction( SIGCHLD , &sig_child_act , &sig_child_act_store ) );
+  }
+
+  /* -A ( -i では既定 ) の場合は、サービスが double fork したり、シェル経由で起動したりした子孫が
+     孤児になった時に、 init ではなくこのプロセスが引き取って、 host_daemonlize_process で回収する */
+  if( param.adopt ){
+    if( 0 == x_set_child_subreaper() ){
+      param.subreaper = 1;
+    }else{
+      syslog( LOG_WARNING , "%m, PR_SET_CHILD_SUBREAPER faild , orphaned descendants are left to init" );
+    }
+  }
+
+  /* シグナルマスクして fork() してから、
+     子 シグナルマスクの解除
+     親 子プロセスの監視を登録して、シグナルマスクの解除 */
+  // シグナルを禁止する。
+  sigset_t oldset = {0};
+  sigset_t sigset = {0};
+  sigemptyset( &oldset );
+  sigemptyset( &sigset );
+  VERIFY( 0 == sigaddset(&sigset, SIGCHLD ) );
+
+  if( -1 == sigprocmask( SIG_BLOCK , &sigset, &oldset ) ){
+    send_start_report( param.report_fd , "sigprocmask()" , 0 , errno , 0 );
+    free_service_environ( &param.service_env );
+    free_service_environ( &param.standby_env );
+    notify_socket_destroy( notify );
+    log_sink_destroy( sink );
+    event_loop_destroy( loop );
+    remove_pid_file( pid_file_path , pid_file_fd );
+    return EXIT_FAILURE;
+  }
+
+  /* -H の場合は、起動する前に全てのサービスのプログラムと共有ライブラリの先読みを頼んでおく */
+  if( param.warmup ){
+    warm_service_executables( table );
+  }
+
+  for( size_t i = 0 ; i < table->count ; ++i ){
+    struct service* const service = &(table->services[i]);
+    const unsigned long long launch_us = host_now_us();
+    if( 0 != ( ( param.init ) ? open_service_passthrough( service ) : open_service_log( loop , &param , sink , service ) ) ||
+        0 != spawn_service( loop , &param , table , service ) ){
+      send_start_report( param.report_fd , service->name , 0 , ( 0 != errno ) ? errno : EIO , 0 );
+      result = EXIT_FAILURE;
+      continue;
+    }
+    /* started_us は exec(3) に成功した時刻 ( -H の有無で比べられるように記録する ) */
+    syslog( LOG_INFO , "service \"%s\" (pid %d) exec'd in %llu us" ,
+            service->name , (int)service->pid , service->started_us - launch_us );
+    if( 0 == param.ready_wait_us ){
+      send_start_report( param.report_fd , service->name , service->pid , 0 , 0 );
+    }
+  }
+  /* 呼び出し元は、全てのサービスの結果を受け取ると制御を返す
+     準備を待つ場合は、起動できたサービスの結果を host_daemonlize_process が READY=1 を受け取ってから知らせる */
+  int ready_report_fd = -1;
+  if( 0 < param.ready_wait_us && 0 < table->running ){
+    ready_report_fd = param.report_fd;
+  }else if( 0 <= param.report_fd ){
+    VERIFY( 0 == close( param.report_fd ) );
+  }
+  param.report_fd = -1;
+  /* host_daemonlize_process の中で子プロセスの監視を登録するが、
+     SIGCHLD で代用している場合も、登録直後に一度確認されるので取りこぼさない */
+  VERIFY( 0 == sigprocmask( SIG_SETMASK , &oldset , NULL ) );
+  if( 0 < table->running ){
+    host_daemonlize_process( loop , &param , table , notify , ready_report_fd );
+  }
+  if( param.init && EXIT_SUCCESS == result ){
+    result = init_exit_status( table );
+  }
+
+  drain_service_logs( loop , table );
+  for( size_t i = 0 ; i < table->count ; ++i ){
+    close_service_log( &(table->services[i]) );
+  }
+  free_service_environ( &param.service_env );
+  free_service_environ( &param.standby_env );
+  notify_socket_destroy( notify );
+  log_sink_destroy( sink );
+  event_loop_destroy( loop );
+  VERIFY( 0 == sigaction( SIGCHLD , &sig_child_act_store , NULL ) );
+  remove_pid_file( pid_file_path , pid_file_fd );
+  return result;
+}
+
+void print_help_text(const char* self_path)
+{
+  fprintf( stdout, "%s [-L syslog_socket | -o directory [-r bytes] [-a seconds] [-z] [-D usec [-B bytes]]] [-O policy] [-Q bytes] [-p priority] [-e priority] [-b usec] [-c] [-P bytes] [-S backend] [-H] [-A] [-R policy [-T ms[:max_ms]] [-K count/seconds] [-W standby]] [-l address ...] [-N ms] [-G ms] [-k ms[:ms]] [-w ms] daemonlize_program [daemonlize_program_args...]\n" , self_path );
+  fprintf( stdout, "%s [-L syslog_socket | -o directory [-r bytes] [-a seconds] [-z] [-D usec [-B bytes]]] [-O policy] [-Q bytes] [-p priority] [-e priority] [-b usec] [-c] [-P bytes] [-S backend] [-H] [-A] [-R policy [-T ms[:max_ms]] [-K count/seconds] [-W standby]] [-l address ...] [-N ms] [-G ms] [-k ms[:ms]] [-w ms] -f manifest\n" , self_path );
+  fprintf( stdout, "%s -i [-S backend] [-H] [-R policy [-T ms[:max_ms]] [-K count/seconds] [-W standby]] [-l address ...] [-k ms[:ms]] daemonlize_program [daemonlize_program_args...]\n" , self_path );
+  fprintf( stdout, " 起動するプログラムは ./sampledaemon とパスを記述するか、絶対パスにする必要があります。\n");
+  fprintf( stdout, " -i  コンテナの PID 1 として前面で動きます。 fork せず、 PID ファイルを作らず、\n");
+  fprintf( stdout, "     サービスの標準出力と標準エラー出力には、このプロセスのものをそのまま渡します。\n");
+  fprintf( stdout, "     受け取ったシグナルはリアルタイムシグナルも含めてサービスへ転送し\n");
+  fprintf( stdout, "     ( INT , TERM , QUIT は終了要求。 KILL STOP CHLD と fault 系 , PIPE TTIN TTOU は除く ) 、\n");
+  fprintf( stdout, "     サービスの終了ステータス ( シグナルの場合は 128 + 番号 ) で終了します。 -A を含みます。\n");
+  fprintf( stdout, " -f manifest  マニフェストファイルに書かれた全てのサービスを一つのプロセスで監視します。\n");
+  fprintf( stdout, "              書式は 一行に一つ \"名前 プログラム [引数...]\" です。\n");
+  fprintf( stdout, " -L syslog_socket  出力を送る syslog のソケット ( 既定値 %s )\n" , LOG_SINK_DEFAULT_SYSLOG_PATH );
+  fprintf( stdout, " -o directory  出力を syslog の代わりに directory/サービス名.log へ書き込みます。\n");
+  fprintf( stdout, "               標準エラー出力は directory/サービス名.err.log へ書き込みます。\n");
+  fprintf( stdout, " -p priority  標準出力を送る syslog の facility.level ( 既定値 user.notice )\n");
+  fprintf( stdout, " -e priority  標準エラー出力を送る syslog の facility.level ( 既定値 user.err )\n");
+  fprintf( stdout, " -b usec  標準出力を溜めてまとめて送る時間 ( 既定値 %d ) 標準エラー出力はすぐに送ります。\n" ,
+           DEFAULT_STDOUT_BATCH_US );
+  fprintf( stdout, " -c  行の先頭の \"ERROR\" \"[W]\" \"<3>\" などの印から level を推定して送ります。\n");
+  fprintf( stdout, "     印が無い行は -p と -e の level のままです。\n");
+  fprintf( stdout, " -P bytes  出力をつなげるパイプの容量 ( F_SETPIPE_SZ )\n");
+  fprintf( stdout, " -R policy  サービスが終了した時に再起動する条件 ( 既定値 no )\n");
+  fprintf( stdout, "            no , always , on-failure ( 0 以外の終了コードかシグナル ) , on-abnormal ( シグナル )\n");
+  fprintf( stdout, "            SIGHUP , SIGINT , SIGTERM , SIGPIPE での終了は失敗とみなしません。\n");
+  fprintf( stdout, " -T ms[:max_ms]  最初の再起動までの時間と、倍々に伸ばす上限 ( 既定値 %d:%d )\n" ,
+           DEFAULT_RESTART_DELAY_MS , DEFAULT_RESTART_MAX_DELAY_MS );
+  fprintf( stdout, " -K count/seconds  seconds 秒の間に count 回を超えて再起動しようとしたら諦めます。\n");
+  fprintf( stdout, "                   ( 既定値 %d/%d 0 の場合は制限しない )\n" ,
+           DEFAULT_RESTART_BURST , DEFAULT_RESTART_INTERVAL_S );
+  fprintf( stdout, " -W standby  サービス毎に起動済みの予備のプロセスを待たせておき、終了した時にすぐ入れ替えます。\n");
+  fprintf( stdout, "             stop : exec した直後に SIGSTOP で止めておく ( -l とは一緒に使えない )\n");
+  fprintf( stdout, "             gate : 環境変数 %s の fd から一バイト読めるまで、プログラム自身に待たせる\n" ,
+           SERVICE_STANDBY_FD_ENV );
+  fprintf( stdout, " -l address  address で待ち受けたソケットを、 fd 3 から順にサービスへ渡します。 ( 何度でも指定できます )\n");
+  fprintf( stdout, "             /path/to/socket ( unix ドメイン ) か [host]:port ( TCP ) で、\n");
+  fprintf( stdout, "             サービスには環境変数 %s と %s で知らせます。\n" ,
+           LISTEN_SOCKET_FDS_ENV , LISTEN_SOCKET_PID_ENV );
+  fprintf( stdout, " -w ms  起動したサービスから READY=1 が届くまで ( 最大 ms ミリ秒 ) 待ってから制御を返します。\n");
+  fprintf( stdout, "        環境変数 %s で sd_notify(3) のソケットを知らせ、時間切れや、準備の前に\n" ,
+           NOTIFY_SOCKET_ENV );
+  fprintf( stdout, "        終了した場合は終了ステータス 1 を返します。 ( 時間切れでもサービスは止めません )\n");
+  fprintf( stdout, " -N ms  SIGHUP のリロードで、新しい世代から READY=1 が届くまで待つ時間 ( 既定値 0 )\n");
+  fprintf( stdout, "        0 の場合は exec できたらすぐに入れ替えます。 0 以外の場合は、環境変数 %s で\n" ,
+           NOTIFY_SOCKET_ENV );
+  fprintf( stdout, "        sd_notify(3) のソケットを知らせ、届かなければ新しい世代を終了させます。\n");
+  fprintf( stdout, " -G ms  リロードで入れ替えた古い世代の終了を待つ時間 過ぎたら SIGKILL を送ります。 ( 既定値 %d )\n" ,
+           DEFAULT_DRAIN_TIMEOUT_MS );
+  fprintf( stdout, " -k ms[:ms]  終了要求でサービスのプロセスグループへ SIGINT を送ってから SIGTERM を送るまでの時間と、\n");
+  fprintf( stdout, "             さらに SIGKILL を送るまでの時間 ( 既定値 %d:%d 0 の場合はその先を送らずに待ちます )\n" ,
+           DEFAULT_STOP_INTERRUPT_MS , DEFAULT_STOP_TERMINATE_MS );
+  fprintf( stdout, " -S backend  サービスを起動する方法 fork , posix_spawn , vfork ( 既定値 %s )\n" ,
+           proc_spawn_backend_name( proc_spawn_default_backend() ) );
+  fprintf( stdout, " -H  起動する前に、プログラムと共有ライブラリ ( ELF の DT_NEEDED を辿る ) の先読みを頼みます。\n");
+  fprintf( stdout, "     大きなプログラムのコールドスタートで、ページフォールトで読む時間を減らします。\n");
+  fprintf( stdout, " -A  PR_SET_CHILD_SUBREAPER を設定して、孤児になったサービスの子孫を init の代わりに引き取り、回収します。\n");
+  fprintf( stdout, " -Q bytes  syslog が詰まっている間に、出力を溜めるバッファの大きさ ( 既定値 32K )\n");
+  fprintf( stdout, " -O policy  -Q のバッファが一杯になった時の扱い\n");
+  fprintf( stdout, "            block : 出力を読まずに待つ ( 既定値 ターゲットプロセスの write が止まる )\n");
+  fprintf( stdout, "            drop-oldest : 古い行を捨てる  drop-newest : 新しい行を捨てる\n");
+  fprintf( stdout, "            sample:N : 新しい行を N 行に一行だけ残す\n");
+  fprintf( stdout, " -r bytes  -o のファイルがこの大きさになったらローテーションします。\n");
+  fprintf( stdout, " -a seconds  -o のファイルをこの秒数毎にローテーションします。\n");
+  fprintf( stdout, " -z  ローテーションしたファイルを gzip で圧縮します。\n");
+  fprintf( stdout, " -D usec  -o のファイルを、最初の書き込みから usec マイクロ秒以内にまとめて fdatasync します。\n");
+  fprintf( stdout, "          0 の場合は、パイプを読み切る毎に fdatasync します。\n");
+  fprintf( stdout, " -B bytes  -D で、未同期のデータがこの大きさになったら待たずに fdatasync します。 ( 既定値 1M )\n");
+  fprintf( stdout, " 大きさには K , M , G を付けられます。 SIGUSR1 で -o のファイルを開きなおします。\n");
+  fprintf( stdout, " SIGHUP でサービスをリロード ( 新しい世代を起動してから入れ替え ) します。\n");
+  fprintf( stdout, " 状態の問い合わせと操作は %s ctl で行えます。 ( %s ctl -h )\n" , self_path , self_path );
+  fprintf( stdout, " %s stop で終了させて、終了するまで待ちます。 ( %s stop -h )\n" , self_path , self_path );
+  return;
+}
+
+/**
+   "10M" のような大きさを解析する K , M , G は 1024 の累乗
+   @return 成功した場合は 0 失敗した場合は -1
+*/
+static int parse_size( const char* text , unsigned long long* size )
+{
+  char* end = NULL;
+  errno = 0;
+  unsigned long long value = strtoull( text , &end , 10 );
+  if( end == text || 0 != errno || '-' == *text ){
+    return -1;
+  }
+  unsigned int shift = 0;
+  switch( *end ){
+  case '\0': break;
+  case 'k': case 'K': shift = 10; ++end; break;
+  case 'm': case 'M': shift = 20; ++end; break;
+  case 'g': case 'G': shift = 30; ++end; break;
+  default: return -1;
+  }
+  if( '\0' != *end || ( value << shift ) >> shift != value ){
+    return -1;
+  }
+  *size = value << shift;
+  return 0;
+}
+
+/**
+   -p と -e の "facility.level" あるいは "level" を解析する ( logger(1) の -p と同じ書式 )
+   facility を省略した場合は user になる。
+   @return 成功した場合は 0 失敗した場合は -1
+*/
+static int parse_priority( const char* text , int* priority )
+{
+  static const struct { const char* name; int value; } facilities[] = {
+    { "user" , LOG_USER } , { "daemon" , LOG_DAEMON } , { "local0" , LOG_LOCAL0 } ,
+    { "local1" , LOG_LOCAL1 } , { "local2" , LOG_LOCAL2 } , { "local3" , LOG_LOCAL3 } ,
+    { "local4" , LOG_LOCAL4 } , { "local5" , LOG_LOCAL5 } , { "local6" , LOG_LOCAL6 } ,
+    { "local7" , LOG_LOCAL7 }
+  };
+  static const struct { const char* name; int value; } levels[] = {
+    { "emerg" , LOG_EMERG } , { "alert" , LOG_ALERT } , { "crit" , LOG_CRIT } ,
+    { "err" , LOG_ERR } , { "error" , LOG_ERR } , { "warning" , LOG_WARNING } , { "warn" , LOG_WARNING } ,
+    { "notice" , LOG_NOTICE } , { "info" , LOG_INFO } , { "debug" , LOG_DEBUG }
+  };
+  int facility = LOG_USER;
+  const char* level = text;
+  const char* const dot = strchr( text , '.' );
+  if( dot ){
+    size_t i = 0;
+    for( ; i < sizeof( facilities ) / sizeof( facilities[0] ) ; ++i ){
+      if( strlen( facilities[i].name ) == (size_t)( dot - text ) &&
+          0 == strncmp( facilities[i].name , text , (size_t)( dot - text ) ) ){
+        break;
+      }
+    }
+    if( sizeof( facilities ) / sizeof( facilities[0] ) == i ){
+      return -1;
+    }
+    facility = facilities[i].value;
+    level = dot + 1;
+  }
+  for( size_t i = 0 ; i < sizeof( levels ) / sizeof( levels[0] ) ; ++i ){
+    if( 0 == strcmp( levels[i].name , level ) ){
+      *priority = facility | levels[i].value;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/**
+   "100:30000" のような、最初の再起動までの時間と、その上限 ( ミリ秒 ) を解析する 上限は省略できる
+   @return 成功した場合は 0 失敗した場合は -1
+*/
+static int parse_backoff( const char* text , struct service_restart_policy* policy )
+{
+  char* end = NULL;
+  errno = 0;
+  const unsigned long long initial_ms = strtoull( text , &end , 10 );
+  if( end == text || 0 != errno || '-' == *text ){
+    return -1;
+  }
+  unsigned long long max_ms = ( initial_ms < DEFAULT_RESTART_MAX_DELAY_MS ) ? DEFAULT_RESTART_MAX_DELAY_MS : initial_ms;
+  if( ':' == *end ){
+    const char* const max_text = end + 1;
+    max_ms = strtoull( max_text , &end , 10 );
+    if( end == max_text || 0 != errno || '-' == *max_text ){
+      return -1;
+    }
+  }
+  if( '\0' != *end || max_ms < initial_ms || ULLONG_MAX / 1000ULL < max_ms ){
+    return -1;
+  }
+  policy->initial_delay_us = initial_ms * 1000ULL;
+  policy->max_delay_us = max_ms * 1000ULL;
+  return 0;
+}
+
+/**
+   "5/60" のような、 crash loop と判定する再起動の回数と秒数を解析する "0" の場合は制限しない
+   @return 成功した場合は 0 失敗した場合は -1
+*/
+static int parse_restart_limit( const char* text , struct service_restart_policy* policy )
+{
+  char* end = NULL;
+  errno = 0;
+  const unsigned long burst = strtoul( text , &end , 10 );
+  if( end == text || 0 != errno || '-' == *text || UINT_MAX < burst ){
+    return -1;
+  }
+  unsigned long long seconds = DEFAULT_RESTART_INTERVAL_S;
+  if( '/' == *end ){
+    const char* const seconds_text = end + 1;
+    seconds = strtoull( seconds_text , &end , 10 );
+    if( end == seconds_text || 0 != errno || '-' == *seconds_text || 0 == seconds ||
+        ULLONG_MAX / 1000000ULL < seconds ){
+      return -1;
+    }
+  }
+  if( '\0' != *end ){
+    return -1;
+  }
+  policy->burst = (unsigned int)burst;
+  policy->interval_us = seconds * 1000000ULL;
+  return 0;
+}
+
+/**
+   "10000:5000" のような、終了要求で SIGINT から SIGTERM を送るまでと、 SIGTERM から SIGKILL を送るまでの時間
+   ( ミリ秒 ) を解析する 後ろは省略できる ( 既定値のまま ) 0 の場合は、その先のシグナルを送らない
+   @return 成功した場合は 0 失敗した場合は -1
+*/
+static int parse_stop_escalation( const char* text , unsigned long long* interrupt_us , unsigned long long* terminate_us )
+{
+  char* end = NULL;
+  errno = 0;
+  const unsigned long long interrupt_ms = strtoull( text , &end , 10 );
+  if( end == text || 0 != errno || '-' == *text ){
+    return -1;
+  }
+  unsigned long long terminate_ms = *terminate_us / 1000ULL;
+  if( ':' == *end ){
+    const char* const terminate_text = end + 1;
+    terminate_ms = strtoull( terminate_text , &end , 10 );
+    if( end == terminate_text || 0 != errno || '-' == *terminate_text ){
+      return -1;
+    }
+  }
+  if( '\0' != *end || ULLONG_MAX / 1000ULL < interrupt_ms || ULLONG_MAX / 1000ULL < terminate_ms ){
+    return -1;
+  }
+  *interrupt_us = interrupt_ms * 1000ULL;
+  *terminate_us = terminate_ms * 1000ULL;
+  return 0;
+}
+
+/**
+   -O の "block" "drop-oldest" "drop-newest" "sample:N" を解析する
+   @return 成功した場合は 0 失敗した場合は -1
+*/
+static int parse_overflow( const char* text , enum log_stream_overflow* policy , unsigned int* sample_rate )
+{
+  if( 0 == strcmp( text , "block" ) ){
+    *policy = LOG_STREAM_OVERFLOW_BLOCK;
+    return 0;
+  }
+  if( 0 == strcmp( text , "drop-oldest" ) ){
+    *policy = LOG_STREAM_OVERFLOW_DROP_OLDEST;
+    return 0;
+  }
+  if( 0 == strcmp( text , "drop-newest" ) ){
+    *policy = LOG_STREAM_OVERFLOW_DROP_NEWEST;
+    return 0;
+  }
+  if( 0 == strncmp( text , "sample:" , 7 ) ){
+    char* end = NULL;
+    errno = 0;
+    const unsigned long rate = strtoul( text + 7 , &end , 10 );
+    if( end == text + 7 || '\0' != *end || 0 != errno || rate < 2 || UINT_MAX < rate ){
+      return -1;
+    }
+    *policy = LOG_STREAM_OVERFLOW_SAMPLE;
+    *sample_rate = (unsigned int)rate;
+    return 0;
+  }
+  return -1;
+}
+
+/**
+   コマンドラインで指定されたプログラムのサービス名を作る
+   プログラムのファイル名を使い、名前に使えない場合は "main" にする
+*/
+static const char* default_service_name( const char* path )
+{
+  const char* p = strrchr( path , '/' );
+  p = ( p ) ? ( p + 1 ) : path;
+  for( const char* q = p ; *q ; ++q ){
+    const char c = *q;
+    if( !( ( 'a' <= c && c <= 'z' ) || ( 'A' <= c && c <= 'Z' ) || ( '0' <= c && c <= '9' ) ||
+           '_' == c || '-' == c || '.' == c ) ){
+      return "main";
+    }
+  }
+  return ( '\0' == *p || SERVICE_NAME_MAX < strlen( p ) ) ? "main" : p;
+}
+
+static int* open_listen_sockets( const char* const* addresses , size_t count )
+{
+  int* const fds = calloc( count , sizeof( int ) );
+  if( NULL == fds ){
+    perror( "calloc()" );
+    return NULL;
+  }
+  for( size_t i = 0 ; i < count ; ++i ){
+    fds[i] = listen_socket_open( addresses[i] , 0 );
+    if( -1 == fds[i] ){
+      close_listen_sockets( fds , i );
+      return NULL;
+    }
+  }
+  return fds;
+}
+
+static void close_listen_sockets( int* fds , size_t count )
+{
+  if( fds ){
+    for( size_t i = 0 ; i < count ; ++i ){
+      VERIFY( 0 == close( fds[i] ) );
+    }
+    free( fds );
+  }
+  return;
+}
+
+static int default_pid_file_path( const char* self_path , char* path , size_t size )
+{
+  // TODO ここの PID_FILE_PATH の作り方、もうちょっと注意が必要 
+  const char* p = strrchr( self_path , '/' );
+  if( p ){
+    p++;
+    p = (('\0' == *p) ? NULL : p);
+  }else{
+    p = self_path;
+  }
+  const int length = snprintf( path , size , "/tmp/%s.pid" , (p)?(p): self_path );
+  return ( 0 < length && (size_t)length < size ) ? 0 : -1;
+}
+
+/**
+   "INT" "SIGINT" "2" のようなシグナルの名前か番号を解析する
+   @return 成功した場合はシグナル番号 失敗した場合は -1
+*/
+static int parse_signal( const char* text )
+{
+  static const struct{
+    const char* name;
+    int signo;
+  } signals[] = {
+    { "HUP" , SIGHUP } , { "INT" , SIGINT } , { "QUIT" , SIGQUIT } , { "KILL" , SIGKILL } ,
+    { "USR1" , SIGUSR1 } , { "USR2" , SIGUSR2 } , { "TERM" , SIGTERM } , { "CONT" , SIGCONT } ,
+    { "STOP" , SIGSTOP } , { "WINCH" , SIGWINCH }
+  };
+  char* end = NULL;
+  errno = 0;
+  const long number = strtol( text , &end , 10 );
+  if( end != text && '\0' == *end && 0 == errno ){
+    return ( 0 < number && number < HOST_NSIG ) ? (int)number : -1;
+  }
+  if( 0 == strncmp( text , "SIG" , 3 ) ){
+    text += 3;
+  }
+  for( size_t i = 0 ; i < sizeof( signals ) / sizeof( signals[0] ) ; ++i ){
+    if( 0 == strcmp( text , signals[i].name ) ){
+      return signals[i].signo;
+    }
+  }
+  return -1;
+}
+
+/**
+   control_main の使い方を出力する
+*/
+static void print_control_help_text( const char* self_path , FILE* out )
+{
+  fprintf( out , "%s ctl [-s socket] status|stats|stop|reload [service]\n" , self_path );
+  fprintf( out , "%s ctl [-s socket] signal SIGNAL [service]\n" , self_path );
+  fprintf( out , "%s ctl [-s socket] reaper\n" , self_path );
+  fprintf( out , " -s socket  コントロールソケットのパス ( 既定値 PID ファイルのパス + %s )\n" , CONTROL_SOCKET_SUFFIX );
+  fprintf( out , " status  サービスの状態を出力します。  stats  出力の転送の統計を出力します。\n");
+  fprintf( out , " stop  全てのサービスを終了させます。 ( SIGINT と同じ )  reload  リロードします。 ( SIGHUP と同じ )\n");
+  fprintf( out , " signal  実行中のサービスへシグナルを送ります。 ( INT , TERM , USR1 や番号 )\n");
+  fprintf( out , " reaper  回収した子プロセスと、引き取った子孫の統計を出力します。\n");
+  fprintf( out , " service を省略した場合は、全てのサービスが対象です。\n");
+  return;
+}
+
+static int control_main( const char* self_path , int argc , char* argv[] )
+{
+  static const struct{
+    const char* name;
+    enum control_command command;
+  } commands[] = {
+    { "status" , CONTROL_STATUS } , { "stats" , CONTROL_STATS } , { "stop" , CONTROL_STOP } ,
+    { "reload" , CONTROL_RELOAD } , { "signal" , CONTROL_SIGNAL } , { "reaper" , CONTROL_REAPER }
+  };
+  char socket_path[PATH_MAX];
+  if( 0 != default_pid_file_path( self_path , socket_path , sizeof( socket_path ) - strlen( CONTROL_SOCKET_SUFFIX ) ) ){
+    fprintf( stderr , "%s: %s\n" , self_path , strerror( ENAMETOOLONG ) );
+    return EXIT_FAILURE;
+  }
+  strcat( socket_path , CONTROL_SOCKET_SUFFIX );
+  int opt = 0;
+  optind = 1;
+  while( -1 != ( opt = getopt( argc , argv , "+s:h" ) ) ){
+    switch( opt ){
+    case 's':
+      if( sizeof( socket_path ) <= (size_t)snprintf( socket_path , sizeof( socket_path ) , "%s" , optarg ) ){
+        fprintf( stderr , "%s: %s\n" , optarg , strerror( ENAMETOOLONG ) );
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'h':
+      print_control_help_text( self_path , stdout );
+      return EXIT_SUCCESS;
+    default:
+      print_control_help_text( self_path , stderr );
+      return EXIT_FAILURE;
+    }
+  }
+  if( ! ( optind < argc ) ){
+    print_control_help_text( self_path , stderr );
+    return EXIT_FAILURE;
+  }
+  const char* const command_name = argv[optind++];
+  size_t index = 0;
+  while( index < sizeof( commands ) / sizeof( commands[0] ) && 0 != strcmp( commands[index].name , command_name ) ){
+    ++index;
+  }
+  if( sizeof( commands ) / sizeof( commands[0] ) <= index ){
+    fprintf( stderr , "unknown command \"%s\"\n" , command_name );
+    return EXIT_FAILURE;
+  }
+  const enum control_command command = commands[index].command;
+  int signo = 0;
+  if( CONTROL_SIGNAL == command ){
+    if( ! ( optind < argc ) || -1 == ( signo = parse_signal( argv[optind] ) ) ){
+      fprintf( stderr , "invalid signal \"%s\"\n" , ( optind < argc ) ? argv[optind] : "" );
+      return EXIT_FAILURE;
+    }
+    ++optind;
+  }
+  const char* const service_name = ( optind < argc ) ? argv[optind++] : NULL;
+  if( optind < argc ){
+    print_control_help_text( self_path , stderr );
+    return EXIT_FAILURE;
+  }
+
+  const int fd = control_connect( socket_path );
+  if( -1 == fd ){
+    perror( socket_path );
+    return EXIT_FAILURE;
+  }
+  struct control_buffer response = { NULL , 0 , 0 , 0 };
+  if( 0 != control_call( fd , (uint8_t)command , (uint8_t)signo , service_name , &response ) ){
+    perror( "control_call()" );
+    control_buffer_free( &response );
+    VERIFY( 0 == close( fd ) );
+    return EXIT_FAILURE;
+  }
+  VERIFY( 0 == close( fd ) );
+
+  struct control_reader reader = { response.data , response.length , 0 , 0 };
+  (void)control_reader_get_u8( &reader );
+  const int status = control_reader_get_u8( &reader );
+  if( 0 != status ){
+    fprintf( stderr , "%s: %s\n" , ( service_name ) ? service_name : command_name , strerror( status ) );
+    control_buffer_free( &response );
+    return EXIT_FAILURE;
+  }
+  if( CONTROL_REAPER == command ){
+    const uint8_t subreaper = control_reader_get_u8( &reader );
+    const uint64_t reaped = control_reader_get_u64( &reader );
+    const uint64_t batches = control_reader_get_u64( &reader );
+    const uint32_t max_batch = control_reader_get_u32( &reader );
+    const uint64_t descendants = control_reader_get_u64( &reader );
+    const uint64_t descendants_failed = control_reader_get_u64( &reader );
+    const uint64_t descendants_killed = control_reader_get_u64( &reader );
+    if( !reader.failed ){
+      fprintf( stdout , "subreaper=%s\treaped=%llu\tbatches=%llu\tmax_batch=%u\tdescendants=%llu\tdescendants_failed=%llu\tdescendants_killed=%llu\n" ,
+               ( subreaper ) ? "on" : "off" , (unsigned long long)reaped , (unsigned long long)batches ,
+               (unsigned int)max_batch , (unsigned long long)descendants ,
+               (unsigned long long)descendants_failed , (unsigned long long)descendants_killed );
+    }
+  }
+  while( CONTROL_REAPER != command && reader.offset < reader.length && !reader.failed ){
+    const size_t name_length = control_reader_get_u8( &reader );
+    const unsigned char* const name = control_reader_get_bytes( &reader , name_length );
+    if( NULL == name ){
+      break;
+    }
+    if( CONTROL_STATUS == command ){
+      const uint8_t state = control_reader_get_u8( &reader );
+      const uint8_t exit_code = control_reader_get_u8( &reader );
+      const int32_t exit_status = (int32_t)control_reader_get_u32( &reader );
+      const uint32_t pid = control_reader_get_u32( &reader );
+      const uint32_t standby_pid = control_reader_get_u32( &reader );
+      const uint32_t reloading_pid = control_reader_get_u32( &reader );
+      const uint32_t draining_pid = control_reader_get_u32( &reader );
+      const uint32_t restart_attempts = control_reader_get_u32( &reader );
+      const uint64_t uptime_us = control_reader_get_u64( &reader );
+      if( reader.failed ){
+        break;
+      }
+      fprintf( stdout , "%.*s\t%s\tpid=%u\tuptime=%llu.%03llus\trestarts=%u" , (int)name_length , (const char*)name ,
+               service_state_name( (enum service_state)state ) , (unsigned int)pid ,
+               (unsigned long long)( uptime_us / 1000000ULL ) , (unsigned long long)( uptime_us / 1000ULL % 1000ULL ) ,
+               (unsigned int)restart_attempts );
+      if( 0 < standby_pid ){
+        fprintf( stdout , "\tstandby=%u" , (unsigned int)standby_pid );
+      }
+      if( 0 < reloading_pid ){
+        fprintf( stdout , "\treloading=%u" , (unsigned int)reloading_pid );
+      }
+      if( 0 < draining_pid ){
+        fprintf( stdout , "\tdraining=%u" , (unsigned int)draining_pid );
+      }
+      if( SERVICE_STATE_RUNNING != state && 0 != exit_code ){
+        fprintf( stdout , ( CLD_EXITED == exit_code ) ? "\texit=%d" : "\tsignal=%d" , (int)exit_status );
+      }
+      fprintf( stdout , "\n" );
+    }else if( CONTROL_STATS == command ){
+      for( size_t i = 0 ; i < SERVICE_OUTPUT_COUNT ; ++i ){
+        const uint64_t read_bytes = control_reader_get_u64( &reader );
+        const uint64_t sent_lines = control_reader_get_u64( &reader );
+        const uint64_t dropped_lines = control_reader_get_u64( &reader );
+        const uint64_t dropped_bytes = control_reader_get_u64( &reader );
+        const uint64_t congestions = control_reader_get_u64( &reader );
+        if( reader.failed ){
+          break;
+        }
+        fprintf( stdout , "%.*s\t%s\tread_bytes=%llu\tsent_lines=%llu\tdropped_lines=%llu\tdropped_bytes=%llu\tcongestions=%llu\n" ,
+                 (int)name_length , (const char*)name , service_output_names[i] ,
+                 (unsigned long long)read_bytes , (unsigned long long)sent_lines , (unsigned long long)dropped_lines ,
+                 (unsigned long long)dropped_bytes , (unsigned long long)congestions );
+      }
+    }
+  }
+  control_buffer_free( &response );
+  return EXIT_SUCCESS;
+}
+
+/**
+   開いた PID ファイルからプロセスID を読む
+   @return 成功した場合はプロセスID 読めない場合は -1 ( 理由は標準エラー出力に出力済み )
+   @param path エラーメッセージに使う PID ファイルのパス
+*/
+static pid_t read_pid_file( const char* path , int fd )
+{
+  char text[32] = {0};
+  ssize_t length = 0;
+  do{
+    length = pread( fd , text , sizeof( text ) - 1 , 0 );
+  }while( -1 == length && EINTR == errno );
+  if( length < 0 ){
+    perror( path );
+    return -1;
+  }
+  char* end = NULL;
+  errno = 0;
+  const long pid = strtol( text , &end , 10 );
+  if( end == text || ( '\0' != *end && '\n' != *end ) || 0 != errno || pid <= 0 || INT_MAX < pid ){
+    /* 作っている途中 ( まだ書き込んでいない ) ものも、ここで失敗する */
+    fprintf( stderr , "%s: invalid pid file\n" , path );
+    return -1;
+  }
+  return (pid_t)pid;
+}
+
+/**
+   PID ファイルに書き込みロックを掛けているプロセス ( 動いているコントロールプロセス ) を調べる
+   @return ロックしているプロセスの PID ロックされていない場合は 0 失敗した場合は -1
+*/
+static pid_t pid_file_owner( int fd )
+{
+  struct flock lock;
+  memset( &lock , 0 , sizeof( lock ) );
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  if( -1 == fcntl( fd , F_GETLK , &lock ) ){
+    return -1;
+  }
+  return ( F_UNLCK == lock.l_type ) ? 0 : lock.l_pid;
+}
+
+/**
+   "daemonic stop" の時間切れで、コントロールソケット ( PID ファイル.ctl ) にサービスの PID を問い合わせて、
+   それぞれのプロセスグループに SIGKILL を送る
+   止めた ( SIGSTOP ) コントロールプロセスは子プロセスを回収しないので、送る先の PID は再利用されていない
+   @return SIGKILL を送ったプロセスグループの数 問い合わせられなかった場合は -1 ( 理由は標準エラー出力に出力済み )
+   @param pidfd 止める前のコントロールプロセス 問い合わせてから SIGSTOP を送る
+*/
+static int kill_service_groups( const char* pid_file_path , int pidfd )
+{
+  char socket_path[PATH_MAX];
+  if( sizeof( socket_path ) <= (size_t)snprintf( socket_path , sizeof( socket_path ) , "%s%s" , pid_file_path , CONTROL_SOCKET_SUFFIX ) ){
+    fprintf( stderr , "%s%s: %s\n" , pid_file_path , CONTROL_SOCKET_SUFFIX , strerror( ENAMETOOLONG ) );
+    return -1;
+  }
+  const int fd = control_connect( socket_path );
+  if( -1 == fd ){
+    perror( socket_path );
+    return -1;
+  }
+  /* コントロールプロセスのイベントループが止まっていても、待ち続けない */
+  const struct timeval timeout = { STOP_CONTROL_TIMEOUT_MS / 1000 , ( STOP_CONTROL_TIMEOUT_MS % 1000 ) * 1000 };
+  VERIFY( 0 == setsockopt( fd , SOL_SOCKET , SO_RCVTIMEO , &timeout , sizeof( timeout ) ) );
+  VERIFY( 0 == setsockopt( fd , SOL_SOCKET , SO_SNDTIMEO , &timeout , sizeof( timeout ) ) );
+  struct control_buffer response = { NULL , 0 , 0 , 0 };
+  const int called = control_call( fd , CONTROL_STATUS , 0 , NULL , &response );
+  const int err = errno;
+  VERIFY( 0 == close( fd ) );
+  if( 0 != called || 0 != response.data[1] ){
+    errno = ( 0 != called ) ? err : response.data[1];
+    perror( socket_path );
+    control_buffer_free( &response );
+    return -1;
+  }
+  if( -1 == x_pidfd_send_signal( pidfd , SIGSTOP ) && ESRCH != errno ){
+    perror( "pidfd_send_signal()" );
+  }
+  int killed = 0;
+  struct control_reader reader = { response.data , response.length , 2 , 0 };
+  while( reader.offset < reader.length && !reader.failed ){
+    const size_t name_length = control_reader_get_u8( &reader );
+    (void)control_reader_get_bytes( &reader , name_length );
+    (void)control_reader_get_u8( &reader ); // state
+    (void)control_reader_get_u8( &reader ); // exit_code
+    (void)control_reader_get_u32( &reader ); // exit_status
+    uint32_t pids[4] = {0};
+    for( size_t i = 0 ; i < sizeof( pids ) / sizeof( pids[0] ) ; ++i ){
+      pids[i] = control_reader_get_u32( &reader ); // pid , standby_pid , reloading_pid , draining_pid
+    }
+    (void)control_reader_get_u32( &reader ); // restart_attempts
+    (void)control_reader_get_u64( &reader ); // uptime_us
+    for( size_t i = 0 ; !reader.failed && i < sizeof( pids ) / sizeof( pids[0] ) ; ++i ){
+      if( 0 < pids[i] && pids[i] <= INT_MAX && 0 == kill( -(pid_t)pids[i] , SIGKILL ) ){
+        ++killed;
+      }
+    }
+  }
+  control_buffer_free( &response );
+  return killed;
+}
+
+/**
+   fd が読み込み可能になる ( プロセスが終了する ソケットが閉じられる ) まで待つ
+   @return 読み込み可能になった場合は 1 時間切れの場合は 0 失敗した場合は -1
+   @param timeout_ms 負の場合は時間切れにしない
+*/
+static int wait_readable( int fd , long long timeout_ms )
+{
+  struct timespec deadline = {0};
+  VERIFY( 0 == clock_gettime( CLOCK_MONOTONIC , &deadline ) );
+  const unsigned long long deadline_ms =
+    (unsigned long long)deadline.tv_sec * 1000ULL + (unsigned long long)deadline.tv_nsec / 1000000ULL + (unsigned long long)timeout_ms;
+  for(;;){
+    int wait_ms = -1;
+    if( 0 <= timeout_ms ){
+      struct timespec now = {0};
+      VERIFY( 0 == clock_gettime( CLOCK_MONOTONIC , &now ) );
+      const unsigned long long now_ms = (unsigned long long)now.tv_sec * 1000ULL + (unsigned long long)now.tv_nsec / 1000000ULL;
+      wait_ms = ( deadline_ms <= now_ms ) ? 0 :
+        ( ( INT_MAX < deadline_ms - now_ms ) ? INT_MAX : (int)( deadline_ms - now_ms ) );
+    }
+    struct pollfd pfd = { fd , POLLIN , 0 };
+    const int result = poll( &pfd , 1 , wait_ms );
+    if( -1 == result ){
+      if( EINTR == errno ){
+        continue; /* 残りの時間で待ちなおす */
+      }
+      return -1;
+    }
+    return ( 0 < result ) ? 1 : 0;
+  }
+}
+
+static int stop_main( const char* self_path , int argc , char* argv[] )
+{
+  char default_path[PATH_MAX];
+  const char* pid_file_path = NULL;
+  int signo = SIGTERM;
+  long long timeout_ms = DEFAULT_STOP_TIMEOUT_MS;
+  int opt = 0;
+  optind = 1;
+  while( -1 != ( opt = getopt( argc , argv , "+p:s:t:h" ) ) ){
+    switch( opt ){
+    case 'p':
+      pid_file_path = optarg;
+      break;
+    case 's':
+      if( -1 == ( signo = parse_signal( optarg ) ) ){
+        fprintf( stderr , "invalid signal \"%s\"\n" , optarg );
+        return EXIT_FAILURE;
+      }
+      break;
+    case 't':
+      {
+        char* end = NULL;
+        errno = 0;
+        timeout_ms = strtoll( optarg , &end , 10 );
+        if( end == optarg || '\0' != *end || 0 != errno || timeout_ms < 0 ){
+          fprintf( stderr , "invalid stop timeout \"%s\"\n" , optarg );
+          return EXIT_FAILURE;
+        }
+      }
+      break;
+    default:
+      fprintf( ( 'h' == opt ) ? stdout : stderr , "%s stop [-p pid_file] [-s signal] [-t ms]\n" , self_path );
+      fprintf( ( 'h' == opt ) ? stdout : stderr , " -p pid_file  ( 既定値 /tmp/ファイル名.pid )  -s signal  ( 既定値 TERM )\n" );
+      fprintf( ( 'h' == opt ) ? stdout : stderr , " -t ms  終了を待ってから SIGKILL を送るまでの時間 ( 既定値 %d 0 の場合は送らずに待つ )\n" ,
+               DEFAULT_STOP_TIMEOUT_MS );
+      return ( 'h' == opt ) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+  if( NULL == pid_file_path ){
+    if( 0 != default_pid_file_path( self_path , default_path , sizeof( default_path ) ) ){
+      fprintf( stderr , "%s: %s\n" , self_path , strerror( ENAMETOOLONG ) );
+      return EXIT_FAILURE;
+    }
+    pid_file_path = default_path;
   }
 
-  /* パイプを作成する */
-  int logger_pipes[2] = {-1,-1};
-  if( pipe( logger_pipes ) ){
-    perror( "pipe()" );
+  const int pid_file_fd = open( pid_file_path , O_RDONLY | O_CLOEXEC );
+  if( -1 == pid_file_fd ){
+    if( ENOENT == errno ){
+      fprintf( stderr , "%s: not running\n" , pid_file_path );
+      return EXIT_SUCCESS;
+    }
+    perror( pid_file_path );
+    return EXIT_FAILURE;
+  }
+  const pid_t pid = read_pid_file( pid_file_path , pid_file_fd );
+  if( pid <= 0 ){
+    VERIFY( 0 == close( pid_file_fd ) );
+    return EXIT_FAILURE;
+  }
+  /* コントロールプロセスは、終了するまで PID ファイルをロックしている。
+     ロックされていなければ、クラッシュや SIGKILL で残ったもので、その PID は別のプロセスかもしれない */
+  pid_t owner = pid_file_owner( pid_file_fd );
+  if( owner != pid ){
+    if( -1 == owner ){
+      perror( "fcntl( F_GETLK )" );
+    }else if( 0 == owner ){
+      fprintf( stderr , "%s: not locked , stale pid file ( process %d is not signalled )\n" , pid_file_path , (int)pid );
+    }else{
+      fprintf( stderr , "%s: locked by process %d , not %d\n" , pid_file_path , (int)owner , (int)pid );
+    }
+    VERIFY( 0 == close( pid_file_fd ) );
+    return ( 0 == owner ) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  const int pidfd = x_pidfd_open( pid );
+  if( -1 == pidfd ){
+    const int err = errno;
+    VERIFY( 0 == close( pid_file_fd ) );
+    if( ESRCH == err ){
+      fprintf( stderr , "%s: not running\n" , pid_file_path );
+      return EXIT_SUCCESS;
+    }
+    errno = err;
+    perror( "pidfd_open()" );
+    return EXIT_FAILURE;
+  }
+  /* 開いた後にもまだロックしていれば、 pidfd は再利用された別のプロセスではなく、コントロールプロセスのものである */
+  owner = pid_file_owner( pid_file_fd );
+  if( owner != pid ){
+    fprintf( stderr , "%s: not running\n" , pid_file_path );
+    VERIFY( 0 == close( pidfd ) );
+    VERIFY( 0 == close( pid_file_fd ) );
+    return ( -1 == owner ) ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+  if( -1 == x_pidfd_send_signal( pidfd , signo ) ){
+    const int err = errno;
+    VERIFY( 0 == close( pidfd ) );
+    VERIFY( 0 == close( pid_file_fd ) );
+    if( ESRCH == err ){
+      return EXIT_SUCCESS; /* 送る前に終了した */
+    }
+    errno = err;
+    perror( "pidfd_send_signal()" );
     return EXIT_FAILURE;
   }
+  int result = wait_readable( pidfd , ( 0 < timeout_ms ) ? timeout_ms : -1 );
+  int killed = 0;
+  if( 0 == result ){
+    killed = 1;
+    fprintf( stderr , "%s: process %d did not exit in %lld ms , sending SIGKILL\n" , pid_file_path , (int)pid , timeout_ms );
+    /* コントロールプロセスだけを止めると、サービスが監視されずに残るので、先にサービスのプロセスグループを止める */
+    const int groups = kill_service_groups( pid_file_path , pidfd );
+    if( groups < 0 ){
+      fprintf( stderr , "%s: could not query services , they may be left running\n" , pid_file_path );
+    }else{
+      fprintf( stderr , "%s: sent SIGKILL to %d service process groups\n" , pid_file_path , groups );
+    }
+    if( -1 == x_pidfd_send_signal( pidfd , SIGKILL ) && ESRCH != errno ){
+      perror( "pidfd_send_signal()" );
+    }
+    result = wait_readable( pidfd , -1 );
+    /* SIGKILL では PID ファイルが残るので、ここで消す ( 次に起動したものの PID ファイルに入れ替わっていなければ ) */
+    struct stat opened;
+    struct stat current;
+    if( 1 == result && 0 == fstat( pid_file_fd , &opened ) && 0 == stat( pid_file_path , &current ) &&
+        opened.st_dev == current.st_dev && opened.st_ino == current.st_ino && -1 == unlink( pid_file_path ) ){
+      perror( pid_file_path );
+    }
+  }
+  if( -1 == result ){
+    perror( "poll()" );
+  }
+  VERIFY( 0 == close( pidfd ) );
+  VERIFY( 0 == close( pid_file_fd ) );
+  /* SIGKILL で止めた場合は、きれいに終了できなかったことを終了ステータスで知らせる */
+  return ( 1 == result && !killed ) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int entry_point( int argc , char* argv[] )
+{
+  /* サブコマンド ( ターゲットプログラムはパスで書くので、名前と紛れない ) */
+  if( 1 < argc && 0 == strcmp( argv[1] , "ctl" ) ){
+    return control_main( argv[0] , argc - 1 , argv + 1 );
+  }
+  if( 1 < argc && 0 == strcmp( argv[1] , "stop" ) ){
+    return stop_main( argv[0] , argc - 1 , argv + 1 );
+  }
+
+  const char* manifest_path = NULL;
+  const char* syslog_path = LOG_SINK_DEFAULT_SYSLOG_PATH;
+  const char* log_directory = NULL;
+  int pipe_size = 0;
+  unsigned long long rotate_bytes = 0;
+  unsigned int rotate_age = 0;
+  unsigned int rotate_flags = 0;
+  int durable = 0;
+  unsigned long long durable_window_us = 0;
+  unsigned long long durable_bytes = 0;
+  enum log_stream_overflow overflow = LOG_STREAM_OVERFLOW_BLOCK;
+  size_t log_buffer_size = 0;
+  unsigned int sample_rate = 0;
+  int priorities[SERVICE_OUTPUT_COUNT] = { LOG_USER | LOG_NOTICE , LOG_USER | LOG_ERR };
+  unsigned long long stdout_batch_us = DEFAULT_STDOUT_BATCH_US;
+  int classify = 0;
+  enum proc_spawn_backend spawn_backend = proc_spawn_default_backend();
+  int warmup = 0;
+  struct service_restart_policy restart = { SERVICE_RESTART_NO ,
+                                            DEFAULT_RESTART_DELAY_MS * 1000ULL , DEFAULT_RESTART_MAX_DELAY_MS * 1000ULL ,
+                                            DEFAULT_RESTART_BURST , DEFAULT_RESTART_INTERVAL_S * 1000000ULL };
+  int restart_option_given = 0;
+  int reload_option_given = 0;
+  enum service_standby_mode standby = SERVICE_STANDBY_NONE;
+  const char** listen_addresses = NULL;
+  size_t listen_count = 0;
+  int* listen_fds = NULL;
+  unsigned long long ready_timeout_us = 0;
+  unsigned long long drain_timeout_us = DEFAULT_DRAIN_TIMEOUT_MS * 1000ULL;
+  unsigned long long ready_wait_us = 0;
+  unsigned long long stop_interrupt_us = DEFAULT_STOP_INTERRUPT_MS * 1000ULL;
+  unsigned long long stop_terminate_us = DEFAULT_STOP_TERMINATE_MS * 1000ULL;
+  int init = 0;
+  int adopt = 0;
+  int syslog_option_given = 0;
+  {
+    int opt = 0;
+    /* 先頭の "+" で、最初のオプションでない引数以降 ( ターゲットプログラムの引数 ) を解析しない */
+    while( -1 != ( opt = getopt( argc , argv , "+f:L:l:o:P:S:HAR:T:K:W:N:G:k:w:ir:a:zD:B:O:Q:p:e:b:ch" ) ) ){
+      switch( opt ){
+      case 'f':
+        manifest_path = optarg;
+        break;
+      case 'L':
+        syslog_path = optarg;
+        break;
+      case 'l':
+        {
+          /* 何度でも指定できる 渡す順番は指定した順番 */
+          const char** const addresses = realloc( listen_addresses , sizeof( const char* ) * ( listen_count + 1 ) );
+          if( NULL == addresses ){
+            perror( "realloc()" );
+            free( listen_addresses );
+            return EXIT_FAILURE;
+          }
+          listen_addresses = addresses;
+          listen_addresses[listen_count++] = optarg;
+        }
+        break;
+      case 'o':
+        log_directory = optarg;
+        break;
+      case 'P':
+        {
+          unsigned long long size = 0;
+          if( 0 != parse_size( optarg , &size ) || 0 == size || INT_MAX < size ){
+            fprintf( stderr , "invalid pipe size \"%s\"\n" , optarg );
+            return EXIT_FAILURE;
+          }
+          pipe_size = (int)size;
+        }
+        break;
+      case 'r':
+        if( 0 != parse_size( optarg , &rotate_bytes ) || 0 == rotate_bytes ){
+          fprintf( stderr , "invalid rotation size \"%s\"\n" , optarg );
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'a':
+        {
+          char* end = NULL;
+          const unsigned long age = strtoul( optarg , &end , 10 );
+          if( end == optarg || '\0' != *end || 0 == age || UINT_MAX < age ){
+            fprintf( stderr , "invalid rotation age \"%s\"\n" , optarg );
+            return EXIT_FAILURE;
+          }
+          rotate_age = (unsigned int)age;
+        }
+        break;
+      case 'z':
+        rotate_flags |= LOG_SINK_ROTATE_COMPRESS;
+        break;
+      case 'D':
+        {
+          char* end = NULL;
+          errno = 0;
+          durable_window_us = strtoull( optarg , &end , 10 );
+          if( end == optarg || '\0' != *end || 0 != errno || '-' == *optarg ){
+            fprintf( stderr , "invalid durable window \"%s\"\n" , optarg );
+            return EXIT_FAILURE;
+          }
+          durable = 1;
+        }
+        break;
+      case 'B':
+        if( 0 != parse_size( optarg , &durable_bytes ) || 0 == durable_bytes ){
+          fprintf( stderr , "invalid durable size \"%s\"\n" , optarg );
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'O':
+        if( 0 != parse_overflow( optarg , &overflow , &sample_rate ) ){
+          fprintf( stderr , "invalid overflow policy \"%s\"\n" , optarg );
+          return EXIT_FAILURE;
+        }
+        syslog_option_given = 1;
+        break;
+      case 'p':
+      case 'e':
+        if( 0 != parse_priority( optarg , &(priorities[ ( 'p' == opt ) ? SERVICE_OUTPUT_STDOUT : SERVICE_OUTPUT_STDERR ]) ) ){
+          fprintf( stderr , "invalid priority \"%s\"\n" , optarg );
+          return EXIT_FAILURE;
+        }
+        syslog_option_given = 1;
+        break;
+      case 'b':
+        {
+          char* end = NULL;
+          errno = 0;
+          stdout_batch_us = strtoull( optarg , &end , 10 );
+          if( end == optarg || '\0' != *end || 0 != errno || '-' == *optarg ){
+            fprintf( stderr , "invalid batch window \"%s\"\n" , optarg );
+            return EXIT_FAILURE;
+          }
+          syslog_option_given = 1;
+        }
+        break;
+      case 'W':
+        if( 0 != service_standby_mode_parse( optarg , &standby ) ){
+          fprintf( stderr , "invalid standby mode \"%s\"\n" , optarg );
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'w':
+        {
+          char* end = NULL;
+          errno = 0;
+          const unsigned long long ms = strtoull( optarg , &end , 10 );
+          if( end == optarg || '\0' != *end || 0 != errno || '-' == *optarg || 0 == ms || ULLONG_MAX / 1000ULL < ms ){
+            fprintf( stderr , "invalid ready wait \"%s\"\n" , optarg );
+            return EXIT_FAILURE;
+          }
+          ready_wait_us = ms * 1000ULL;
+        }
+        break;
+      case 'N':
+      case 'G':
+        {
+          char* end = NULL;
+          errno = 0;
+          const unsigned long long ms = strtoull( optarg , &end , 10 );
+          if( end == optarg || '\0' != *end || 0 != errno || '-' == *optarg ||
+              ( 'G' == opt && 0 == ms ) || ULLONG_MAX / 1000ULL < ms ){
+            fprintf( stderr , "invalid %s timeout \"%s\"\n" , ( 'N' == opt ) ? "ready" : "drain" , optarg );
+            return EXIT_FAILURE;
+          }
+          *( ( 'N' == opt ) ? &ready_timeout_us : &drain_timeout_us ) = ms * 1000ULL;
+        }
+        reload_option_given = 1;
+        break;
+      case 'R':
+        if( 0 != service_restart_mode_parse( optarg , &(restart.mode) ) ){
+          fprintf( stderr , "invalid restart policy \"%s\"\n" , optarg );
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'T':
+        if( 0 != parse_backoff( optarg , &restart ) ){
+          fprintf( stderr , "invalid restart backoff \"%s\"\n" , optarg );
+          return EXIT_FAILURE;
+        }
+        restart_option_given = 1;
+        break;
+      case 'K':
+        if( 0 != parse_restart_limit( optarg , &restart ) ){
+          fprintf( stderr , "invalid restart limit \"%s\"\n" , optarg );
+          return EXIT_FAILURE;
+        }
+        restart_option_given = 1;
+        break;
+      case 'i':
+        init = 1;
+        break;
+      case 'k':
+        if( 0 != parse_stop_escalation( optarg , &stop_interrupt_us , &stop_terminate_us ) ){
+          fprintf( stderr , "invalid stop escalation \"%s\"\n" , optarg );
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'S':
+        if( 0 != proc_spawn_backend_parse( optarg , &spawn_backend ) || !proc_spawn_backend_available( spawn_backend ) ){
+          fprintf( stderr , "invalid or unavailable spawn backend \"%s\"\n" , optarg );
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'H':
+        warmup = 1;
+        break;
+      case 'A':
+        adopt = 1;
+        break;
+      case 'c':
+        classify = 1;
+        syslog_option_given = 1;
+        break;
+      case 'Q':
+        {
+          unsigned long long size = 0;
+          if( 0 != parse_size( optarg , &size ) || size < LOG_STREAM_MIN_BUFFER_SIZE || SIZE_MAX < size ){
+            fprintf( stderr , "invalid log buffer size \"%s\"\n" , optarg );
+            return EXIT_FAILURE;
+          }
+          log_buffer_size = (size_t)size;
+          syslog_option_given = 1;
+        }
+        break;
+      case 'h':
+        print_help_text(argv[0]);
+        return EXIT_SUCCESS;
+      default:
+        print_help_text(argv[0]);
+        return EXIT_FAILURE;
+      }
+    }
+  }
 
-  assert( 0 <=logger_pipes[0] );
-  assert( 0 <=logger_pipes[1] );
+  if( NULL == log_directory && ( 0 < rotate_bytes || 0 < rotate_age || 0 != rotate_flags || durable ) ){
+    fprintf( stderr , "-r , -a , -z and -D require -o\n" );
+    return EXIT_FAILURE;
+  }
+  if( !durable && 0 < durable_bytes ){
+    fprintf( stderr , "-B requires -D\n" );
+    return EXIT_FAILURE;
+  }
+  if( SERVICE_RESTART_NO == restart.mode && ( restart_option_given || SERVICE_STANDBY_NONE != standby ) ){
+    fprintf( stderr , "-T , -K and -W require -R\n" );
+    return EXIT_FAILURE;
+  }
+  if( SERVICE_STANDBY_STOP == standby && 0 < listen_count ){
+    /* 止める前に動いている間に、待ち受けているソケットから accept(2) した接続を抱えたまま止まってしまう */
+    fprintf( stderr , "-W stop cannot be used with -l , use -W gate\n" );
+    return EXIT_FAILURE;
+  }
+  if( log_directory && syslog_option_given ){
+    /* ファイルへは splice(2) で移すので、バッファや priority を持たない */
+    fprintf( stderr , "-O , -Q , -p , -e , -b and -c cannot be used with -o\n" );
+    return EXIT_FAILURE;
+  }
+  if( init && ( log_directory || syslog_option_given || 0 < pipe_size || 0 < ready_wait_us || reload_option_given ||
+                0 != strcmp( syslog_path , LOG_SINK_DEFAULT_SYSLOG_PATH ) ) ){
+    /* 出力はパイプを挟まずにそのまま引き継ぎ、待っている呼び出し元もいない
+       SIGHUP はサービスへ転送し、コントロールソケットも無いので、リロードもしない */
+    fprintf( stderr , "-L , -o , -O , -Q , -p , -e , -b , -c , -P , -w , -N and -G cannot be used with -i\n" );
+    return EXIT_FAILURE;
+  }
+  if( init ){
+    /* コンテナには syslogd が無いことが多いので、このプロセス自身のメッセージは標準エラー出力にも出す */
+#if defined( LOG_PERROR )
+    openlog( "daemonic" , LOG_PID | LOG_PERROR , LOG_USER );
+#endif /* defined( LOG_PERROR ) */
+  }
 
-  /* ログを書きだす先の プロセスを作成する */
-  const pid_t logger_pid = fork();
-  
-  if( -1 == logger_pid ){
-    perror( "fork() faild");
-    VERIFY( 0 == close( logger_pipes[WRITE_SIDE] ));
-    VERIFY( 0 == close( logger_pipes[READ_SIDE] ));
-    abort();
+  if( ( NULL == manifest_path ) == ( ! ( optind < argc ) ) ){
+    /* オプションが足りない あるいは マニフェストとプログラムの両方が指定された */
+    print_help_text(argv[0]);
+    return ( NULL == manifest_path ) ? EXIT_SUCCESS : EXIT_FAILURE;
   }
 
-  if( 0 == logger_pid){
-    VERIFY( 0 == close( logger_pipes[WRITE_SIDE] ));
-    exec_logger_process( logger_pipes[READ_SIDE] );
+  /* 設定の誤りは、呼び出し元の端末に出力できるように fork の前に読み込んでおく */
+  char* absolute_log_directory = NULL;
+  if( log_directory ){
+    absolute_log_directory = get_absolute_path( log_directory );
+    if( NULL == absolute_log_directory ){
+      perror( log_directory );
+      return EXIT_FAILURE;
+    }
+  }
+  struct service_table* const table = service_table_create();
+  if( NULL == table ){
+    perror( "service_table_create()" );
+    free( absolute_log_directory );
     return EXIT_FAILURE;
+  }
+  if( manifest_path ){
+    if( 0 != service_table_load_manifest( table , manifest_path ) ){
+      service_table_destroy( table );
+      free( absolute_log_directory );
+      return EXIT_FAILURE;
+    }
   }else{
-    VERIFY( 0 == close( logger_pipes[READ_SIDE] ));
+    if( NULL == service_table_add( table , default_service_name( argv[optind] ) , &argv[optind] ) ){
+      perror( "service_table_add()" );
+      service_table_destroy( table );
+      free( absolute_log_directory );
+      return EXIT_FAILURE;
+    }
+  }
+
+  /* bind(2) の失敗 ( EADDRINUSE など ) も、呼び出し元の端末に出力できるように fork の前に行う */
+  if( 0 < listen_count ){
+    listen_fds = open_listen_sockets( listen_addresses , listen_count );
+    if( NULL == listen_fds ){
+      free( listen_addresses );
+      service_table_destroy( table );
+      free( absolute_log_directory );
+      return EXIT_FAILURE;
+    }
+  }
+  free( listen_addresses );
+  listen_addresses = NULL;
+
+  int status = EXIT_SUCCESS;
+  int report_sockets[2] = {-1,-1};
+  /* -i の場合は、コンテナの PID 1 として前面に残るので、 fork も setsid もしない */
+  if( !init ){
+    /* まず一段階目のfork では SIGCHLD を 無視する  */
+    {
+      struct sigaction sa = {{0}}; 
+      sa.sa_handler = SIG_IGN;
+      sa.sa_flags = SA_NOCLDWAIT;
+      if (sigaction(SIGCHLD, &sa, NULL) == -1) {
+        return EXIT_FAILURE;
+      }
+    }
+
+    /* サービスの起動の結果 ( exec の失敗など ) を、コントロールプロセスから受け取るソケット
+       呼び出し元は、全てのサービスの結果を受け取ってから、失敗があれば EXIT_FAILURE で制御を返す */
+    if( socketpair( AF_UNIX , SOCK_STREAM , 0 , report_sockets ) ){
+      perror( "socketpair()" );
+      close_listen_sockets( listen_fds , listen_count );
+      service_table_destroy( table );
+      free( absolute_log_directory );
+      return EXIT_FAILURE;
+    }
+    VERIFY( -1 != fcntl( report_sockets[READ_SIDE] , F_SETFD , FD_CLOEXEC ) );
+    VERIFY( -1 != fcntl( report_sockets[WRITE_SIDE] , F_SETFD , FD_CLOEXEC ) );
 
-    /* 標準入力を /dev/null に置き換える */
     {
+      const pid_t pid = fork();
+      if( pid < 0 ){ // fork fail.
+        perror( "fork faild" );
+        VERIFY( 0 == close( report_sockets[READ_SIDE] ) );
+        VERIFY( 0 == close( report_sockets[WRITE_SIDE] ) );
+        close_listen_sockets( listen_fds , listen_count );
+        return EXIT_FAILURE;
+      }
+    
+      if( 0 != pid ){
+        VERIFY( 0 == close( report_sockets[WRITE_SIDE] ) );
+        /* 待ち受けているソケットは、コントロールプロセスだけが持つ */
+        close_listen_sockets( listen_fds , listen_count );
+        const int report_status = wait_start_report( report_sockets[READ_SIDE] , table->count );
+        VERIFY( 0 == close( report_sockets[READ_SIDE] ) );
+        service_table_destroy( table );
+        free( absolute_log_directory );
+        return report_status;
+      }
+      VERIFY( 0 == close( report_sockets[READ_SIDE] ) );
+
+      /* セッショングループを作り直して端末グループから外れる  */
+      assert( 0 == pid && "the process is child process.");
+      if( -1 == setsid() ){
+        perror("create new session");
+      }
+    }
+  }
+
+  {
+    /* 標準入力を /dev/null に置き換える ( -i の場合は、サービスへそのまま引き継ぐので置き換えない ) */
+    if( !init ){
       int null_in = open( "/dev/null" , O_RDONLY );
       if( -1 == null_in ){
         return EXIT_FAILURE;
@@ -694,49 +3359,39 @@ int entry_point( int argc , char* argv[] )
       VERIFY( 0 == close( null_out ));
     }
     
-    struct process_param param = { logger_pipes[WRITE_SIDE] ,NULL};
+    struct process_param param = { syslog_path , absolute_log_directory , pipe_size ,
+                                   rotate_bytes , rotate_age , rotate_flags ,
+                                   durable , durable_window_us , durable_bytes ,
+                                   overflow , log_buffer_size , sample_rate ,
+                                   { priorities[SERVICE_OUTPUT_STDOUT] , priorities[SERVICE_OUTPUT_STDERR] } ,
+                                   stdout_batch_us , classify , spawn_backend , warmup ,
+                                   report_sockets[WRITE_SIDE] , restart , standby ,
+                                   listen_fds , listen_count , { NULL , NULL } , { NULL , NULL } ,
+                                   ready_timeout_us , drain_timeout_us , ready_wait_us ,
+                                   stop_interrupt_us , stop_terminate_us , ( adopt || init ) , 0 , init , NULL };
 
     char* pid_file_path = malloc( sizeof(char) * PATH_MAX );
+    if( NULL == pid_file_path && init ){
+      status = EXIT_FAILURE;
+    }
 
     if( pid_file_path ){
-      // TODO ここの PID_FILE_PATH の作り方、もうちょっと注意が必要 
-      char *p = strrchr( argv[0] , '/' ); 
-      if( p ){
-        p++;
-        p = (('\0' == *p) ? NULL : p);
-      }else{
-        p = argv[0];
-      }
-      VERIFY( 0 < snprintf( pid_file_path, sizeof( char ) * PATH_MAX , "/tmp/%s.pid" ,  (p)?(p): argv[0] ) );
+      VERIFY( 0 == default_pid_file_path( argv[0] , pid_file_path , sizeof( char ) * PATH_MAX ) );
       param.pid_file_path = pid_file_path;
       
-      const size_t params_len = argc;
-      char**params = malloc( sizeof(char*) * params_len );
-      
-      if( params ){
-        // params に strdup で引数を積んでいく
-        for( size_t i = 0 ; i < (params_len -1); ++i ){
-          params[i] = strdup( argv[ i + 1] );
-        }
-        params[params_len - 1] = NULL;
-        
-        if( EXIT_SUCCESS != start_process(param, params[0], params ) ){
-          // TODO spawn 失敗した
-        }
-        
-        for( size_t i = 0;  i < params_len ; ++i ){
-          if( params[i] ){
-            free( params[i] );
-          }
-        }
-        free( params );  
+      /* 起動の失敗は、 start_process が send_start_report で呼び出し元へ知らせている
+         -i の場合は呼び出し元がいないので、サービスの終了ステータスをこのプロセスの終了ステータスにする */
+      const int result = start_process( param , table );
+      if( init ){
+        status = result;
       }
       free( pid_file_path );
     }
-
-    VERIFY( 0 == close( logger_pipes[WRITE_SIDE] ));
   }
-  return EXIT_SUCCESS;
+  close_listen_sockets( listen_fds , listen_count );
+  service_table_destroy( table );
+  free( absolute_log_directory );
+  return status;
 }
 
 int main(int argc, char* argv[] )
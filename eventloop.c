@@ -0,0 +1,1110 @@
+﻿/**
+   コントロールプロセスのイベントループ
+
+   USE_EPOLL_EVENT_LOOP が定義されている場合は、 epoll(7) をエッジトリガで使い、
+   シグナルは signalfd(2) 、子プロセスの終了は pidfd_open(2) で受け取る。
+   ファイルディスクリプタ毎の登録は epoll_ctl(2) で一度だけ行うので、
+   select(2) のように毎回 fd_set を作り直す必要も、 FD_SETSIZE の制限もない。
+
+   定義されていない場合は、従来の select(2) + "self-pipe technique" を使う。
+   ただし、シグナル一回につき 1byte を書き込むと、SIGCHLD が大量に届いた時に
+   パイプが一杯になってシグナルハンドラがブロックする（あるいは abort する）ので、
+   シグナルハンドラはシグナル毎の受信回数を atomic に数えるだけにして、
+   起床のための 1byte は、まだ起床を要求していない時にだけ O_NONBLOCK で書き込む。
+   イベントループ側は、起床要求を解除してからパイプを空にし、全てのシグナルの
+   受信回数を 0 と交換して、一回のイベントでまとめて処理する。
+   ( 起床要求の解除後に届いたシグナルは、新しく 1byte を書き込むので取りこぼさない )
+
+   タイマーは数が少ない ( サービス毎に数個 ) ので、期限順には並べずに配列を線形に探す。
+   epoll 版は、最も近い期限を一つの timerfd(2) に TFD_TIMER_ABSTIME で設定して起床する。
+   ( epoll_wait(2) のタイムアウトはミリ秒単位なので、マイクロ秒単位のタイマーには使えない )
+   select 版は、最も近い期限までを select(2) のタイムアウトにする。
+   期限が来たタイマーのハンドラは、 event_loop_run_once の最後にまとめて呼ぶ。
+*/
+
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif /* defined(HAVE_CONFIG_H) */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <assert.h>
+#if !defined( USE_EPOLL_EVENT_LOOP )
+#include <stdatomic.h>
+#endif /* !defined( USE_EPOLL_EVENT_LOOP ) */
+
+#if defined( USE_EPOLL_EVENT_LOOP )
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#else /* defined( USE_EPOLL_EVENT_LOOP ) */
+#include <sys/select.h>
+#endif /* defined( USE_EPOLL_EVENT_LOOP ) */
+
+#include "verify.h"
+#include "alternative.h"
+#include "eventloop.h"
+
+/* シグナル番号の上限 _XOPEN_SOURCE だけでは NSIG が定義されないことがある */
+#if defined( NSIG )
+#define EVENT_LOOP_NSIG NSIG
+#elif defined( _NSIG )
+#define EVENT_LOOP_NSIG _NSIG
+#else /* defined( NSIG ) */
+#define EVENT_LOOP_NSIG 65
+#endif /* defined( NSIG ) */
+
+enum{
+  READ_SIDE = 0,
+  WRITE_SIDE = 1
+};
+
+/** ファイルディスクリプタ毎の登録情報 */
+struct event_loop_watch{
+  event_loop_fd_handler handler; /* NULL の場合は未登録 */
+  void* context;
+  unsigned int events;
+};
+
+/** シグナル毎の登録情報 */
+struct event_loop_signal_watch{
+  event_loop_signal_handler handler; /* NULL の場合は未登録 */
+  void* context;
+#if !defined( USE_EPOLL_EVENT_LOOP )
+  /** 登録前のシグナルハンドラ */
+  struct sigaction saved_action;
+#endif /* !defined( USE_EPOLL_EVENT_LOOP ) */
+};
+
+/** 子プロセス毎の登録情報
+    イベントループ内部のハンドラの context として使うのでアドレスが変わらないように個別に確保する */
+struct event_loop_child_watch{
+  pid_t pid;
+  /** pidfd が使えない場合は -1 で、SIGCHLD で代用する */
+  int pidfd;
+  event_loop_child_handler handler;
+  void* context;
+};
+
+/** タイマー毎の登録情報 */
+struct event_loop_timer{
+  event_loop_timer_id id;
+  /** 期限 ( CLOCK_MONOTONIC のナノ秒 ) */
+  unsigned long long deadline;
+  /** 繰り返す間隔 ( ナノ秒 ) 0 の場合は一度だけ */
+  unsigned long long interval;
+  event_loop_timer_handler handler;
+  void* context;
+};
+
+#if !defined( USE_EPOLL_EVENT_LOOP )
+/**
+   select(2) で fd_set を使用する際に、ファイルディスクリプタの最大値に+1をした数が必要なので
+   それを算出するためのラッピング構造体
+*/
+typedef struct fd_set_wrap_tag{
+  /** ファイルディスクリプタ集合 */
+  fd_set fds;
+  /** ファイルディスクリプタ集合 の中で最大の ファイルディスクリプタ
+      ファイルディスクリプタが空集合の場合は-1 である。*/
+  int maxfd;
+} fd_set_wrap;
+#endif /* !defined( USE_EPOLL_EVENT_LOOP ) */
+
+struct event_loop{
+  /** ファイルディスクリプタをインデックスにした登録情報の表 */
+  struct event_loop_watch* watches;
+  int watches_length;
+
+  struct event_loop_signal_watch signals[EVENT_LOOP_NSIG];
+
+  struct event_loop_child_watch** children;
+  size_t children_count;
+  size_t children_capacity;
+  /** SIGCHLD で代用している子プロセスの監視があるかどうか */
+  int sigchld_fallback;
+  /** 次の event_loop_run_once で、SIGCHLD で代用している子プロセスを一度確認する */
+  int child_check_pending;
+
+  /** イベントループを作成する前のシグナルマスク */
+  sigset_t saved_sigmask;
+
+  struct event_loop_timer* timers;
+  size_t timers_count;
+  size_t timers_capacity;
+  /** 次に割り当てるタイマーの識別子 */
+  event_loop_timer_id next_timer_id;
+
+#if defined( USE_EPOLL_EVENT_LOOP )
+  int epoll_fd;
+  int signal_fd;
+  /** 最初のタイマーの登録時に作る timerfd 作るまでは -1 */
+  int timer_fd;
+  /** timer_fd に設定している期限 設定していない場合は 0 */
+  unsigned long long timer_fd_deadline;
+  /** signalfd で受け付けているシグナルの集合 */
+  sigset_t signal_mask;
+#else /* defined( USE_EPOLL_EVENT_LOOP ) */
+  fd_set_wrap readfds;
+  fd_set_wrap writefds;
+  /** シグナルハンドラから書き込まれる self-pipe */
+  int signal_pipe[2];
+#endif /* defined( USE_EPOLL_EVENT_LOOP ) */
+};
+
+/**
+    内部で使う、登録情報の表を fd が入るまで広げる
+*/
+static int event_loop_reserve( struct event_loop* loop , int fd );
+
+/**
+    SIGCHLD で代用している子プロセスのハンドラを全て呼び出す
+*/
+static void event_loop_dispatch_fallback_children( struct event_loop* loop );
+
+/** SIGCHLD を受けた時の内部ハンドラ */
+static void event_loop_on_sigchld( struct event_loop* loop , int signo , unsigned int count , void* context );
+
+/** 子プロセス毎の監視を、登録表から pid で探す */
+static size_t event_loop_find_child( const struct event_loop* loop , pid_t pid );
+
+/** CLOCK_MONOTONIC の現在時刻をナノ秒で返す */
+static unsigned long long event_loop_now( void );
+
+/**
+   最も近いタイマーの期限を返す
+   @return タイマーが無い場合は 0
+*/
+static unsigned long long event_loop_next_deadline( const struct event_loop* loop );
+
+/** 期限が来たタイマーのハンドラを呼ぶ
+    @return 呼んだハンドラの数 */
+static int event_loop_dispatch_timers( struct event_loop* loop );
+
+#if defined( USE_EPOLL_EVENT_LOOP )
+/** signalfd が読み込み可能になった時の内部ハンドラ */
+static void event_loop_on_signalfd( struct event_loop* loop , int fd , unsigned int events , void* context );
+/** pidfd が読み込み可能になった時の内部ハンドラ */
+static void event_loop_on_pidfd( struct event_loop* loop , int fd , unsigned int events , void* context );
+/** timerfd が読み込み可能になった時のハンドラ 起床するためだけにあるので、読み捨てる */
+static void event_loop_on_timerfd( struct event_loop* loop , int fd , unsigned int events , void* context );
+/** timer_fd に最も近い期限を設定する */
+static void event_loop_arm_timerfd( struct event_loop* loop );
+#else /* defined( USE_EPOLL_EVENT_LOOP ) */
+/** self-pipe が読み込み可能になった時の内部ハンドラ */
+static void event_loop_on_signal_pipe( struct event_loop* loop , int fd , unsigned int events , void* context );
+/** シグナルハンドラ */
+static void event_loop_signal_trampoline( int sig );
+#endif /* defined( USE_EPOLL_EVENT_LOOP ) */
+
+/************************* 実装 **************************/
+
+#if !defined( USE_EPOLL_EVENT_LOOP )
+
+/* シグナルハンドラの中から使うので lock-free でなければならない */
+#if ( 201112L <=__STDC_VERSION__ )
+static_assert( 2 == ATOMIC_INT_LOCK_FREE , "atomic_uint must be lock-free to be used in a signal handler" );
+#endif /* ( 201112L <=__STDC_VERSION__ ) */
+
+/** シグナルハンドラから使う self-pipe の書き込み側
+    シグナルハンドラからは、 struct event_loop を参照できないので、ここに置く */
+static volatile sig_atomic_t event_loop_signal_pipe = -1;
+
+/** シグナル毎の、まだイベントループで処理されていない受信回数 */
+static atomic_uint event_loop_signal_pending[EVENT_LOOP_NSIG];
+
+/** self-pipe に起床要求の 1byte を書き込み済みかどうか */
+static atomic_flag event_loop_wakeup_armed = ATOMIC_FLAG_INIT;
+
+/**
+   fd_set_wrap が指し示す ファイルディスクリプタ集合を消去して、一つも含まれていない状態にする。
+   FD_ZERO を fd_set_wrap に合わせた関数
+*/
+static void fd_set_wrap_clear( fd_set_wrap* fds )
+{
+  assert( fds );
+  fds->maxfd = -1;
+  FD_ZERO( &(fds->fds) );
+  return;
+}
+
+/**
+   引数 ファイルディスクリプタ fd  を  fd_set_wrap が指し示すファイルディスクリプタ集合に加える。
+*/
+static void fd_set_wrap_set( int fd, fd_set_wrap* fds )
+{
+  assert( fds );
+  fds->maxfd = ( fds->maxfd < fd ) ? fd : fds->maxfd ;
+  FD_SET( fd , &(fds->fds) );
+  return;
+}
+
+/**
+   引数 ファイルディスクリプタ fd  を  fd_set_wrap が指し示すファイルディスクリプタ集合から消去する。
+   最大値を取り除いた場合には、次に大きいファイルディスクリプタを探す
+*/
+static void fd_set_wrap_unset( int fd, fd_set_wrap* fds )
+{
+  assert( fds );
+  FD_CLR( fd , &(fds->fds) );
+  if( fd == fds->maxfd ){
+    while( 0 <= fds->maxfd && !FD_ISSET( fds->maxfd , &(fds->fds) ) ){
+      --(fds->maxfd);
+    }
+  }
+  return;
+}
+
+static void event_loop_signal_trampoline( int sig )
+{
+  if( sig <= 0 || EVENT_LOOP_NSIG <= sig ){
+    return;
+  }
+  atomic_fetch_add( &event_loop_signal_pending[sig] , 1u );
+  if( !atomic_flag_test_and_set( &event_loop_wakeup_armed ) ){
+    /* write(2) は errno を書き換えるので、割り込まれた側のために保存しておく */
+    const int err = errno;
+    const int fd = (int)event_loop_signal_pipe;
+    if( 0 < fd ){
+      const unsigned char b[1] = {0};
+      /* O_NONBLOCK なので、ブロックはしない。 EAGAIN で失敗したとしても
+         パイプにはまだ読まれていない起床要求が残っているので問題ない */
+      (void)write( fd , b , sizeof( b ) );
+    }
+    errno = err;
+  }
+  return;
+}
+
+static void event_loop_on_signal_pipe( struct event_loop* loop , int fd , unsigned int events , void* context )
+{
+  (void)events;
+  (void)context;
+  /* 先に起床要求を解除する。これ以降に届いたシグナルは、もう一度起床を要求する */
+  atomic_flag_clear( &event_loop_wakeup_armed );
+  for(;;){
+    unsigned char b[64] = {0};
+    const ssize_t read_result = read( fd , b , sizeof( b ) );
+    if( read_result < 0 ){
+      if( EINTR == errno ){
+        continue;
+      }
+      break; /* EAGAIN */
+    }
+    if( 0 == read_result ){
+      break;
+    }
+  }
+  for( int signo = 1 ; signo < EVENT_LOOP_NSIG ; ++signo ){
+    const unsigned int count = atomic_exchange( &event_loop_signal_pending[signo] , 0u );
+    if( 0 < count && loop->signals[signo].handler ){
+      loop->signals[signo].handler( loop , signo , count , loop->signals[signo].context );
+    }
+  }
+  return;
+}
+
+#endif /* !defined( USE_EPOLL_EVENT_LOOP ) */
+
+const char* event_loop_backend_name( void )
+{
+#if defined( USE_EPOLL_EVENT_LOOP )
+  return "epoll";
+#else /* defined( USE_EPOLL_EVENT_LOOP ) */
+  return "select";
+#endif /* defined( USE_EPOLL_EVENT_LOOP ) */
+}
+
+#if !defined( USE_EPOLL_EVENT_LOOP )
+/**
+   ファイルディスクリプタに O_NONBLOCK と FD_CLOEXEC を設定する
+*/
+static int event_loop_set_nonblock_cloexec( int fd )
+{
+  const int fl = fcntl( fd , F_GETFL );
+  if( -1 == fl || -1 == fcntl( fd , F_SETFL , fl | O_NONBLOCK ) ){
+    return -1;
+  }
+  const int fdfl = fcntl( fd , F_GETFD );
+  if( -1 == fdfl || -1 == fcntl( fd , F_SETFD , fdfl | FD_CLOEXEC ) ){
+    return -1;
+  }
+  return 0;
+}
+#endif /* !defined( USE_EPOLL_EVENT_LOOP ) */
+
+struct event_loop* event_loop_create( void )
+{
+  struct event_loop* loop = calloc( 1 , sizeof( struct event_loop ) );
+  if( NULL == loop ){
+    return NULL;
+  }
+  VERIFY( 0 == sigemptyset( &(loop->saved_sigmask) ) );
+  VERIFY( 0 == sigprocmask( SIG_BLOCK , NULL , &(loop->saved_sigmask) ) );
+
+#if defined( USE_EPOLL_EVENT_LOOP )
+  loop->signal_fd = -1;
+  loop->timer_fd = -1;
+  VERIFY( 0 == sigemptyset( &(loop->signal_mask) ) );
+  loop->epoll_fd = epoll_create1( EPOLL_CLOEXEC );
+  if( -1 == loop->epoll_fd ){
+    const int err = errno;
+    free( loop );
+    errno = err;
+    return NULL;
+  }
+#else /* defined( USE_EPOLL_EVENT_LOOP ) */
+  fd_set_wrap_clear( &(loop->readfds) );
+  fd_set_wrap_clear( &(loop->writefds) );
+  loop->signal_pipe[READ_SIDE] = -1;
+  loop->signal_pipe[WRITE_SIDE] = -1;
+  if( 0 != pipe( loop->signal_pipe ) ){
+    const int err = errno;
+    free( loop );
+    errno = err;
+    return NULL;
+  }
+  /* 書き込み側も O_NONBLOCK にして、シグナルハンドラがブロックしないようにする */
+  VERIFY( 0 == event_loop_set_nonblock_cloexec( loop->signal_pipe[READ_SIDE] ) );
+  VERIFY( 0 == event_loop_set_nonblock_cloexec( loop->signal_pipe[WRITE_SIDE] ) );
+  if( 0 != event_loop_add_fd( loop , loop->signal_pipe[READ_SIDE] , EVENT_LOOP_READ ,
+                              event_loop_on_signal_pipe , NULL ) ){
+    const int err = errno;
+    VERIFY( 0 == close( loop->signal_pipe[READ_SIDE] ) );
+    VERIFY( 0 == close( loop->signal_pipe[WRITE_SIDE] ) );
+    free( loop );
+    errno = err;
+    return NULL;
+  }
+#endif /* defined( USE_EPOLL_EVENT_LOOP ) */
+  return loop;
+}
+
+void event_loop_destroy( struct event_loop* loop )
+{
+  if( NULL == loop ){
+    return;
+  }
+  while( 0 < loop->children_count ){
+    VERIFY( 0 == event_loop_remove_child( loop , loop->children[ loop->children_count - 1 ]->pid ) );
+  }
+  free( loop->children );
+
+  for( int signo = 1 ; signo < EVENT_LOOP_NSIG ; ++signo ){
+    if( loop->signals[signo].handler ){
+      VERIFY( 0 == event_loop_remove_signal( loop , signo ) );
+    }
+  }
+
+  free( loop->timers );
+
+#if defined( USE_EPOLL_EVENT_LOOP )
+  if( 0 <= loop->signal_fd ){
+    VERIFY( 0 == close( loop->signal_fd ) );
+  }
+  if( 0 <= loop->timer_fd ){
+    VERIFY( 0 == close( loop->timer_fd ) );
+  }
+  VERIFY( 0 == close( loop->epoll_fd ) );
+#else /* defined( USE_EPOLL_EVENT_LOOP ) */
+  event_loop_signal_pipe = (sig_atomic_t)-1;
+#if defined( __GNUC__ )
+  __sync_synchronize();
+#endif /* defined( __GNUC__ ) */
+  VERIFY( 0 == close( loop->signal_pipe[READ_SIDE] ) );
+  VERIFY( 0 == close( loop->signal_pipe[WRITE_SIDE] ) );
+#endif /* defined( USE_EPOLL_EVENT_LOOP ) */
+  free( loop->watches );
+  free( loop );
+  return;
+}
+
+static int event_loop_reserve( struct event_loop* loop , int fd )
+{
+  assert( loop );
+  if( fd < loop->watches_length ){
+    return 0;
+  }
+  int length = ( 0 < loop->watches_length ) ? loop->watches_length : 64;
+  while( length <= fd ){
+    length *= 2;
+  }
+  struct event_loop_watch* const watches = realloc( loop->watches , sizeof( struct event_loop_watch ) * length );
+  if( NULL == watches ){
+    return -1;
+  }
+  memset( &watches[ loop->watches_length ] , 0 ,
+          sizeof( struct event_loop_watch ) * ( length - loop->watches_length ) );
+  loop->watches = watches;
+  loop->watches_length = length;
+  return 0;
+}
+
+#if defined( USE_EPOLL_EVENT_LOOP )
+/** EVENT_LOOP_* を epoll のイベントに変換する 常にエッジトリガ */
+static uint32_t event_loop_to_epoll_events( unsigned int events )
+{
+  uint32_t result = EPOLLET;
+  if( events & EVENT_LOOP_READ ){
+    result |= EPOLLIN | EPOLLRDHUP;
+  }
+  if( events & EVENT_LOOP_WRITE ){
+    result |= EPOLLOUT;
+  }
+  return result;
+}
+#endif /* defined( USE_EPOLL_EVENT_LOOP ) */
+
+int event_loop_add_fd( struct event_loop* loop , int fd , unsigned int events ,
+                       event_loop_fd_handler handler , void* context )
+{
+  assert( loop );
+  assert( handler );
+  if( fd < 0 ){
+    errno = EBADF;
+    return -1;
+  }
+#if !defined( USE_EPOLL_EVENT_LOOP )
+  if( FD_SETSIZE <= fd ){
+    errno = EINVAL;
+    return -1;
+  }
+#endif /* !defined( USE_EPOLL_EVENT_LOOP ) */
+  if( 0 != event_loop_reserve( loop , fd ) ){
+    return -1;
+  }
+  if( loop->watches[fd].handler ){
+    errno = EEXIST;
+    return -1;
+  }
+#if defined( USE_EPOLL_EVENT_LOOP )
+  {
+    struct epoll_event ev = {0};
+    ev.events = event_loop_to_epoll_events( events );
+    ev.data.fd = fd;
+    if( -1 == epoll_ctl( loop->epoll_fd , EPOLL_CTL_ADD , fd , &ev ) ){
+      return -1;
+    }
+  }
+#else /* defined( USE_EPOLL_EVENT_LOOP ) */
+  if( events & EVENT_LOOP_READ ){
+    fd_set_wrap_set( fd , &(loop->readfds) );
+  }
+  if( events & EVENT_LOOP_WRITE ){
+    fd_set_wrap_set( fd , &(loop->writefds) );
+  }
+#endif /* defined( USE_EPOLL_EVENT_LOOP ) */
+  loop->watches[fd].handler = handler;
+  loop->watches[fd].context = context;
+  loop->watches[fd].events = events;
+  return 0;
+}
+
+int event_loop_modify_fd( struct event_loop* loop , int fd , unsigned int events )
+{
+  assert( loop );
+  if( fd < 0 || loop->watches_length <= fd || NULL == loop->watches[fd].handler ){
+    errno = ENOENT;
+    return -1;
+  }
+  if( loop->watches[fd].events == events ){
+    return 0;
+  }
+#if defined( USE_EPOLL_EVENT_LOOP )
+  {
+    struct epoll_event ev = {0};
+    ev.events = event_loop_to_epoll_events( events );
+    ev.data.fd = fd;
+    if( -1 == epoll_ctl( loop->epoll_fd , EPOLL_CTL_MOD , fd , &ev ) ){
+      return -1;
+    }
+  }
+#else /* defined( USE_EPOLL_EVENT_LOOP ) */
+  if( events & EVENT_LOOP_READ ){
+    fd_set_wrap_set( fd , &(loop->readfds) );
+  }else{
+    fd_set_wrap_unset( fd , &(loop->readfds) );
+  }
+  if( events & EVENT_LOOP_WRITE ){
+    fd_set_wrap_set( fd , &(loop->writefds) );
+  }else{
+    fd_set_wrap_unset( fd , &(loop->writefds) );
+  }
+#endif /* defined( USE_EPOLL_EVENT_LOOP ) */
+  loop->watches[fd].events = events;
+  return 0;
+}
+
+int event_loop_remove_fd( struct event_loop* loop , int fd )
+{
+  assert( loop );
+  if( fd < 0 || loop->watches_length <= fd || NULL == loop->watches[fd].handler ){
+    errno = ENOENT;
+    return -1;
+  }
+#if defined( USE_EPOLL_EVENT_LOOP )
+  if( -1 == epoll_ctl( loop->epoll_fd , EPOLL_CTL_DEL , fd , NULL ) ){
+    return -1;
+  }
+#else /* defined( USE_EPOLL_EVENT_LOOP ) */
+  fd_set_wrap_unset( fd , &(loop->readfds) );
+  fd_set_wrap_unset( fd , &(loop->writefds) );
+#endif /* defined( USE_EPOLL_EVENT_LOOP ) */
+  memset( &(loop->watches[fd]) , 0 , sizeof( loop->watches[fd] ) );
+  return 0;
+}
+
+#if defined( USE_EPOLL_EVENT_LOOP )
+
+static void event_loop_on_signalfd( struct event_loop* loop , int fd , unsigned int events , void* context )
+{
+  (void)events;
+  (void)context;
+  /* エッジトリガなので、EAGAIN まで全部読み切って、シグナル毎に回数をまとめてから呼び出す */
+  unsigned int pending[EVENT_LOOP_NSIG] = {0};
+  for(;;){
+    struct signalfd_siginfo info[16];
+    const ssize_t read_result = read( fd , info , sizeof( info ) );
+    if( read_result < 0 ){
+      if( EINTR == errno ){
+        continue;
+      }
+      break; /* EAGAIN */
+    }
+    const size_t count = (size_t)read_result / sizeof( info[0] );
+    if( 0 == count ){
+      break;
+    }
+    for( size_t i = 0 ; i < count ; ++i ){
+      const int signo = (int)info[i].ssi_signo;
+      if( 0 < signo && signo < EVENT_LOOP_NSIG ){
+        ++pending[signo];
+      }
+    }
+  }
+  for( int signo = 1 ; signo < EVENT_LOOP_NSIG ; ++signo ){
+    if( 0 < pending[signo] && loop->signals[signo].handler ){
+      loop->signals[signo].handler( loop , signo , pending[signo] , loop->signals[signo].context );
+    }
+  }
+  return;
+}
+
+/**
+   signalfd の受け付けるシグナル集合を更新する。
+   初回は signalfd を作成して epoll に登録する
+*/
+static int event_loop_update_signalfd( struct event_loop* loop )
+{
+  const int fd = signalfd( loop->signal_fd , &(loop->signal_mask) , SFD_NONBLOCK | SFD_CLOEXEC );
+  if( -1 == fd ){
+    return -1;
+  }
+  if( loop->signal_fd < 0 ){
+    loop->signal_fd = fd;
+    if( 0 != event_loop_add_fd( loop , fd , EVENT_LOOP_READ , event_loop_on_signalfd , NULL ) ){
+      const int err = errno;
+      VERIFY( 0 == close( fd ) );
+      loop->signal_fd = -1;
+      errno = err;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+#endif /* defined( USE_EPOLL_EVENT_LOOP ) */
+
+int event_loop_add_signal( struct event_loop* loop , int signo ,
+                           event_loop_signal_handler handler , void* context )
+{
+  assert( loop );
+  assert( handler );
+  if( signo <= 0 || EVENT_LOOP_NSIG <= signo ){
+    errno = EINVAL;
+    return -1;
+  }
+  if( loop->signals[signo].handler ){
+    errno = EEXIST;
+    return -1;
+  }
+#if defined( USE_EPOLL_EVENT_LOOP )
+  {
+    sigset_t set;
+    VERIFY( 0 == sigemptyset( &set ) );
+    VERIFY( 0 == sigaddset( &set , signo ) );
+    if( 0 != sigprocmask( SIG_BLOCK , &set , NULL ) ){
+      return -1;
+    }
+    VERIFY( 0 == sigaddset( &(loop->signal_mask) , signo ) );
+    if( 0 != event_loop_update_signalfd( loop ) ){
+      const int err = errno;
+      VERIFY( 0 == sigdelset( &(loop->signal_mask) , signo ) );
+      if( !sigismember( &(loop->saved_sigmask) , signo ) ){
+        VERIFY( 0 == sigprocmask( SIG_UNBLOCK , &set , NULL ) );
+      }
+      errno = err;
+      return -1;
+    }
+  }
+#else /* defined( USE_EPOLL_EVENT_LOOP ) */
+  {
+    assert( -1 == event_loop_signal_pipe || event_loop_signal_pipe == loop->signal_pipe[WRITE_SIDE] );
+    event_loop_signal_pipe = (sig_atomic_t)loop->signal_pipe[WRITE_SIDE];
+#if defined( __GNUC__ )
+    __sync_synchronize();
+#endif /* defined( __GNUC__ ) */
+    atomic_store( &event_loop_signal_pending[signo] , 0u );
+    struct sigaction act = {{0}};
+    act.sa_handler = event_loop_signal_trampoline;
+    VERIFY( 0 == sigemptyset( &(act.sa_mask) ) );
+    act.sa_flags = 0;
+    if( 0 != sigaction( signo , &act , &(loop->signals[signo].saved_action) ) ){
+      return -1;
+    }
+  }
+#endif /* defined( USE_EPOLL_EVENT_LOOP ) */
+  loop->signals[signo].handler = handler;
+  loop->signals[signo].context = context;
+  return 0;
+}
+
+int event_loop_remove_signal( struct event_loop* loop , int signo )
+{
+  assert( loop );
+  if( signo <= 0 || EVENT_LOOP_NSIG <= signo || NULL == loop->signals[signo].handler ){
+    errno = ENOENT;
+    return -1;
+  }
+#if defined( USE_EPOLL_EVENT_LOOP )
+  VERIFY( 0 == sigdelset( &(loop->signal_mask) , signo ) );
+  if( 0 != event_loop_update_signalfd( loop ) ){
+    return -1;
+  }
+  if( !sigismember( &(loop->saved_sigmask) , signo ) ){
+    sigset_t set;
+    VERIFY( 0 == sigemptyset( &set ) );
+    VERIFY( 0 == sigaddset( &set , signo ) );
+    VERIFY( 0 == sigprocmask( SIG_UNBLOCK , &set , NULL ) );
+  }
+#else /* defined( USE_EPOLL_EVENT_LOOP ) */
+  if( 0 != sigaction( signo , &(loop->signals[signo].saved_action) , NULL ) ){
+    return -1;
+  }
+#endif /* defined( USE_EPOLL_EVENT_LOOP ) */
+  memset( &(loop->signals[signo]) , 0 , sizeof( loop->signals[signo] ) );
+  return 0;
+}
+
+static void event_loop_dispatch_fallback_children( struct event_loop* loop )
+{
+  /* ハンドラの中で event_loop_remove_child されることがあるので、後ろから回す */
+  for( size_t i = loop->children_count ; 0 < i ; --i ){
+    if( loop->children_count < i ){
+      continue;
+    }
+    struct event_loop_child_watch* const child = loop->children[i-1];
+    if( child->pidfd < 0 ){
+      child->handler( loop , child->pid , child->context );
+    }
+  }
+  return;
+}
+
+static void event_loop_on_sigchld( struct event_loop* loop , int signo , unsigned int count , void* context )
+{
+  (void)signo;
+  (void)count;
+  (void)context;
+  event_loop_dispatch_fallback_children( loop );
+  return;
+}
+
+#if defined( USE_EPOLL_EVENT_LOOP )
+static void event_loop_on_pidfd( struct event_loop* loop , int fd , unsigned int events , void* context )
+{
+  (void)fd;
+  (void)events;
+  struct event_loop_child_watch* const child = context;
+  assert( child );
+  child->handler( loop , child->pid , child->context );
+  return;
+}
+#endif /* defined( USE_EPOLL_EVENT_LOOP ) */
+
+static size_t event_loop_find_child( const struct event_loop* loop , pid_t pid )
+{
+  for( size_t i = 0 ; i < loop->children_count ; ++i ){
+    if( loop->children[i]->pid == pid ){
+      return i;
+    }
+  }
+  return loop->children_count;
+}
+
+int event_loop_add_child( struct event_loop* loop , pid_t pid ,
+                          event_loop_child_handler handler , void* context )
+{
+  assert( loop );
+  assert( handler );
+  if( pid <= 0 && EVENT_LOOP_ANY_CHILD != pid ){
+    errno = EINVAL;
+    return -1;
+  }
+  if( event_loop_find_child( loop , pid ) != loop->children_count ){
+    errno = EEXIST;
+    return -1;
+  }
+  if( loop->children_capacity <= loop->children_count ){
+    const size_t capacity = ( 0 < loop->children_capacity ) ? loop->children_capacity * 2 : 8;
+    struct event_loop_child_watch** const children =
+      realloc( loop->children , sizeof( struct event_loop_child_watch* ) * capacity );
+    if( NULL == children ){
+      return -1;
+    }
+    loop->children = children;
+    loop->children_capacity = capacity;
+  }
+  struct event_loop_child_watch* const child = calloc( 1 , sizeof( struct event_loop_child_watch ) );
+  if( NULL == child ){
+    return -1;
+  }
+  child->pid = pid;
+  child->pidfd = -1;
+  child->handler = handler;
+  child->context = context;
+
+#if defined( USE_EPOLL_EVENT_LOOP )
+  /* 全ての子プロセスを一つの pidfd では待てないので、 EVENT_LOOP_ANY_CHILD は SIGCHLD で待つ */
+  child->pidfd = ( EVENT_LOOP_ANY_CHILD == pid ) ? -1 : x_pidfd_open( pid );
+  if( 0 <= child->pidfd ){
+    if( 0 != event_loop_add_fd( loop , child->pidfd , EVENT_LOOP_READ , event_loop_on_pidfd , child ) ){
+      const int err = errno;
+      VERIFY( 0 == close( child->pidfd ) );
+      free( child );
+      errno = err;
+      return -1;
+    }
+  }
+#endif /* defined( USE_EPOLL_EVENT_LOOP ) */
+
+  if( child->pidfd < 0 ){
+    /* pidfd が使えないので SIGCHLD で代用する */
+    if( !loop->sigchld_fallback ){
+      if( 0 != event_loop_add_signal( loop , SIGCHLD , event_loop_on_sigchld , NULL ) ){
+        const int err = errno;
+        free( child );
+        errno = err;
+        return -1;
+      }
+      loop->sigchld_fallback = 1;
+    }
+    /* 登録前に SIGCHLD が届いていた場合に備えて、一度は確認する */
+    loop->child_check_pending = 1;
+  }
+  loop->children[ loop->children_count++ ] = child;
+  return 0;
+}
+
+int event_loop_dispatch_child( struct event_loop* loop , pid_t pid )
+{
+  assert( loop );
+  const size_t index = event_loop_find_child( loop , pid );
+  if( EVENT_LOOP_ANY_CHILD == pid || loop->children_count <= index ){
+    return 0;
+  }
+  struct event_loop_child_watch* const child = loop->children[index];
+  child->handler( loop , child->pid , child->context );
+  return 1;
+}
+
+int event_loop_remove_child( struct event_loop* loop , pid_t pid )
+{
+  assert( loop );
+  const size_t index = event_loop_find_child( loop , pid );
+  if( loop->children_count <= index ){
+    errno = ENOENT;
+    return -1;
+  }
+  struct event_loop_child_watch* const child = loop->children[index];
+  if( 0 <= child->pidfd ){
+    VERIFY( 0 == event_loop_remove_fd( loop , child->pidfd ) );
+    VERIFY( 0 == close( child->pidfd ) );
+  }
+  free( child );
+  loop->children[index] = loop->children[ --(loop->children_count) ];
+
+  if( loop->sigchld_fallback ){
+    int rest = 0;
+    for( size_t i = 0 ; i < loop->children_count ; ++i ){
+      if( loop->children[i]->pidfd < 0 ){
+        rest = 1;
+        break;
+      }
+    }
+    if( !rest ){
+      VERIFY( 0 == event_loop_remove_signal( loop , SIGCHLD ) );
+      loop->sigchld_fallback = 0;
+    }
+  }
+  return 0;
+}
+
+static unsigned long long event_loop_now( void )
+{
+  struct timespec ts = {0};
+  VERIFY( 0 == clock_gettime( CLOCK_MONOTONIC , &ts ) );
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+static unsigned long long event_loop_next_deadline( const struct event_loop* loop )
+{
+  unsigned long long deadline = 0;
+  for( size_t i = 0 ; i < loop->timers_count ; ++i ){
+    if( 0 == deadline || loop->timers[i].deadline < deadline ){
+      deadline = loop->timers[i].deadline;
+    }
+  }
+  return deadline;
+}
+
+#if defined( USE_EPOLL_EVENT_LOOP )
+static void event_loop_on_timerfd( struct event_loop* loop , int fd , unsigned int events , void* context )
+{
+  (void)events;
+  (void)context;
+  uint64_t expirations = 0;
+  while( sizeof( expirations ) == read( fd , &expirations , sizeof( expirations ) ) ){
+    ;
+  }
+  /* 期限が過ぎたので、設定は解除されている */
+  loop->timer_fd_deadline = 0;
+  return;
+}
+
+static void event_loop_arm_timerfd( struct event_loop* loop )
+{
+  if( loop->timer_fd < 0 ){
+    return;
+  }
+  const unsigned long long deadline = event_loop_next_deadline( loop );
+  if( deadline == loop->timer_fd_deadline ){
+    return;
+  }
+  struct itimerspec spec;
+  memset( &spec , 0 , sizeof( spec ) );
+  spec.it_value.tv_sec = (time_t)( deadline / 1000000000ULL );
+  spec.it_value.tv_nsec = (long)( deadline % 1000000000ULL );
+  /* deadline が 0 の場合は it_value が 0 になり、設定が解除される */
+  VERIFY( 0 == timerfd_settime( loop->timer_fd , TFD_TIMER_ABSTIME , &spec , NULL ) );
+  loop->timer_fd_deadline = deadline;
+  return;
+}
+#endif /* defined( USE_EPOLL_EVENT_LOOP ) */
+
+event_loop_timer_id event_loop_add_timer( struct event_loop* loop ,
+                                          unsigned long long delay_us , unsigned long long interval_us ,
+                                          event_loop_timer_handler handler , void* context )
+{
+  assert( loop );
+  assert( handler );
+#if defined( USE_EPOLL_EVENT_LOOP )
+  if( loop->timer_fd < 0 ){
+    const int fd = timerfd_create( CLOCK_MONOTONIC , TFD_NONBLOCK | TFD_CLOEXEC );
+    if( -1 == fd ){
+      return 0;
+    }
+    if( 0 != event_loop_add_fd( loop , fd , EVENT_LOOP_READ , event_loop_on_timerfd , NULL ) ){
+      const int err = errno;
+      VERIFY( 0 == close( fd ) );
+      errno = err;
+      return 0;
+    }
+    loop->timer_fd = fd;
+  }
+#endif /* defined( USE_EPOLL_EVENT_LOOP ) */
+  if( loop->timers_capacity <= loop->timers_count ){
+    const size_t capacity = ( 0 < loop->timers_capacity ) ? loop->timers_capacity * 2 : 8;
+    struct event_loop_timer* const timers = realloc( loop->timers , sizeof( struct event_loop_timer ) * capacity );
+    if( NULL == timers ){
+      return 0;
+    }
+    loop->timers = timers;
+    loop->timers_capacity = capacity;
+  }
+  if( 0 == ++(loop->next_timer_id) ){
+    ++(loop->next_timer_id); /* 一周したら 0 を飛ばす */
+  }
+  struct event_loop_timer* const timer = &(loop->timers[ loop->timers_count++ ]);
+  timer->id = loop->next_timer_id;
+  /* 期限 0 は「タイマー無し」を表すので、使わない */
+  timer->deadline = event_loop_now() + delay_us * 1000ULL + 1;
+  timer->interval = interval_us * 1000ULL;
+  timer->handler = handler;
+  timer->context = context;
+#if defined( USE_EPOLL_EVENT_LOOP )
+  event_loop_arm_timerfd( loop );
+#endif /* defined( USE_EPOLL_EVENT_LOOP ) */
+  return timer->id;
+}
+
+int event_loop_remove_timer( struct event_loop* loop , event_loop_timer_id id )
+{
+  assert( loop );
+  for( size_t i = 0 ; i < loop->timers_count ; ++i ){
+    if( loop->timers[i].id == id ){
+      loop->timers[i] = loop->timers[ --(loop->timers_count) ];
+#if defined( USE_EPOLL_EVENT_LOOP )
+      event_loop_arm_timerfd( loop );
+#endif /* defined( USE_EPOLL_EVENT_LOOP ) */
+      return 0;
+    }
+  }
+  errno = ENOENT;
+  return -1;
+}
+
+static int event_loop_dispatch_timers( struct event_loop* loop )
+{
+  int dispatched = 0;
+  const unsigned long long now = event_loop_now();
+  /* ハンドラの中でタイマーが追加・削除されるかもしれないので、一つ呼ぶ毎に探しなおす
+     呼んだタイマーの期限は now より後になるので、必ず終わる */
+  for(;;){
+    size_t found = loop->timers_count;
+    for( size_t i = 0 ; i < loop->timers_count ; ++i ){
+      if( loop->timers[i].deadline <= now &&
+          ( found == loop->timers_count || loop->timers[i].deadline < loop->timers[found].deadline ) ){
+        found = i;
+      }
+    }
+    if( found == loop->timers_count ){
+      break;
+    }
+    struct event_loop_timer* const timer = &(loop->timers[found]);
+    const event_loop_timer_id id = timer->id;
+    const event_loop_timer_handler handler = timer->handler;
+    void* const context = timer->context;
+    if( 0 < timer->interval ){
+      /* 遅れた分はまとめて一回にする */
+      timer->deadline += timer->interval;
+      if( timer->deadline <= now ){
+        timer->deadline = now + timer->interval;
+      }
+    }else{
+      loop->timers[found] = loop->timers[ --(loop->timers_count) ];
+    }
+    handler( loop , id , context );
+    ++dispatched;
+  }
+#if defined( USE_EPOLL_EVENT_LOOP )
+  event_loop_arm_timerfd( loop );
+#endif /* defined( USE_EPOLL_EVENT_LOOP ) */
+  return dispatched;
+}
+
+void event_loop_saved_sigmask( const struct event_loop* loop , sigset_t* set )
+{
+  assert( loop );
+  assert( set );
+  *set = loop->saved_sigmask;
+  return;
+}
+
+int event_loop_run_once( struct event_loop* loop , int timeout_ms )
+{
+  assert( loop );
+  if( loop->child_check_pending ){
+    timeout_ms = 0;
+  }
+  int dispatched = 0;
+
+#if defined( USE_EPOLL_EVENT_LOOP )
+  struct epoll_event events[64];
+  const int nfds = epoll_wait( loop->epoll_fd , events , sizeof( events ) / sizeof( events[0] ) , timeout_ms );
+  if( nfds < 0 ){
+    if( EINTR != errno ){
+      return -1;
+    }
+  }
+  for( int i = 0 ; i < nfds ; ++i ){
+    const int fd = events[i].data.fd;
+    /* 前のハンドラで登録が外されているかもしれないので、毎回表を引く */
+    if( fd < 0 || loop->watches_length <= fd || NULL == loop->watches[fd].handler ){
+      continue;
+    }
+    unsigned int ev = 0;
+    if( events[i].events & EPOLLIN ){
+      ev |= EVENT_LOOP_READ;
+    }
+    if( events[i].events & EPOLLOUT ){
+      ev |= EVENT_LOOP_WRITE;
+    }
+    if( events[i].events & ( EPOLLERR | EPOLLHUP | EPOLLRDHUP ) ){
+      ev |= EVENT_LOOP_HANGUP;
+    }
+    loop->watches[fd].handler( loop , fd , ev , loop->watches[fd].context );
+    ++dispatched;
+  }
+#else /* defined( USE_EPOLL_EVENT_LOOP ) */
+  /* select(2) は fd_set を書き換えるので、毎回コピーする必要がある */
+  fd_set readfds = loop->readfds.fds;
+  fd_set writefds = loop->writefds.fds;
+  const int nfds = 1 + ( ( loop->readfds.maxfd < loop->writefds.maxfd ) ? loop->writefds.maxfd : loop->readfds.maxfd );
+  /* 最も近いタイマーの期限までしか待たない */
+  long long timeout_us = ( timeout_ms < 0 ) ? -1 : (long long)timeout_ms * 1000;
+  {
+    const unsigned long long deadline = event_loop_next_deadline( loop );
+    if( 0 < deadline ){
+      const unsigned long long now = event_loop_now();
+      /* 切り上げて、期限の前に起きてしまわないようにする */
+      const long long until_us = ( deadline <= now ) ? 0 : (long long)( ( deadline - now + 999 ) / 1000 );
+      if( timeout_us < 0 || until_us < timeout_us ){
+        timeout_us = until_us;
+      }
+    }
+  }
+  struct timeval timeout = { 0 , 0 };
+  if( 0 <= timeout_us ){
+    timeout.tv_sec = (time_t)( timeout_us / 1000000 );
+    timeout.tv_usec = (suseconds_t)( timeout_us % 1000000 );
+  }
+  const int select_result = select( nfds , &readfds , &writefds , NULL , ( timeout_us < 0 ) ? NULL : &timeout );
+  if( select_result < 0 ){
+    /* select にエラーが起きた時には readfds の状態は不明なので ここで抜けないと、ハンドラの read がブロックする */
+    if( EINTR != errno ){
+      return -1;
+    }
+  }else{
+    for( int fd = 0 ; fd < nfds ; ++fd ){
+      unsigned int ev = 0;
+      if( FD_ISSET( fd , &readfds ) ){
+        ev |= EVENT_LOOP_READ;
+      }
+      if( FD_ISSET( fd , &writefds ) ){
+        ev |= EVENT_LOOP_WRITE;
+      }
+      if( 0 == ev || loop->watches_length <= fd || NULL == loop->watches[fd].handler ){
+        continue;
+      }
+      loop->watches[fd].handler( loop , fd , ev , loop->watches[fd].context );
+      ++dispatched;
+    }
+  }
+#endif /* defined( USE_EPOLL_EVENT_LOOP ) */
+
+  if( loop->child_check_pending ){
+    loop->child_check_pending = 0;
+    event_loop_dispatch_fallback_children( loop );
+  }
+  if( 0 < loop->timers_count ){
+    dispatched += event_loop_dispatch_timers( loop );
+  }
+  return dispatched;
+}
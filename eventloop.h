@@ -0,0 +1,174 @@
+﻿#if ! defined( EVENTLOOP_H_HEADER_GUARD )
+#define EVENTLOOP_H_HEADER_GUARD 1
+
+/**
+   コントロールプロセスのイベントループ
+
+   configure 時に、 Linux の epoll(7) + signalfd(2) + pidfd_open(2) を使う
+   バックエンドと、移植性のための select(2) + self-pipe を使うバックエンドの
+   どちらかが選ばれる。( --disable-epoll で select(2) 版を強制できる )
+
+   epoll 版はエッジトリガで動作するので、ファイルディスクリプタのハンドラは
+   EAGAIN が返るまで読み切らなければならない。 select 版はレベルトリガだが、
+   EAGAIN まで読み切るハンドラはどちらでも同じように動作する。
+   そのため、登録するファイルディスクリプタは O_NONBLOCK にしておくこと。
+
+   タイマーは CLOCK_MONOTONIC でマイクロ秒単位に指定する。 epoll 版は timerfd(2) で、
+   select 版は select(2) のタイムアウトで起床する。
+ */
+
+#include <sys/types.h>
+#include <signal.h>
+
+/** ハンドラに渡される、あるいは登録時に指定するイベントの種類 */
+enum{
+  EVENT_LOOP_READ   = 0x01,
+  EVENT_LOOP_WRITE  = 0x02,
+  /** エラーもしくは相手側のクローズ ( 登録時に指定する必要は無い ) */
+  EVENT_LOOP_HANGUP = 0x04
+};
+
+struct event_loop;
+
+/**
+   ファイルディスクリプタが読み書き可能になった時に呼ばれるハンドラ
+   @param events EVENT_LOOP_READ , EVENT_LOOP_WRITE , EVENT_LOOP_HANGUP の論理和
+ */
+typedef void (*event_loop_fd_handler)( struct event_loop* loop , int fd , unsigned int events , void* context );
+
+/**
+   シグナルを受信した時に呼ばれるハンドラ
+   シグナルハンドラの中ではなく、イベントループの中から呼ばれるので、
+   非同期シグナル安全でない関数を呼んでもよい。
+   同じシグナルが何度も届いている場合でも、一回のイベントで一度だけまとめて呼ばれる。
+   @param count 前回の呼び出しから受信した回数 ( 1 以上 )
+   ただし、標準シグナルはカーネル側で合流されるので、送信された回数とは一致しない。
+   リアルタイムシグナルはキューイングされるので、送信された回数と一致する。
+ */
+typedef void (*event_loop_signal_handler)( struct event_loop* loop , int signo , unsigned int count , void* context );
+
+/**
+   子プロセスが終了した（可能性がある）時に呼ばれるハンドラ
+   子プロセスの回収( waitpid(2) ) は呼び出し側の責任で行う。
+   SIGCHLD で代用している場合には、実際には終了していないこともあるので、
+   WNOHANG を指定すること。
+ */
+typedef void (*event_loop_child_handler)( struct event_loop* loop , pid_t pid , void* context );
+
+/** タイマーの識別子 0 は無効な値 */
+typedef unsigned long event_loop_timer_id;
+
+/**
+   タイマーの期限が来た時に呼ばれるハンドラ
+   一度だけのタイマーは、ハンドラが呼ばれる前に登録が外されている。
+ */
+typedef void (*event_loop_timer_handler)( struct event_loop* loop , event_loop_timer_id id , void* context );
+
+/**
+   イベントループを作成する
+   @return 失敗した場合は NULL を返し、理由を errno に保存する。
+ */
+struct event_loop* event_loop_create( void );
+
+/**
+   イベントループを破棄する
+   登録されたままのシグナルは、登録前の状態に戻される。
+ */
+void event_loop_destroy( struct event_loop* loop );
+
+/**
+   configure 時に選択されたバックエンドの名前 ( "epoll" または "select" )
+ */
+const char* event_loop_backend_name( void );
+
+/**
+   ファイルディスクリプタを監視対象に加える
+   @return 成功時には 0 失敗時には -1 を返し、理由を errno に保存する。
+ */
+int event_loop_add_fd( struct event_loop* loop , int fd , unsigned int events ,
+                       event_loop_fd_handler handler , void* context );
+
+/**
+   監視するイベントの種類を変更する
+   @return 成功時には 0 失敗時には -1 を返し、理由を errno に保存する。
+ */
+int event_loop_modify_fd( struct event_loop* loop , int fd , unsigned int events );
+
+/**
+   ファイルディスクリプタを監視対象から外す。ファイルディスクリプタは閉じない。
+   @return 成功時には 0 失敗時には -1 を返し、理由を errno に保存する。
+ */
+int event_loop_remove_fd( struct event_loop* loop , int fd );
+
+/**
+   シグナルを監視対象に加える
+   epoll 版では、シグナルはブロックされ signalfd(2) 経由で受信する。
+   @return 成功時には 0 失敗時には -1 を返し、理由を errno に保存する。
+ */
+int event_loop_add_signal( struct event_loop* loop , int signo ,
+                           event_loop_signal_handler handler , void* context );
+
+/**
+   シグナルを監視対象から外して、シグナルの処理を登録前の状態に戻す
+ */
+int event_loop_remove_signal( struct event_loop* loop , int signo );
+
+/** event_loop_add_child に渡すと、どの子プロセスの終了でもハンドラを呼ぶ */
+#define EVENT_LOOP_ANY_CHILD ( (pid_t)-1 )
+
+/**
+   子プロセスの終了を監視対象に加える
+   pidfd が使える場合は pidfd を、使えない場合は SIGCHLD を使う。
+   SIGCHLD が SIG_IGN のままだと子プロセスは自動的に回収されてしまうので、
+   呼び出し側で SIG_DFL に戻しておく必要がある。
+   pid が EVENT_LOOP_ANY_CHILD の場合は、常に SIGCHLD を使って、全ての子プロセスを監視する。
+   ( PR_SET_CHILD_SUBREAPER で引き取った子孫のように、 PID を前もって知らない子プロセスを回収するために使う )
+   @return 成功時には 0 失敗時には -1 を返し、理由を errno に保存する。
+ */
+int event_loop_add_child( struct event_loop* loop , pid_t pid ,
+                          event_loop_child_handler handler , void* context );
+
+/**
+   子プロセスの監視を止める
+ */
+int event_loop_remove_child( struct event_loop* loop , pid_t pid );
+
+/**
+   pid の子プロセスを監視していれば、そのハンドラをすぐに呼ぶ ( EVENT_LOOP_ANY_CHILD の監視は呼ばない )
+   waitid( P_ALL ) でまとめて回収する側が、別に監視されている子プロセスを横取りせずに、
+   監視している側に回収させるために使う。
+   @return 監視していてハンドラを呼んだ場合は 1 監視していない場合は 0
+ */
+int event_loop_dispatch_child( struct event_loop* loop , pid_t pid );
+
+/**
+   タイマーを登録する
+   @return タイマーの識別子 失敗した時には 0 を返し、理由を errno に保存する。
+   @param delay_us 最初に期限が来るまでの時間 ( マイクロ秒 )
+   @param interval_us 0 の場合は一度だけ それ以外の場合は、この間隔で繰り返す ( マイクロ秒 )
+ */
+event_loop_timer_id event_loop_add_timer( struct event_loop* loop ,
+                                          unsigned long long delay_us , unsigned long long interval_us ,
+                                          event_loop_timer_handler handler , void* context );
+
+/**
+   タイマーの登録を外す
+   @return 成功時には 0 登録されていない ( 一度だけのタイマーの期限が過ぎた ) 場合は -1 を返し、 errno を ENOENT にする。
+ */
+int event_loop_remove_timer( struct event_loop* loop , event_loop_timer_id id );
+
+/**
+   イベントループ作成前のシグナルマスクを得る
+   fork(2) した子プロセスで exec の前に、このマスクに戻すこと。
+ */
+void event_loop_saved_sigmask( const struct event_loop* loop , sigset_t* set );
+
+/**
+   イベントを一回待って、発生したイベントのハンドラを呼び出す
+   @return 処理したイベントの数 シグナルによる割り込みの時は 0 
+   失敗した時には -1 を返し、理由を errno に保存する
+   @param timeout_ms 待つ時間( ミリ秒 ) 負の値の場合は無限に待つ
+ */
+int event_loop_run_once( struct event_loop* loop , int timeout_ms );
+
+#endif /* EVENTLOOP_H_HEADER_GUARD */
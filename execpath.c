@@ -1,6 +1,17 @@
 ﻿/*
   exec に渡す realpath の処理をテストする。
 
+  execpath bench [最大 MiB] [回数] では、 procspawn.c のバックエンド毎に /bin/true を
+  起動する速さを、このプロセスの RSS を増やしながら計る。
+  fork(2) はページテーブルを複製するので RSS に比例して遅くなるが、
+  posix_spawn と vfork ( clone(2) の CLONE_VM | CLONE_VFORK ) はほぼ一定になる。
+
+  execpath warmbench 回数 プログラム [引数...] では、プログラムと共有ライブラリを
+  ページキャッシュから追い出してから起動する ( cold ) のと、追い出した後に warmup.c で
+  先読みを頼んでから起動する ( warm ) のとで、 exec(3) が終わるまでと、プログラムが
+  終了する ( 準備ができたとみなす ) までの時間を比べる。 どちらも先読みを頼む前から計る。
+  ( 他のプロセスがマップしているページは追い出せないので、 libc などは常に warm になる )
+
   TODO：
   fork_and_exec したときの SIGCHLD の取扱を追加するべき。
  */
@@ -18,7 +29,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/resource.h>
 #include "verify.h"
+#include "procspawn.h"
+#include "warmup.h"
 
 #if ( _POSIX_C_SOURCE < 200809L )
 #error you must use compiler option -D_XOPEN_SOURCE=700
@@ -70,6 +85,15 @@ int fcntl_set_close_exec( int fd );
  */
 int fdperror( int fd ,int errnum ,const char* msg );
 
+/**
+   procspawn.c のバックエンド毎の起動の速さを、 RSS を 16MiB から 4 倍ずつ max_megabytes まで
+   増やしながら計って、標準出力に表にする。
+   call_us は proc_spawn が戻るまでの時間 ( 親が止まっている時間 ) ,
+   cycle_us は子プロセスを回収するまでの時間
+   @return 成功した場合は EXIT_SUCCESS
+ */
+static int spawn_bench( size_t max_megabytes , unsigned long count );
+
 /************************************************
  * 実装
  ************************************************/
@@ -558,6 +582,141 @@ int fork_and_execvp( const char* path , char* const argv[] )
 #endif /* 0 */
 
 
+/** 現在時刻をマイクロ秒で返す */
+static double spawn_bench_now( void )
+{
+  struct timespec ts = {0};
+  VERIFY( 0 == clock_gettime( CLOCK_MONOTONIC , &ts ) );
+  return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+}
+
+static int spawn_bench( size_t max_megabytes , unsigned long count )
+{
+  const int null_out = open( "/dev/null" , O_WRONLY | O_CLOEXEC );
+  if( -1 == null_out ){
+    perror( "open( \"/dev/null\" )" );
+    return EXIT_FAILURE;
+  }
+  char* argv[] = { "/bin/true" , NULL };
+  const struct proc_spawn_request request = { argv[0] , argv , null_out , null_out , NULL , NULL , 0 , NULL , NULL , 0 , -1 };
+
+  /* RSS を増やすために確保して書き込んだ領域 */
+  char** ballast = NULL;
+  size_t ballast_count = 0;
+  size_t ballast_megabytes = 0;
+  int result = EXIT_SUCCESS;
+
+  printf( "%-11s %8s %10s %10s\n" , "backend" , "rss_MiB" , "call_us" , "cycle_us" );
+  for( size_t megabytes = 0 ; megabytes <= max_megabytes && EXIT_SUCCESS == result ;
+       megabytes = ( 0 == megabytes ) ? 16 : megabytes * 4 ){
+    if( ballast_megabytes < megabytes ){
+      const size_t size = ( megabytes - ballast_megabytes ) * 1024 * 1024;
+      char** const grown = realloc( ballast , sizeof( char* ) * ( ballast_count + 1 ) );
+      char* const chunk = malloc( size );
+      if( NULL == grown || NULL == chunk ){
+        perror( "malloc()" );
+        free( chunk );
+        if( grown ){
+          ballast = grown;
+        }
+        result = EXIT_FAILURE;
+        break;
+      }
+      memset( chunk , 1 , size );
+      ballast = grown;
+      ballast[ballast_count++] = chunk;
+      ballast_megabytes = megabytes;
+    }
+    struct rusage usage = {{0}};
+    VERIFY( 0 == getrusage( RUSAGE_SELF , &usage ) );
+
+    for( int b = 0 ; b < PROC_SPAWN_BACKEND_COUNT ; ++b ){
+      const enum proc_spawn_backend backend = (enum proc_spawn_backend)b;
+      if( !proc_spawn_backend_available( backend ) ){
+        printf( "%-11s %8ld %10s\n" , proc_spawn_backend_name( backend ) , usage.ru_maxrss / 1024 , "n/a" );
+        continue;
+      }
+      double call_total = 0;
+      const double start = spawn_bench_now();
+      for( unsigned long i = 0 ; i < count ; ++i ){
+        const double before = spawn_bench_now();
+        const pid_t pid = proc_spawn( backend , &request );
+        call_total += spawn_bench_now() - before;
+        if( -1 == pid ){
+          perror( "proc_spawn()" );
+          result = EXIT_FAILURE;
+          break;
+        }
+        int status = 0;
+        VERIFY( pid == waitpid( pid , &status , 0 ) );
+      }
+      const double elapsed = spawn_bench_now() - start;
+      printf( "%-11s %8ld %10.1f %10.1f\n" , proc_spawn_backend_name( backend ) , usage.ru_maxrss / 1024 ,
+              call_total / (double)count , elapsed / (double)count );
+      fflush( stdout );
+    }
+  }
+
+  for( size_t i = 0 ; i < ballast_count ; ++i ){
+    free( ballast[i] );
+  }
+  free( ballast );
+  VERIFY( 0 == close( null_out ) );
+  return result;
+}
+
+static int warmup_bench( unsigned long count , char* const argv[] )
+{
+  const int null_out = open( "/dev/null" , O_WRONLY | O_CLOEXEC );
+  if( -1 == null_out ){
+    perror( "open( \"/dev/null\" )" );
+    return EXIT_FAILURE;
+  }
+  const struct proc_spawn_request request = { argv[0] , argv , null_out , null_out , NULL , NULL , 0 , NULL , NULL , 0 , -1 };
+  const char* const paths[] = { argv[0] };
+  int result = EXIT_SUCCESS;
+
+  printf( "%-5s %6s %10s %10s %10s %10s\n" , "mode" , "files" , "MiB" , "warmup_us" , "exec_us" , "ready_us" );
+  for( int warm = 0 ; warm < 2 && EXIT_SUCCESS == result ; ++warm ){
+    struct exec_warmup_stats stats = {0};
+    double warmup_total = 0 , exec_total = 0 , ready_total = 0;
+    for( unsigned long i = 0 ; i < count ; ++i ){
+      if( 0 != exec_warmup( paths , 1 , EXEC_WARMUP_EVICT , &stats ) ){
+        perror( "exec_warmup( EXEC_WARMUP_EVICT )" );
+        result = EXIT_FAILURE;
+        break;
+      }
+      const double start = spawn_bench_now();
+      if( warm && 0 != exec_warmup( paths , 1 , 0 , &stats ) ){
+        perror( "exec_warmup()" );
+        result = EXIT_FAILURE;
+        break;
+      }
+      const double warmed = spawn_bench_now();
+      const pid_t pid = proc_spawn( proc_spawn_default_backend() , &request );
+      const double execed = spawn_bench_now();
+      if( -1 == pid ){
+        perror( "proc_spawn()" );
+        result = EXIT_FAILURE;
+        break;
+      }
+      int status = 0;
+      VERIFY( pid == waitpid( pid , &status , 0 ) );
+      ready_total += spawn_bench_now() - start;
+      warmup_total += warmed - start;
+      exec_total += execed - start;
+    }
+    if( EXIT_SUCCESS == result ){
+      printf( "%-5s %6zu %10.1f %10.1f %10.1f %10.1f\n" , ( warm ) ? "warm" : "cold" , stats.files ,
+              (double)stats.bytes / ( 1024.0 * 1024.0 ) , warmup_total / (double)count ,
+              exec_total / (double)count , ready_total / (double)count );
+      fflush( stdout );
+    }
+  }
+  VERIFY( 0 == close( null_out ) );
+  return result;
+}
+
 #include <locale.h>
 
 pid_t sample_fork_and_exec(){
@@ -570,6 +729,24 @@ int main(int argc , char* argv[] )
 {
   VERIFY( NULL != setlocale(LC_ALL , ""  ) );
 
+  if( 1 < argc && 0 == strcmp( argv[1] , "bench" ) ){
+    const size_t max_megabytes = ( 2 < argc ) ? strtoul( argv[2] , NULL , 10 ) : 1024;
+    const unsigned long count = ( 3 < argc ) ? strtoul( argv[3] , NULL , 10 ) : 200;
+    if( 0 == count ){
+      fprintf( stderr , "usage: %s bench [max_MiB] [count]\n" , argv[0] );
+      return EXIT_FAILURE;
+    }
+    return spawn_bench( max_megabytes , count );
+  }
+  if( 1 < argc && 0 == strcmp( argv[1] , "warmbench" ) ){
+    const unsigned long count = ( 2 < argc ) ? strtoul( argv[2] , NULL , 10 ) : 0;
+    if( 0 == count || argc < 4 || NULL == strchr( argv[3] , '/' ) ){
+      fprintf( stderr , "usage: %s warmbench count /path/to/program [args...]\n" , argv[0] );
+      return EXIT_FAILURE;
+    }
+    return warmup_bench( count , &argv[3] );
+  }
+
   printf( "sysconf( _SC_VERSION )       = %ldL (%ld)\n" ,sysconf( _SC_VERSION) , _POSIX_VERSION );
   printf( "sysconf( _SC_XOPEN_VERSION ) = %ldL \n" , sysconf( _SC_XOPEN_VERSION ) );
   VERIFY( 0 == fdperror( STDERR_FILENO , 0 , "fdperror()" ) );
@@ -0,0 +1,219 @@
+﻿/**
+   linesplit の改行の検索と重要度の推定の速さを計るベンチマーク
+
+   linebench [MiB] [回数]
+
+   ログらしい四種類のデータを作り、それぞれを全ての実装で行に分けて、
+   一秒当たりのバイト数と、一行当たりの時間を比べる。
+
+   short  : "ok 123" のような 8 から 32 バイトの行
+   app    : 時刻 level [スレッド名] メッセージ の 100 バイト前後の行
+   access : HTTP サーバのアクセスログ形式の 200 バイト前後の行
+   json   : 400 から 700 バイトの JSON の行
+
+   最後に、 app のデータで linesplit_classify の速さと、推定した level の内訳を出力する。
+   全ての実装の行数が一致しない場合は、 EXIT_FAILURE で終了する。
+ */
+
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif /* defined(HAVE_CONFIG_H) */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <syslog.h>
+#include <assert.h>
+
+#include "verify.h"
+#include "linesplit.h"
+
+#if ( _POSIX_C_SOURCE < 200809L )
+#error you must use compiler option -D_XOPEN_SOURCE=700
+#endif /* ( _POSIX_C_SOURCE < 200809L ) */
+
+/** 作ったデータ */
+struct linebench_corpus{
+  const char* name;
+  char* data;
+  size_t size;
+  unsigned long lines;
+};
+
+/** 現在時刻を秒で返す */
+static double linebench_now( void )
+{
+  struct timespec ts = {0};
+  VERIFY( 0 == clock_gettime( CLOCK_MONOTONIC , &ts ) );
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/** 再現できる擬似乱数 ( xorshift64 ) */
+static unsigned long long linebench_random( unsigned long long* state )
+{
+  unsigned long long x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+  return x;
+}
+
+/**
+   size バイトを超えるまで、 kind の行を作る
+   @return 成功した場合は 0
+*/
+static int linebench_generate( struct linebench_corpus* corpus , const char* kind , size_t size )
+{
+  static const char* const levels[] = { "INFO" , "INFO" , "INFO" , "INFO" , "INFO" , "INFO" , "INFO" ,
+                                        "DEBUG" , "DEBUG" , "WARN" , "WARN" , "ERROR" };
+  static const char* const paths[] = { "/" , "/api/v1/items" , "/api/v1/items/42/comments" ,
+                                       "/static/js/app.min.js" , "/healthz" , "/login?next=%2Fdashboard" };
+  corpus->name = kind;
+  corpus->data = malloc( size + 4096 );
+  corpus->size = 0;
+  corpus->lines = 0;
+  if( NULL == corpus->data ){
+    perror( "malloc()" );
+    return -1;
+  }
+  unsigned long long state = 0x9e3779b97f4a7c15ULL;
+  while( corpus->size < size ){
+    char* const out = corpus->data + corpus->size;
+    const size_t room = size + 4096 - corpus->size;
+    const unsigned long long r = linebench_random( &state );
+    int length = 0;
+    if( 0 == strcmp( kind , "short" ) ){
+      length = snprintf( out , room , "ok %.*s\n" , (int)( r % 26 ) + 1 , "12345678901234567890123456789" );
+    }else if( 0 == strcmp( kind , "app" ) ){
+      length = snprintf( out , room , "2026-10-17T12:%02u:%02u.%03uZ %-5s [worker-%u] request handled "
+                         "path=%s status=%u duration_ms=%u\n" ,
+                         (unsigned)( r % 60 ) , (unsigned)( ( r >> 8 ) % 60 ) , (unsigned)( ( r >> 16 ) % 1000 ) ,
+                         levels[ ( r >> 26 ) % ( sizeof( levels ) / sizeof( levels[0] ) ) ] ,
+                         (unsigned)( ( r >> 30 ) % 16 ) , paths[ ( r >> 34 ) % ( sizeof( paths ) / sizeof( paths[0] ) ) ] ,
+                         ( 0 == ( r >> 40 ) % 20 ) ? 500u : 200u , (unsigned)( ( r >> 44 ) % 2000 ) );
+    }else if( 0 == strcmp( kind , "access" ) ){
+      length = snprintf( out , room , "10.%u.%u.%u - - [17/Oct/2026:12:%02u:%02u +0900] \"GET %s HTTP/1.1\" %u %u "
+                         "\"https://example.com/\" \"Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+                         "(KHTML, like Gecko) Chrome/120.0 Safari/537.36\"\n" ,
+                         (unsigned)( r & 0xff ) , (unsigned)( ( r >> 8 ) & 0xff ) , (unsigned)( ( r >> 16 ) & 0xff ) ,
+                         (unsigned)( ( r >> 24 ) % 60 ) , (unsigned)( ( r >> 30 ) % 60 ) ,
+                         paths[ ( r >> 36 ) % ( sizeof( paths ) / sizeof( paths[0] ) ) ] ,
+                         ( 0 == ( r >> 40 ) % 20 ) ? 404u : 200u , (unsigned)( ( r >> 44 ) % 100000 ) );
+    }else{
+      const int payload = (int)( r % 300 ) + 200;
+      length = snprintf( out , room , "{\"ts\":\"2026-10-17T12:%02u:%02uZ\",\"level\":\"%s\",\"msg\":\"batch processed\","
+                         "\"batch\":%u,\"payload\":\"%.*s\"}\n" ,
+                         (unsigned)( r % 60 ) , (unsigned)( ( r >> 8 ) % 60 ) ,
+                         levels[ ( r >> 26 ) % ( sizeof( levels ) / sizeof( levels[0] ) ) ] ,
+                         (unsigned)( ( r >> 30 ) % 100000 ) , payload ,
+                         "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789abcdefghijklmnopqrstuvwxyz"
+                         "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789abcdefghijklmnopqrstuvwxyz"
+                         "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789abcdefghijklmnopqrstuvwxyz"
+                         "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789abcdefghijklmnopqrstuvwxyz"
+                         "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789abcdefghijklmnopqrstuvwxyz" );
+    }
+    VERIFY( 0 < length && (size_t)length < room );
+    corpus->size += (size_t)length;
+    ++(corpus->lines);
+  }
+  return 0;
+}
+
+/**
+   finder でデータを行に分ける
+   @return 見つけた行数
+*/
+static unsigned long linebench_split( linesplit_finder finder , const char* data , size_t size )
+{
+  unsigned long lines = 0;
+  const char* p = data;
+  const char* const end = data + size;
+  while( p < end ){
+    const char* const newline = finder( p , (size_t)( end - p ) );
+    if( NULL == newline ){
+      break;
+    }
+    ++lines;
+    p = newline + 1;
+  }
+  return lines;
+}
+
+int main( int argc , char* argv[] )
+{
+  const size_t megabytes = ( 1 < argc ) ? strtoul( argv[1] , NULL , 10 ) : 16;
+  const unsigned long repeat = ( 2 < argc ) ? strtoul( argv[2] , NULL , 10 ) : 10;
+  if( 0 == megabytes || 0 == repeat ){
+    fprintf( stderr , "usage: %s [MiB] [repeat]\n" , argv[0] );
+    return EXIT_FAILURE;
+  }
+
+  static const char* const kinds[] = { "short" , "app" , "access" , "json" };
+  struct linebench_corpus corpora[ sizeof( kinds ) / sizeof( kinds[0] ) ];
+  for( size_t i = 0 ; i < sizeof( kinds ) / sizeof( kinds[0] ) ; ++i ){
+    if( linebench_generate( &corpora[i] , kinds[i] , megabytes * 1024 * 1024 ) ){
+      return EXIT_FAILURE;
+    }
+  }
+
+  printf( "default kernel : %s\n" , linesplit_kernel_name( linesplit_default_kernel() ) );
+  printf( "%-7s %8s %-7s %10s %10s\n" , "corpus" , "avg_line" , "kernel" , "GiB/s" , "ns/line" );
+  int mismatch = 0;
+  for( size_t i = 0 ; i < sizeof( kinds ) / sizeof( kinds[0] ) ; ++i ){
+    const struct linebench_corpus* const corpus = &corpora[i];
+    for( int k = 0 ; k < LINESPLIT_KERNEL_COUNT ; ++k ){
+      const linesplit_finder finder = linesplit_kernel_finder( (enum linesplit_kernel)k );
+      if( NULL == finder ){
+        printf( "%-7s %8.1f %-7s %10s\n" , corpus->name , (double)corpus->size / (double)corpus->lines ,
+                linesplit_kernel_name( (enum linesplit_kernel)k ) , "n/a" );
+        continue;
+      }
+      unsigned long lines = 0;
+      const double start = linebench_now();
+      for( unsigned long r = 0 ; r < repeat ; ++r ){
+        lines += linebench_split( finder , corpus->data , corpus->size );
+      }
+      const double elapsed = linebench_now() - start;
+      mismatch |= ( lines != corpus->lines * repeat );
+      printf( "%-7s %8.1f %-7s %10.2f %10.2f%s\n" , corpus->name , (double)corpus->size / (double)corpus->lines ,
+              linesplit_kernel_name( (enum linesplit_kernel)k ) ,
+              (double)corpus->size * (double)repeat / elapsed / ( 1024.0 * 1024.0 * 1024.0 ) ,
+              elapsed * 1e9 / (double)( corpus->lines * repeat ) ,
+              ( lines != corpus->lines * repeat ) ? "  LINE COUNT MISMATCH" : "" );
+    }
+  }
+
+  /* app のデータで、行に分けながら重要度を推定する */
+  {
+    const struct linebench_corpus* const corpus = &corpora[1];
+    unsigned long counts[9] = {0};
+    const double start = linebench_now();
+    for( unsigned long r = 0 ; r < repeat ; ++r ){
+      const char* p = corpus->data;
+      const char* const end = corpus->data + corpus->size;
+      while( p < end ){
+        const char* const newline = linesplit_find_newline( p , (size_t)( end - p ) );
+        if( NULL == newline ){
+          break;
+        }
+        ++counts[ linesplit_classify( p , (size_t)( newline - p ) ) + 1 ];
+        p = newline + 1;
+      }
+    }
+    const double elapsed = linebench_now() - start;
+    printf( "split+classify app : %.2f ns/line\n" , elapsed * 1e9 / (double)( corpus->lines * repeat ) );
+    static const char* const names[] = { "none" , "emerg" , "alert" , "crit" , "err" , "warning" , "notice" , "info" , "debug" };
+    for( size_t i = 0 ; i < sizeof( names ) / sizeof( names[0] ) ; ++i ){
+      if( counts[i] ){
+        printf( "  %-8s %5.1f%%\n" , names[i] , 100.0 * (double)counts[i] / (double)( corpus->lines * repeat ) );
+      }
+    }
+  }
+
+  for( size_t i = 0 ; i < sizeof( kinds ) / sizeof( kinds[0] ) ; ++i ){
+    free( corpora[i].data );
+  }
+  return mismatch ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,367 @@
+﻿/**
+   ターゲットプロセスの出力を行に分けて、行の重要度を推定する
+
+   SSE2 と AVX2 の実装は、 __attribute__(( target )) でその関数だけを各命令セット向けに
+   コンパイルするので、コンパイラのオプションは変えずに済む。
+   どれを使うかは、最初の呼び出しで __builtin_cpu_supports を見て決める。
+   ( 一つのスレッドで動くので、選んだ結果の保存に排他は要らない )
+ */
+
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif /* defined(HAVE_CONFIG_H) */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <assert.h>
+
+#if defined( HAVE_IMMINTRIN_H ) && defined( __GNUC__ ) && ( defined( __x86_64__ ) || defined( __i386__ ) )
+#define LINESPLIT_X86 1
+#include <immintrin.h>
+#endif /* defined( HAVE_IMMINTRIN_H ) && defined( __GNUC__ ) && ( defined( __x86_64__ ) || defined( __i386__ ) ) */
+
+#include "linesplit.h"
+
+/** 一バイトずつ調べる */
+static const char* linesplit_find_scalar( const char* data , size_t size );
+
+/** libc の memchr(3) */
+static const char* linesplit_find_memchr( const char* data , size_t size );
+
+#if defined( LINESPLIT_X86 )
+/** 16 バイトずつ SSE2 で調べる */
+static const char* linesplit_find_sse2( const char* data , size_t size );
+
+/** 64 バイト ( 32 バイトを二つ ) ずつ AVX2 で調べる */
+static const char* linesplit_find_avx2( const char* data , size_t size );
+#endif /* defined( LINESPLIT_X86 ) */
+
+/**
+   重要度を表す語 ( 前後の記号を除いたもの ) から、 syslog の level を返す
+   @return 重要度を表す語でない場合は -1
+   @param strict 一文字の語 ( "E" など ) を認めるかどうか ( [] で囲まれていた場合 )
+*/
+static int linesplit_classify_word( const char* word , size_t length , int strict );
+
+/**
+   LINESPLIT_CLASSIFY_BYTES ( 64 ) バイトの block の中の、空白 ( ' ' と '\t' ) と '=' の位置を
+   ビットの並びにする ( i バイト目が i ビット目 )
+   x86 では SSE2 で 16 バイトずつ比べる。
+*/
+static void linesplit_scan_block( const char* block , uint64_t* spaces , uint64_t* equals );
+
+/************************* 実装 **************************/
+
+/** 選んだ実装 最初の呼び出しまでは NULL */
+static linesplit_finder linesplit_selected = NULL;
+static enum linesplit_kernel linesplit_selected_kernel = LINESPLIT_KERNEL_MEMCHR;
+
+const char* linesplit_kernel_name( enum linesplit_kernel kernel )
+{
+  switch( kernel ){
+  case LINESPLIT_KERNEL_SCALAR: return "scalar";
+  case LINESPLIT_KERNEL_MEMCHR: return "memchr";
+  case LINESPLIT_KERNEL_SSE2: return "sse2";
+  case LINESPLIT_KERNEL_AVX2: return "avx2";
+  default: return "unknown";
+  }
+}
+
+int linesplit_kernel_available( enum linesplit_kernel kernel )
+{
+  switch( kernel ){
+  case LINESPLIT_KERNEL_SCALAR:
+  case LINESPLIT_KERNEL_MEMCHR:
+    return 1;
+#if defined( LINESPLIT_X86 )
+  case LINESPLIT_KERNEL_SSE2:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports( "sse2" ) ? 1 : 0;
+  case LINESPLIT_KERNEL_AVX2:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports( "avx2" ) ? 1 : 0;
+#endif /* defined( LINESPLIT_X86 ) */
+  default:
+    return 0;
+  }
+}
+
+enum linesplit_kernel linesplit_default_kernel( void )
+{
+  if( NULL == linesplit_selected ){
+    /* 短い行では、 memchr(3) の呼び出しの準備の分だけ、自前の SIMD の方が速い */
+    static const enum linesplit_kernel preferred[] = { LINESPLIT_KERNEL_AVX2 , LINESPLIT_KERNEL_SSE2 ,
+                                                       LINESPLIT_KERNEL_MEMCHR };
+    for( size_t i = 0 ; i < sizeof( preferred ) / sizeof( preferred[0] ) ; ++i ){
+      if( linesplit_kernel_available( preferred[i] ) ){
+        linesplit_selected_kernel = preferred[i];
+        break;
+      }
+    }
+    linesplit_selected = linesplit_kernel_finder( linesplit_selected_kernel );
+    assert( linesplit_selected );
+  }
+  return linesplit_selected_kernel;
+}
+
+const char* linesplit_find_newline( const char* data , size_t size )
+{
+  if( NULL == linesplit_selected ){
+    (void)linesplit_default_kernel();
+  }
+  return linesplit_selected( data , size );
+}
+
+linesplit_finder linesplit_kernel_finder( enum linesplit_kernel kernel )
+{
+  if( !linesplit_kernel_available( kernel ) ){
+    return NULL;
+  }
+  switch( kernel ){
+  case LINESPLIT_KERNEL_SCALAR: return linesplit_find_scalar;
+  case LINESPLIT_KERNEL_MEMCHR: return linesplit_find_memchr;
+#if defined( LINESPLIT_X86 )
+  case LINESPLIT_KERNEL_SSE2: return linesplit_find_sse2;
+  case LINESPLIT_KERNEL_AVX2: return linesplit_find_avx2;
+#endif /* defined( LINESPLIT_X86 ) */
+  default: return NULL;
+  }
+}
+
+static const char* linesplit_find_scalar( const char* data , size_t size )
+{
+  for( size_t i = 0 ; i < size ; ++i ){
+    if( '\n' == data[i] ){
+      return data + i;
+    }
+  }
+  return NULL;
+}
+
+static const char* linesplit_find_memchr( const char* data , size_t size )
+{
+  return memchr( data , '\n' , size );
+}
+
+#if defined( LINESPLIT_X86 )
+__attribute__(( target( "sse2" ) ))
+static const char* linesplit_find_sse2( const char* data , size_t size )
+{
+  const __m128i newline = _mm_set1_epi8( '\n' );
+  size_t i = 0;
+  for( ; i + 16 <= size ; i += 16 ){
+    const __m128i chunk = _mm_loadu_si128( (const __m128i*)( data + i ) );
+    const unsigned int mask = (unsigned int)_mm_movemask_epi8( _mm_cmpeq_epi8( chunk , newline ) );
+    if( mask ){
+      return data + i + (size_t)__builtin_ctz( mask );
+    }
+  }
+  return linesplit_find_scalar( data + i , size - i );
+}
+
+__attribute__(( target( "avx2" ) ))
+static const char* linesplit_find_avx2( const char* data , size_t size )
+{
+  const __m256i newline = _mm256_set1_epi8( '\n' );
+  size_t i = 0;
+  /* 短い行が多いので、最初の 32 バイトは一つだけ調べる */
+  if( 32 <= size ){
+    const __m256i chunk = _mm256_loadu_si256( (const __m256i*)data );
+    const unsigned int mask = (unsigned int)_mm256_movemask_epi8( _mm256_cmpeq_epi8( chunk , newline ) );
+    if( mask ){
+      return data + (size_t)__builtin_ctz( mask );
+    }
+    i = 32;
+  }
+  for( ; i + 64 <= size ; i += 64 ){
+    const __m256i low = _mm256_cmpeq_epi8( _mm256_loadu_si256( (const __m256i*)( data + i ) ) , newline );
+    const __m256i high = _mm256_cmpeq_epi8( _mm256_loadu_si256( (const __m256i*)( data + i + 32 ) ) , newline );
+    if( !_mm256_testz_si256( _mm256_or_si256( low , high ) , _mm256_or_si256( low , high ) ) ){
+      const unsigned int low_mask = (unsigned int)_mm256_movemask_epi8( low );
+      if( low_mask ){
+        return data + i + (size_t)__builtin_ctz( low_mask );
+      }
+      return data + i + 32 + (size_t)__builtin_ctz( (unsigned int)_mm256_movemask_epi8( high ) );
+    }
+  }
+  for( ; i + 32 <= size ; i += 32 ){
+    const __m256i chunk = _mm256_loadu_si256( (const __m256i*)( data + i ) );
+    const unsigned int mask = (unsigned int)_mm256_movemask_epi8( _mm256_cmpeq_epi8( chunk , newline ) );
+    if( mask ){
+      return data + i + (size_t)__builtin_ctz( mask );
+    }
+  }
+  return linesplit_find_sse2( data + i , size - i );
+}
+#endif /* defined( LINESPLIT_X86 ) */
+
+static int linesplit_classify_word( const char* word , size_t length , int strict )
+{
+#define LINESPLIT_WORD( name , level ) { name , sizeof( name ) - 1 , level }
+  static const struct { const char* name; size_t length; int level; } words[] = {
+    LINESPLIT_WORD( "info" , LOG_INFO ) , LINESPLIT_WORD( "debug" , LOG_DEBUG ) ,
+    LINESPLIT_WORD( "warn" , LOG_WARNING ) , LINESPLIT_WORD( "warning" , LOG_WARNING ) ,
+    LINESPLIT_WORD( "error" , LOG_ERR ) , LINESPLIT_WORD( "err" , LOG_ERR ) ,
+    LINESPLIT_WORD( "notice" , LOG_NOTICE ) , LINESPLIT_WORD( "trace" , LOG_DEBUG ) ,
+    LINESPLIT_WORD( "fatal" , LOG_CRIT ) , LINESPLIT_WORD( "crit" , LOG_CRIT ) ,
+    LINESPLIT_WORD( "critical" , LOG_CRIT ) , LINESPLIT_WORD( "alert" , LOG_ALERT ) ,
+    LINESPLIT_WORD( "emerg" , LOG_EMERG ) , LINESPLIT_WORD( "emergency" , LOG_EMERG ) ,
+    LINESPLIT_WORD( "panic" , LOG_EMERG )
+  };
+#undef LINESPLIT_WORD
+  if( 1 == length ){
+    if( !strict ){
+      return -1;
+    }
+    switch( word[0] ){
+    case 'F': case 'C': return LOG_CRIT;
+    case 'E': return LOG_ERR;
+    case 'W': return LOG_WARNING;
+    case 'N': return LOG_NOTICE;
+    case 'I': return LOG_INFO;
+    case 'D': case 'T': return LOG_DEBUG;
+    default: return -1;
+    }
+  }
+  if( length < 3 || 9 < length ){
+    return -1;
+  }
+  /* ロケールに依存しないように、 ASCII だけを小文字にして比べる ( 多く現れる順に並べてある ) */
+  char lower[10];
+  for( size_t i = 0 ; i < length ; ++i ){
+    const char c = word[i];
+    lower[i] = ( 'A' <= c && c <= 'Z' ) ? (char)( c - 'A' + 'a' ) : c;
+  }
+  for( size_t i = 0 ; i < sizeof( words ) / sizeof( words[0] ) ; ++i ){
+    if( length == words[i].length && lower[0] == words[i].name[0] &&
+        0 == memcmp( lower , words[i].name , length ) ){
+      return words[i].level;
+    }
+  }
+  return -1;
+}
+
+int linesplit_classify( const char* line , size_t length )
+{
+  assert( line );
+  /* sd-daemon(3) の "<3>" 形式 */
+  if( 3 <= length && '<' == line[0] && '0' <= line[1] && line[1] <= '7' && '>' == line[2] ){
+    return line[1] - '0';
+  }
+  /* glog の "E0102 12:34:56.789012 ..." 形式 */
+  if( 5 <= length && NULL != memchr( "FEWI" , line[0] , 4 ) &&
+      '0' <= line[1] && line[1] <= '1' && '0' <= line[2] && line[2] <= '9' &&
+      '0' <= line[3] && line[3] <= '3' && '0' <= line[4] && line[4] <= '9' &&
+      ( 5 == length || ' ' == line[5] ) ){
+    return linesplit_classify_word( line , 1 , 1 );
+  }
+
+  /* 先頭の 64 バイトの空白と '=' の位置を一度に調べて、語の区切りはビット演算で求める
+     短い行は空白で埋めた写しを使う ( 行の後ろを読まないように ) */
+  char copy[LINESPLIT_CLASSIFY_BYTES];
+  if( length < LINESPLIT_CLASSIFY_BYTES ){
+    memcpy( copy , line , length );
+    memset( copy + length , ' ' , LINESPLIT_CLASSIFY_BYTES - length );
+    line = copy;
+  }
+  uint64_t spaces = 0;
+  uint64_t equals = 0;
+  linesplit_scan_block( line , &spaces , &equals );
+  uint64_t words = ~spaces;
+  for( int token = 0 ; token < LINESPLIT_CLASSIFY_TOKENS && 0 != words ; ++token ){
+    size_t begin = (size_t)__builtin_ctzll( words );
+    const uint64_t after = spaces >> begin;
+    size_t end = ( 0 == after ) ? LINESPLIT_CLASSIFY_BYTES : begin + (size_t)__builtin_ctzll( after );
+    const uint64_t range = ( ( LINESPLIT_CLASSIFY_BYTES <= end ) ? ~(uint64_t)0 : ( ( (uint64_t)1 << end ) - 1 ) ) &
+      ~( ( (uint64_t)1 << begin ) - 1 );
+    words &= ~range;
+    const int has_equal = ( 0 != ( equals & range ) );
+
+    /* "[ERROR]" "(W)" "ERROR:" "level=error" の前後を取り除く */
+    int bracketed = 0;
+    if( '[' == line[begin] || '(' == line[begin] ){
+      ++begin;
+      bracketed = 1;
+    }
+    int marked = bracketed;
+    while( begin < end && ( ']' == line[end - 1] || ')' == line[end - 1] ||
+                            ':' == line[end - 1] || ',' == line[end - 1] ) ){
+      marked |= ( ':' == line[end - 1] );
+      --end;
+    }
+    const char* const equal = has_equal ? memchr( line + begin , '=' , end - begin ) : NULL;
+    if( equal ){
+      static const char* const keys[] = { "level" , "lvl" , "severity" };
+      const size_t key_length = (size_t)( equal - ( line + begin ) );
+      int known = 0;
+      for( size_t i = 0 ; i < sizeof( keys ) / sizeof( keys[0] ) ; ++i ){
+        known |= ( key_length == strlen( keys[i] ) && 0 == memcmp( line + begin , keys[i] , key_length ) );
+      }
+      if( !known ){
+        continue;
+      }
+      begin += key_length + 1;
+      if( begin < end && '"' == line[begin] ){
+        ++begin;
+      }
+      if( begin < end && '"' == line[end - 1] ){
+        --end;
+      }
+      marked = 1;
+    }
+    if( end <= begin ){
+      continue;
+    }
+
+    /* 二つ目以降の語は、普通の文章の "info" などと区別できる場合だけ印とみなす */
+    if( 0 < token && !marked ){
+      int upper = 1;
+      for( size_t i = begin ; i < end && upper ; ++i ){
+        upper = ( 'A' <= line[i] && line[i] <= 'Z' );
+      }
+      if( !upper ){
+        continue;
+      }
+    }
+    const int level = linesplit_classify_word( line + begin , end - begin , bracketed );
+    if( 0 <= level ){
+      return level;
+    }
+  }
+  return -1;
+}
+
+static void linesplit_scan_block( const char* block , uint64_t* spaces , uint64_t* equals )
+{
+  assert( block );
+  assert( spaces );
+  assert( equals );
+#if defined( __SSE2__ ) && defined( LINESPLIT_X86 )
+  const __m128i space = _mm_set1_epi8( ' ' );
+  const __m128i tab = _mm_set1_epi8( '\t' );
+  const __m128i equal = _mm_set1_epi8( '=' );
+  uint64_t space_bits = 0;
+  uint64_t equal_bits = 0;
+  for( int i = 0 ; i < LINESPLIT_CLASSIFY_BYTES / 16 ; ++i ){
+    const __m128i chunk = _mm_loadu_si128( (const __m128i*)( block + i * 16 ) );
+    const unsigned s = (unsigned)_mm_movemask_epi8( _mm_or_si128( _mm_cmpeq_epi8( chunk , space ) ,
+                                                                   _mm_cmpeq_epi8( chunk , tab ) ) );
+    const unsigned e = (unsigned)_mm_movemask_epi8( _mm_cmpeq_epi8( chunk , equal ) );
+    space_bits |= (uint64_t)s << ( i * 16 );
+    equal_bits |= (uint64_t)e << ( i * 16 );
+  }
+  *spaces = space_bits;
+  *equals = equal_bits;
+#else /* defined( __SSE2__ ) && defined( LINESPLIT_X86 ) */
+  uint64_t space_bits = 0;
+  uint64_t equal_bits = 0;
+  for( int i = 0 ; i < LINESPLIT_CLASSIFY_BYTES ; ++i ){
+    space_bits |= (uint64_t)( ' ' == block[i] || '\t' == block[i] ) << i;
+    equal_bits |= (uint64_t)( '=' == block[i] ) << i;
+  }
+  *spaces = space_bits;
+  *equals = equal_bits;
+#endif /* defined( __SSE2__ ) && defined( LINESPLIT_X86 ) */
+}
@@ -0,0 +1,82 @@
+﻿#if ! defined( LINESPLIT_H_HEADER_GUARD )
+#define LINESPLIT_H_HEADER_GUARD 1
+
+/**
+   ターゲットプロセスの出力を行に分けて、行の重要度を推定する
+
+   改行の検索は、 SSE2 と AVX2 の実装を持ち、実行時に CPU が対応している
+   一番速いものを選ぶ。 x86 以外では libc の memchr(3) を使う。
+   ( 比較用に、一バイトずつ調べる実装も持つ )
+
+   重要度の推定は、行の先頭の "ERROR" "WARN" "[E]" "level=error" "<3>" "E0102" などの
+   印を見て、 syslog の level ( LOG_ERR など ) を返す。
+   行全体は見ずに、先頭の LINESPLIT_CLASSIFY_BYTES バイトの中の、
+   LINESPLIT_CLASSIFY_TOKENS 個の語だけを調べる。
+ */
+
+#include <stddef.h>
+
+/** linesplit_classify が調べる、行の先頭のバイト数 */
+#define LINESPLIT_CLASSIFY_BYTES 64
+
+/** linesplit_classify が調べる、行の先頭の語の数 ( 時刻やスレッド名の後ろの印も拾う ) */
+#define LINESPLIT_CLASSIFY_TOKENS 3
+
+/** 改行を探す実装 */
+enum linesplit_kernel{
+  /** 一バイトずつ調べる */
+  LINESPLIT_KERNEL_SCALAR = 0,
+  /** libc の memchr(3) */
+  LINESPLIT_KERNEL_MEMCHR ,
+  /** 16 バイトずつ SSE2 で調べる */
+  LINESPLIT_KERNEL_SSE2 ,
+  /** 32 バイトずつ AVX2 で調べる */
+  LINESPLIT_KERNEL_AVX2 ,
+  LINESPLIT_KERNEL_COUNT
+};
+
+/**
+   改行を探す関数
+   @return data から size バイトの中で、最初の '\n' の位置 見つからない場合は NULL
+*/
+typedef const char* (*linesplit_finder)( const char* data , size_t size );
+
+/**
+   実装の名前を返す
+*/
+const char* linesplit_kernel_name( enum linesplit_kernel kernel );
+
+/**
+   実装がこの CPU で使えるかどうか
+   @return 使える場合は 1 そうでない場合は 0
+*/
+int linesplit_kernel_available( enum linesplit_kernel kernel );
+
+/**
+   linesplit_find_newline が使う実装を返す
+   最初に呼ばれた時に、使える中で一番速いものを選ぶ。
+*/
+enum linesplit_kernel linesplit_default_kernel( void );
+
+/**
+   data から size バイトの中で、最初の '\n' を探す
+   @return 見つかった '\n' の位置 見つからない場合は NULL
+*/
+const char* linesplit_find_newline( const char* data , size_t size );
+
+/**
+   指定した実装の関数を返す ( ベンチマーク用 )
+   @return この CPU で使えない場合は NULL
+*/
+linesplit_finder linesplit_kernel_finder( enum linesplit_kernel kernel );
+
+/**
+   行の先頭の印から、重要度を推定する
+   最初の語は大文字小文字を問わない。 二つ目以降の語は、全て大文字であるか、
+   [] で囲まれているか、 "level=" などが付いている場合だけ印とみなす。
+   @return syslog の level ( LOG_EMERG から LOG_DEBUG ) 印が無い場合は -1
+   @param line 改行を含まない一行
+*/
+int linesplit_classify( const char* line , size_t length );
+
+#endif /* LINESPLIT_H_HEADER_GUARD */
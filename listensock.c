@@ -0,0 +1,173 @@
+﻿/**
+   コントロールプロセスが待ち受けて、サービスへ渡すソケット ( socket activation )
+ */
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif /* defined(HAVE_CONFIG_H) */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <assert.h>
+
+#include "verify.h"
+#include "listensock.h"
+
+/**
+   unix ドメインのストリームソケットを作成して、 path で待ち受ける
+   @return 成功した場合はソケットの fd 失敗した場合は -1 ( 理由は標準エラー出力に出力済み )
+ */
+static int listen_socket_open_unix( const char* path , int backlog );
+
+/**
+   TCP のソケットを作成して、 "[host]:port" もしくは "port" で待ち受ける
+   getaddrinfo(3) の結果を順に試して、最初に bind(2) できたものを使う。
+   @return 成功した場合はソケットの fd 失敗した場合は -1 ( 理由は標準エラー出力に出力済み )
+ */
+static int listen_socket_open_tcp( const char* address , int backlog );
+
+/**
+   path に、接続できない古い unix ドメインのソケットが残っていれば削除する
+   待ち受けているプロセスがいる場合や、ソケット以外のファイルは残す。 ( bind(2) が EADDRINUSE になる )
+ */
+static void listen_socket_remove_stale( const char* path );
+
+/************************* 実装 **************************/
+
+int listen_socket_open( const char* address , int backlog )
+{
+  assert( address );
+  if( backlog <= 0 ){
+    backlog = SOMAXCONN;
+  }
+  if( '/' == address[0] ){
+    return listen_socket_open_unix( address , backlog );
+  }
+  return listen_socket_open_tcp( address , backlog );
+}
+
+static void listen_socket_remove_stale( const char* path )
+{
+  struct stat st;
+  if( 0 != lstat( path , &st ) || !S_ISSOCK( st.st_mode ) ){
+    return;
+  }
+  const int fd = socket( AF_UNIX , SOCK_STREAM | SOCK_CLOEXEC , 0 );
+  if( -1 == fd ){
+    return;
+  }
+  struct sockaddr_un addr;
+  memset( &addr , 0 , sizeof( addr ) );
+  addr.sun_family = AF_UNIX;
+  memcpy( addr.sun_path , path , strlen( path ) + 1 );
+  if( -1 == connect( fd , (const struct sockaddr*)&addr , sizeof( addr ) ) && ECONNREFUSED == errno ){
+    /* 誰も待ち受けていない */
+    (void)unlink( path );
+  }
+  VERIFY( 0 == close( fd ) );
+  return;
+}
+
+static int listen_socket_open_unix( const char* path , int backlog )
+{
+  struct sockaddr_un addr;
+  memset( &addr , 0 , sizeof( addr ) );
+  if( sizeof( addr.sun_path ) <= strlen( path ) ){
+    fprintf( stderr , "%s: %s\n" , path , strerror( ENAMETOOLONG ) );
+    return -1;
+  }
+  addr.sun_family = AF_UNIX;
+  memcpy( addr.sun_path , path , strlen( path ) + 1 );
+
+  listen_socket_remove_stale( path );
+  const int fd = socket( AF_UNIX , SOCK_STREAM | SOCK_CLOEXEC , 0 );
+  if( -1 == fd ){
+    perror( "socket( AF_UNIX , SOCK_STREAM | SOCK_CLOEXEC , 0 )" );
+    return -1;
+  }
+  if( -1 == bind( fd , (const struct sockaddr*)&addr , sizeof( addr ) ) ||
+      -1 == listen( fd , backlog ) ){
+    perror( path );
+    VERIFY( 0 == close( fd ) );
+    return -1;
+  }
+  return fd;
+}
+
+static int listen_socket_open_tcp( const char* address , int backlog )
+{
+  /* "[host]:port" "host:port" ":port" "port" を host と port に分ける */
+  char* const text = strdup( address );
+  if( NULL == text ){
+    perror( "strdup()" );
+    return -1;
+  }
+  char* host = NULL;
+  char* port = text;
+  if( '[' == text[0] ){
+    char* const close_bracket = strchr( text , ']' );
+    if( NULL == close_bracket || ':' != close_bracket[1] ){
+      fprintf( stderr , "%s: invalid address\n" , address );
+      free( text );
+      return -1;
+    }
+    *close_bracket = '\0';
+    host = text + 1;
+    port = close_bracket + 2;
+  }else{
+    char* const colon = strrchr( text , ':' );
+    if( colon ){
+      *colon = '\0';
+      host = ( '\0' != text[0] && 0 != strcmp( text , "*" ) ) ? text : NULL;
+      port = colon + 1;
+    }
+  }
+  if( '\0' == *port ){
+    fprintf( stderr , "%s: port is missing\n" , address );
+    free( text );
+    return -1;
+  }
+
+  struct addrinfo hints;
+  memset( &hints , 0 , sizeof( hints ) );
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  struct addrinfo* addrs = NULL;
+  const int gai_result = getaddrinfo( host , port , &hints , &addrs );
+  free( text );
+  if( 0 != gai_result ){
+    fprintf( stderr , "%s: %s\n" , address , gai_strerror( gai_result ) );
+    return -1;
+  }
+
+  int fd = -1;
+  int err = 0;
+  for( const struct addrinfo* ai = addrs ; ai && -1 == fd ; ai = ai->ai_next ){
+    fd = socket( ai->ai_family , ai->ai_socktype | SOCK_CLOEXEC , ai->ai_protocol );
+    if( -1 == fd ){
+      err = errno;
+      continue;
+    }
+    /* 再起動した直後に TIME_WAIT の接続があっても bind(2) できるようにする */
+    const int on = 1;
+    VERIFY( 0 == setsockopt( fd , SOL_SOCKET , SO_REUSEADDR , &on , sizeof( on ) ) );
+    if( -1 == bind( fd , ai->ai_addr , ai->ai_addrlen ) || -1 == listen( fd , backlog ) ){
+      err = errno;
+      VERIFY( 0 == close( fd ) );
+      fd = -1;
+    }
+  }
+  freeaddrinfo( addrs );
+  if( -1 == fd ){
+    fprintf( stderr , "%s: %s\n" , address , strerror( err ) );
+  }
+  return fd;
+}
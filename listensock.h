@@ -0,0 +1,35 @@
+﻿#if ! defined( LISTENSOCK_H_HEADER_GUARD )
+#define LISTENSOCK_H_HEADER_GUARD 1
+
+/**
+   コントロールプロセスが待ち受けて、サービスへ渡すソケット ( socket activation )
+
+   ソケットはコントロールプロセスが持ち続けるので、サービスが再起動している間も
+   接続は accept(2) を待つキューに溜まり、クライアントの接続は拒否されない。
+   サービスへは PROC_SPAWN_PASS_FDS_START ( 3 ) から順に並べて渡し、 systemd と同じ
+   LISTEN_FDS と LISTEN_PID の環境変数で知らせる。 ( sd_listen_fds(3) がそのまま使える )
+
+   アドレスの書式 :
+     /path/to/socket        unix ドメインのストリームソケット
+     [host]:port , port     TCP ( host を省略した場合は全てのアドレス IPv6 は [::1]:port のように書く )
+ */
+
+/** サービスへ渡したソケットの数を知らせる環境変数 */
+#define LISTEN_SOCKET_FDS_ENV "LISTEN_FDS"
+
+/** ソケットを渡したプロセスの PID を知らせる環境変数 */
+#define LISTEN_SOCKET_PID_ENV "LISTEN_PID"
+
+/** ソケットの名前を知らせる環境変数 ( daemonic は設定しないが、引き継がないように取り除く ) */
+#define LISTEN_SOCKET_FDNAMES_ENV "LISTEN_FDNAMES"
+
+/**
+   address で待ち受けるソケットを作成する
+   ソケットには close-on-exec を付ける。 ( サービスへは proc_spawn の pass_fds で渡す )
+   unix ドメインのソケットのパスに、接続できない古いソケットのファイルが残っている場合は削除してから作り直す。
+   @return 成功した場合はソケットの fd 失敗した場合は -1 を返し、理由を標準エラー出力に出力する。
+   @param backlog listen(2) の backlog 0 以下の場合は SOMAXCONN
+ */
+int listen_socket_open( const char* address , int backlog );
+
+#endif /* LISTENSOCK_H_HEADER_GUARD */
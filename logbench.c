@@ -0,0 +1,428 @@
+﻿/**
+   ターゲットプロセスの出力を転送する経路の、スループットを比較するベンチマーク
+
+   logbench [行数] [一行のバイト数] [パイプの容量]
+   logbench durable [行数] [一行のバイト数] [パイプの容量]
+
+   書き込み用の子プロセスが、パイプへ指定された行数を書き込み、次の経路で転送し終わるまでの
+   時間と、転送を担当したプロセスの CPU 時間を計る。
+
+   splice : log_sink_create_file  splice(2) でパイプからファイルへ直接移す
+   copy   : log_sink_create_file( LOG_SINK_FILE_COPY ) read(2) と write(2) でコピーする
+   syslog : log_sink_create_syslog  行に分けて sendmmsg(2) で unix ドメインソケットへ送る
+   logger : /usr/bin/logger -u を exec して標準入力につなげる ( 以前の daemonic の経路 )
+
+   syslog と logger の送り先は、子プロセスで受信して捨てるだけのソケットである。
+
+   durable を指定した場合は、 splice の経路を log_sink_set_durable の window_us と max_bytes を
+   変えながら計り、 fdatasync の回数と遅延に対するスループットの変化を表にする。
+   時間は、最後の書き込みが x_fdatasync されるまでを計る。
+   全ての行が届かなかった場合は、 EXIT_FAILURE で終了する。
+ */
+
+/* wait4(2) の宣言を得るために必要 */
+#if !defined( _GNU_SOURCE )
+#define _GNU_SOURCE 1
+#endif /* !defined( _GNU_SOURCE ) */
+
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif /* defined(HAVE_CONFIG_H) */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <assert.h>
+
+#include "verify.h"
+#include "alternative.h"
+#include "eventloop.h"
+#include "logsink.h"
+
+#if ( _POSIX_C_SOURCE < 200809L )
+#error you must use compiler option -D_XOPEN_SOURCE=700
+#endif /* ( _POSIX_C_SOURCE < 200809L ) */
+
+/** ベンチマークの条件 */
+struct logbench_param{
+  unsigned long lines;
+  size_t line_length;
+  int pipe_size;
+  /** 出力先のファイル */
+  char file_path[64];
+  /** 出力先のソケット */
+  char socket_path[64];
+  /** 0 以外の場合は log_sink_set_durable を呼ぶ */
+  int durable;
+  unsigned long long durable_window_us;
+  unsigned long long durable_max_bytes;
+};
+
+/** 一つの経路の結果 */
+struct logbench_result{
+  double elapsed;
+  /** 転送を担当したプロセスの CPU 時間 ( user + system ) */
+  double cpu;
+  /** 届いた行数 ( ファイルの場合は バイト数 / 一行のバイト数 ) */
+  unsigned long delivered;
+  /** ファイルの log_sink の統計 */
+  struct log_sink_stats stats;
+};
+
+/** 現在時刻を秒で返す */
+static double logbench_now( void )
+{
+  struct timespec ts = {0};
+  VERIFY( 0 == clock_gettime( CLOCK_MONOTONIC , &ts ) );
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/** rusage の CPU 時間を秒で返す */
+static double logbench_cpu( const struct rusage* usage )
+{
+  return (double)( usage->ru_utime.tv_sec + usage->ru_stime.tv_sec ) +
+    (double)( usage->ru_utime.tv_usec + usage->ru_stime.tv_usec ) / 1e6;
+}
+
+/** 自分自身の CPU 時間を秒で返す */
+static double logbench_self_cpu( void )
+{
+  struct rusage usage;
+  memset( &usage , 0 , sizeof( usage ) );
+  VERIFY( 0 == getrusage( RUSAGE_SELF , &usage ) );
+  return logbench_cpu( &usage );
+}
+
+/**
+   パイプの両端を作る 書き込み側の容量を pipe_size にする
+   @return 成功した場合は 0
+*/
+static int logbench_pipe( const struct logbench_param* param , int pipes[2] )
+{
+  if( pipe( pipes ) ){
+    perror( "pipe()" );
+    return -1;
+  }
+  VERIFY( -1 != fcntl( pipes[0] , F_SETFD , FD_CLOEXEC ) );
+  VERIFY( -1 != fcntl( pipes[1] , F_SETFD , FD_CLOEXEC ) );
+  if( 0 < param->pipe_size && -1 == x_set_pipe_size( pipes[1] , param->pipe_size ) ){
+    perror( "x_set_pipe_size()" );
+  }
+  return 0;
+}
+
+/**
+   fd へ、 lines 行を書き込む子プロセスを作る
+   一度の write(2) で書き込める分だけ行をまとめる ( stdio でバッファリングしたサービスと同じ )
+   @return 子プロセスのプロセスID
+*/
+static pid_t logbench_spawn_writer( const struct logbench_param* param , int fd )
+{
+  const pid_t pid = fork();
+  if( 0 != pid ){
+    return pid;
+  }
+  const size_t per_write = ( 64 * 1024 ) / param->line_length + 1;
+  char* const buffer = malloc( per_write * param->line_length );
+  if( NULL == buffer ){
+    _exit( EXIT_FAILURE );
+  }
+  for( size_t i = 0 ; i < per_write ; ++i ){
+    char* const line = buffer + i * param->line_length;
+    memset( line , 'x' , param->line_length - 1 );
+    memcpy( line , "logbench " , ( 9 < param->line_length - 1 ) ? 9 : param->line_length - 1 );
+    line[ param->line_length - 1 ] = '\n';
+  }
+  for( unsigned long written = 0 ; written < param->lines ; ){
+    const size_t count = ( param->lines - written < per_write ) ? ( param->lines - written ) : per_write;
+    const size_t length = count * param->line_length;
+    for( size_t offset = 0 ; offset < length ; ){
+      const ssize_t result = write( fd , buffer + offset , length - offset );
+      if( 0 < result ){
+        offset += (size_t)result;
+      }else if( !( result < 0 && EINTR == errno ) ){
+        _exit( EXIT_FAILURE );
+      }
+    }
+    written += count;
+  }
+  _exit( EXIT_SUCCESS );
+}
+
+/**
+   socket_path でデータグラムを受信して数える子プロセスを作る
+   lines 個受信するか、 5 秒間何も届かなければ終了する。 終了コードは受信できたかどうか
+   @return 子プロセスのプロセスID 失敗した場合は -1
+*/
+static pid_t logbench_spawn_receiver( const struct logbench_param* param )
+{
+  const int fd = socket( AF_UNIX , SOCK_DGRAM , 0 );
+  if( -1 == fd ){
+    perror( "socket()" );
+    return -1;
+  }
+  struct sockaddr_un address;
+  memset( &address , 0 , sizeof( address ) );
+  address.sun_family = AF_UNIX;
+  VERIFY( 0 < snprintf( address.sun_path , sizeof( address.sun_path ) , "%s" , param->socket_path ) );
+  (void)unlink( param->socket_path );
+  if( -1 == bind( fd , (const struct sockaddr*)&address , sizeof( address ) ) ){
+    perror( "bind()" );
+    VERIFY( 0 == close( fd ) );
+    return -1;
+  }
+  /* 受信の準備ができてから送信を始められるように、 bind してから fork する */
+  const pid_t pid = fork();
+  if( 0 != pid ){
+    VERIFY( 0 == close( fd ) );
+    return pid;
+  }
+  {
+    struct timeval timeout = { 5 , 0 };
+    VERIFY( 0 == setsockopt( fd , SOL_SOCKET , SO_RCVTIMEO , &timeout , sizeof( timeout ) ) );
+  }
+  static char buffer[ 64 * 1024 ];
+  unsigned long received = 0;
+  while( received < param->lines ){
+    const ssize_t result = recv( fd , buffer , sizeof( buffer ) , 0 );
+    if( 0 <= result ){
+      ++received;
+    }else if( EINTR != errno ){
+      break; /* 5 秒間何も届かなかった */
+    }
+  }
+  _exit( ( received == param->lines ) ? EXIT_SUCCESS : EXIT_FAILURE );
+}
+
+/**
+   log_sink で転送する ( splice , copy , syslog )
+   @return 成功した場合は 0
+*/
+static int logbench_run_sink( const struct logbench_param* param , const char* mode ,
+                              struct logbench_result* result )
+{
+  const int is_file = ( 0 != strcmp( mode , "syslog" ) );
+  struct event_loop* const loop = event_loop_create();
+  if( NULL == loop ){
+    perror( "event_loop_create()" );
+    return -1;
+  }
+
+  pid_t receiver = -1;
+  struct log_sink* sink = NULL;
+  if( is_file ){
+    (void)unlink( param->file_path );
+    sink = log_sink_create_file( loop , param->file_path ,
+                                 ( 0 == strcmp( mode , "copy" ) ) ? LOG_SINK_FILE_COPY : 0 );
+  }else{
+    receiver = logbench_spawn_receiver( param );
+    if( -1 == receiver ){
+      event_loop_destroy( loop );
+      return -1;
+    }
+    sink = log_sink_create_syslog( loop , param->socket_path );
+  }
+  if( NULL == sink ){
+    perror( "log_sink_create()" );
+    event_loop_destroy( loop );
+    return -1;
+  }
+  if( param->durable && log_sink_set_durable( sink , param->durable_window_us , param->durable_max_bytes ) ){
+    perror( "log_sink_set_durable()" );
+    log_sink_destroy( sink );
+    event_loop_destroy( loop );
+    return -1;
+  }
+
+  int pipes[2] = {-1,-1};
+  if( logbench_pipe( param , pipes ) ){
+    log_sink_destroy( sink );
+    event_loop_destroy( loop );
+    return -1;
+  }
+  const double cpu_start = logbench_self_cpu();
+  const double start = logbench_now();
+  const pid_t writer = logbench_spawn_writer( param , pipes[1] );
+  VERIFY( 0 == close( pipes[1] ) );
+
+  struct log_stream* const stream = log_stream_create( loop , sink , pipes[0] , "logbench" , LOG_USER | LOG_NOTICE );
+  VERIFY( NULL != stream );
+  while( !log_stream_is_drained( stream ) ){
+    if( event_loop_run_once( loop , 1000 ) < 0 ){
+      perror( "event_loop_run_once()" );
+      break;
+    }
+  }
+  log_stream_destroy( stream );
+  if( is_file ){
+    /* durable モードでは、最後の書き込みが同期されるまで待つ */
+    log_sink_get_stats( sink , &(result->stats) );
+    while( param->durable && result->stats.synced_bytes < result->stats.written_bytes ){
+      if( event_loop_run_once( loop , 1000 ) < 0 ){
+        perror( "event_loop_run_once()" );
+        break;
+      }
+      log_sink_get_stats( sink , &(result->stats) );
+    }
+  }
+
+  int status = 0;
+  if( is_file ){
+    result->delivered = (unsigned long)( result->stats.written_bytes / param->line_length );
+  }else{
+    VERIFY( receiver == waitpid( receiver , &status , 0 ) );
+    result->delivered = ( WIFEXITED( status ) && EXIT_SUCCESS == WEXITSTATUS( status ) ) ? param->lines : 0;
+  }
+  result->elapsed = logbench_now() - start;
+  result->cpu = logbench_self_cpu() - cpu_start;
+  VERIFY( writer == waitpid( writer , &status , 0 ) );
+
+  log_sink_destroy( sink );
+  event_loop_destroy( loop );
+  if( is_file ){
+    VERIFY( 0 == unlink( param->file_path ) );
+  }else{
+    VERIFY( 0 == unlink( param->socket_path ) );
+  }
+  return 0;
+}
+
+/**
+   /usr/bin/logger へパイプでつなげて転送する
+   @return 成功した場合は 0 logger が無い場合は 1
+*/
+static int logbench_run_logger( const struct logbench_param* param , struct logbench_result* result )
+{
+  if( 0 != access( "/usr/bin/logger" , X_OK ) ){
+    return 1;
+  }
+  const pid_t receiver = logbench_spawn_receiver( param );
+  if( -1 == receiver ){
+    return -1;
+  }
+  int pipes[2] = {-1,-1};
+  if( logbench_pipe( param , pipes ) ){
+    return -1;
+  }
+  const double start = logbench_now();
+  const pid_t writer = logbench_spawn_writer( param , pipes[1] );
+  const pid_t logger = fork();
+  if( 0 == logger ){
+    VERIFY( STDIN_FILENO == dup2( pipes[0] , STDIN_FILENO ) );
+    execl( "/usr/bin/logger" , "/usr/bin/logger" , "-u" , param->socket_path , "-t" , "logbench" , NULL );
+    _exit( EXIT_FAILURE );
+  }
+  VERIFY( 0 == close( pipes[0] ) );
+  VERIFY( 0 == close( pipes[1] ) );
+
+  int status = 0;
+  VERIFY( receiver == waitpid( receiver , &status , 0 ) );
+  result->delivered = ( WIFEXITED( status ) && EXIT_SUCCESS == WEXITSTATUS( status ) ) ? param->lines : 0;
+  result->elapsed = logbench_now() - start;
+
+  struct rusage usage;
+  memset( &usage , 0 , sizeof( usage ) );
+  VERIFY( logger == wait4( logger , &status , 0 , &usage ) );
+  result->cpu = logbench_cpu( &usage );
+  VERIFY( writer == waitpid( writer , &status , 0 ) );
+  VERIFY( 0 == unlink( param->socket_path ) );
+  return 0;
+}
+
+/**
+   durable モードの window_us と max_bytes を変えながら、 splice の経路を計る
+   @return 全ての行が届いた場合は 0
+*/
+static int logbench_durable( struct logbench_param* param , double megabytes )
+{
+  static const unsigned long long windows[] = { 0 , 100 , 1000 , 10000 , 100000 };
+  static const unsigned long long max_bytes[] = { 64 * 1024 , 1024 * 1024 , 16 * 1024 * 1024 };
+
+  printf( "%-10s %10s %10s %10s %9s %12s %12s  %s\n" ,
+          "window_us" , "max_bytes" , "MiB/s" , "elapsed" , "syncs" , "avg_sync_us" , "max_sync_us" , "result" );
+  int lost = 0;
+  param->durable = 1;
+  for( size_t i = 0 ; i < sizeof( windows ) / sizeof( windows[0] ) ; ++i ){
+    for( size_t j = 0 ; j < sizeof( max_bytes ) / sizeof( max_bytes[0] ) ; ++j ){
+      param->durable_window_us = windows[i];
+      param->durable_max_bytes = max_bytes[j];
+      struct logbench_result result;
+      memset( &result , 0 , sizeof( result ) );
+      if( logbench_run_sink( param , "splice" , &result ) ){
+        return -1;
+      }
+      const int ok = ( result.delivered == param->lines );
+      lost |= !ok;
+      const unsigned long syncs = result.stats.syncs;
+      printf( "%-10llu %10llu %10.1f %9.3fs %9lu %12.0f %12llu  %s\n" ,
+              windows[i] , max_bytes[j] , megabytes / result.elapsed , result.elapsed , syncs ,
+              ( 0 < syncs ) ? (double)result.stats.sync_latency_total_us / (double)syncs : 0.0 ,
+              result.stats.sync_latency_max_us , ok ? "ok" : "LOST LINES" );
+    }
+  }
+  return lost;
+}
+
+int main( int argc , char* argv[] )
+{
+  struct logbench_param param;
+  memset( &param , 0 , sizeof( param ) );
+  const int durable = ( 1 < argc && 0 == strcmp( argv[1] , "durable" ) );
+  if( durable ){
+    --argc;
+    ++argv;
+  }
+  param.lines = ( 1 < argc ) ? strtoul( argv[1] , NULL , 10 ) : 200000;
+  param.line_length = ( 2 < argc ) ? strtoul( argv[2] , NULL , 10 ) : 100;
+  param.pipe_size = ( 3 < argc ) ? atoi( argv[3] ) : 0;
+  if( 0 == param.lines || param.line_length < 2 || 4096 < param.line_length ){
+    fprintf( stderr , "usage: %s [durable] [lines] [line_length(2-4096)] [pipe_size]\n" , argv[0] );
+    return EXIT_FAILURE;
+  }
+  VERIFY( 0 < snprintf( param.file_path , sizeof( param.file_path ) , "/tmp/logbench.%d.log" , (int)getpid() ) );
+  VERIFY( 0 < snprintf( param.socket_path , sizeof( param.socket_path ) , "/tmp/logbench.%d.sock" , (int)getpid() ) );
+
+  const double megabytes = (double)param.lines * (double)param.line_length / ( 1024.0 * 1024.0 );
+  printf( "backend : %s\n" , event_loop_backend_name() );
+  printf( "input   : %lu lines x %zu bytes (%.1f MiB) , pipe size %d\n" ,
+          param.lines , param.line_length , megabytes , param.pipe_size );
+  if( durable ){
+    const int result = logbench_durable( &param , megabytes );
+    return ( 0 == result ) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  printf( "%-8s %10s %12s %10s %10s  %s\n" , "mode" , "MiB/s" , "lines/s" , "elapsed" , "cpu" , "result" );
+
+  int lost = 0;
+  static const char* const modes[] = { "splice" , "copy" , "syslog" , "logger" };
+  for( size_t i = 0 ; i < sizeof( modes ) / sizeof( modes[0] ) ; ++i ){
+    struct logbench_result result;
+    memset( &result , 0 , sizeof( result ) );
+    const int run = ( 0 == strcmp( modes[i] , "logger" ) ) ?
+      logbench_run_logger( &param , &result ) : logbench_run_sink( &param , modes[i] , &result );
+    if( 1 == run ){
+      printf( "%-8s %10s\n" , modes[i] , "skipped" );
+      continue;
+    }
+    if( 0 != run ){
+      return EXIT_FAILURE;
+    }
+    const int ok = ( result.delivered == param.lines );
+    lost |= !ok;
+    printf( "%-8s %10.1f %12.0f %9.3fs %9.3fs  %s\n" , modes[i] ,
+            megabytes / result.elapsed , (double)param.lines / result.elapsed ,
+            result.elapsed , result.cpu , ok ? "ok" : "LOST LINES" );
+  }
+  return lost ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,1349 @@
+﻿/**
+   ターゲットプロセスの出力を、コントロールプロセス自身が syslog へ転送する
+
+   以前は /usr/bin/logger を exec したプロセスへパイプをつないでいたが、
+   プロセス一つ分のメモリと、一行毎のパイプの中継が無駄なので、
+   コントロールプロセスのイベントループで直接パイプを読み、
+   RFC 3164 形式 ( "<PRI>Mmm dd hh:mm:ss TAG[PID]: MSG" ) のデータグラムにして
+   sendmmsg(2) でまとめて送る。
+
+   ファイルへ出力する場合は、行に分けずに splice(2) でパイプからファイルへ
+   直接移すので、データはユーザ空間にコピーされない。
+   splice(2) は O_APPEND で開いたファイルには EINVAL を返すので、ファイルは
+   O_APPEND 無しで開いて末尾へ lseek(2) しておき、ファイル位置を進めながら書き込む。
+   ( ファイルに書き込むのはコントロールプロセスだけなので、追記と同じ結果になる )
+
+   ローテーションは、パイプから移す合間に rename(2) と open(2) をするだけなので、
+   その間に子プロセスが書き込んだ分はパイプに溜まり、子プロセスは止まらない。
+   ( コントロールプロセスは一つのスレッドで動くので、ファイルの切り替えにロックは要らない )
+   ローテーションしたファイルの圧縮は gzip(1) の子プロセスに任せて、終了をイベントループで待つ。
+   行の区切りを見ないので、ローテーションの境目で行が二つのファイルに分かれることがある。
+
+   durable モードでは、 group commit を行う。 書き込んだ分が max_bytes に達するか、
+   最初の未同期の書き込みから window_us が過ぎた時に、一度の x_fdatasync でまとめて同期する。
+   同期している間はパイプを読まないので、ディスクに届いていないデータは
+   max_bytes ( と一回の splice(2) の分 ) を超えず、それ以上は子プロセスの write(2) が待たされる。
+
+   syslog へ送る log_stream は、ソケットが詰まっている間もパイプを読み続けて、大きさを
+   制限したバッファに溜める。 バッファが一杯になった時の扱いは log_stream_set_overflow で選ぶ。
+   BLOCK 以外では子プロセスの write(2) は止まらず、捨てた行は数えておいて、
+   ソケットが空いた時に "daemonic: dropped ..." という行で知らせる。
+   捨てるかどうかは行の先頭で決めて、その行の残りは後から読んだ分も同じように扱う。
+
+   log_stream_set_batch で、読んだ行をすぐに送らずに少しの間溜めて、まとめて送ることができる。
+   ( 標準出力は溜めてまとめて送り、標準エラー出力はすぐに送る、という使い分けをする )
+   ソケットが空いた時は、溜めない log_stream から先に送るので、標準エラー出力の行が
+   標準出力の大量の行の後ろで待たされることは無い。
+
+   行の区切りは linesplit_find_newline ( SSE2 / AVX2 ) で探す。 log_stream_set_classify で、
+   行の先頭の "ERROR" "[W]" "<3>" などの印から推定した level で送ることもできる。
+ */
+
+/* sendmmsg(2) と splice(2) の宣言を得るために必要 */
+#if !defined( _GNU_SOURCE )
+#define _GNU_SOURCE 1
+#endif /* !defined( _GNU_SOURCE ) */
+
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif /* defined(HAVE_CONFIG_H) */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <assert.h>
+
+#include "verify.h"
+#include "alternative.h"
+#include "eventloop.h"
+#include "logsink.h"
+#include "linesplit.h"
+
+enum{
+  /** 捨てる行を読み込む一時的な領域の大きさ */
+  LOG_STREAM_SCRATCH_SIZE = 16 * 1024,
+  /** 一回の sendmmsg(2) で送る行数の上限 */
+  LOG_SINK_BATCH_MAX = 256,
+  /** syslog のタグの長さの上限 ( RFC 3164 ) */
+  LOG_SINK_TAG_MAX = 32
+};
+
+/** 一回の splice(2) で移す最大のバイト数 ( パイプに入っている分しか移らない ) */
+#define LOG_SINK_SPLICE_MAX ( (size_t)1024 * 1024 )
+
+/** log_sink の種類 */
+enum log_sink_type{
+  LOG_SINK_SYSLOG = 0,
+  LOG_SINK_FILE
+};
+
+struct log_sink{
+  struct event_loop* loop;
+  /** enum log_sink_type */
+  int type;
+  /** LOG_SINK_SYSLOG の場合は接続したソケット 接続していない時は -1
+      LOG_SINK_FILE の場合は書き込むファイル */
+  int fd;
+  /** LOG_SINK_FILE の場合の log_sink_create_file の flags */
+  unsigned int flags;
+  /** LOG_SINK_FILE の場合のファイルへのパス */
+  char* path;
+  /** 今のファイルの大きさ */
+  unsigned long long file_bytes;
+  /** ローテーションする大きさ 0 の場合は大きさではローテーションしない */
+  unsigned long long rotate_bytes;
+  /** ローテーションする間隔 ( 秒 ) 0 の場合は時間ではローテーションしない */
+  unsigned int rotate_age;
+  /** log_sink_set_rotation の flags */
+  unsigned int rotate_flags;
+  /** rotate_age のタイマー */
+  event_loop_timer_id rotate_timer;
+  /** 実行中の gzip(1) のプロセスID 実行していない場合は 0 */
+  pid_t compressor;
+  /** durable モードかどうか */
+  int durable;
+  /** 最初の未同期の書き込みから同期するまでの最大の時間 ( マイクロ秒 ) 0 の場合はパイプを読み切る毎に同期する */
+  unsigned long long durable_window_us;
+  /** 未同期のバイト数がこれに達したら、すぐに同期する */
+  unsigned long long durable_max_bytes;
+  /** まだ x_fdatasync していないバイト数 */
+  unsigned long long unsynced_bytes;
+  /** 最初の未同期の書き込みの時刻 ( CLOCK_MONOTONIC のナノ秒 ) */
+  unsigned long long unsynced_since;
+  /** durable_window_us のタイマー 無い場合は 0 */
+  event_loop_timer_id durable_timer;
+  /** 統計 */
+  struct log_sink_stats stats;
+  /** ソケットのパス */
+  struct sockaddr_un address;
+  /** 最後に接続を試みた時刻 */
+  time_t last_connect;
+  /** ソケットが書き込み可能になるのを待っている log_stream のリスト */
+  struct log_stream* waiting;
+  /** sendmmsg(2) に渡す領域 ( 一つのイベントループの中でしか使わないので共有する ) */
+  struct mmsghdr messages[LOG_SINK_BATCH_MAX];
+  struct iovec iov[LOG_SINK_BATCH_MAX][2];
+};
+
+struct log_stream{
+  struct event_loop* loop;
+  struct log_sink* sink;
+  /** パイプの読み込み側 */
+  int fd;
+  /** syslog の facility と priority */
+  int priority;
+  /** "TAG[PID]: " の部分 */
+  char tag[ LOG_SINK_TAG_MAX + 32 ];
+  char name[ LOG_SINK_TAG_MAX + 1 ];
+  /** 読み込んだが、まだ送っていないデータ 最初の読み込み時に確保する */
+  char* buffer;
+  size_t length;
+  /** buffer の大きさ これより長い行は分割される */
+  size_t capacity;
+  /** ソケットが書き込み可能になるのを待っているかどうか */
+  int blocked;
+  /** バッファが一杯になって、パイプの監視を止めているかどうか ( LOG_STREAM_OVERFLOW_BLOCK ) */
+  int paused;
+  /** EOF あるいはエラーで、読み込みを止めたかどうか */
+  int closed;
+  /** log_sink の待ち行列の次の要素 */
+  struct log_stream* next_waiting;
+  /** enum log_stream_overflow */
+  int overflow;
+  /** LOG_STREAM_OVERFLOW_SAMPLE で、何行に一行を残すか */
+  unsigned int sample_rate;
+  /** バッファが溢れてから読んだ行数 ( 間引く行を選ぶのに使う ) */
+  unsigned long sample_count;
+  /** バッファが溢れてから、ソケットが空くまでの間かどうか */
+  int overflowing;
+  /** 最後に読んだデータが改行で終わっていない ( 行の途中 ) かどうか */
+  int in_line;
+  /** 読み込み途中の行を捨てているかどうか */
+  int dropping;
+  /** 統計 */
+  struct log_stream_stats stats;
+  /** 最後に知らせた時の stats.dropped_lines と stats.dropped_bytes */
+  unsigned long reported_lines;
+  unsigned long long reported_bytes;
+  /** 読んだ行を溜めておく最大の時間 ( マイクロ秒 ) 0 の場合はすぐに送る */
+  unsigned long long batch_us;
+  /** batch_us のタイマー 無い場合は 0 */
+  event_loop_timer_id batch_timer;
+  /** 行の先頭の印から level を推定するかどうか */
+  int classify;
+};
+
+/** log_stream_accept で、読み込んだ行をどう扱うか */
+enum log_stream_accept_mode{
+  /** 全て残す */
+  LOG_STREAM_ACCEPT_ALL = 0,
+  /** sample_rate 行に一行だけ残す */
+  LOG_STREAM_ACCEPT_SAMPLE ,
+  /** 全て捨てる */
+  LOG_STREAM_ACCEPT_NONE
+};
+
+/**
+   ソケットに接続する 一秒以内に接続を試みていた場合は何もしない
+   @return 接続している場合は 0 そうでない場合は -1
+*/
+static int log_sink_connect( struct log_sink* sink );
+
+/** ソケットを閉じて、次の送信で接続しなおすようにする */
+static void log_sink_disconnect( struct log_sink* sink );
+
+/** ソケットが書き込み可能になった時のハンドラ */
+static void log_sink_on_writable( struct event_loop* loop , int fd , unsigned int events , void* context );
+
+/**
+   ソケットが空いたので、待ち行列に入っていた log_stream を再開する
+*/
+static void log_stream_resume( struct log_stream* stream );
+
+/** batch_us のタイマーのハンドラ */
+static void log_stream_on_batch_timer( struct event_loop* loop , event_loop_timer_id id , void* context );
+
+/** パイプが読み込み可能になった時のハンドラ */
+static void log_stream_on_readable( struct event_loop* loop , int fd , unsigned int events , void* context );
+
+/**
+   パイプから読めるだけ読み込んで送る
+   @return 0 まだ開いている 1 EOF ( 全ての書き込み側が閉じられた ) -1 エラー
+*/
+static int log_stream_pump( struct log_stream* stream );
+
+/**
+   ソケットが詰まっている間に、パイプから読めるだけ読み込んでバッファに溜める
+   バッファが一杯になった場合は、 overflow に従ってパイプの監視を止めるか、行を捨てる
+   @return log_stream_pump と同じ
+*/
+static int log_stream_absorb( struct log_stream* stream );
+
+/**
+   新しく読み込んだ data から、 mode に従って捨てる行を取り除いて前に詰める
+   行の途中から始まる場合は、その行の先頭で決めた扱いを続ける。
+   @return 残したバイト数
+*/
+static size_t log_stream_accept( struct log_stream* stream , char* data , size_t size ,
+                                 enum log_stream_accept_mode mode );
+
+/**
+   バッファの先頭の古い行を、 size バイト以上空くまで捨てる
+   読み込み途中の行しか残っていない場合は、それも捨てて、残りも捨てるようにする。
+*/
+static void log_stream_drop_oldest( struct log_stream* stream , size_t size );
+
+/**
+   前に知らせてから捨てた行を、ソケットへ "daemonic: dropped ..." という行で知らせる
+   @return 送った ( あるいは接続していない ) 場合は 0 ソケットが詰まった場合は 1
+*/
+static int log_stream_report_drops( struct log_stream* stream );
+
+/**
+   syslog のヘッダ "<PRI>Mmm dd hh:mm:ss TAG[PID]: " を作る
+   @return ヘッダの長さ
+*/
+static size_t log_stream_format_header( const struct log_stream* stream , int priority ,
+                                        char* buffer , size_t size );
+
+/**
+   LOG_SINK_FILE の log_stream_pump パイプから読めるだけファイルへ移す
+   @return log_stream_pump と同じ
+*/
+static int log_stream_pump_file( struct log_stream* stream );
+
+/**
+   ファイルを追記用に開く ( O_APPEND は splice(2) が使えないので、末尾に lseek(2) する )
+   @return ファイルディスクリプタ 失敗した場合は -1
+   @param size ファイルの大きさを返す
+*/
+static int log_sink_open_file( const char* path , unsigned long long* size );
+
+/** ファイルへ書き込んだ分を数えて、大きさが上限を超えたらローテーションする */
+static void log_sink_account( struct log_sink* sink , size_t bytes );
+
+/**
+   今のファイルを "パス.YYYYmmdd-HHMMSS" に rename(2) して、新しいファイルを開く
+   失敗した場合は、今のファイルに書き込み続ける
+   @return 成功した場合は 0 失敗した場合は -1
+*/
+static int log_sink_rotate( struct log_sink* sink );
+
+/** CLOCK_MONOTONIC の現在時刻をナノ秒で返す */
+static unsigned long long log_sink_now( void );
+
+/**
+   durable モードで、未同期の書き込みがあれば x_fdatasync する
+*/
+static void log_sink_sync( struct log_sink* sink );
+
+/** durable_window_us のタイマーのハンドラ */
+static void log_sink_on_durable_timer( struct event_loop* loop , event_loop_timer_id id , void* context );
+
+/** rotate_age のタイマーのハンドラ */
+static void log_sink_on_rotate_timer( struct event_loop* loop , event_loop_timer_id id , void* context );
+
+/** ローテーションしたファイルを圧縮する gzip(1) の子プロセスを起動する */
+static void log_sink_compress( struct log_sink* sink , const char* path );
+
+/** gzip(1) の子プロセスが終了した時のハンドラ */
+static void log_sink_on_compressor_exit( struct event_loop* loop , pid_t pid , void* context );
+
+/**
+   バッファの中の完全な行を全て送る
+   @return 全て送った ( あるいは捨てた ) 場合は 0 ソケットが詰まった場合は 1
+   @param force 改行で終わっていない行も送る
+*/
+static int log_stream_send_lines( struct log_stream* stream , int force );
+
+/************************* 実装 **************************/
+
+struct log_sink* log_sink_create_syslog( struct event_loop* loop , const char* socket_path )
+{
+  assert( loop );
+  assert( socket_path );
+  struct log_sink* const sink = calloc( 1 , sizeof( struct log_sink ) );
+  if( NULL == sink ){
+    return NULL;
+  }
+  if( sizeof( sink->address.sun_path ) <= strlen( socket_path ) ){
+    free( sink );
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  sink->loop = loop;
+  sink->fd = -1;
+  sink->address.sun_family = AF_UNIX;
+  strcpy( sink->address.sun_path , socket_path );
+  return sink;
+}
+
+struct log_sink* log_sink_create_file( struct event_loop* loop , const char* path , unsigned int flags )
+{
+  assert( loop );
+  assert( path );
+  struct log_sink* const sink = calloc( 1 , sizeof( struct log_sink ) );
+  if( NULL == sink ){
+    return NULL;
+  }
+  sink->loop = loop;
+  sink->type = LOG_SINK_FILE;
+  sink->flags = flags;
+#if !defined( HAVE_SPLICE )
+  sink->flags |= LOG_SINK_FILE_COPY;
+#endif /* !defined( HAVE_SPLICE ) */
+  sink->path = strdup( path );
+  sink->fd = ( sink->path ) ? log_sink_open_file( path , &(sink->file_bytes) ) : -1;
+  if( -1 == sink->fd ){
+    const int err = errno;
+    free( sink->path );
+    free( sink );
+    errno = err;
+    return NULL;
+  }
+  return sink;
+}
+
+static int log_sink_open_file( const char* path , unsigned long long* size )
+{
+  const int fd = open( path , O_WRONLY | O_CREAT | O_CLOEXEC , S_IRUSR | S_IWUSR | S_IRGRP );
+  if( -1 == fd ){
+    return -1;
+  }
+  const off_t end = lseek( fd , 0 , SEEK_END );
+  if( -1 == end ){
+    const int err = errno;
+    VERIFY( 0 == close( fd ) );
+    errno = err;
+    return -1;
+  }
+  *size = (unsigned long long)end;
+  return fd;
+}
+
+int log_sink_set_rotation( struct log_sink* sink , unsigned long long max_bytes , unsigned int max_age_sec ,
+                           unsigned int flags )
+{
+  assert( sink );
+  if( LOG_SINK_FILE != sink->type ){
+    errno = EINVAL;
+    return -1;
+  }
+  if( sink->rotate_timer ){
+    VERIFY( 0 == event_loop_remove_timer( sink->loop , sink->rotate_timer ) );
+    sink->rotate_timer = 0;
+  }
+  sink->rotate_bytes = max_bytes;
+  sink->rotate_age = max_age_sec;
+  sink->rotate_flags = flags;
+  if( 0 < max_age_sec ){
+    const unsigned long long interval = (unsigned long long)max_age_sec * 1000000ULL;
+    sink->rotate_timer = event_loop_add_timer( sink->loop , interval , interval , log_sink_on_rotate_timer , sink );
+    if( 0 == sink->rotate_timer ){
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int log_sink_reopen( struct log_sink* sink )
+{
+  assert( sink );
+  if( LOG_SINK_SYSLOG == sink->type ){
+    /* syslogd が再起動した場合に備えて、次の送信で接続しなおす */
+    log_sink_disconnect( sink );
+    sink->last_connect = 0;
+    return 0;
+  }
+  unsigned long long size = 0;
+  const int fd = log_sink_open_file( sink->path , &size );
+  if( -1 == fd ){
+    return -1;
+  }
+  log_sink_sync( sink );
+  VERIFY( 0 == close( sink->fd ) );
+  sink->fd = fd;
+  sink->file_bytes = size;
+  return 0;
+}
+
+static void log_sink_account( struct log_sink* sink , size_t bytes )
+{
+  sink->stats.written_bytes += (unsigned long long)bytes;
+  sink->file_bytes += (unsigned long long)bytes;
+  if( sink->durable ){
+    if( 0 == sink->unsynced_bytes ){
+      sink->unsynced_since = log_sink_now();
+    }
+    sink->unsynced_bytes += (unsigned long long)bytes;
+    if( sink->durable_max_bytes <= sink->unsynced_bytes ){
+      log_sink_sync( sink );
+    }else if( 0 < sink->durable_window_us && 0 == sink->durable_timer ){
+      sink->durable_timer = event_loop_add_timer( sink->loop , sink->durable_window_us , 0 ,
+                                                  log_sink_on_durable_timer , sink );
+      if( 0 == sink->durable_timer ){
+        log_sink_sync( sink ); /* タイマーが使えないなら、すぐに同期する */
+      }
+    }
+  }
+  if( 0 < sink->rotate_bytes && sink->rotate_bytes <= sink->file_bytes ){
+    if( 0 == log_sink_rotate( sink ) && sink->rotate_timer ){
+      /* 時間によるローテーションは、新しいファイルを開いた時から数えなおす */
+      (void)log_sink_set_rotation( sink , sink->rotate_bytes , sink->rotate_age , sink->rotate_flags );
+    }
+  }
+  return;
+}
+
+static void log_sink_on_rotate_timer( struct event_loop* loop , event_loop_timer_id id , void* context )
+{
+  (void)loop;
+  (void)id;
+  struct log_sink* const sink = context;
+  assert( sink );
+  if( 0 < sink->file_bytes ){
+    (void)log_sink_rotate( sink );
+  }
+  return;
+}
+
+static int log_sink_rotate( struct log_sink* sink )
+{
+  char rotated[PATH_MAX];
+  {
+    char stamp[32];
+    const time_t now = time( NULL );
+    struct tm tm = {0};
+    VERIFY( NULL != localtime_r( &now , &tm ) );
+    VERIFY( 0 < strftime( stamp , sizeof( stamp ) , "%Y%m%d-%H%M%S" , &tm ) );
+    /* 一秒の間に何度もローテーションした場合は、番号を付けて区別する */
+    for( unsigned int n = 0 ; ; ++n ){
+      const int length = ( 0 == n ) ?
+        snprintf( rotated , sizeof( rotated ) , "%s.%s" , sink->path , stamp ) :
+        snprintf( rotated , sizeof( rotated ) , "%s.%s.%u" , sink->path , stamp , n );
+      if( length < 0 || (int)sizeof( rotated ) <= length ){
+        syslog( LOG_WARNING , "log rotation faild, path too long \"%s\"" , sink->path );
+        return -1;
+      }
+      char compressed[ PATH_MAX + 4 ];
+      VERIFY( 0 < snprintf( compressed , sizeof( compressed ) , "%s.gz" , rotated ) );
+      if( 0 != access( rotated , F_OK ) && 0 != access( compressed , F_OK ) ){
+        break;
+      }
+    }
+  }
+  if( -1 == rename( sink->path , rotated ) ){
+    syslog( LOG_WARNING , "%m, rename(2) faild \"%s\" -> \"%s\"" , sink->path , rotated );
+    return -1;
+  }
+  unsigned long long size = 0;
+  const int fd = log_sink_open_file( sink->path , &size );
+  if( -1 == fd ){
+    /* 新しいファイルが開けない場合は、 rename したファイルに書き続けて、次の機会に再度試みる */
+    syslog( LOG_WARNING , "%m, open(2) faild \"%s\"" , sink->path );
+    return -1;
+  }
+  log_sink_sync( sink );
+  VERIFY( 0 == close( sink->fd ) );
+  sink->fd = fd;
+  sink->file_bytes = size;
+  if( sink->rotate_flags & LOG_SINK_ROTATE_COMPRESS ){
+    log_sink_compress( sink , rotated );
+  }
+  return 0;
+}
+
+static void log_sink_compress( struct log_sink* sink , const char* path )
+{
+  if( 0 != sink->compressor ){
+    /* 前の圧縮が終わっていない 圧縮が追いつかない程ローテーションする時は、圧縮を諦める */
+    syslog( LOG_WARNING , "previous gzip(1) is still running, \"%s\" is left uncompressed" , path );
+    return;
+  }
+  const pid_t pid = fork();
+  if( -1 == pid ){
+    syslog( LOG_WARNING , "%m, fork(2) faild, \"%s\" is left uncompressed" , path );
+    return;
+  }
+  if( 0 == pid ){
+    sigset_t saved_sigmask;
+    event_loop_saved_sigmask( sink->loop , &saved_sigmask );
+    VERIFY( 0 == sigprocmask( SIG_SETMASK , &saved_sigmask , NULL ) );
+    execlp( "gzip" , "gzip" , "-f" , "--" , path , (char*)NULL );
+    _exit( EXIT_FAILURE );
+  }
+  sink->compressor = pid;
+  if( 0 != event_loop_add_child( sink->loop , pid , log_sink_on_compressor_exit , sink ) ){
+    /* すでに回収されている */
+    sink->compressor = 0;
+  }
+  return;
+}
+
+static void log_sink_on_compressor_exit( struct event_loop* loop , pid_t pid , void* context )
+{
+  struct log_sink* const sink = context;
+  assert( sink );
+  int status = 0;
+  const pid_t result = waitpid( pid , &status , WNOHANG );
+  if( 0 == result || ( -1 == result && EINTR == errno ) ){
+    return; /* SIGCHLD で代用している場合に、まだ終了していない */
+  }
+  /* コントロールプロセスの waitid( P_ALL ) は、監視している子プロセスをこのハンドラに回収させる */
+  if( pid == result && !( WIFEXITED( status ) && EXIT_SUCCESS == WEXITSTATUS( status ) ) ){
+    syslog( LOG_WARNING , "gzip(1) (pid %d) faild, status = %d" , (int)pid , status );
+  }
+  VERIFY( 0 == event_loop_remove_child( loop , pid ) );
+  sink->compressor = 0;
+  return;
+}
+
+void log_sink_destroy( struct log_sink* sink )
+{
+  if( NULL == sink ){
+    return;
+  }
+  assert( NULL == sink->waiting );
+  if( LOG_SINK_FILE == sink->type ){
+    if( sink->rotate_timer ){
+      VERIFY( 0 == event_loop_remove_timer( sink->loop , sink->rotate_timer ) );
+    }
+    if( sink->compressor ){
+      /* 圧縮は続けさせて、終了は待たない */
+      VERIFY( 0 == event_loop_remove_child( sink->loop , sink->compressor ) );
+    }
+    log_sink_sync( sink );
+    VERIFY( 0 == close( sink->fd ) );
+    free( sink->path );
+  }else{
+    log_sink_disconnect( sink );
+  }
+  free( sink );
+  return;
+}
+
+void log_sink_get_stats( const struct log_sink* sink , struct log_sink_stats* stats )
+{
+  assert( sink );
+  assert( stats );
+  *stats = sink->stats;
+  return;
+}
+
+int log_sink_set_durable( struct log_sink* sink , unsigned long long window_us , unsigned long long max_bytes )
+{
+  assert( sink );
+  if( LOG_SINK_FILE != sink->type ){
+    errno = EINVAL;
+    return -1;
+  }
+  log_sink_sync( sink );
+  sink->durable = 1;
+  sink->durable_window_us = window_us;
+  sink->durable_max_bytes = ( 0 < max_bytes ) ? max_bytes : LOG_SINK_DURABLE_DEFAULT_BYTES;
+  return 0;
+}
+
+static unsigned long long log_sink_now( void )
+{
+  struct timespec ts = {0};
+  VERIFY( 0 == clock_gettime( CLOCK_MONOTONIC , &ts ) );
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+static void log_sink_sync( struct log_sink* sink )
+{
+  if( sink->durable_timer ){
+    VERIFY( 0 == event_loop_remove_timer( sink->loop , sink->durable_timer ) );
+    sink->durable_timer = 0;
+  }
+  if( !sink->durable || 0 == sink->unsynced_bytes ){
+    return;
+  }
+  if( 0 != x_fdatasync( sink->fd ) ){
+    syslog( LOG_WARNING , "%m, fdatasync faild \"%s\"" , sink->path );
+  }
+  const unsigned long long latency_us = ( log_sink_now() - sink->unsynced_since ) / 1000ULL;
+  ++(sink->stats.syncs);
+  sink->stats.synced_bytes += sink->unsynced_bytes;
+  sink->stats.sync_latency_total_us += latency_us;
+  if( sink->stats.sync_latency_max_us < latency_us ){
+    sink->stats.sync_latency_max_us = latency_us;
+  }
+  sink->unsynced_bytes = 0;
+  return;
+}
+
+static void log_sink_on_durable_timer( struct event_loop* loop , event_loop_timer_id id , void* context )
+{
+  (void)loop;
+  (void)id;
+  struct log_sink* const sink = context;
+  assert( sink );
+  sink->durable_timer = 0; /* 一度だけのタイマーなので、すでに登録は外れている */
+  log_sink_sync( sink );
+  return;
+}
+
+static int log_sink_connect( struct log_sink* sink )
+{
+  if( 0 <= sink->fd ){
+    return 0;
+  }
+  const time_t now = time( NULL );
+  if( now == sink->last_connect ){
+    return -1;
+  }
+  sink->last_connect = now;
+
+  const int fd = socket( AF_UNIX , SOCK_DGRAM , 0 );
+  if( -1 == fd ){
+    return -1;
+  }
+  {
+    const int fl = fcntl( fd , F_GETFL );
+    const int fdfl = fcntl( fd , F_GETFD );
+    VERIFY( -1 != fcntl( fd , F_SETFL , fl | O_NONBLOCK ) );
+    VERIFY( -1 != fcntl( fd , F_SETFD , fdfl | FD_CLOEXEC ) );
+  }
+  if( -1 == connect( fd , (const struct sockaddr*)&(sink->address) , sizeof( sink->address ) ) ||
+      -1 == event_loop_add_fd( sink->loop , fd , 0 , log_sink_on_writable , sink ) ){
+    const int err = errno;
+    VERIFY( 0 == close( fd ) );
+    errno = err;
+    return -1;
+  }
+  sink->fd = fd;
+  return 0;
+}
+
+static void log_sink_disconnect( struct log_sink* sink )
+{
+  if( 0 <= sink->fd ){
+    VERIFY( 0 == event_loop_remove_fd( sink->loop , sink->fd ) );
+    VERIFY( 0 == close( sink->fd ) );
+    sink->fd = -1;
+  }
+  return;
+}
+
+static void log_sink_on_writable( struct event_loop* loop , int fd , unsigned int events , void* context )
+{
+  (void)events;
+  struct log_sink* const sink = context;
+  assert( sink );
+  VERIFY( 0 == event_loop_modify_fd( loop , fd , 0 ) );
+
+  /* 待っていた log_stream を全て再開する 再開した中でまた詰まったものは、待ち行列に戻る
+     溜めずにすぐ送る log_stream ( 標準エラー出力 ) を先に再開して、ソケットの空きを先に使わせる */
+  struct log_stream* list = sink->waiting;
+  sink->waiting = NULL;
+  for( int pass = 0 ; pass < 2 ; ++pass ){
+    struct log_stream** p = &list;
+    while( *p ){
+      struct log_stream* const stream = *p;
+      if( ( 0 == pass ) != ( 0 == stream->batch_us ) ){
+        p = &(stream->next_waiting);
+        continue;
+      }
+      *p = stream->next_waiting;
+      stream->next_waiting = NULL;
+      log_stream_resume( stream );
+    }
+  }
+  return;
+}
+
+static void log_stream_resume( struct log_stream* stream )
+{
+  stream->blocked = 0;
+  stream->overflowing = 0;
+  if( stream->paused ){
+    stream->paused = 0;
+    if( !stream->closed ){
+      VERIFY( 0 == event_loop_modify_fd( stream->loop , stream->fd , EVENT_LOOP_READ ) );
+    }
+  }
+  if( stream->closed ){
+    /* 詰まっている間に EOF を読んでいたので、溜めた分を送るだけ */
+    (void)log_stream_send_lines( stream , 1 );
+  }else if( 0 != log_stream_pump( stream ) ){
+    /* EOF あるいはエラー 後は log_stream_destroy に任せる */
+    stream->closed = 1;
+    VERIFY( 0 == event_loop_modify_fd( stream->loop , stream->fd , 0 ) );
+  }
+  return;
+}
+
+static void log_stream_on_batch_timer( struct event_loop* loop , event_loop_timer_id id , void* context )
+{
+  (void)loop;
+  (void)id;
+  struct log_stream* const stream = context;
+  assert( stream );
+  stream->batch_timer = 0; /* 一度だけのタイマーなので、すでに登録は外れている */
+  if( !stream->blocked ){
+    (void)log_stream_send_lines( stream , 0 );
+  }
+  return;
+}
+
+struct log_stream* log_stream_create( struct event_loop* loop , struct log_sink* sink , int fd ,
+                                      const char* tag , int priority )
+{
+  assert( loop );
+  assert( sink );
+  assert( tag );
+  struct log_stream* const stream = calloc( 1 , sizeof( struct log_stream ) );
+  if( NULL == stream ){
+    return NULL;
+  }
+  stream->loop = loop;
+  stream->sink = sink;
+  stream->fd = fd;
+  stream->priority = priority;
+  stream->capacity = LOG_STREAM_DEFAULT_BUFFER_SIZE;
+  stream->overflow = LOG_STREAM_OVERFLOW_BLOCK;
+  VERIFY( 0 < snprintf( stream->name , sizeof( stream->name ) , "%s" , tag ) );
+  log_stream_set_pid( stream , 0 );
+
+  const int fl = fcntl( fd , F_GETFL );
+  if( -1 == fl || -1 == fcntl( fd , F_SETFL , fl | O_NONBLOCK ) ||
+      -1 == event_loop_add_fd( loop , fd , EVENT_LOOP_READ , log_stream_on_readable , stream ) ){
+    const int err = errno;
+    free( stream );
+    errno = err;
+    return NULL;
+  }
+  return stream;
+}
+
+int log_stream_set_overflow( struct log_stream* stream , enum log_stream_overflow policy ,
+                             size_t buffer_bytes , unsigned int sample_rate )
+{
+  assert( stream );
+  if( 0 == buffer_bytes ){
+    buffer_bytes = LOG_STREAM_DEFAULT_BUFFER_SIZE;
+  }
+  if( LOG_SINK_SYSLOG != stream->sink->type || buffer_bytes < LOG_STREAM_MIN_BUFFER_SIZE ||
+      buffer_bytes < stream->length || ( LOG_STREAM_OVERFLOW_SAMPLE == policy && sample_rate < 2 ) ){
+    errno = EINVAL;
+    return -1;
+  }
+  switch( policy ){
+  case LOG_STREAM_OVERFLOW_BLOCK:
+  case LOG_STREAM_OVERFLOW_DROP_OLDEST:
+  case LOG_STREAM_OVERFLOW_DROP_NEWEST:
+  case LOG_STREAM_OVERFLOW_SAMPLE:
+    break;
+  default:
+    errno = EINVAL;
+    return -1;
+  }
+  if( stream->buffer && buffer_bytes != stream->capacity ){
+    char* const buffer = realloc( stream->buffer , buffer_bytes );
+    if( NULL == buffer ){
+      return -1;
+    }
+    stream->buffer = buffer;
+  }
+  stream->capacity = buffer_bytes;
+  stream->overflow = policy;
+  stream->sample_rate = sample_rate;
+  return 0;
+}
+
+int log_stream_set_batch( struct log_stream* stream , unsigned long long batch_us )
+{
+  assert( stream );
+  if( LOG_SINK_SYSLOG != stream->sink->type ){
+    errno = EINVAL;
+    return -1;
+  }
+  stream->batch_us = batch_us;
+  return 0;
+}
+
+int log_stream_set_classify( struct log_stream* stream , int enable )
+{
+  assert( stream );
+  if( LOG_SINK_SYSLOG != stream->sink->type ){
+    errno = EINVAL;
+    return -1;
+  }
+  stream->classify = ( enable ) ? 1 : 0;
+  return 0;
+}
+
+void log_stream_get_stats( const struct log_stream* stream , struct log_stream_stats* stats )
+{
+  assert( stream );
+  assert( stats );
+  *stats = stream->stats;
+  return;
+}
+
+void log_stream_set_pid( struct log_stream* stream , pid_t pid )
+{
+  assert( stream );
+  if( 0 < pid ){
+    VERIFY( 0 < snprintf( stream->tag , sizeof( stream->tag ) , "%s[%d]: " , stream->name , (int)pid ) );
+  }else{
+    VERIFY( 0 < snprintf( stream->tag , sizeof( stream->tag ) , "%s: " , stream->name ) );
+  }
+  return;
+}
+
+int log_stream_is_drained( const struct log_stream* stream )
+{
+  assert( stream );
+  return ( stream->closed && !stream->blocked && 0 == stream->length ) ? 1 : 0;
+}
+
+void log_stream_destroy( struct log_stream* stream )
+{
+  if( NULL == stream ){
+    return;
+  }
+  struct log_sink* const sink = stream->sink;
+  /* 待ち行列から外す */
+  for( struct log_stream** p = &(sink->waiting) ; *p ; p = &((*p)->next_waiting) ){
+    if( *p == stream ){
+      *p = stream->next_waiting;
+      break;
+    }
+  }
+  if( stream->batch_timer ){
+    VERIFY( 0 == event_loop_remove_timer( stream->loop , stream->batch_timer ) );
+    stream->batch_timer = 0;
+  }
+  stream->batch_us = 0; /* 溜めずに送りきる */
+  /* 残りを読めるだけ読んで送る ソケットが詰まっていた場合は諦める */
+  stream->blocked = 0;
+  stream->next_waiting = NULL;
+  if( ( 0 == log_stream_pump( stream ) || stream->blocked ) && LOG_SINK_SYSLOG == sink->type ){
+    (void)log_stream_send_lines( stream , 1 );
+  }
+  for( struct log_stream** p = &(sink->waiting) ; *p ; p = &((*p)->next_waiting) ){
+    if( *p == stream ){
+      *p = stream->next_waiting;
+      break;
+    }
+  }
+  VERIFY( 0 == event_loop_remove_fd( stream->loop , stream->fd ) );
+  VERIFY( 0 == close( stream->fd ) );
+  free( stream->buffer );
+  free( stream );
+  return;
+}
+
+static void log_stream_on_readable( struct event_loop* loop , int fd , unsigned int events , void* context )
+{
+  (void)events;
+  struct log_stream* const stream = context;
+  assert( stream );
+  /* 監視を止めても、 epoll(7) は EPOLLHUP を一度は報告してくるので、ここで無視する */
+  if( stream->paused || stream->closed ){
+    return;
+  }
+  const int result = ( stream->blocked ) ? log_stream_absorb( stream ) : log_stream_pump( stream );
+  if( 0 != result ){
+    /* EOF あるいはエラー これ以上読んでも仕方がないので、監視だけ止める */
+    stream->closed = 1;
+    VERIFY( 0 == event_loop_modify_fd( loop , fd , 0 ) );
+  }
+  return;
+}
+
+/**
+   RFC 3164 の時刻 "Mmm dd hh:mm:ss" を作る
+   strftime(3) の %b はロケールに依存するので、月の名前は自前で持つ
+*/
+static void log_sink_format_timestamp( char* buffer , size_t size )
+{
+  static const char months[12][4] = { "Jan" , "Feb" , "Mar" , "Apr" , "May" , "Jun" ,
+                                      "Jul" , "Aug" , "Sep" , "Oct" , "Nov" , "Dec" };
+  const time_t now = time( NULL );
+  struct tm tm = {0};
+  VERIFY( NULL != localtime_r( &now , &tm ) );
+  VERIFY( 0 < snprintf( buffer , size , "%s %2d %02d:%02d:%02d" ,
+                        months[ tm.tm_mon % 12 ] , tm.tm_mday , tm.tm_hour , tm.tm_min , tm.tm_sec ) );
+  return;
+}
+
+static size_t log_stream_format_header( const struct log_stream* stream , int priority ,
+                                        char* buffer , size_t size )
+{
+  char timestamp[32];
+  log_sink_format_timestamp( timestamp , sizeof( timestamp ) );
+  const int length = snprintf( buffer , size , "<%d>%s %s" , priority , timestamp , stream->tag );
+  VERIFY( 0 < length && (size_t)length < size );
+  return (size_t)length;
+}
+
+static int log_stream_send_lines( struct log_stream* stream , int force )
+{
+  struct log_sink* const sink = stream->sink;
+  if( stream->batch_timer ){
+    /* 溜めていた分も、ここで送る */
+    VERIFY( 0 == event_loop_remove_timer( stream->loop , stream->batch_timer ) );
+    stream->batch_timer = 0;
+  }
+  char header[ 64 + sizeof( stream->tag ) ];
+  const size_t header_length = log_stream_format_header( stream , stream->priority , header , sizeof( header ) );
+  /* classify の場合の level 毎のヘッダ 使う時に作る ( 一度の呼び出しの中では時刻は同じ ) */
+  char level_headers[ LOG_DEBUG + 1 ][ 64 + sizeof( stream->tag ) ];
+  size_t level_header_lengths[ LOG_DEBUG + 1 ] = {0};
+
+  size_t consumed = 0;
+  int blocked = 0;
+  for(;;){
+    /* バッファの先頭から、完全な行を LOG_SINK_BATCH_MAX 行まで集める */
+    unsigned int count = 0;
+    size_t offset = consumed;
+    while( count < LOG_SINK_BATCH_MAX && offset < stream->length ){
+      const char* const begin = stream->buffer + offset;
+      const char* const newline = linesplit_find_newline( begin , stream->length - offset );
+      if( NULL == newline && !force ){
+        break;
+      }
+      const size_t line_length = ( newline ) ? (size_t)( newline - begin ) : ( stream->length - offset );
+      offset += line_length + ( newline ? 1 : 0 );
+      if( 0 == line_length ){
+        continue; /* 空行は送らない */
+      }
+      sink->iov[count][0].iov_base = header;
+      sink->iov[count][0].iov_len = header_length;
+      if( stream->classify ){
+        const int level = linesplit_classify( begin , line_length );
+        if( 0 <= level ){
+          if( 0 == level_header_lengths[level] ){
+            level_header_lengths[level] =
+              log_stream_format_header( stream , ( stream->priority & LOG_FACMASK ) | level ,
+                                        level_headers[level] , sizeof( level_headers[level] ) );
+          }
+          sink->iov[count][0].iov_base = level_headers[level];
+          sink->iov[count][0].iov_len = level_header_lengths[level];
+        }
+      }
+      sink->iov[count][1].iov_base = (void*)begin;
+      sink->iov[count][1].iov_len = line_length;
+      memset( &(sink->messages[count]) , 0 , sizeof( sink->messages[count] ) );
+      sink->messages[count].msg_hdr.msg_iov = sink->iov[count];
+      sink->messages[count].msg_hdr.msg_iovlen = 2;
+      ++count;
+    }
+    if( 0 == count ){
+      consumed = offset;
+      break;
+    }
+
+    unsigned int sent = 0;
+    if( 0 != log_sink_connect( sink ) ){
+      /* syslogd がいないので捨てる */
+      for( ; sent < count ; ++sent ){
+        ++(stream->stats.dropped_lines);
+        stream->stats.dropped_bytes += (unsigned long long)sink->iov[sent][1].iov_len;
+      }
+    }
+    while( sent < count ){
+#if defined( HAVE_SENDMMSG )
+      const int result = sendmmsg( sink->fd , &(sink->messages[sent]) , count - sent , MSG_DONTWAIT );
+#else /* defined( HAVE_SENDMMSG ) */
+      const int result =
+        ( -1 == sendmsg( sink->fd , &(sink->messages[sent].msg_hdr) , MSG_DONTWAIT ) ) ? -1 : 1;
+#endif /* defined( HAVE_SENDMMSG ) */
+      if( 0 < result ){
+        sent += (unsigned int)result;
+        stream->stats.sent_lines += (unsigned long)result;
+        continue;
+      }
+      if( EINTR == errno ){
+        continue;
+      }
+      if( EAGAIN == errno || EWOULDBLOCK == errno || ENOBUFS == errno ){
+        blocked = 1;
+        break;
+      }
+      if( EMSGSIZE == errno ){
+        ++(stream->stats.dropped_lines);
+        stream->stats.dropped_bytes += (unsigned long long)sink->iov[sent][1].iov_len;
+        ++sent;
+        continue;
+      }
+      /* syslogd が再起動したなど 次の送信で接続しなおす */
+      log_sink_disconnect( sink );
+      for( ; sent < count ; ++sent ){
+        ++(stream->stats.dropped_lines);
+        stream->stats.dropped_bytes += (unsigned long long)sink->iov[sent][1].iov_len;
+      }
+    }
+
+    /* 送った行の分だけ consumed を進める */
+    if( sent == count ){
+      consumed = offset;
+    }else{
+      consumed = (size_t)( (const char*)sink->iov[sent][1].iov_base - stream->buffer );
+    }
+    if( blocked ){
+      break;
+    }
+    if( offset == consumed && count < LOG_SINK_BATCH_MAX ){
+      break;
+    }
+  }
+
+  if( 0 < consumed ){
+    memmove( stream->buffer , stream->buffer + consumed , stream->length - consumed );
+    stream->length -= consumed;
+  }
+  if( !blocked && stream->reported_lines != stream->stats.dropped_lines ){
+    blocked = log_stream_report_drops( stream );
+  }
+
+  if( blocked ){
+    /* ソケットが書き込み可能になるまで、待ち行列に入る
+       その間に読んだ行は log_stream_absorb でバッファに溜める */
+    if( !stream->blocked ){
+      stream->blocked = 1;
+      ++(stream->stats.congestions);
+      stream->next_waiting = sink->waiting;
+      sink->waiting = stream;
+      VERIFY( 0 == event_loop_modify_fd( sink->loop , sink->fd , EVENT_LOOP_WRITE ) );
+    }
+    return 1;
+  }
+  return 0;
+}
+
+static int log_stream_report_drops( struct log_stream* stream )
+{
+  struct log_sink* const sink = stream->sink;
+  if( 0 > sink->fd ){
+    return 0; /* syslogd がいない 次に接続できた時に知らせる */
+  }
+  char message[ 256 + sizeof( stream->tag ) ];
+  const size_t header_length =
+    log_stream_format_header( stream , ( stream->priority & LOG_FACMASK ) | LOG_WARNING , message , sizeof( message ) );
+  const int length = snprintf( message + header_length , sizeof( message ) - header_length ,
+                               "daemonic: dropped %lu lines (%llu bytes) of output" ,
+                               stream->stats.dropped_lines - stream->reported_lines ,
+                               stream->stats.dropped_bytes - stream->reported_bytes );
+  VERIFY( 0 < length && (size_t)length < sizeof( message ) - header_length );
+  if( -1 == send( sink->fd , message , header_length + (size_t)length , MSG_DONTWAIT ) ){
+    return ( EAGAIN == errno || EWOULDBLOCK == errno || ENOBUFS == errno ) ? 1 : 0;
+  }
+  stream->reported_lines = stream->stats.dropped_lines;
+  stream->reported_bytes = stream->stats.dropped_bytes;
+  return 0;
+}
+
+static size_t log_stream_accept( struct log_stream* stream , char* data , size_t size ,
+                                 enum log_stream_accept_mode mode )
+{
+  size_t kept = 0;
+  size_t offset = 0;
+  while( offset < size ){
+    if( !stream->in_line ){
+      /* 行の先頭で、この行を残すかどうかを決める */
+      switch( mode ){
+      case LOG_STREAM_ACCEPT_ALL:
+        stream->dropping = 0;
+        break;
+      case LOG_STREAM_ACCEPT_SAMPLE:
+        stream->dropping = ( 0 != ( stream->sample_count++ % stream->sample_rate ) );
+        break;
+      default:
+        stream->dropping = 1;
+        break;
+      }
+      if( stream->dropping ){
+        ++(stream->stats.dropped_lines);
+      }
+    }
+    if( !stream->dropping && LOG_STREAM_ACCEPT_ALL == mode ){
+      /* 残りは全て残すので、最後が行の途中かどうかだけを見る */
+      if( kept != offset ){
+        memmove( data + kept , data + offset , size - offset );
+      }
+      kept += size - offset;
+      stream->in_line = ( '\n' != data[ size - 1 ] );
+      break;
+    }
+    const char* const newline = linesplit_find_newline( data + offset , size - offset );
+    const size_t end = ( newline ) ? (size_t)( newline - data ) + 1 : size;
+    stream->in_line = ( NULL == newline );
+    if( stream->dropping ){
+      stream->stats.dropped_bytes += (unsigned long long)( end - offset );
+    }else{
+      if( kept != offset ){
+        memmove( data + kept , data + offset , end - offset );
+      }
+      kept += end - offset;
+    }
+    offset = end;
+  }
+  return kept;
+}
+
+static void log_stream_drop_oldest( struct log_stream* stream , size_t size )
+{
+  size_t dropped = 0;
+  while( dropped < size && dropped < stream->length ){
+    const char* const newline = linesplit_find_newline( stream->buffer + dropped , stream->length - dropped );
+    ++(stream->stats.dropped_lines);
+    if( NULL == newline ){
+      /* 読み込み途中の行 残りも捨てる */
+      dropped = stream->length;
+      stream->dropping = 1;
+      break;
+    }
+    dropped = (size_t)( newline - stream->buffer ) + 1;
+  }
+  stream->stats.dropped_bytes += (unsigned long long)dropped;
+  memmove( stream->buffer , stream->buffer + dropped , stream->length - dropped );
+  stream->length -= dropped;
+  return;
+}
+
+static int log_stream_absorb( struct log_stream* stream )
+{
+  char scratch[ LOG_STREAM_SCRATCH_SIZE ];
+  for(;;){
+    if( stream->capacity == stream->length ){
+      if( !stream->overflowing ){
+        stream->overflowing = 1;
+        stream->sample_count = 0;
+      }
+      if( LOG_STREAM_OVERFLOW_BLOCK == stream->overflow ){
+        /* ソケットが空くまでパイプを読まない */
+        stream->paused = 1;
+        VERIFY( 0 == event_loop_modify_fd( stream->loop , stream->fd , 0 ) );
+        return 0;
+      }
+      if( LOG_STREAM_OVERFLOW_DROP_NEWEST != stream->overflow ){
+        log_stream_drop_oldest( stream , stream->capacity / 4 );
+      }else if( stream->in_line && !stream->dropping ){
+        /* 末尾の読み込み途中の行は、続きを捨てるので完成しない これも捨てる */
+        const char* const newline = memrchr( stream->buffer , '\n' , stream->length );
+        const size_t keep = ( newline ) ? (size_t)( newline - stream->buffer ) + 1 : 0;
+        ++(stream->stats.dropped_lines);
+        stream->stats.dropped_bytes += (unsigned long long)( stream->length - keep );
+        stream->length = keep;
+        stream->dropping = 1;
+      }
+    }
+    /* LOG_STREAM_OVERFLOW_DROP_NEWEST でバッファが一杯の場合は、読んで捨てる */
+    const int discard = ( stream->capacity == stream->length );
+    char* const data = ( discard ) ? scratch : stream->buffer + stream->length;
+    const size_t size = ( discard ) ? sizeof( scratch ) : stream->capacity - stream->length;
+    const ssize_t read_result = read( stream->fd , data , size );
+    if( 0 < read_result ){
+      stream->stats.read_bytes += (unsigned long long)read_result;
+      enum log_stream_accept_mode mode = LOG_STREAM_ACCEPT_ALL;
+      if( discard ){
+        mode = LOG_STREAM_ACCEPT_NONE;
+      }else if( stream->overflowing && LOG_STREAM_OVERFLOW_SAMPLE == stream->overflow ){
+        mode = LOG_STREAM_ACCEPT_SAMPLE;
+      }
+      const size_t kept = log_stream_accept( stream , data , (size_t)read_result , mode );
+      if( !discard ){
+        stream->length += kept;
+        if( stream->stats.buffer_high_water < stream->length ){
+          stream->stats.buffer_high_water = stream->length;
+        }
+      }
+      continue;
+    }
+    if( 0 == read_result ){
+      return 1; /* 溜めた分は、ソケットが空いた時に送る */
+    }
+    if( EINTR == errno ){
+      continue;
+    }
+    return ( EAGAIN == errno || EWOULDBLOCK == errno ) ? 0 : -1;
+  }
+}
+
+static int log_stream_pump_file( struct log_stream* stream )
+{
+  struct log_sink* const sink = stream->sink;
+  for(;;){
+#if defined( HAVE_SPLICE )
+    if( !( sink->flags & LOG_SINK_FILE_COPY ) ){
+      const ssize_t result = splice( stream->fd , NULL , sink->fd , NULL , LOG_SINK_SPLICE_MAX ,
+                                     SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+      if( 0 < result ){
+        stream->stats.read_bytes += (unsigned long long)result;
+        log_sink_account( sink , (size_t)result );
+        continue;
+      }
+      if( 0 == result ){
+        return 1;
+      }
+      if( EINTR == errno ){
+        continue;
+      }
+      if( EAGAIN == errno || EWOULDBLOCK == errno ){
+        return 0;
+      }
+      /* ファイルシステムが splice(2) に対応していない ( EINVAL ) か 書き込みに失敗した
+         以後はコピーして、書き込めない分は捨てる */
+      sink->flags |= LOG_SINK_FILE_COPY;
+      continue;
+    }
+#endif /* defined( HAVE_SPLICE ) */
+    if( NULL == stream->buffer ){
+      stream->buffer = malloc( stream->capacity );
+      if( NULL == stream->buffer ){
+        return -1;
+      }
+    }
+    const ssize_t read_result = read( stream->fd , stream->buffer , stream->capacity );
+    if( 0 == read_result ){
+      return 1;
+    }
+    if( read_result < 0 ){
+      if( EINTR == errno ){
+        continue;
+      }
+      return ( EAGAIN == errno || EWOULDBLOCK == errno ) ? 0 : -1;
+    }
+    stream->stats.read_bytes += (unsigned long long)read_result;
+    for( size_t offset = 0 ; offset < (size_t)read_result ; ){
+      const ssize_t write_result = write( sink->fd , stream->buffer + offset , (size_t)read_result - offset );
+      if( 0 < write_result ){
+        offset += (size_t)write_result;
+        log_sink_account( sink , (size_t)write_result );
+        continue;
+      }
+      if( write_result < 0 && EINTR == errno ){
+        continue;
+      }
+      /* ENOSPC など 子プロセスを止めないように、書き込めない分は捨てて読み進める */
+      stream->stats.dropped_bytes += (unsigned long long)( (size_t)read_result - offset );
+      break;
+    }
+  }
+}
+
+static int log_stream_pump( struct log_stream* stream )
+{
+  assert( stream );
+  if( LOG_SINK_FILE == stream->sink->type ){
+    const int result = log_stream_pump_file( stream );
+    /* window が 0 の場合は、読み切る毎に同期する EOF の場合は待たずに同期する */
+    if( 0 != result || 0 == stream->sink->durable_window_us ){
+      log_sink_sync( stream->sink );
+    }
+    return result;
+  }
+  if( NULL == stream->buffer ){
+    stream->buffer = malloc( stream->capacity );
+    if( NULL == stream->buffer ){
+      return -1;
+    }
+  }
+  /* ソケットが詰まっている間に溜めた行と、捨てた行の知らせを、先に送る ( batch_us で溜めている場合は除く ) */
+  if( 0 == stream->batch_timer &&
+      ( 0 < stream->length || stream->reported_lines != stream->stats.dropped_lines ) &&
+      0 != log_stream_send_lines( stream , 0 ) ){
+    return 0;
+  }
+  for(;;){
+    if( stream->capacity == stream->length ){
+      /* 一行がバッファより長いので、ここで区切って送る */
+      if( 0 != log_stream_send_lines( stream , 1 ) ){
+        return 0;
+      }
+    }
+    const ssize_t read_result = read( stream->fd , stream->buffer + stream->length ,
+                                      stream->capacity - stream->length );
+    if( 0 < read_result ){
+      stream->stats.read_bytes += (unsigned long long)read_result;
+      stream->length += log_stream_accept( stream , stream->buffer + stream->length , (size_t)read_result ,
+                                           LOG_STREAM_ACCEPT_ALL );
+      if( stream->stats.buffer_high_water < stream->length ){
+        stream->stats.buffer_high_water = stream->length;
+      }
+      if( 0 < stream->batch_us && stream->length < stream->capacity / 2 ){
+        /* バッファの半分までは、 batch_us の間溜めてからまとめて送る */
+        if( 0 == stream->batch_timer ){
+          stream->batch_timer = event_loop_add_timer( stream->loop , stream->batch_us , 0 ,
+                                                      log_stream_on_batch_timer , stream );
+        }
+        if( stream->batch_timer ){
+          continue;
+        }
+      }
+      if( 0 != log_stream_send_lines( stream , 0 ) ){
+        return 0; /* ソケットが詰まったので、書き込み可能になるまで log_stream_absorb で溜める */
+      }
+      continue;
+    }
+    if( 0 == read_result ){
+      (void)log_stream_send_lines( stream , 1 );
+      return 1;
+    }
+    if( EINTR == errno ){
+      continue;
+    }
+    if( EAGAIN == errno || EWOULDBLOCK == errno ){
+      return 0;
+    }
+    return -1;
+  }
+}
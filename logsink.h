@@ -0,0 +1,216 @@
+﻿#if ! defined( LOGSINK_H_HEADER_GUARD )
+#define LOGSINK_H_HEADER_GUARD 1
+
+/**
+   ターゲットプロセスの標準出力と標準エラー出力を、コントロールプロセス自身が
+   読み込んで転送する。
+
+   log_stream は子プロセスの出力をつなげたパイプの読み込み側で、
+   読み込んだデータを行に分けて log_sink へ送る。
+   log_sink は syslog の unix ドメインソケット ( 通常は /dev/log ) で、
+   一回の起床で読めた行を sendmmsg(2) でまとめてデータグラムとして送信する。
+
+   syslogd が詰まってソケットが EAGAIN を返した時には、ソケットが書き込み可能になるまで
+   読み込んだ行を log_stream のバッファに溜める。 バッファが一杯になった時には、
+   log_stream_set_overflow で選んだ方針に従って、パイプの読み込みを止める ( 既定値 ) か、行を捨てる。
+   ( パイプの読み込みを止めて、パイプが一杯になると子プロセスの write(2) が止まる )
+
+   log_sink をファイルにした場合は、パイプの中身を splice(2) でそのままファイルへ移す。
+   行の区切りを見ないので、一つのファイルの log_sink には一つの log_stream だけをつなげること。
+   ファイルは、大きさと経過時間でローテーションでき、 log_sink_reopen で開きなおせる。
+   log_sink_set_durable で、 x_fdatasync をまとめて行う ( group commit ) durable モードにできる。
+ */
+
+#include <sys/types.h>
+
+struct event_loop;
+struct log_sink;
+struct log_stream;
+
+/** syslog のソケットの既定のパス */
+#define LOG_SINK_DEFAULT_SYSLOG_PATH "/dev/log"
+
+/** log_stream のバッファの既定の大きさ これより長い行は分割される */
+#define LOG_STREAM_DEFAULT_BUFFER_SIZE ( (size_t)32 * 1024 )
+
+/** log_stream_set_overflow で指定できる、バッファの最小の大きさ */
+#define LOG_STREAM_MIN_BUFFER_SIZE ( (size_t)4 * 1024 )
+
+/** durable モードで、 max_bytes を省略した時の値 */
+#define LOG_SINK_DURABLE_DEFAULT_BYTES ( 1024ULL * 1024ULL )
+
+/** log_sink の統計 */
+struct log_sink_stats{
+  /** 書き込んだバイト数 ( ファイル ) */
+  unsigned long long written_bytes;
+  /** durable モードで x_fdatasync した回数 */
+  unsigned long syncs;
+  /** durable モードで x_fdatasync したバイト数 */
+  unsigned long long synced_bytes;
+  /** 最初の未同期の書き込みから、 x_fdatasync が終わるまでの時間の合計と最大 ( マイクロ秒 ) */
+  unsigned long long sync_latency_total_us;
+  unsigned long long sync_latency_max_us;
+};
+
+/** log_stream の統計 */
+struct log_stream_stats{
+  /** パイプから読んだバイト数 */
+  unsigned long long read_bytes;
+  /** 送った行数 ( syslog ) */
+  unsigned long sent_lines;
+  /** 捨てた行数 ( バッファが溢れた 接続できなかった 長すぎた ) */
+  unsigned long dropped_lines;
+  /** 捨てたバイト数 ( ファイルの場合は書き込めなかったバイト数 ) */
+  unsigned long long dropped_bytes;
+  /** ソケットが詰まった回数 */
+  unsigned long congestions;
+  /** バッファに溜まった最大のバイト数 */
+  size_t buffer_high_water;
+};
+
+/** バッファが一杯になった時の扱い */
+enum log_stream_overflow{
+  /** パイプの読み込みを止める 子プロセスの write(2) は、いずれ止まる */
+  LOG_STREAM_OVERFLOW_BLOCK = 0,
+  /** バッファの先頭の古い行を捨てて、新しい行を溜める */
+  LOG_STREAM_OVERFLOW_DROP_OLDEST ,
+  /** 新しく読んだ行を捨てる */
+  LOG_STREAM_OVERFLOW_DROP_NEWEST ,
+  /** 新しく読んだ行を sample_rate 行に一行だけ残し、場所は古い行を捨てて作る */
+  LOG_STREAM_OVERFLOW_SAMPLE
+};
+
+/** log_sink_create_file の flags */
+enum{
+  /** splice(2) を使わずに、 read(2) と write(2) でコピーする ( 比較用 ) */
+  LOG_SINK_FILE_COPY = 0x01
+};
+
+/**
+   syslog のソケットへ送る log_sink を作成する
+   ソケットへの接続は最初の送信時に行い、接続できない間は行を捨てて、一秒毎に接続をやり直す。
+   @return 失敗した場合は NULL を返し、理由を errno に保存する。
+   @param socket_path unix ドメインのデータグラムソケットのパス
+ */
+struct log_sink* log_sink_create_syslog( struct event_loop* loop , const char* socket_path );
+
+/**
+   ファイルへ書き込む log_sink を作成する
+   ファイルが無い場合は作成し、ある場合は末尾に追記する。
+   splice(2) が使えない環境や、ファイルシステムが splice(2) に対応していない場合は
+   read(2) と write(2) でコピーする。
+   @return 失敗した場合は NULL を返し、理由を errno に保存する。
+   @param flags LOG_SINK_FILE_COPY の論理和
+ */
+struct log_sink* log_sink_create_file( struct event_loop* loop , const char* path , unsigned int flags );
+
+/** log_sink_set_rotation の flags */
+enum{
+  /** ローテーションしたファイルを gzip(1) の子プロセスで圧縮する */
+  LOG_SINK_ROTATE_COMPRESS = 0x01
+};
+
+/**
+   ファイルの log_sink のローテーションを設定する
+   ローテーションしたファイルは "パス.YYYYmmdd-HHMMSS" になり、元のパスに新しいファイルを作る。
+   @return 成功した場合は 0 失敗した場合は -1 を返し、理由を errno に保存する。 ( syslog の log_sink は EINVAL )
+   @param max_bytes ファイルがこの大きさ以上になったらローテーションする 0 の場合は大きさでは行わない
+   @param max_age_sec この秒数毎にローテーションする ( 空のファイルはそのまま ) 0 の場合は時間では行わない
+   @param flags LOG_SINK_ROTATE_COMPRESS の論理和
+ */
+int log_sink_set_rotation( struct log_sink* sink , unsigned long long max_bytes , unsigned int max_age_sec ,
+                           unsigned int flags );
+
+/**
+   出力先を開きなおす
+   ファイルの場合は、同じパスを開きなおす。 ( logrotate(8) などで外から rename した後に使う )
+   syslog の場合は、次の送信でソケットに接続しなおす。
+   @return 成功した場合は 0 失敗した場合は -1 を返し、理由を errno に保存する。 ( 元の出力先を使い続ける )
+ */
+int log_sink_reopen( struct log_sink* sink );
+
+/**
+   ファイルの log_sink を durable モードにする
+   ファイルに書き込んだデータは、未同期の分が max_bytes に達するか、最初の未同期の書き込みから
+   window_us が過ぎた時に、まとめて x_fdatasync される。 同期している間はパイプを読まないので、
+   ディスクに届いていないデータの量は max_bytes 程度に抑えられる。
+   window_us を大きくすると fdatasync の回数が減ってスループットが上がり、
+   小さくすると、書き込んでからディスクに届くまでの遅延が短くなる。
+   @return 成功した場合は 0 失敗した場合は -1 を返し、理由を errno に保存する。 ( syslog の log_sink は EINVAL )
+   @param window_us 0 の場合は、パイプを読み切る毎に同期する
+   @param max_bytes 0 の場合は LOG_SINK_DURABLE_DEFAULT_BYTES
+ */
+int log_sink_set_durable( struct log_sink* sink , unsigned long long window_us , unsigned long long max_bytes );
+
+/**
+   log_sink の統計を得る
+ */
+void log_sink_get_stats( const struct log_sink* sink , struct log_sink_stats* stats );
+
+/**
+   log_sink を破棄する 先に全ての log_stream を破棄しておくこと。
+ */
+void log_sink_destroy( struct log_sink* sink );
+
+/**
+   パイプの読み込み側 fd から読み込んで sink へ送る log_stream を作成して、イベントループに登録する
+   fd は O_NONBLOCK に設定され、 log_stream_destroy で閉じられる。
+   @return 失敗した場合は NULL を返し、理由を errno に保存する。
+   @param tag syslog のタグ ( サービスの名前 )
+   @param priority syslog の facility と priority の論理和 ( LOG_USER | LOG_NOTICE など )
+ */
+struct log_stream* log_stream_create( struct event_loop* loop , struct log_sink* sink , int fd ,
+                                      const char* tag , int priority );
+
+/**
+   バッファの大きさと、一杯になった時の扱いを設定する ( syslog の log_stream のみ )
+   ファイルの log_stream は splice(2) で移すのでバッファを持たず、常に LOG_STREAM_OVERFLOW_BLOCK になる。
+   @return 成功した場合は 0 失敗した場合は -1 を返し、理由を errno に保存する。
+   ( ファイルの log_stream や、 buffer_bytes が LOG_STREAM_MIN_BUFFER_SIZE 未満の場合は EINVAL )
+   @param policy enum log_stream_overflow
+   @param buffer_bytes バッファの大きさ 0 の場合は LOG_STREAM_DEFAULT_BUFFER_SIZE
+   @param sample_rate LOG_STREAM_OVERFLOW_SAMPLE で、何行に一行を残すか ( 2 以上 ) それ以外では使わない
+ */
+int log_stream_set_overflow( struct log_stream* stream , enum log_stream_overflow policy ,
+                             size_t buffer_bytes , unsigned int sample_rate );
+
+/**
+   読んだ行を、最初の行から batch_us が過ぎるか、バッファの半分に達するまで溜めて、まとめて送る
+   ( syslog の log_stream のみ ) ソケットが空いた時は、 batch_us が 0 の log_stream を先に再開する。
+   @return 成功した場合は 0 失敗した場合は -1 を返し、理由を errno に保存する。 ( ファイルの log_stream は EINVAL )
+   @param batch_us 0 の場合は、読む毎にすぐ送る ( 既定値 )
+ */
+int log_stream_set_batch( struct log_stream* stream , unsigned long long batch_us );
+
+/**
+   行の先頭の "ERROR" "[W]" "<3>" などの印から level を推定して、その level で送る ( syslog の log_stream のみ )
+   facility は log_stream_create の priority のものを使い、印が無い行は priority のまま送る。
+   @return 成功した場合は 0 失敗した場合は -1 を返し、理由を errno に保存する。 ( ファイルの log_stream は EINVAL )
+   @param enable 0 以外の場合は推定する 0 の場合はしない ( 既定値 )
+*/
+int log_stream_set_classify( struct log_stream* stream , int enable );
+
+/**
+   log_stream の統計を得る
+ */
+void log_stream_get_stats( const struct log_stream* stream , struct log_stream_stats* stats );
+
+/**
+   syslog のタグに付ける、プロセスID を設定する
+ */
+void log_stream_set_pid( struct log_stream* stream , pid_t pid );
+
+/**
+   書き込み側が全て閉じられて ( EOF を読んで ) 、読み込んだデータを全て送り終えたかどうか
+   終了時に、イベントループを回してログを送りきるのを待つために使う。
+   @return 送り終えた場合は 1 そうでない場合は 0
+ */
+int log_stream_is_drained( const struct log_stream* stream );
+
+/**
+   パイプに残っているデータを読めるだけ読み込んで送ってから、log_stream を破棄する
+   改行で終わっていない最後の行も送る。
+ */
+void log_stream_destroy( struct log_stream* stream );
+
+#endif /* LOGSINK_H_HEADER_GUARD */
@@ -0,0 +1,228 @@
+﻿/**
+   サービスからの状態の通知 ( sd_notify(3) と同じ書式 ) を受け取る
+ */
+
+/* struct ucred の宣言を得るために必要 */
+#if !defined( _GNU_SOURCE )
+#define _GNU_SOURCE 1
+#endif /* !defined( _GNU_SOURCE ) */
+
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif /* defined(HAVE_CONFIG_H) */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <assert.h>
+
+#include "verify.h"
+#include "eventloop.h"
+#include "notify.h"
+
+enum{
+  /** 一つの通知の最大の大きさ ( sd_notify(3) の通知は短い ) これより長い部分は捨てる */
+  NOTIFY_MESSAGE_MAX = 4096
+};
+
+struct notify_socket{
+  struct event_loop* loop;
+  int fd;
+  char* path;
+  notify_socket_handler handler;
+  void* context;
+};
+
+/**
+   ソケットが読み込み可能になった時のハンドラ EAGAIN になるまで読んで、一つずつ handler に渡す
+ */
+static void notify_socket_on_read( struct event_loop* loop , int fd , unsigned int events , void* context );
+
+/**
+   message の "MAINPID=" の値を返す
+   @return 無い場合は 0
+ */
+static pid_t notify_message_mainpid( const char* message );
+
+/************************* 実装 **************************/
+
+struct notify_socket* notify_socket_create( struct event_loop* loop , const char* path )
+{
+  assert( loop );
+  assert( path );
+  struct sockaddr_un addr;
+  memset( &addr , 0 , sizeof( addr ) );
+  if( sizeof( addr.sun_path ) <= strlen( path ) ){
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  addr.sun_family = AF_UNIX;
+  memcpy( addr.sun_path , path , strlen( path ) + 1 );
+
+  struct notify_socket* const notify = calloc( 1 , sizeof( struct notify_socket ) );
+  if( NULL == notify ){
+    return NULL;
+  }
+  notify->loop = loop;
+  notify->fd = -1;
+  notify->path = strdup( path );
+  if( NULL == notify->path ){
+    goto ERROR_HANDLE_SOCKET;
+  }
+  notify->fd = socket( AF_UNIX , SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK , 0 );
+  if( -1 == notify->fd ){
+    goto ERROR_HANDLE_SOCKET;
+  }
+  (void)unlink( path );
+  if( -1 == bind( notify->fd , (const struct sockaddr*)&addr , sizeof( addr ) ) ){
+    goto ERROR_HANDLE_SOCKET;
+  }
+#if defined( SO_PASSCRED )
+  {
+    const int on = 1;
+    VERIFY( 0 == setsockopt( notify->fd , SOL_SOCKET , SO_PASSCRED , &on , sizeof( on ) ) );
+  }
+#endif /* defined( SO_PASSCRED ) */
+  if( 0 != event_loop_add_fd( loop , notify->fd , EVENT_LOOP_READ , notify_socket_on_read , notify ) ){
+    const int err = errno;
+    (void)unlink( path );
+    errno = err;
+    goto ERROR_HANDLE_SOCKET;
+  }
+  return notify;
+
+ERROR_HANDLE_SOCKET:
+  {
+    const int err = errno;
+    if( 0 <= notify->fd ){
+      VERIFY( 0 == close( notify->fd ) );
+    }
+    free( notify->path );
+    free( notify );
+    errno = err;
+  }
+  return NULL;
+}
+
+void notify_socket_set_handler( struct notify_socket* notify , notify_socket_handler handler , void* context )
+{
+  assert( notify );
+  notify->handler = handler;
+  notify->context = context;
+  return;
+}
+
+const char* notify_socket_path( const struct notify_socket* notify )
+{
+  assert( notify );
+  return notify->path;
+}
+
+static void notify_socket_on_read( struct event_loop* loop , int fd , unsigned int events , void* context )
+{
+  (void)loop;
+  (void)events;
+  struct notify_socket* const notify = context;
+  assert( notify );
+  for(;;){
+    char message[NOTIFY_MESSAGE_MAX + 1];
+    struct iovec iov = { message , NOTIFY_MESSAGE_MAX };
+    union{
+      struct cmsghdr header;
+      char buffer[CMSG_SPACE( 256 )];
+    } control;
+    struct msghdr msg;
+    memset( &msg , 0 , sizeof( msg ) );
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = &control;
+    msg.msg_controllen = sizeof( control );
+
+    const ssize_t length = recvmsg( fd , &msg , MSG_DONTWAIT | MSG_CMSG_CLOEXEC );
+    if( -1 == length ){
+      if( EINTR == errno ){
+        continue;
+      }
+      break; /* EAGAIN */
+    }
+    message[length] = '\0';
+
+    pid_t pid = 0;
+    for( struct cmsghdr* cmsg = CMSG_FIRSTHDR( &msg ) ; cmsg ; cmsg = CMSG_NXTHDR( &msg , cmsg ) ){
+#if defined( SCM_CREDENTIALS )
+      if( SOL_SOCKET == cmsg->cmsg_level && SCM_CREDENTIALS == cmsg->cmsg_type ){
+        struct ucred credentials;
+        memcpy( &credentials , CMSG_DATA( cmsg ) , sizeof( credentials ) );
+        pid = credentials.pid;
+      }
+#endif /* defined( SCM_CREDENTIALS ) */
+      if( SOL_SOCKET == cmsg->cmsg_level && SCM_RIGHTS == cmsg->cmsg_type ){
+        /* fd を送ってくるもの ( FDSTORE=1 ) には対応しないので閉じる */
+        const size_t count = ( cmsg->cmsg_len - CMSG_LEN( 0 ) ) / sizeof( int );
+        for( size_t i = 0 ; i < count ; ++i ){
+          int passed = -1;
+          memcpy( &passed , CMSG_DATA( cmsg ) + i * sizeof( int ) , sizeof( int ) );
+          VERIFY( 0 == close( passed ) );
+        }
+      }
+    }
+    if( 0 == pid ){
+      pid = notify_message_mainpid( message );
+    }
+    if( notify->handler ){
+      notify->handler( notify , pid , message , notify->context );
+    }
+  }
+  return;
+}
+
+static pid_t notify_message_mainpid( const char* message )
+{
+  static const char key[] = "MAINPID=";
+  for( const char* line = message ; line && *line ; ){
+    if( 0 == strncmp( line , key , sizeof( key ) - 1 ) ){
+      const long pid = strtol( line + sizeof( key ) - 1 , NULL , 10 );
+      return ( 0 < pid ) ? (pid_t)pid : 0;
+    }
+    line = strchr( line , '\n' );
+    if( line ){
+      ++line;
+    }
+  }
+  return 0;
+}
+
+int notify_message_has( const char* message , const char* assignment )
+{
+  assert( message );
+  assert( assignment );
+  const size_t length = strlen( assignment );
+  for( const char* line = message ; line && *line ; ){
+    if( 0 == strncmp( line , assignment , length ) && ( '\n' == line[length] || '\0' == line[length] ) ){
+      return 1;
+    }
+    line = strchr( line , '\n' );
+    if( line ){
+      ++line;
+    }
+  }
+  return 0;
+}
+
+void notify_socket_destroy( struct notify_socket* notify )
+{
+  if( NULL == notify ){
+    return;
+  }
+  VERIFY( 0 == event_loop_remove_fd( notify->loop , notify->fd ) );
+  VERIFY( 0 == close( notify->fd ) );
+  (void)unlink( notify->path );
+  free( notify->path );
+  free( notify );
+  return;
+}
@@ -0,0 +1,57 @@
+﻿#if ! defined( NOTIFY_H_HEADER_GUARD )
+#define NOTIFY_H_HEADER_GUARD 1
+
+/**
+   サービスからの状態の通知 ( sd_notify(3) と同じ書式 ) を受け取る unix ドメインのデータグラムソケット
+
+   サービスには、ソケットのパスを環境変数 NOTIFY_SOCKET_ENV で知らせる。
+   サービスは "READY=1" のような改行区切りの "KEY=VALUE" を一つのデータグラムで送る。
+   送ったプロセスの PID は SCM_CREDENTIALS で受け取り、使えない環境では "MAINPID=" を使う。
+   ( sd_notify(3) はそのまま使える )
+ */
+
+#include <sys/types.h>
+
+struct event_loop;
+struct notify_socket;
+
+/** 通知を受け取るソケットのパスを知らせる環境変数 */
+#define NOTIFY_SOCKET_ENV "NOTIFY_SOCKET"
+
+/**
+   通知を受け取った時に呼ばれるハンドラ
+   @param pid 送ったプロセスの PID 分からない場合は 0
+   @param message NUL 終端した、改行区切りの "KEY=VALUE"
+ */
+typedef void (*notify_socket_handler)( struct notify_socket* notify , pid_t pid , const char* message , void* context );
+
+/**
+   path で通知を受け取るソケットを作成して、イベントループに登録する
+   path に古いファイルがある場合は削除してから作る。
+   @return 失敗した場合は NULL を返し、理由を errno に保存する。
+ */
+struct notify_socket* notify_socket_create( struct event_loop* loop , const char* path );
+
+/**
+   通知を受け取った時のハンドラを設定する
+   ハンドラが NULL の間に受け取った通知は捨てる。
+ */
+void notify_socket_set_handler( struct notify_socket* notify , notify_socket_handler handler , void* context );
+
+/**
+   ソケットのパスを返す
+ */
+const char* notify_socket_path( const struct notify_socket* notify );
+
+/**
+   message に "KEY=VALUE" の行 assignment があるかどうか
+   @return ある場合は 1 無い場合は 0
+ */
+int notify_message_has( const char* message , const char* assignment );
+
+/**
+   ソケットをイベントループから外して閉じ、パスを削除する
+ */
+void notify_socket_destroy( struct notify_socket* notify );
+
+#endif /* NOTIFY_H_HEADER_GUARD */
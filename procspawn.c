@@ -0,0 +1,684 @@
+﻿/**
+   ターゲットプロセスを起動する
+
+   vfork バックエンドは、 glibc の posix_spawn(3) と同じように clone(2) へ
+   CLONE_VM | CLONE_VFORK を渡す。子プロセスは親のメモリの上で動き、
+   execvp(2) するか終了するまで親は止まっている。そのため子プロセスでは
+   非同期シグナル安全な関数しか呼ばず、 exec(3) の失敗は共有している
+   struct proc_spawn_vfork_context に errno を書いて親に知らせる。
+   親のシグナルハンドラが子プロセスで ( 親のメモリの上で ) 動かないように、
+   clone(2) の前に全てのシグナルをブロックして、子プロセスでハンドラを既定の動作に戻してから
+   シグナルマスクを戻す。
+ */
+
+/* clone(2) と execvpe(3) と environ の宣言を得るために必要 */
+#if !defined( _GNU_SOURCE )
+#define _GNU_SOURCE 1
+#endif /* !defined( _GNU_SOURCE ) */
+
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif /* defined(HAVE_CONFIG_H) */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <assert.h>
+
+#if defined( HAVE_SPAWN_H ) && defined( HAVE_POSIX_SPAWNP )
+#define PROC_SPAWN_HAVE_POSIX_SPAWN 1
+#include <spawn.h>
+#endif /* defined( HAVE_SPAWN_H ) && defined( HAVE_POSIX_SPAWNP ) */
+
+#if defined( __linux__ ) && defined( HAVE_CLONE ) && defined( HAVE_SYS_MMAN_H )
+#define PROC_SPAWN_HAVE_VFORK 1
+#include <sched.h>
+#include <sys/mman.h>
+#endif /* defined( __linux__ ) && defined( HAVE_CLONE ) && defined( HAVE_SYS_MMAN_H ) */
+
+#include "verify.h"
+#include "alternative.h"
+#include "procspawn.h"
+
+enum{
+  /** vfork バックエンドの子プロセスのスタックの大きさ ( これに argv の分を足す ) */
+  PROC_SPAWN_VFORK_STACK_SIZE = 64 * 1024
+};
+
+/**
+   request->process_group があれば新しいプロセスグループへ移ってから、
+   子プロセスの標準入力を /dev/null に、標準出力と標準エラー出力を request の fd につなげ、
+   pass_fds を PROC_SPAWN_PASS_FDS_START から順に並べて、その後ろの全ての fd に close-on-exec を付ける
+   fork と vfork の子プロセスから呼ぶので、非同期シグナル安全な関数だけを使う。
+   @return 成功した場合は 0 失敗した場合は -1
+*/
+static int proc_spawn_redirect( const struct proc_spawn_request* request );
+
+/**
+   request->envp_pid があれば、自分の PID を十進で書き込む
+   子プロセスから呼ぶので、非同期シグナル安全な関数だけを使う。
+*/
+static void proc_spawn_write_pid( const struct proc_spawn_request* request );
+
+/**
+   request->envp があればそれを、無ければ environ を渡して exec(3) する
+   request->exec_fd があれば fexecve(3) し、 /proc が無いなどで fd から exec できない場合は path で exec(3) する。
+   戻った場合は失敗で、理由は errno にある。
+*/
+static void proc_spawn_exec( const struct proc_spawn_request* request );
+
+/**
+   pass_fds の中に、並べる先 ( PROC_SPAWN_PASS_FDS_START から pass_fd_count 個 ) より小さな fd があると、
+   dup2(2) で並べている途中で上書きしてしまうので、並べる先より大きな fd へ複製しておく
+   @return 成功した場合は 0 を返し、複製した fd を fds に入れる ( 複製しなかったものは元の fd )
+   失敗した場合は -1 を返し、理由を errno に保存する。
+*/
+static int proc_spawn_relocate_fds( const struct proc_spawn_request* request , int* fds );
+
+/**
+   proc_spawn_relocate_fds で複製した fd を閉じる
+*/
+static void proc_spawn_release_fds( const struct proc_spawn_request* request , int* fds );
+
+/**
+   execvp(3) と同じように name を PATH から探す ( '/' を含む場合は探さない )
+   @return 成功した場合は malloc(3) で確保したパス 失敗した場合は NULL を返し、理由を errno に保存する。
+*/
+static char* proc_spawn_resolve_path( const char* name );
+
+/**
+   fork(2) + execvp(2)
+   exec(3) の結果は、 close-on-exec を付けたパイプで受け取る
+*/
+static pid_t proc_spawn_fork( const struct proc_spawn_request* request );
+
+/**
+   子プロセスを回収する ( exec(3) に失敗して終了した子プロセス用 )
+   errno は変えない
+*/
+static void proc_spawn_reap( pid_t pid );
+
+#if defined( PROC_SPAWN_HAVE_POSIX_SPAWN )
+/** posix_spawnp(3) */
+static pid_t proc_spawn_posix_spawn( const struct proc_spawn_request* request );
+#endif /* defined( PROC_SPAWN_HAVE_POSIX_SPAWN ) */
+
+#if defined( PROC_SPAWN_HAVE_VFORK )
+/** clone(2) ( CLONE_VM | CLONE_VFORK ) + execvp(2) */
+static pid_t proc_spawn_vfork( const struct proc_spawn_request* request );
+
+/** proc_spawn_vfork の子プロセスと共有する状態 */
+struct proc_spawn_vfork_context{
+  const struct proc_spawn_request* request;
+  /** 子プロセスに設定するシグナルマスク */
+  sigset_t sigmask;
+  /** exec(3) が失敗した時の errno 成功した場合は 0 のまま */
+  int error;
+};
+
+/** proc_spawn_vfork の子プロセスの本体 */
+static int proc_spawn_vfork_child( void* argument );
+#endif /* defined( PROC_SPAWN_HAVE_VFORK ) */
+
+/************************* 実装 **************************/
+
+const char* proc_spawn_backend_name( enum proc_spawn_backend backend )
+{
+  switch( backend ){
+  case PROC_SPAWN_BACKEND_FORK: return "fork";
+  case PROC_SPAWN_BACKEND_POSIX_SPAWN: return "posix_spawn";
+  case PROC_SPAWN_BACKEND_VFORK: return "vfork";
+  default: return "unknown";
+  }
+}
+
+int proc_spawn_backend_parse( const char* name , enum proc_spawn_backend* backend )
+{
+  assert( name );
+  assert( backend );
+  for( int i = 0 ; i < PROC_SPAWN_BACKEND_COUNT ; ++i ){
+    if( 0 == strcmp( name , proc_spawn_backend_name( (enum proc_spawn_backend)i ) ) ){
+      *backend = (enum proc_spawn_backend)i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+int proc_spawn_backend_available( enum proc_spawn_backend backend )
+{
+  switch( backend ){
+  case PROC_SPAWN_BACKEND_FORK:
+    return 1;
+#if defined( PROC_SPAWN_HAVE_POSIX_SPAWN )
+  case PROC_SPAWN_BACKEND_POSIX_SPAWN:
+    return 1;
+#endif /* defined( PROC_SPAWN_HAVE_POSIX_SPAWN ) */
+#if defined( PROC_SPAWN_HAVE_VFORK )
+  case PROC_SPAWN_BACKEND_VFORK:
+    return 1;
+#endif /* defined( PROC_SPAWN_HAVE_VFORK ) */
+  default:
+    return 0;
+  }
+}
+
+enum proc_spawn_backend proc_spawn_default_backend( void )
+{
+  static const enum proc_spawn_backend preferred[] = { PROC_SPAWN_BACKEND_POSIX_SPAWN , PROC_SPAWN_BACKEND_VFORK };
+  for( size_t i = 0 ; i < sizeof( preferred ) / sizeof( preferred[0] ) ; ++i ){
+    if( proc_spawn_backend_available( preferred[i] ) ){
+      return preferred[i];
+    }
+  }
+  return PROC_SPAWN_BACKEND_FORK;
+}
+
+pid_t proc_spawn( enum proc_spawn_backend backend , const struct proc_spawn_request* request )
+{
+  assert( request );
+  assert( request->path );
+  assert( request->argv );
+  assert( 0 == request->pass_fd_count || request->pass_fds );
+  if( !proc_spawn_backend_available( backend ) ){
+    errno = ENOSYS;
+    return -1;
+  }
+
+  /* 並べる途中で上書きされないように、 fd を複製した request で起動する */
+  struct proc_spawn_request relocated = *request;
+  int* fds = NULL;
+  if( 0 < request->pass_fd_count ){
+    fds = calloc( request->pass_fd_count , sizeof( int ) );
+    if( NULL == fds ){
+      return -1;
+    }
+    if( 0 != proc_spawn_relocate_fds( request , fds ) ){
+      const int err = errno;
+      free( fds );
+      errno = err;
+      return -1;
+    }
+    relocated.pass_fds = fds;
+  }
+
+#if !defined( HAVE_FEXECVE )
+  relocated.exec_fd = -1;
+#endif /* !defined( HAVE_FEXECVE ) */
+
+  /* posix_spawnp(3) では、子プロセスの PID を環境変数に書けず、 fd を exec することもできない */
+  if( ( request->envp_pid || 0 <= relocated.exec_fd ) && PROC_SPAWN_BACKEND_POSIX_SPAWN == backend ){
+    backend = proc_spawn_backend_available( PROC_SPAWN_BACKEND_VFORK ) ? PROC_SPAWN_BACKEND_VFORK : PROC_SPAWN_BACKEND_FORK;
+  }
+#if !defined( HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP )
+  /* posix_spawn_file_actions_addclosefrom_np(3) が無いと、 pass_fds より後ろの fd を閉じられない */
+  if( PROC_SPAWN_BACKEND_POSIX_SPAWN == backend ){
+    backend = proc_spawn_backend_available( PROC_SPAWN_BACKEND_VFORK ) ? PROC_SPAWN_BACKEND_VFORK : PROC_SPAWN_BACKEND_FORK;
+  }
+#endif /* !defined( HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP ) */
+  pid_t pid = -1;
+  switch( backend ){
+#if defined( PROC_SPAWN_HAVE_POSIX_SPAWN )
+  case PROC_SPAWN_BACKEND_POSIX_SPAWN:
+    pid = proc_spawn_posix_spawn( &relocated );
+    break;
+#endif /* defined( PROC_SPAWN_HAVE_POSIX_SPAWN ) */
+#if defined( PROC_SPAWN_HAVE_VFORK )
+  case PROC_SPAWN_BACKEND_VFORK:
+    pid = proc_spawn_vfork( &relocated );
+    break;
+#endif /* defined( PROC_SPAWN_HAVE_VFORK ) */
+  case PROC_SPAWN_BACKEND_FORK:
+  default:
+    pid = proc_spawn_fork( &relocated );
+    break;
+  }
+
+  if( fds ){
+    const int err = errno;
+    proc_spawn_release_fds( request , fds );
+    free( fds );
+    errno = err;
+  }
+  return pid;
+}
+
+static int proc_spawn_relocate_fds( const struct proc_spawn_request* request , int* fds )
+{
+  const int end = PROC_SPAWN_PASS_FDS_START + (int)request->pass_fd_count;
+  for( size_t i = 0 ; i < request->pass_fd_count ; ++i ){
+    fds[i] = request->pass_fds[i];
+    if( end <= fds[i] ){
+      continue;
+    }
+    fds[i] = fcntl( request->pass_fds[i] , F_DUPFD_CLOEXEC , end );
+    if( -1 == fds[i] ){
+      const int err = errno;
+      proc_spawn_release_fds( request , fds );
+      errno = err;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void proc_spawn_release_fds( const struct proc_spawn_request* request , int* fds )
+{
+  for( size_t i = 0 ; i < request->pass_fd_count ; ++i ){
+    if( 0 <= fds[i] && fds[i] != request->pass_fds[i] ){
+      VERIFY( 0 == close( fds[i] ) );
+    }
+    fds[i] = -1;
+  }
+  return;
+}
+
+static int proc_spawn_redirect( const struct proc_spawn_request* request )
+{
+  if( request->process_group && -1 == setpgid( 0 , 0 ) ){
+    return -1;
+  }
+  const int null_in = open( "/dev/null" , O_RDONLY );
+  if( -1 == null_in ){
+    return -1;
+  }
+  if( STDIN_FILENO != null_in ){
+    const int result = dup2( null_in , STDIN_FILENO );
+    VERIFY( 0 == close( null_in ) );
+    if( -1 == result ){
+      return -1;
+    }
+  }
+  /* dup2(2) した先には close-on-exec が付かないので、元の fd だけが exec で閉じられる */
+  if( -1 == dup2( request->stdout_fd , STDOUT_FILENO ) ||
+      -1 == dup2( request->stderr_fd , STDERR_FILENO ) ){
+    return -1;
+  }
+  /* proc_spawn_relocate_fds で、元の fd は並べる先より大きくしてある */
+  for( size_t i = 0 ; i < request->pass_fd_count ; ++i ){
+    if( -1 == dup2( request->pass_fds[i] , PROC_SPAWN_PASS_FDS_START + (int)i ) ){
+      return -1;
+    }
+  }
+  /* 閉じずに close-on-exec にするのは、 exec(3) の失敗を知らせるパイプと exec_fd を exec(3) まで残すため
+     ( 付けられない環境では、そのまま引き継がせる ) */
+  (void)x_set_cloexec_from( PROC_SPAWN_PASS_FDS_START + (int)request->pass_fd_count );
+  return 0;
+}
+
+static void proc_spawn_write_pid( const struct proc_spawn_request* request )
+{
+  if( NULL == request->envp_pid ){
+    return;
+  }
+  char digits[PROC_SPAWN_PID_BUFFER_SIZE];
+  size_t length = 0;
+  for( unsigned long pid = (unsigned long)getpid() ; length < sizeof( digits ) - 1 ; pid /= 10 ){
+    digits[length++] = (char)( '0' + pid % 10 );
+    if( pid < 10 ){
+      break;
+    }
+  }
+  for( size_t i = 0 ; i < length ; ++i ){
+    request->envp_pid[i] = digits[ length - 1 - i ];
+  }
+  request->envp_pid[length] = '\0';
+  return;
+}
+
+static void proc_spawn_exec( const struct proc_spawn_request* request )
+{
+  proc_spawn_write_pid( request );
+#if defined( HAVE_FEXECVE )
+  if( 0 <= request->exec_fd ){
+    extern char** environ;
+    fexecve( request->exec_fd , request->argv , request->envp ? request->envp : environ );
+    if( ENOSYS != errno && ENOENT != errno ){
+      return;
+    }
+  }
+#endif /* defined( HAVE_FEXECVE ) */
+  if( request->envp ){
+#if defined( HAVE_EXECVPE )
+    execvpe( request->path , request->argv , request->envp );
+    return;
+#else /* defined( HAVE_EXECVPE ) */
+    /* vfork では親の environ を書き換えることになるので、親が proc_spawn_vfork で戻す */
+    extern char** environ;
+    environ = (char**)request->envp;
+#endif /* defined( HAVE_EXECVPE ) */
+  }
+  execvp( request->path , request->argv );
+  return;
+}
+
+static pid_t proc_spawn_fork( const struct proc_spawn_request* request )
+{
+  int pipes[2] = {-1,-1};
+  if( pipe( pipes ) ){
+    return -1;
+  }
+  /* 書き込み側は exec(3) に成功すると閉じられる 読み込み側は子プロセスへ残さない */
+  VERIFY( -1 != fcntl( pipes[0] , F_SETFD , FD_CLOEXEC ) );
+  VERIFY( -1 != fcntl( pipes[1] , F_SETFD , FD_CLOEXEC ) );
+
+  const pid_t pid = fork();
+  if( -1 == pid ){
+    const int err = errno;
+    VERIFY( 0 == close( pipes[0] ) );
+    VERIFY( 0 == close( pipes[1] ) );
+    errno = err;
+    return -1;
+  }
+  if( 0 == pid ){
+    VERIFY( 0 == close( pipes[0] ) );
+    if( request->sigmask ){
+      VERIFY( 0 == sigprocmask( SIG_SETMASK , request->sigmask , NULL ) );
+    }
+    if( 0 == proc_spawn_redirect( request ) ){
+      proc_spawn_exec( request );
+    }
+    const int err = errno;
+    while( -1 == write( pipes[1] , &err , sizeof( err ) ) && EINTR == errno ){
+      ;
+    }
+    _exit( 127 );
+  }
+
+  VERIFY( 0 == close( pipes[1] ) );
+  int err = 0;
+  ssize_t length = 0;
+  do{
+    length = read( pipes[0] , &err , sizeof( err ) );
+  }while( -1 == length && EINTR == errno );
+  VERIFY( 0 == close( pipes[0] ) );
+  if( 0 == length || -1 == length ){
+    /* exec(3) に成功して、書き込み側が閉じられた
+       ( 読めなかった場合も、動いているかもしれない子プロセスを待たないように成功とみなす ) */
+    return pid;
+  }
+  proc_spawn_reap( pid );
+  errno = ( (ssize_t)sizeof( err ) == length ) ? err : EIO;
+  return -1;
+}
+
+static void proc_spawn_reap( pid_t pid )
+{
+  const int err = errno;
+  while( -1 == waitpid( pid , NULL , 0 ) && EINTR == errno ){
+    ;
+  }
+  errno = err;
+  return;
+}
+
+void proc_spawn_executable_init( struct proc_spawn_executable* executable )
+{
+  assert( executable );
+  memset( executable , 0 , sizeof( struct proc_spawn_executable ) );
+  executable->fd = -1;
+  return;
+}
+
+static char* proc_spawn_resolve_path( const char* name )
+{
+  assert( name );
+  if( strchr( name , '/' ) ){
+    return strdup( name );
+  }
+  /* PATH が無い時は、 glibc の execvp(3) と同じ既定値を使う */
+  const char* search = getenv( "PATH" );
+  if( NULL == search ){
+    search = "/bin:/usr/bin";
+  }
+  const size_t name_length = strlen( name );
+  int err = ENOENT;
+  for( const char* p = search ; ; ){
+    const char* const end = strchrnul( p , ':' );
+    const size_t dir_length = (size_t)( end - p );
+    char* const candidate = malloc( dir_length + 1 + name_length + 1 );
+    if( NULL == candidate ){
+      return NULL;
+    }
+    /* 空の要素はカレントディレクトリ */
+    if( 0 < dir_length ){
+      memcpy( candidate , p , dir_length );
+      candidate[dir_length] = '/';
+      memcpy( candidate + dir_length + 1 , name , name_length + 1 );
+    }else{
+      memcpy( candidate , name , name_length + 1 );
+    }
+    struct stat st;
+    if( 0 == stat( candidate , &st ) && S_ISREG( st.st_mode ) ){
+      if( 0 == access( candidate , X_OK ) ){
+        return candidate;
+      }
+      err = EACCES;
+    }
+    free( candidate );
+    if( '\0' == *end ){
+      break;
+    }
+    p = end + 1;
+  }
+  errno = err;
+  return NULL;
+}
+
+int proc_spawn_executable_prepare( struct proc_spawn_executable* executable , const char* name )
+{
+  assert( executable );
+  assert( name );
+  if( NULL == executable->path ){
+    executable->path = proc_spawn_resolve_path( name );
+    if( NULL == executable->path ){
+      return -1;
+    }
+  }
+
+  struct stat st;
+  if( -1 == stat( executable->path , &st ) ){
+    /* 消されたか、 PATH の別のディレクトリへ移されたので、次は探しなおす */
+    const int err = errno;
+    proc_spawn_executable_close( executable );
+    errno = err;
+    return -1;
+  }
+  if( executable->cached && executable->dev == st.st_dev && executable->ino == st.st_ino &&
+      executable->mtime.tv_sec == st.st_mtim.tv_sec && executable->mtime.tv_nsec == st.st_mtim.tv_nsec ){
+    return 0;
+  }
+
+  if( 0 <= executable->fd ){
+    VERIFY( 0 == close( executable->fd ) );
+    executable->fd = -1;
+  }
+  executable->cached = 0;
+  int fd = open( executable->path , O_RDONLY | O_CLOEXEC );
+  if( -1 == fd ){
+    return -1;
+  }
+  /* stat(2) してから開くまでに入れ替えられていても、開いたファイルの識別を覚えておけば次に開きなおせる */
+  if( -1 == fstat( fd , &st ) ){
+    const int err = errno;
+    VERIFY( 0 == close( fd ) );
+    errno = err;
+    return -1;
+  }
+  if( !S_ISREG( st.st_mode ) ){
+    VERIFY( 0 == close( fd ) );
+    errno = EACCES;
+    return -1;
+  }
+  /* スクリプトはインタプリタが /dev/fd/N を開くが、 close-on-exec の fd は exec(3) で閉じられている */
+  char magic[2] = {0};
+  if( (ssize_t)sizeof( magic ) == pread( fd , magic , sizeof( magic ) , 0 ) && '#' == magic[0] && '!' == magic[1] ){
+    VERIFY( 0 == close( fd ) );
+    fd = -1;
+  }
+  executable->fd = fd;
+  executable->cached = 1;
+  executable->dev = st.st_dev;
+  executable->ino = st.st_ino;
+  executable->mtime = st.st_mtim;
+  ++(executable->opens);
+  return 1;
+}
+
+void proc_spawn_executable_close( struct proc_spawn_executable* executable )
+{
+  assert( executable );
+  if( 0 <= executable->fd ){
+    VERIFY( 0 == close( executable->fd ) );
+  }
+  free( executable->path );
+  const unsigned long opens = executable->opens;
+  proc_spawn_executable_init( executable );
+  executable->opens = opens;
+  return;
+}
+
+#if defined( PROC_SPAWN_HAVE_POSIX_SPAWN )
+static pid_t proc_spawn_posix_spawn( const struct proc_spawn_request* request )
+{
+  extern char** environ;
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attributes;
+  int err = posix_spawn_file_actions_init( &actions );
+  if( 0 != err ){
+    errno = err;
+    return -1;
+  }
+  err = posix_spawnattr_init( &attributes );
+  if( 0 != err ){
+    VERIFY( 0 == posix_spawn_file_actions_destroy( &actions ) );
+    errno = err;
+    return -1;
+  }
+
+  /* proc_spawn_redirect と同じことを file actions で表す */
+  if( 0 == err ){
+    err = posix_spawn_file_actions_addopen( &actions , STDIN_FILENO , "/dev/null" , O_RDONLY , 0 );
+  }
+  if( 0 == err ){
+    err = posix_spawn_file_actions_adddup2( &actions , request->stdout_fd , STDOUT_FILENO );
+  }
+  if( 0 == err ){
+    err = posix_spawn_file_actions_adddup2( &actions , request->stderr_fd , STDERR_FILENO );
+  }
+  for( size_t i = 0 ; 0 == err && i < request->pass_fd_count ; ++i ){
+    err = posix_spawn_file_actions_adddup2( &actions , request->pass_fds[i] , PROC_SPAWN_PASS_FDS_START + (int)i );
+  }
+#if defined( HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP )
+  if( 0 == err ){
+    err = posix_spawn_file_actions_addclosefrom_np( &actions , PROC_SPAWN_PASS_FDS_START + (int)request->pass_fd_count );
+  }
+#endif /* defined( HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP ) */
+  short flags = 0;
+  if( 0 == err && request->sigmask ){
+    err = posix_spawnattr_setsigmask( &attributes , request->sigmask );
+    flags |= POSIX_SPAWN_SETSIGMASK;
+  }
+  if( 0 == err && request->process_group ){
+    err = posix_spawnattr_setpgroup( &attributes , 0 );
+    flags |= POSIX_SPAWN_SETPGROUP;
+  }
+  if( 0 == err && 0 != flags ){
+    err = posix_spawnattr_setflags( &attributes , flags );
+  }
+
+  pid_t pid = -1;
+  if( 0 == err ){
+    /* exec(3) の失敗も err で返る ( glibc は失敗した子プロセスを回収してから返す ) */
+    err = posix_spawnp( &pid , request->path , &actions , &attributes , request->argv ,
+                        ( request->envp ) ? request->envp : environ );
+  }
+  VERIFY( 0 == posix_spawnattr_destroy( &attributes ) );
+  VERIFY( 0 == posix_spawn_file_actions_destroy( &actions ) );
+  if( 0 != err ){
+    errno = err;
+    return -1;
+  }
+  return pid;
+}
+#endif /* defined( PROC_SPAWN_HAVE_POSIX_SPAWN ) */
+
+#if defined( PROC_SPAWN_HAVE_VFORK )
+static pid_t proc_spawn_vfork( const struct proc_spawn_request* request )
+{
+  /* 子プロセスのスタック execvp(2) が PATH を探す時と、スクリプトを /bin/sh で
+     実行する時に argv の写しを置けるだけの大きさを取る */
+  size_t argc = 0;
+  while( request->argv[argc] ){
+    ++argc;
+  }
+  const long page_size = sysconf( _SC_PAGESIZE );
+  const size_t page = ( 0 < page_size ) ? (size_t)page_size : 4096;
+  const size_t stack_size =
+    ( PROC_SPAWN_VFORK_STACK_SIZE + ( argc + 2 ) * sizeof( char* ) + page - 1 ) / page * page;
+  char* const stack = mmap( NULL , stack_size , PROT_READ | PROT_WRITE ,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK , -1 , 0 );
+  if( MAP_FAILED == stack ){
+    return -1;
+  }
+
+  struct proc_spawn_vfork_context context;
+  memset( &context , 0 , sizeof( context ) );
+  context.request = request;
+  sigset_t all;
+  sigset_t saved;
+  VERIFY( 0 == sigfillset( &all ) );
+  VERIFY( 0 == sigprocmask( SIG_SETMASK , &all , &saved ) );
+  context.sigmask = ( request->sigmask ) ? *(request->sigmask) : saved;
+
+  extern char** environ;
+  char** const saved_environ = environ;
+  /* スタックは下に伸びるので、末尾を渡す */
+  const pid_t pid = clone( proc_spawn_vfork_child , stack + stack_size , CLONE_VM | CLONE_VFORK | SIGCHLD , &context );
+  const int err = errno;
+  environ = saved_environ; /* proc_spawn_exec が書き換えていることがある */
+
+  VERIFY( 0 == sigprocmask( SIG_SETMASK , &saved , NULL ) );
+  VERIFY( 0 == munmap( stack , stack_size ) );
+  if( -1 == pid ){
+    errno = err;
+    return -1;
+  }
+  if( 0 != context.error ){
+    /* exec(3) に失敗して終了した子プロセスは、ここで回収する */
+    proc_spawn_reap( pid );
+    errno = context.error;
+    return -1;
+  }
+  return pid;
+}
+
+static int proc_spawn_vfork_child( void* argument )
+{
+  struct proc_spawn_vfork_context* const context = argument;
+  /* 子プロセスはシグナルハンドラを引き継ぐので、既定の動作に戻す ( SIG_IGN はそのまま ) */
+  for( int signo = 1 ; signo <= SIGRTMAX ; ++signo ){
+    struct sigaction action;
+    if( 0 == sigaction( signo , NULL , &action ) &&
+        SIG_IGN != action.sa_handler && SIG_DFL != action.sa_handler ){
+      memset( &action , 0 , sizeof( action ) );
+      action.sa_handler = SIG_DFL;
+      sigemptyset( &(action.sa_mask) );
+      sigaction( signo , &action , NULL );
+    }
+  }
+  sigprocmask( SIG_SETMASK , &(context->sigmask) , NULL );
+  if( 0 == proc_spawn_redirect( context->request ) ){
+    proc_spawn_exec( context->request );
+  }
+  context->error = errno;
+  _exit( 127 );
+}
+#endif /* defined( PROC_SPAWN_HAVE_VFORK ) */
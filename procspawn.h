@@ -0,0 +1,152 @@
+﻿#if ! defined( PROCSPAWN_H_HEADER_GUARD )
+#define PROCSPAWN_H_HEADER_GUARD 1
+
+/**
+   ターゲットプロセスを起動する
+
+   次の三つのバックエンドから選べる。
+   fork        : fork(2) して、子プロセスで dup2(2) してから execvp(2) する ( 従来の方法 )
+   posix_spawn : posix_spawnp(3) の file actions で標準入出力をつなげる
+   vfork       : clone(2) に CLONE_VM | CLONE_VFORK を付けて、親のメモリを共有したまま execvp(2) する
+
+   fork(2) はコントロールプロセスのページテーブルを複製するので、
+   監視するサービスやバッファが増えてコントロールプロセスの RSS が大きくなると、
+   起動 ( と再起動 ) に掛かる時間が伸びる。 posix_spawn と vfork は
+   ページテーブルを複製しないので、 RSS によらずほぼ一定の時間で起動できる。
+   ( execpath bench で比べられる )
+
+   どのバックエンドでも、 exec(3) が失敗したことは proc_spawn の戻り値と errno で知ることができる。
+   fork では close-on-exec を付けたパイプを子プロセスに渡し、 exec(3) に成功すればパイプが閉じられて
+   親の read(2) が 0 を返し、失敗すれば子プロセスが errno を書き込む。
+   ( posix_spawn と vfork は、子プロセスと共有しているメモリで errno を受け取る )
+
+   標準入出力の他に、 pass_fds の fd を PROC_SPAWN_PASS_FDS_START から順に並べて子プロセスへ渡せる。
+   子プロセスへ残すのは、標準入出力と pass_fds ( 待ち受けているソケットや予備のプロセスのゲート ) だけで、
+   それより後ろの fd は、 close-on-exec を付け忘れたものや、コントロールプロセスが起動した時に
+   引き継いだものも含めて、 exec(3) で閉じる。 ( fork と vfork は x_set_cloexec_from 、
+   posix_spawn は posix_spawn_file_actions_addclosefrom_np(3) で行い、それが無い環境では vfork ( 無ければ fork ) で起動する )
+   envp_pid を指定すると、子プロセスが exec(3) の前に自分の PID を十進で書き込む。 ( LISTEN_PID 用 )
+   posix_spawnp(3) では子プロセスで何もできないので、 envp_pid がある場合は vfork ( 無ければ fork ) で起動する。
+   process_group を指定すると、子プロセスは exec(3) の前に自分の PID を ID とするプロセスグループへ移る。
+   ( posix_spawnp(3) では POSIX_SPAWN_SETPGROUP で行う ) proc_spawn が戻った時には移り終わっているので、
+   呼び出し側はすぐに kill( -pid , signo ) でグループ全体へシグナルを送れる。
+
+   exec_fd を指定すると、 path を探さずに、開いておいた実行ファイルを fexecve(3) する。
+   ( glibc の fexecve(3) は execveat( fd , "" , ... , AT_EMPTY_PATH ) を使う )
+   再起動の度に PATH を探してパスを解決しなおす必要が無く、解決してから exec(3) するまでの間に
+   ファイルが入れ替えられても、開いた時のファイルを実行する。 exec_fd は
+   proc_spawn_executable_prepare で開いて、 inode か mtime が変わった時だけ開きなおす。
+   posix_spawnp(3) は fd を exec できないので、 exec_fd がある場合も vfork ( 無ければ fork ) で起動する。
+ */
+
+#include <sys/types.h>
+#include <signal.h>
+#include <time.h>
+
+/** proc_spawn_request の pass_fds を子プロセスで並べる、最初の fd */
+#define PROC_SPAWN_PASS_FDS_START 3
+
+/** proc_spawn_request の envp_pid の大きさ ( NUL 終端を含む ) */
+#define PROC_SPAWN_PID_BUFFER_SIZE 16
+
+/** ターゲットプロセスを起動する方法 */
+enum proc_spawn_backend{
+  /** fork(2) + execvp(2) */
+  PROC_SPAWN_BACKEND_FORK = 0,
+  /** posix_spawnp(3) */
+  PROC_SPAWN_BACKEND_POSIX_SPAWN ,
+  /** clone(2) ( CLONE_VM | CLONE_VFORK ) + execvp(2) */
+  PROC_SPAWN_BACKEND_VFORK ,
+  PROC_SPAWN_BACKEND_COUNT
+};
+
+/** proc_spawn に渡す、起動するプロセスの指定 */
+struct proc_spawn_request{
+  /** 実行するプログラム '/' を含まない場合は PATH から探す */
+  const char* path;
+  /** NULL 終端の引数 */
+  char* const* argv;
+  /** 子プロセスの標準出力と標準エラー出力にする fd ( 標準入力は /dev/null につなげる ) */
+  int stdout_fd;
+  int stderr_fd;
+  /** 子プロセスのシグナルマスク NULL の場合は呼び出し元のものを引き継ぐ */
+  const sigset_t* sigmask;
+  /** 子プロセスで PROC_SPAWN_PASS_FDS_START から順に並べる fd ( pass_fd_count が 0 の場合は NULL でよい ) */
+  const int* pass_fds;
+  size_t pass_fd_count;
+  /** 子プロセスの環境変数 NULL の場合は environ を引き継ぐ */
+  char* const* envp;
+  /** envp の中の、子プロセスが自分の PID を書き込む PROC_SPAWN_PID_BUFFER_SIZE バイトの場所 NULL の場合は書かない */
+  char* envp_pid;
+  /** 0 以外の場合は、子プロセスを新しいプロセスグループ ( ID は子プロセスの PID ) に入れる */
+  int process_group;
+  /** path の代わりに fexecve(3) する fd ( struct proc_spawn_executable の fd ) -1 の場合は path を exec する */
+  int exec_fd;
+};
+
+/** proc_spawn_executable_prepare で開いておく実行ファイル */
+struct proc_spawn_executable{
+  /** O_RDONLY | O_CLOEXEC で開いた fd 開いていない場合と、 "#!" で始まるスクリプトの場合は -1 */
+  int fd;
+  /** PATH から解決したパス 解決していない場合は NULL */
+  char* path;
+  /** 0 以外の場合は、 dev ino mtime に開いた時のファイルの識別がある */
+  int cached;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  /** 開いた回数 ( 最初の一回を含む ) */
+  unsigned long opens;
+};
+
+/**
+   バックエンドの名前を返す
+*/
+const char* proc_spawn_backend_name( enum proc_spawn_backend backend );
+
+/**
+   名前からバックエンドを得る
+   @return 成功した場合は 0 知らない名前の場合は -1
+*/
+int proc_spawn_backend_parse( const char* name , enum proc_spawn_backend* backend );
+
+/**
+   バックエンドがこの環境で使えるかどうか
+   @return 使える場合は 1 そうでない場合は 0
+*/
+int proc_spawn_backend_available( enum proc_spawn_backend backend );
+
+/**
+   使える中で一番速いバックエンドを返す ( posix_spawn , vfork , fork の順に選ぶ )
+*/
+enum proc_spawn_backend proc_spawn_default_backend( void );
+
+/**
+   request のプロセスを起動する
+   fd は close-on-exec を付けたままでよい ( 子プロセスでは dup2(2) した先だけが残る )
+   子プロセスの回収は呼び出し側の責任で行う。
+   @return 成功した場合は子プロセスの PID 失敗した場合は -1 を返し、理由を errno に保存する。
+   ( 使えないバックエンドの場合は ENOSYS exec(3) の失敗もここで返り、失敗した子プロセスは回収済み )
+*/
+pid_t proc_spawn( enum proc_spawn_backend backend , const struct proc_spawn_request* request );
+
+/**
+   struct proc_spawn_executable を、何も開いていない状態に初期化する
+*/
+void proc_spawn_executable_init( struct proc_spawn_executable* executable );
+
+/**
+   name を PATH から探して ( '/' を含む場合はそのまま ) 開き、 executable->fd を exec_fd に渡せるようにする
+   二回目からは stat(2) でパスのファイルを調べて、開いた時と inode か mtime が違う場合だけ開きなおす。
+   スクリプトは fd を閉じて exec(3) するとインタプリタが開けないので、 executable->fd を -1 にする。
+   @return 開いたままのものを使う場合は 0 開きなおした ( 最初に開いた ) 場合は 1
+   失敗した場合は -1 を返し、理由を errno に保存する。 ( 呼び出し側は path で exec(3) すればよい )
+*/
+int proc_spawn_executable_prepare( struct proc_spawn_executable* executable , const char* name );
+
+/**
+   executable の fd を閉じ、解決したパスを解放して、 proc_spawn_executable_init の状態に戻す ( opens は残す )
+*/
+void proc_spawn_executable_close( struct proc_spawn_executable* executable );
+
+#endif /* PROCSPAWN_H_HEADER_GUARD */
@@ -0,0 +1,702 @@
+﻿/**
+   一つのコントロールプロセスで監視する、ターゲットプロセス( サービス ) の表
+ */
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif /* defined(HAVE_CONFIG_H) */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <assert.h>
+
+#include "verify.h"
+#include "service.h"
+
+/**
+   名前として使える文字列かどうか
+   英数字と "_-." だけからなる、 SERVICE_NAME_MAX 文字までの文字列
+ */
+static int service_is_valid_name( const char* name );
+
+/**
+   文字列 line から、空白で区切られた次のトークンを取り出す。
+   "..." あるいは '...' で囲まれた部分は空白を含めることができる。
+   line は破壊的に書き換えられる。
+   @return トークンの先頭 トークンが無い場合は NULL 引用符が閉じていない場合は NULL を返し、 *error を 1 にする
+   @param cursor 解析を始める位置 解析を終えた位置に更新される
+ */
+static char* service_next_token( char** cursor , int* error );
+
+/** サービス一つ分の確保したメモリを解放する */
+static void service_free( struct service* service );
+
+/**
+   実行中のプロセス以外 ( 予備のプロセスとリロードの世代 ) のプロセスID からサービスを探して、
+   記録を消して、数を減らす
+   @return 見つからない場合は NULL
+   @param role 見つかったプロセスの役割
+ */
+static struct service* service_table_take_auxiliary( struct service_table* table , pid_t pid ,
+                                                     enum service_process_role* role );
+
+/**
+   pid が表のプロセス ( 実行中 予備 リロードの世代 ) かどうか
+   @return 表のプロセスの場合は 1 そうでない場合は 0
+ */
+static int service_table_owns( const struct service_table* table , pid_t pid );
+
+/** CLOCK_MONOTONIC の現在時刻 ( マイクロ秒 ) */
+static unsigned long long service_now_us( void );
+
+/**
+   再起動までの時間に加える乱数 ( xorshift64 )
+   最初の呼び出しで、 PID と時刻から種を作る
+ */
+static unsigned long long service_random( void );
+
+/**
+   SIGHUP SIGINT SIGTERM SIGPIPE のような、止めるために送られることが普通のシグナルかどうか
+ */
+static int service_is_clean_signal( int signo );
+
+/************************* 実装 **************************/
+
+struct service_table* service_table_create( void )
+{
+  return calloc( 1 , sizeof( struct service_table ) );
+}
+
+static void service_free( struct service* service )
+{
+  assert( service );
+  if( service->argv ){
+    for( char** p = service->argv ; *p ; ++p ){
+      free( *p );
+    }
+    free( service->argv );
+  }
+  free( service->name );
+  proc_spawn_executable_close( &(service->executable) );
+  memset( service , 0 , sizeof( struct service ) );
+  for( size_t i = 0 ; i < SERVICE_OUTPUT_COUNT ; ++i ){
+    service->logs[i].fd = -1;
+  }
+  service->standby_gate = -1;
+  proc_spawn_executable_init( &(service->executable) );
+  return;
+}
+
+void service_table_destroy( struct service_table* table )
+{
+  if( NULL == table ){
+    return;
+  }
+  for( size_t i = 0 ; i < table->count ; ++i ){
+    service_free( &(table->services[i]) );
+  }
+  free( table->services );
+  free( table );
+  return;
+}
+
+static int service_is_valid_name( const char* name )
+{
+  assert( name );
+  if( '\0' == *name ){
+    return 0;
+  }
+  for( const char* p = name ; *p ; ++p ){
+    const char c = *p;
+    if( SERVICE_NAME_MAX <= p - name ||
+        !( ( 'a' <= c && c <= 'z' ) || ( 'A' <= c && c <= 'Z' ) || ( '0' <= c && c <= '9' ) ||
+           '_' == c || '-' == c || '.' == c ) ){
+      return 0;
+    }
+  }
+  return 1;
+}
+
+struct service* service_table_add( struct service_table* table , const char* name , char* const argv[] )
+{
+  assert( table );
+  assert( name );
+  assert( argv );
+  if( !service_is_valid_name( name ) || NULL == argv[0] ){
+    errno = EINVAL;
+    return NULL;
+  }
+  if( service_table_find_name( table , name ) ){
+    errno = EEXIST;
+    return NULL;
+  }
+  if( table->capacity <= table->count ){
+    const size_t capacity = ( 0 < table->capacity ) ? table->capacity * 2 : 4;
+    struct service* const services = realloc( table->services , sizeof( struct service ) * capacity );
+    if( NULL == services ){
+      return NULL;
+    }
+    table->services = services;
+    table->capacity = capacity;
+  }
+
+  struct service* const service = &(table->services[ table->count ]);
+  memset( service , 0 , sizeof( struct service ) );
+  for( size_t i = 0 ; i < SERVICE_OUTPUT_COUNT ; ++i ){
+    service->logs[i].fd = -1;
+  }
+  service->standby_gate = -1;
+  proc_spawn_executable_init( &(service->executable) );
+
+  size_t argc = 0;
+  while( argv[argc] ){
+    ++argc;
+  }
+  service->name = strdup( name );
+  service->argv = calloc( argc + 1 , sizeof( char* ) );
+  if( NULL == service->name || NULL == service->argv ){
+    const int err = errno;
+    service_free( service );
+    errno = err;
+    return NULL;
+  }
+  for( size_t i = 0 ; i < argc ; ++i ){
+    service->argv[i] = strdup( argv[i] );
+    if( NULL == service->argv[i] ){
+      const int err = errno;
+      service_free( service );
+      errno = err;
+      return NULL;
+    }
+  }
+  ++(table->count);
+  return service;
+}
+
+static char* service_next_token( char** cursor , int* error )
+{
+  assert( cursor );
+  assert( error );
+  char* p = *cursor;
+  while( ' ' == *p || '\t' == *p || '\r' == *p || '\n' == *p ){
+    ++p;
+  }
+  if( '\0' == *p || '#' == *p ){
+    *cursor = p;
+    return NULL;
+  }
+  /* 引用符を取り除きながら、同じ領域に詰めていく */
+  char* const token = p;
+  char* out = p;
+  char quote = '\0';
+  for( ; *p ; ++p ){
+    if( quote ){
+      if( *p == quote ){
+        quote = '\0';
+      }else{
+        *out++ = *p;
+      }
+      continue;
+    }
+    if( '"' == *p || '\'' == *p ){
+      quote = *p;
+      continue;
+    }
+    if( ' ' == *p || '\t' == *p || '\r' == *p || '\n' == *p ){
+      ++p;
+      break;
+    }
+    *out++ = *p;
+  }
+  if( quote ){
+    *error = 1;
+    return NULL;
+  }
+  *out = '\0';
+  *cursor = p;
+  return token;
+}
+
+int service_table_load_manifest( struct service_table* table , const char* path )
+{
+  assert( table );
+  assert( path );
+  FILE* const fp = fopen( path , "r" );
+  if( NULL == fp ){
+    perror( path );
+    return -1;
+  }
+
+  int result = 0;
+  char* line = NULL;
+  size_t line_capacity = 0;
+  size_t lineno = 0;
+  char** argv = NULL;
+  size_t argv_capacity = 0;
+
+  while( 0 == result && 0 <= getline( &line , &line_capacity , fp ) ){
+    ++lineno;
+    char* cursor = line;
+    int error = 0;
+    const char* const name = service_next_token( &cursor , &error );
+    if( NULL == name ){
+      if( error ){
+        fprintf( stderr , "%s:%zu: unterminated quote\n" , path , lineno );
+        result = -1;
+      }
+      continue; /* 空行もしくはコメント */
+    }
+
+    size_t argc = 0;
+    for(;;){
+      if( argv_capacity <= argc + 1 ){
+        const size_t capacity = ( 0 < argv_capacity ) ? argv_capacity * 2 : 8;
+        char** const new_argv = realloc( argv , sizeof( char* ) * capacity );
+        if( NULL == new_argv ){
+          perror( "realloc()" );
+          result = -1;
+          break;
+        }
+        argv = new_argv;
+        argv_capacity = capacity;
+      }
+      char* const token = service_next_token( &cursor , &error );
+      if( NULL == token ){
+        break;
+      }
+      argv[argc++] = token;
+    }
+    if( 0 != result ){
+      break;
+    }
+    argv[argc] = NULL;
+
+    if( error ){
+      fprintf( stderr , "%s:%zu: unterminated quote\n" , path , lineno );
+      result = -1;
+    }else if( 0 == argc ){
+      fprintf( stderr , "%s:%zu: service \"%s\" has no program\n" , path , lineno , name );
+      result = -1;
+    }else if( NULL == service_table_add( table , name , argv ) ){
+      if( EEXIST == errno ){
+        fprintf( stderr , "%s:%zu: duplicate service name \"%s\"\n" , path , lineno , name );
+      }else if( EINVAL == errno ){
+        fprintf( stderr , "%s:%zu: invalid service name \"%s\" ( [A-Za-z0-9_.-] up to %d characters )\n" ,
+                 path , lineno , name , SERVICE_NAME_MAX );
+      }else{
+        perror( path );
+      }
+      result = -1;
+    }
+  }
+
+  if( 0 == result && 0 == table->count ){
+    fprintf( stderr , "%s: no service is defined\n" , path );
+    result = -1;
+  }
+  free( argv );
+  free( line );
+  VERIFY( 0 == fclose( fp ) );
+  return result;
+}
+
+struct service* service_table_find_pid( struct service_table* table , pid_t pid )
+{
+  assert( table );
+  if( pid <= 0 ){
+    return NULL;
+  }
+  for( size_t i = 0 ; i < table->count ; ++i ){
+    if( table->services[i].pid == pid ){
+      return &(table->services[i]);
+    }
+  }
+  return NULL;
+}
+
+static struct service* service_table_take_auxiliary( struct service_table* table , pid_t pid ,
+                                                     enum service_process_role* role )
+{
+  assert( table );
+  assert( role );
+  if( pid <= 0 ){
+    return NULL;
+  }
+  for( size_t i = 0 ; i < table->count ; ++i ){
+    struct service* const service = &(table->services[i]);
+    if( service->standby_pid == pid ){
+      assert( 0 < table->standbys );
+      service->standby_pid = 0;
+      --(table->standbys);
+      *role = SERVICE_PROCESS_STANDBY;
+      return service;
+    }
+    if( service->reloading_pid == pid ){
+      assert( 0 < table->reloading );
+      service->reloading_pid = 0;
+      --(table->reloading);
+      *role = SERVICE_PROCESS_RELOADING;
+      return service;
+    }
+    if( service->draining_pid == pid ){
+      assert( 0 < table->draining );
+      service->draining_pid = 0;
+      --(table->draining);
+      *role = SERVICE_PROCESS_DRAINING;
+      return service;
+    }
+  }
+  return NULL;
+}
+
+static int service_table_owns( const struct service_table* table , pid_t pid )
+{
+  assert( table );
+  if( pid <= 0 ){
+    return 0;
+  }
+  for( size_t i = 0 ; i < table->count ; ++i ){
+    const struct service* const service = &(table->services[i]);
+    if( service->pid == pid || service->standby_pid == pid ||
+        service->reloading_pid == pid || service->draining_pid == pid ){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+struct service* service_table_find_name( struct service_table* table , const char* name )
+{
+  assert( table );
+  assert( name );
+  for( size_t i = 0 ; i < table->count ; ++i ){
+    if( 0 == strcmp( table->services[i].name , name ) ){
+      return &(table->services[i]);
+    }
+  }
+  return NULL;
+}
+
+void service_started( struct service_table* table , struct service* service , pid_t pid )
+{
+  assert( table );
+  assert( service );
+  assert( 0 < pid );
+  assert( SERVICE_STATE_RUNNING != service->state );
+  if( SERVICE_STATE_BACKOFF == service->state ){
+    assert( 0 < table->pending );
+    --(table->pending);
+  }
+  service->pid = pid;
+  service->state = SERVICE_STATE_RUNNING;
+  service->started_us = service_now_us();
+  ++(table->running);
+  return;
+}
+
+void service_start_failed( struct service_table* table , struct service* service )
+{
+  assert( table );
+  assert( service );
+  assert( SERVICE_STATE_RUNNING != service->state );
+  if( SERVICE_STATE_BACKOFF == service->state ){
+    assert( 0 < table->pending );
+    --(table->pending);
+  }
+  service->state = SERVICE_STATE_EXITED;
+  service->exit_code = CLD_EXITED;
+  service->exit_status = 127;
+  service->started_us = service_now_us();
+  return;
+}
+
+void service_standby_started( struct service_table* table , struct service* service , pid_t pid , int gate )
+{
+  assert( table );
+  assert( service );
+  assert( 0 < pid );
+  assert( 0 == service->standby_pid );
+  service->standby_pid = pid;
+  service->standby_gate = gate;
+  ++(table->standbys);
+  return;
+}
+
+void service_promote_standby( struct service_table* table , struct service* service )
+{
+  assert( table );
+  assert( service );
+  assert( 0 < service->standby_pid );
+  assert( 0 < table->standbys );
+  const pid_t pid = service->standby_pid;
+  service->standby_pid = 0;
+  --(table->standbys);
+  service_started( table , service , pid );
+  return;
+}
+
+void service_reload_started( struct service_table* table , struct service* service , pid_t pid )
+{
+  assert( table );
+  assert( service );
+  assert( 0 < pid );
+  assert( 0 == service->reloading_pid );
+  service->reloading_pid = pid;
+  ++(table->reloading);
+  return;
+}
+
+pid_t service_reload_ready( struct service_table* table , struct service* service )
+{
+  assert( table );
+  assert( service );
+  assert( SERVICE_STATE_RUNNING == service->state );
+  assert( 0 < service->reloading_pid );
+  assert( 0 == service->draining_pid );
+  const pid_t old_pid = service->pid;
+  service->draining_pid = old_pid;
+  ++(table->draining);
+  service->pid = service->reloading_pid;
+  service->reloading_pid = 0;
+  --(table->reloading);
+  service->started_us = service_now_us();
+  return old_pid;
+}
+
+pid_t service_reload_abort( struct service_table* table , struct service* service )
+{
+  assert( table );
+  assert( service );
+  assert( 0 < service->reloading_pid );
+  assert( 0 == service->draining_pid );
+  const pid_t pid = service->reloading_pid;
+  service->draining_pid = pid;
+  ++(table->draining);
+  service->reloading_pid = 0;
+  --(table->reloading);
+  return pid;
+}
+
+const char* service_state_name( enum service_state state )
+{
+  static const char* const names[] = { "stopped" , "running" , "exited" , "backoff" , "failed" };
+  return ( (size_t)state < sizeof( names ) / sizeof( names[0] ) ) ? names[state] : "unknown";
+}
+
+int service_standby_mode_parse( const char* name , enum service_standby_mode* mode )
+{
+  assert( name );
+  assert( mode );
+  if( 0 == strcmp( name , "stop" ) ){
+    *mode = SERVICE_STANDBY_STOP;
+  }else if( 0 == strcmp( name , "gate" ) ){
+    *mode = SERVICE_STANDBY_GATE;
+  }else{
+    return -1;
+  }
+  return 0;
+}
+
+int service_restart_mode_parse( const char* name , enum service_restart_mode* mode )
+{
+  static const struct{
+    const char* name;
+    enum service_restart_mode mode;
+  } modes[] = {
+    { "no" , SERVICE_RESTART_NO } ,
+    { "always" , SERVICE_RESTART_ALWAYS } ,
+    { "on-failure" , SERVICE_RESTART_ON_FAILURE } ,
+    { "on-abnormal" , SERVICE_RESTART_ON_ABNORMAL }
+  };
+  assert( name );
+  assert( mode );
+  for( size_t i = 0 ; i < sizeof( modes ) / sizeof( modes[0] ) ; ++i ){
+    if( 0 == strcmp( name , modes[i].name ) ){
+      *mode = modes[i].mode;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static int service_is_clean_signal( int signo )
+{
+  return ( SIGHUP == signo || SIGINT == signo || SIGTERM == signo || SIGPIPE == signo );
+}
+
+int service_needs_restart( const struct service_restart_policy* policy , const struct service* service )
+{
+  assert( policy );
+  assert( service );
+  assert( SERVICE_STATE_EXITED == service->state );
+  const int exited = ( CLD_EXITED == service->exit_code );
+  const int unclean_signal = !exited && !service_is_clean_signal( service->exit_status );
+  switch( policy->mode ){
+  case SERVICE_RESTART_ALWAYS:
+    return 1;
+  case SERVICE_RESTART_ON_FAILURE:
+    return ( exited && 0 != service->exit_status ) || unclean_signal;
+  case SERVICE_RESTART_ON_ABNORMAL:
+    return unclean_signal;
+  case SERVICE_RESTART_NO:
+  default:
+    return 0;
+  }
+}
+
+int service_schedule_restart( struct service_table* table , const struct service_restart_policy* policy ,
+                              struct service* service , unsigned long long* delay_us )
+{
+  assert( table );
+  assert( policy );
+  assert( service );
+  assert( delay_us );
+  assert( SERVICE_STATE_EXITED == service->state );
+  const unsigned long long now = service_now_us();
+
+  /* crash loop の判定 interval_us 毎の窓の中で burst 回まで */
+  if( 0 < policy->burst ){
+    if( 0 == service->restart_window_count || policy->interval_us <= now - service->restart_window_us ){
+      service->restart_window_us = now;
+      service->restart_window_count = 0;
+    }
+    if( policy->burst <= service->restart_window_count ){
+      service->state = SERVICE_STATE_FAILED;
+      return -1;
+    }
+    ++(service->restart_window_count);
+  }
+
+  /* 十分長く動いていた場合は、バックオフを最初からやり直す */
+  if( policy->max_delay_us <= now - service->started_us ){
+    service->restart_attempts = 0;
+  }
+  unsigned long long delay = policy->initial_delay_us;
+  for( unsigned int i = 0 ; i < service->restart_attempts && delay < policy->max_delay_us ; ++i ){
+    delay *= 2;
+  }
+  if( policy->max_delay_us < delay ){
+    delay = policy->max_delay_us;
+  }
+  /* 半分は固定で、残りの半分を乱数にする ( equal jitter ) */
+  const unsigned long long half = delay / 2;
+  *delay_us = ( delay - half ) + ( ( 0 < half ) ? service_random() % ( half + 1 ) : 0 );
+  ++(service->restart_attempts);
+
+  service->state = SERVICE_STATE_BACKOFF;
+  ++(table->pending);
+  return 0;
+}
+
+void service_cancel_restart( struct service_table* table , struct service* service )
+{
+  assert( table );
+  assert( service );
+  assert( SERVICE_STATE_BACKOFF == service->state );
+  assert( 0 < table->pending );
+  --(table->pending);
+  service->state = SERVICE_STATE_EXITED;
+  service->restart_timer = 0;
+  return;
+}
+
+static unsigned long long service_now_us( void )
+{
+  struct timespec ts = {0};
+  VERIFY( 0 == clock_gettime( CLOCK_MONOTONIC , &ts ) );
+  return (unsigned long long)ts.tv_sec * 1000000ULL + (unsigned long long)ts.tv_nsec / 1000ULL;
+}
+
+static unsigned long long service_random( void )
+{
+  static unsigned long long state = 0;
+  if( 0 == state ){
+    state = ( service_now_us() << 16 ) ^ (unsigned long long)getpid() ^ 0x9e3779b97f4a7c15ULL;
+  }
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return state;
+}
+
+size_t service_table_reap( struct service_table* table , service_exit_handler handler ,
+                           service_foreign_handler foreign , void* context )
+{
+  assert( table );
+  size_t reaped = 0;
+  /* 最後に foreign に任せた子プロセス */
+  pid_t delegated = 0;
+  for(;;){
+    siginfo_t info;
+    memset( &info , 0 , sizeof( info ) );
+    if( -1 == waitid( P_ALL , 0 , &info , WEXITED | WNOHANG | WNOWAIT ) ){
+      if( EINTR == errno ){
+        continue;
+      }
+      break; /* ECHILD 子プロセスはもういない */
+    }
+    if( 0 == info.si_pid ){
+      break; /* 終了した子プロセスはもういない */
+    }
+    if( foreign && !service_table_owns( table , info.si_pid ) ){
+      if( delegated == info.si_pid ){
+        /* 任せた側が回収しなかった P_ALL では先頭のゾンビを飛ばせないので、残りは次の通知で回収する */
+        break;
+      }
+      if( foreign( info.si_pid , context ) ){
+        delegated = info.si_pid;
+        continue;
+      }
+    }
+    /* 覗いた子プロセスだけを回収する */
+    const pid_t pid = info.si_pid;
+    while( -1 == waitid( P_PID , (id_t)pid , &info , WEXITED | WNOHANG ) && EINTR == errno ){
+      ;
+    }
+    ++reaped;
+
+    enum service_process_role role = SERVICE_PROCESS_MAIN;
+    struct service* const auxiliary = service_table_take_auxiliary( table , info.si_pid , &role );
+    if( auxiliary ){
+      if( handler ){
+        handler( table , auxiliary , role , info.si_pid , context );
+      }
+      continue;
+    }
+    struct service* const service = service_table_find_pid( table , info.si_pid );
+    if( NULL == service ){
+      /* 孤児になって引き取った子孫 サービスの終了には関係しない */
+      ++(table->reap_stats.descendants);
+      if( CLD_EXITED != info.si_code ){
+        ++(table->reap_stats.descendants_killed);
+      }else if( 0 != info.si_status ){
+        ++(table->reap_stats.descendants_failed);
+      }
+      continue;
+    }
+    assert( SERVICE_STATE_RUNNING == service->state );
+    service->pid = 0;
+    service->state = SERVICE_STATE_EXITED;
+    service->exit_code = (unsigned char)info.si_code;
+    service->exit_status = info.si_status;
+    assert( 0 < table->running );
+    --(table->running);
+    if( handler ){
+      handler( table , service , SERVICE_PROCESS_MAIN , info.si_pid , context );
+    }
+  }
+  if( 0 < reaped ){
+    table->reap_stats.reaped += reaped;
+    ++(table->reap_stats.batches);
+    if( table->reap_stats.max_batch < reaped ){
+      table->reap_stats.max_batch = reaped;
+    }
+  }
+  return reaped;
+}
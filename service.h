@@ -0,0 +1,348 @@
+﻿#if ! defined( SERVICE_H_HEADER_GUARD )
+#define SERVICE_H_HEADER_GUARD 1
+
+/**
+   一つのコントロールプロセスで監視する、ターゲットプロセス( サービス ) の表
+
+   サービス毎の状態は struct service の配列にまとめて保持する。
+   サービス毎のコントロールプロセスは作らない。
+
+   マニフェストファイルの書式 ( 一行に一つのサービス ) :
+     # コメント
+     名前  プログラム  [引数...]
+   空白で区切られ、 "..." あるいは '...' で囲むと空白を含めることができる。
+   名前には英数字と "_" "-" "." が使える。
+
+   サービスが終了した時に、 struct service_restart_policy に従って再起動できる。
+   再起動までの時間は initial_delay_us から倍々に max_delay_us まで伸ばし、
+   その半分から全体の間で乱数を加える ( 同時に落ちたサービスが同時に再起動しないように ) 。
+   max_delay_us 以上動き続けた後に終了した場合は、 initial_delay_us に戻す。
+   interval_us の間に burst 回を超えて再起動しようとした場合は crash loop とみなして諦める。
+   ( 窓は interval_us 毎に区切る、 systemd の StartLimitBurst と同じ数え方 )
+   再起動は、呼び出し側がタイマーで行う。
+
+   サービス毎に、起動済みの予備のプロセス ( warm standby ) を一つ待たせておける。
+   サービスが終了した時は、 exec(3) と初期化を待たずに、予備のプロセスを動かして入れ替える。
+   予備のプロセスの起動と、動かす方法 ( enum service_standby_mode ) は呼び出し側で行い、
+   ここでは状態だけを記録する。
+
+   リロード ( blue/green ) では、実行中のプロセスを残したまま新しい世代のプロセスを起動し、
+   新しい世代の準備ができてから入れ替えて、古い世代を終了させる。 入れ替えるまでの新しい世代と、
+   終了を待っている古い世代は、実行中のプロセスとは別に記録する。
+ */
+
+#include <sys/types.h>
+#include <signal.h>
+#include "procspawn.h"
+
+struct log_sink;
+struct log_stream;
+
+/** サービスの状態 */
+enum service_state{
+  /** まだ起動していない */
+  SERVICE_STATE_STOPPED = 0,
+  /** 実行中 */
+  SERVICE_STATE_RUNNING ,
+  /** 終了して、回収済み */
+  SERVICE_STATE_EXITED ,
+  /** 終了して、再起動を待っている */
+  SERVICE_STATE_BACKOFF ,
+  /** 再起動を繰り返したので、諦めた */
+  SERVICE_STATE_FAILED
+};
+
+/** 再起動する条件 */
+enum service_restart_mode{
+  /** 再起動しない ( 既定値 ) */
+  SERVICE_RESTART_NO = 0,
+  /** 常に再起動する */
+  SERVICE_RESTART_ALWAYS ,
+  /** 0 以外の終了コードか、 SIGHUP SIGINT SIGTERM SIGPIPE 以外のシグナルで終了した場合 */
+  SERVICE_RESTART_ON_FAILURE ,
+  /** SIGHUP SIGINT SIGTERM SIGPIPE 以外のシグナルで終了した場合 ( 終了コードは問わない ) */
+  SERVICE_RESTART_ON_ABNORMAL
+};
+
+/** 再起動の方針 */
+struct service_restart_policy{
+  enum service_restart_mode mode;
+  /** 最初の再起動までの時間 ( マイクロ秒 ) */
+  unsigned long long initial_delay_us;
+  /** 再起動までの時間の上限 これ以上動いた後の終了は、 initial_delay_us から数えなおす */
+  unsigned long long max_delay_us;
+  /** interval_us の間に再起動してよい回数 0 の場合は制限しない */
+  unsigned int burst;
+  unsigned long long interval_us;
+};
+
+/** 予備のプロセスの待たせ方 */
+enum service_standby_mode{
+  /** 予備のプロセスを使わない ( 既定値 ) */
+  SERVICE_STANDBY_NONE = 0,
+  /** exec(3) した直後に SIGSTOP で止めておき、 SIGCONT で動かす ( プログラムの協力は要らない ) */
+  SERVICE_STANDBY_STOP ,
+  /** 初期化を済ませたプログラムに、環境変数 SERVICE_STANDBY_FD_ENV の fd ( ゲート ) を読んで待たせ、
+      一バイト書き込んで動かす ( EOF を読んだ場合は、動かさずに終了させる ) */
+  SERVICE_STANDBY_GATE
+};
+
+/** サービスの名前の最大の長さ ( コントロールソケットの応答では u8 で送る ) */
+#define SERVICE_NAME_MAX 255
+
+/** SERVICE_STANDBY_GATE で、ゲートの fd の番号を渡す環境変数 */
+#define SERVICE_STANDBY_FD_ENV "DAEMONIC_STANDBY_FD"
+
+/** service_table_reap が回収したプロセスの、サービスの中での役割 */
+enum service_process_role{
+  /** 実行中のプロセス */
+  SERVICE_PROCESS_MAIN = 0,
+  /** 予備のプロセス */
+  SERVICE_PROCESS_STANDBY ,
+  /** リロードで起動して、準備ができるのを待っている新しい世代 */
+  SERVICE_PROCESS_RELOADING ,
+  /** リロードで入れ替えられて、終了を待っている古い世代 */
+  SERVICE_PROCESS_DRAINING
+};
+
+/** サービスの出力の種類 struct service の logs の添字 */
+enum service_output{
+  /** 標準出力 */
+  SERVICE_OUTPUT_STDOUT = 0,
+  /** 標準エラー出力 */
+  SERVICE_OUTPUT_STDERR ,
+  SERVICE_OUTPUT_COUNT
+};
+
+/** サービスの出力一つ分の転送先 */
+struct service_log{
+  /** 出力につなげるパイプの書き込み側 ( 再起動しても同じものを使う ) */
+  int fd;
+  /** パイプの読み込み側を転送する log_stream */
+  struct log_stream* stream;
+  /** この出力専用の log_sink ( ファイルへ出力する場合 ) 共有の syslog へ送る場合は NULL */
+  struct log_sink* sink;
+};
+
+/** サービス一つ分の状態 */
+struct service{
+  /** 実行中のプロセスID 実行していない時は 0 */
+  pid_t pid;
+  /** enum service_state */
+  unsigned char state;
+  /** 最後に終了した時の waitid(2) の si_code ( CLD_EXITED , CLD_KILLED , CLD_DUMPED ) */
+  unsigned char exit_code;
+  /** 最後に終了した時の waitid(2) の si_status ( 終了コードもしくはシグナル番号 ) */
+  int exit_status;
+  /** サービスの名前 */
+  char* name;
+  /** execvp(2) に渡す NULL 終端の引数 argv[0] が実行するプログラム */
+  char** argv;
+  /** argv[0] を開いておいた実行ファイル ( 再起動の度に探さずに、 fd で exec する ) */
+  struct proc_spawn_executable executable;
+  /** 標準出力と標準エラー出力の転送先 ( enum service_output を添字にする ) */
+  struct service_log logs[SERVICE_OUTPUT_COUNT];
+  /** 最後に起動した時刻 ( CLOCK_MONOTONIC のマイクロ秒 ) */
+  unsigned long long started_us;
+  /** 続けて再起動した回数 ( 再起動までの時間の指数 ) */
+  unsigned int restart_attempts;
+  /** 再起動の回数を数えている窓の開始時刻と、その中での再起動の回数 */
+  unsigned long long restart_window_us;
+  unsigned int restart_window_count;
+  /** 再起動を待っているタイマー ( event_loop_timer_id ) 無い場合は 0 */
+  unsigned long restart_timer;
+  /** 待機している予備のプロセスID 無い場合は 0 */
+  pid_t standby_pid;
+  /** 予備のプロセスのゲートの親の側 SERVICE_STANDBY_GATE 以外と、予備のプロセスが無い時は -1 */
+  int standby_gate;
+  /** 予備のプロセスを起動するタイマー ( event_loop_timer_id ) 無い場合は 0 */
+  unsigned long standby_timer;
+  /** 要らなくなって終了させた予備のプロセスかどうか */
+  unsigned char standby_retired;
+  /** リロードで起動して、準備ができるのを待っている新しい世代のプロセスID 無い場合は 0 */
+  pid_t reloading_pid;
+  /** 新しい世代の準備を待つタイマー ( event_loop_timer_id ) 無い場合は 0 */
+  unsigned long reload_timer;
+  /** リロードで入れ替えられて、終了を待っている古い世代のプロセスID 無い場合は 0 */
+  pid_t draining_pid;
+  /** 古い世代を SIGKILL で終了させるタイマー ( event_loop_timer_id ) 無い場合は 0 */
+  unsigned long drain_timer;
+};
+
+/** service_table_reap で回収した子プロセスの統計 */
+struct service_reap_stats{
+  /** 回収した子プロセスの数 ( サービスのプロセスを含む ) */
+  unsigned long long reaped;
+  /** 一つ以上回収した service_table_reap の呼び出しの回数と、一度に回収した最大の数 */
+  unsigned long long batches;
+  size_t max_batch;
+  /** 表に無い子プロセス ( サービスが起動して孤児になり、 PR_SET_CHILD_SUBREAPER で引き取った子孫 ) を回収した数 */
+  unsigned long long descendants;
+  /** descendants の内、 0 以外の終了コードで終了したものと、シグナルで終了したものの数 */
+  unsigned long long descendants_failed;
+  unsigned long long descendants_killed;
+};
+
+/** サービスの表 */
+struct service_table{
+  struct service* services;
+  size_t count;
+  size_t capacity;
+  /** SERVICE_STATE_RUNNING のサービスの数 */
+  size_t running;
+  /** SERVICE_STATE_BACKOFF のサービスの数 */
+  size_t pending;
+  /** 回収していない予備のプロセスの数 */
+  size_t standbys;
+  /** 回収していない、リロードの新しい世代と古い世代のプロセスの数 */
+  size_t reloading;
+  size_t draining;
+  /** service_table_reap の統計 */
+  struct service_reap_stats reap_stats;
+};
+
+/**
+   サービスのプロセスが終了した時に service_table_reap から呼ばれるハンドラ
+   SERVICE_PROCESS_MAIN の場合は、すでに状態は SERVICE_STATE_EXITED になっている。
+   どの役割でも、終了したプロセスのプロセスID は、記録していた場所から 0 に戻されている。
+   ( タイマーとゲートの片付けは呼び出し側で行う )
+   @param pid 終了したプロセスのプロセスID
+ */
+typedef void (*service_exit_handler)( struct service_table* table , struct service* service ,
+                                      enum service_process_role role , pid_t pid , void* context );
+
+/**
+   表に無い子プロセスが終了していた時に、 service_table_reap が回収する前に呼ばれるハンドラ
+   その子プロセスを別に監視している ( gzip(1) の圧縮など ) 場合は、ここで回収して 0 以外を返す。
+   0 を返した場合は、引き取った子孫として service_table_reap が回収する。
+ */
+typedef int (*service_foreign_handler)( pid_t pid , void* context );
+
+/**
+   空のサービスの表を作成する
+   @return 失敗した場合は NULL
+ */
+struct service_table* service_table_create( void );
+
+/**
+   サービスの表を破棄する
+ */
+void service_table_destroy( struct service_table* table );
+
+/**
+   サービスを表に加える。 name と argv は複製される。
+   @return 追加されたサービス 失敗した時には NULL を返し、理由を errno に保存する。
+   同じ名前のサービスがある場合は、 EEXIST になる。 名前が使えない文字を含むか、
+   SERVICE_NAME_MAX より長い場合は EINVAL になる。
+ */
+struct service* service_table_add( struct service_table* table , const char* name , char* const argv[] );
+
+/**
+   マニフェストファイルを読み込んで、サービスを表に加える
+   書式の誤りは、ファイル名と行番号と共に標準エラー出力に出力する。
+   @return 成功時には 0 失敗時には -1
+ */
+int service_table_load_manifest( struct service_table* table , const char* path );
+
+/**
+   プロセスID からサービスを探す
+   @return 見つからない場合は NULL
+ */
+struct service* service_table_find_pid( struct service_table* table , pid_t pid );
+
+/**
+   名前からサービスを探す
+   @return 見つからない場合は NULL
+ */
+struct service* service_table_find_name( struct service_table* table , const char* name );
+
+/**
+   サービスが起動したことを記録する
+ */
+void service_started( struct service_table* table , struct service* service , pid_t pid );
+
+/**
+   再起動しようとしたサービスが、起動できなかったことを記録する
+   状態は SERVICE_STATE_EXITED ( 終了コード 127 ) になり、すぐに終了したものとして
+   service_schedule_restart で扱われる。
+ */
+void service_start_failed( struct service_table* table , struct service* service );
+
+/**
+   予備のプロセスを起動したことを記録する
+   @param gate ゲートの親の側 ゲートを使わない場合は -1
+ */
+void service_standby_started( struct service_table* table , struct service* service , pid_t pid , int gate );
+
+/**
+   予備のプロセスを、サービスの実行中のプロセスにする
+   状態は service_started と同じように SERVICE_STATE_RUNNING になる。 ゲートは呼び出し側で閉じる。
+ */
+void service_promote_standby( struct service_table* table , struct service* service );
+
+/**
+   リロードで新しい世代のプロセスを起動したことを記録する
+ */
+void service_reload_started( struct service_table* table , struct service* service , pid_t pid );
+
+/**
+   準備ができた新しい世代を実行中のプロセスにして、それまでのプロセスを古い世代として記録する
+   @return 古い世代のプロセスID ( 終了させるのは呼び出し側で行う )
+ */
+pid_t service_reload_ready( struct service_table* table , struct service* service );
+
+/**
+   準備ができなかった新しい世代を、終了を待つ古い世代として記録しなおす ( リロードを取りやめる )
+   @return そのプロセスID ( 終了させるのは呼び出し側で行う )
+ */
+pid_t service_reload_abort( struct service_table* table , struct service* service );
+
+/**
+   サービスの状態の名前 ( "running" など ) を返す
+   @return 知らない状態の場合は "unknown"
+ */
+const char* service_state_name( enum service_state state );
+
+/**
+   "stop" "gate" から予備のプロセスの待たせ方を得る
+   @return 成功した場合は 0 知らない名前の場合は -1
+ */
+int service_standby_mode_parse( const char* name , enum service_standby_mode* mode );
+
+/**
+   "no" "always" "on-failure" "on-abnormal" から再起動する条件を得る
+   @return 成功した場合は 0 知らない名前の場合は -1
+ */
+int service_restart_mode_parse( const char* name , enum service_restart_mode* mode );
+
+/**
+   終了したサービスを、 policy に従って再起動する必要があるかどうか
+   @return 再起動する場合は 1 そうでない場合は 0
+ */
+int service_needs_restart( const struct service_restart_policy* policy , const struct service* service );
+
+/**
+   終了したサービスの再起動を予定して、状態を SERVICE_STATE_BACKOFF にする
+   crash loop と判定した場合は SERVICE_STATE_FAILED にする。
+   @return 再起動までの時間 ( マイクロ秒 ) を *delay_us に入れて 0 を返す crash loop の場合は -1
+ */
+int service_schedule_restart( struct service_table* table , const struct service_restart_policy* policy ,
+                              struct service* service , unsigned long long* delay_us );
+
+/**
+   再起動を取り消して、状態を SERVICE_STATE_EXITED に戻す ( タイマーの解除は呼び出し側が行う )
+ */
+void service_cancel_restart( struct service_table* table , struct service* service );
+
+/**
+   終了した子プロセスを waitid( P_ALL , WEXITED | WNOHANG | WNOWAIT ) で覗いて、回収できなくなるまで回収する。
+   サービスのプロセス ( 予備のプロセスとリロードの世代を含む ) であれば、記録を更新して handler を呼ぶ。
+   表に無い子プロセスは、 foreign が 0 以外を返せば回収を任せ、そうでなければ ( 引き取った子孫 )
+   回収して table->reap_stats に数えるだけである。 ( 別に監視している子プロセスの終了ステータスを横取りしない )
+   @return 回収した子プロセスの数 ( foreign に任せたものは含まない )
+   @param handler foreign NULL でもよい context はどちらにも渡す
+ */
+size_t service_table_reap( struct service_table* table , service_exit_handler handler ,
+                           service_foreign_handler foreign , void* context );
+
+#endif /* SERVICE_H_HEADER_GUARD */
@@ -0,0 +1,192 @@
+﻿/**
+   イベントループのシグナル処理が、大量のシグナルを受けても取りこぼさないことを確認する
+   ストレステスト兼ベンチマーク
+
+   sigbench [子プロセスの数] [リアルタイムシグナルの数]
+
+   1) 指定された数の子プロセスを一気に fork して、すぐに終了させる ( SIGCHLD の嵐 )
+   2) 送信用の子プロセスから、親プロセスへ sigqueue(3) でリアルタイムシグナルを連射する
+
+   SIGCHLD はカーネル側で合流されるので、受信回数ではなく waitpid(2) で回収できた
+   子プロセスの数を数える。 リアルタイムシグナルはキューイングされるので、
+   イベントループから通知された回数が送信した回数と一致しなければならない。
+   一定時間進展がなければ、取りこぼしたとみなして EXIT_FAILURE で終了する。
+ */
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif /* defined(HAVE_CONFIG_H) */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <assert.h>
+
+#include "verify.h"
+#include "eventloop.h"
+
+#if ( _POSIX_C_SOURCE < 200809L )
+#error you must use compiler option -D_XOPEN_SOURCE=700
+#endif /* ( _POSIX_C_SOURCE < 200809L ) */
+
+/** ベンチマークの状態 */
+struct sigbench_state{
+  /** 回収した子プロセスの数 */
+  unsigned long reaped;
+  /** SIGCHLD のハンドラが呼ばれた回数 */
+  unsigned long sigchld_wakeups;
+  /** 受信したリアルタイムシグナルの数 */
+  unsigned long rt_received;
+  /** リアルタイムシグナルのハンドラが呼ばれた回数 */
+  unsigned long rt_wakeups;
+};
+
+/** 現在時刻を秒で返す */
+static double sigbench_now( void )
+{
+  struct timespec ts = {0};
+  VERIFY( 0 == clock_gettime( CLOCK_MONOTONIC , &ts ) );
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+   SIGCHLD のハンドラ 合流されているので、回収できなくなるまで waitpid(2) する
+ */
+static void sigbench_on_sigchld( struct event_loop* loop , int signo , unsigned int count , void* context )
+{
+  (void)loop;
+  (void)signo;
+  (void)count;
+  struct sigbench_state* const state = context;
+  ++(state->sigchld_wakeups);
+  for(;;){
+    int status = 0;
+    const pid_t pid = waitpid( -1 , &status , WNOHANG );
+    if( 0 < pid ){
+      ++(state->reaped);
+      continue;
+    }
+    if( -1 == pid && EINTR == errno ){
+      continue;
+    }
+    break;
+  }
+  return;
+}
+
+/** リアルタイムシグナルのハンドラ */
+static void sigbench_on_rt( struct event_loop* loop , int signo , unsigned int count , void* context )
+{
+  (void)loop;
+  (void)signo;
+  struct sigbench_state* const state = context;
+  state->rt_received += count;
+  ++(state->rt_wakeups);
+  return;
+}
+
+/**
+   親プロセスへ リアルタイムシグナルを count 回送信する
+   シグナルのキューが一杯 ( EAGAIN ) の場合は、受信側が処理するまで待って再送する
+ */
+static void sigbench_sender( pid_t parent , unsigned long count )
+{
+  for( unsigned long i = 0 ; i < count ; ){
+    union sigval value = {0};
+    value.sival_int = (int)i;
+    if( 0 == sigqueue( parent , SIGRTMIN , value ) ){
+      ++i;
+      continue;
+    }
+    if( EAGAIN == errno ){
+      sched_yield();
+      continue;
+    }
+    perror( "sigqueue()" );
+    _exit( EXIT_FAILURE );
+  }
+  _exit( EXIT_SUCCESS );
+}
+
+int main( int argc , char* argv[] )
+{
+  const unsigned long children = ( 1 < argc ) ? strtoul( argv[1] , NULL , 10 ) : 2000;
+  const unsigned long rt_signals = ( 2 < argc ) ? strtoul( argv[2] , NULL , 10 ) : 100000;
+
+  struct sigbench_state state = {0};
+  struct event_loop* const loop = event_loop_create();
+  if( NULL == loop ){
+    perror( "event_loop_create()" );
+    return EXIT_FAILURE;
+  }
+  VERIFY( 0 == event_loop_add_signal( loop , SIGCHLD , sigbench_on_sigchld , &state ) );
+  VERIFY( 0 == event_loop_add_signal( loop , SIGRTMIN , sigbench_on_rt , &state ) );
+
+  const double start = sigbench_now();
+  {
+    const pid_t parent = getpid();
+    const pid_t pid = fork();
+    if( -1 == pid ){
+      perror( "fork()" );
+      return EXIT_FAILURE;
+    }
+    if( 0 == pid ){
+      sigset_t saved_sigmask;
+      event_loop_saved_sigmask( loop , &saved_sigmask );
+      VERIFY( 0 == sigprocmask( SIG_SETMASK , &saved_sigmask , NULL ) );
+      sigbench_sender( parent , rt_signals );
+    }
+  }
+  unsigned long forked = 1; /* 送信用の子プロセスの分 */
+  for( unsigned long i = 0 ; i < children ; ++i ){
+    const pid_t pid = fork();
+    if( -1 == pid ){
+      /* プロセス数の制限に掛かった場合は、回収が進むまで待つ */
+      if( EAGAIN == errno ){
+        VERIFY( 0 <= event_loop_run_once( loop , 10 ) );
+        --i;
+        continue;
+      }
+      perror( "fork()" );
+      break;
+    }
+    if( 0 == pid ){
+      _exit( EXIT_SUCCESS );
+    }
+    ++forked;
+  }
+
+  double progress = sigbench_now();
+  unsigned long last_reaped = 0;
+  unsigned long last_received = 0;
+  while( state.reaped < forked || state.rt_received < rt_signals ){
+    if( event_loop_run_once( loop , 1000 ) < 0 ){
+      perror( "event_loop_run_once()" );
+      break;
+    }
+    if( last_reaped != state.reaped || last_received != state.rt_received ){
+      last_reaped = state.reaped;
+      last_received = state.rt_received;
+      progress = sigbench_now();
+    }else if( 5.0 < sigbench_now() - progress ){
+      break; /* 5 秒間何も届かないので、取りこぼしている */
+    }
+  }
+  const double elapsed = sigbench_now() - start;
+
+  const int lost = ( state.reaped != forked || state.rt_received != rt_signals );
+  printf( "backend             : %s\n" , event_loop_backend_name() );
+  printf( "children reaped     : %lu / %lu (%lu SIGCHLD wakeups)\n" , state.reaped , forked , state.sigchld_wakeups );
+  printf( "rt signals received : %lu / %lu (%lu wakeups)\n" , state.rt_received , rt_signals , state.rt_wakeups );
+  printf( "elapsed             : %.3f s (%.0f events/s)\n" ,
+          elapsed , ( elapsed > 0 ) ? (double)( state.reaped + state.rt_received ) / elapsed : 0.0 );
+  printf( "result              : %s\n" , lost ? "LOST EVENTS" : "no event lost" );
+
+  event_loop_destroy( loop );
+  return lost ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,5 +1,6 @@
 #!/bin/sh 
 
+# daemonic stop は、コントロールプロセスが終了するまで待ってから戻る
 if [ -f /tmp/daemonic.pid ] ; then
-    kill -INT `cat /tmp/daemonic.pid` ;
+    exec "${DAEMONIC:-./daemonic}" stop -p /tmp/daemonic.pid "$@" ;
 fi
@@ -0,0 +1,442 @@
+﻿/**
+   起動する前に、プログラムと共有ライブラリをページキャッシュへ先読みする
+
+   ELF はファイルを pread(2) で読んで調べる。 ( mmap(2) すると、調べるだけでページフォールトを待つことになる )
+   DT_STRTAB は仮想アドレスなので、 PT_LOAD のセグメントからファイルのオフセットに直す。
+   調べるファイルは queue に積んで、幅優先で辿る。
+ */
+
+/* strchrnul(3) の宣言を得るために必要 */
+#if !defined( _GNU_SOURCE )
+#define _GNU_SOURCE 1
+#endif /* !defined( _GNU_SOURCE ) */
+
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif /* defined(HAVE_CONFIG_H) */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <assert.h>
+
+#if defined( HAVE_ELF_H ) && defined( HAVE_LINK_H )
+#define EXEC_WARMUP_HAVE_ELF 1
+#include <elf.h>
+#include <link.h>
+#endif /* defined( HAVE_ELF_H ) && defined( HAVE_LINK_H ) */
+
+#include "verify.h"
+#include "alternative.h"
+#include "warmup.h"
+
+enum{
+  /** 読み込む動的セクションのエントリの最大の数 */
+  EXEC_WARMUP_MAX_DYNAMIC = 4096,
+  /** 読み込む文字列表 ( DT_STRSZ ) の最大の大きさ */
+  EXEC_WARMUP_MAX_STRTAB = 1024 * 1024,
+  /** 読み込むプログラムヘッダの最大の数 */
+  EXEC_WARMUP_MAX_PHNUM = 256
+};
+
+/** 既定のライブラリのディレクトリ ( 動的リンカのディレクトリの後に探す ) */
+static const char exec_warmup_default_dirs[] = "/lib64:/usr/lib64:/lib:/usr/lib";
+
+/** exec_warmup の作業中の状態 */
+struct exec_warmup{
+  /** これから調べるファイルのパス ( malloc(3) したもの ) */
+  char** queue;
+  size_t queue_head;
+  size_t queue_count;
+  size_t queue_capacity;
+  /** 先読みしたファイルの識別 */
+  dev_t* seen_dev;
+  ino_t* seen_ino;
+  size_t seen_count;
+  size_t seen_capacity;
+  /** 動的リンカのあるディレクトリ ( realpath(3) したもの ) 分からない場合は NULL */
+  char* interp_dir;
+  /** exec_warmup の flags */
+  unsigned int flags;
+  struct exec_warmup_stats stats;
+};
+
+/**
+   path を queue の末尾に積む path は複製する
+   @return 成功した場合は 0 失敗した場合は -1
+*/
+static int exec_warmup_push( struct exec_warmup* warmup , const char* path );
+
+/**
+   dev と ino をまだ先読みしていなければ記録する
+   @return 初めてのファイルの場合は 1 先読みしたことがある場合は 0 失敗した場合は -1
+*/
+static int exec_warmup_mark( struct exec_warmup* warmup , dev_t dev , ino_t ino );
+
+/**
+   path を開いて先読みを頼み ( EXEC_WARMUP_EVICT では追い出し ) 、 ELF であれば、動的リンカと DT_NEEDED のライブラリを queue に積む
+*/
+static void exec_warmup_file( struct exec_warmup* warmup , const char* path );
+
+/**
+   fd が "#!" で始まるスクリプトであれば、インタプリタを queue に積む
+   @return スクリプトの場合は 1 そうでない場合は 0
+*/
+static int exec_warmup_script( struct exec_warmup* warmup , int fd );
+
+#if defined( EXEC_WARMUP_HAVE_ELF )
+/**
+   fd がこのプロセスと同じ ELF クラスとマシンの ELF であれば、 ELF ヘッダを読み込む
+   @return ELF の場合は 1 そうでない場合は 0
+*/
+static int exec_warmup_read_ehdr( int fd , ElfW(Ehdr)* ehdr );
+
+/**
+   ELF を調べて、動的リンカと DT_NEEDED のライブラリを queue に積む
+   @param path ELF のパス ( $ORIGIN に使う )
+*/
+static void exec_warmup_elf( struct exec_warmup* warmup , int fd , const char* path , const ElfW(Ehdr)* ehdr );
+
+/**
+   DT_NEEDED の name を、 dirs ( ':' 区切り NULL の場合は探さない ) から探して queue に積む
+   @return 見つかった場合は 1 見つからなかった場合は 0 失敗した場合は -1
+   @param origin $ORIGIN を置き換えるディレクトリ
+*/
+static int exec_warmup_search( struct exec_warmup* warmup , const char* name , const char* dirs , const char* origin );
+#endif /* defined( EXEC_WARMUP_HAVE_ELF ) */
+
+/************************* 実装 **************************/
+
+int exec_warmup( const char* const* paths , size_t count , unsigned int flags , struct exec_warmup_stats* stats )
+{
+  assert( 0 == count || paths );
+  struct timespec start = {0};
+  VERIFY( 0 == clock_gettime( CLOCK_MONOTONIC , &start ) );
+
+  struct exec_warmup warmup = {0};
+  warmup.flags = flags;
+  int err = 0;
+  for( size_t i = 0 ; i < count ; ++i ){
+    if( 0 != exec_warmup_push( &warmup , paths[i] ) ){
+      err = errno;
+      break;
+    }
+  }
+  /* 積んでいく途中で queue が伸びるので、添字で辿る */
+  for( ; warmup.queue_head < warmup.queue_count ; ++warmup.queue_head ){
+    char* const path = warmup.queue[ warmup.queue_head ];
+    exec_warmup_file( &warmup , path );
+    free( path );
+    warmup.queue[ warmup.queue_head ] = NULL;
+  }
+  free( warmup.queue );
+  free( warmup.seen_dev );
+  free( warmup.seen_ino );
+  free( warmup.interp_dir );
+
+  struct timespec now = {0};
+  VERIFY( 0 == clock_gettime( CLOCK_MONOTONIC , &now ) );
+  warmup.stats.elapsed_us = (unsigned long long)( now.tv_sec - start.tv_sec ) * 1000000ULL +
+    (unsigned long long)( now.tv_nsec - start.tv_nsec ) / 1000ULL;
+  if( stats ){
+    *stats = warmup.stats;
+  }
+  if( 0 == warmup.stats.files ){
+    errno = ( 0 != err ) ? err : ENOENT;
+    return -1;
+  }
+  return 0;
+}
+
+static int exec_warmup_push( struct exec_warmup* warmup , const char* path )
+{
+  if( warmup->queue_capacity <= warmup->queue_count ){
+    const size_t capacity = ( 0 < warmup->queue_capacity ) ? warmup->queue_capacity * 2 : 16;
+    char** const queue = realloc( warmup->queue , sizeof( char* ) * capacity );
+    if( NULL == queue ){
+      return -1;
+    }
+    warmup->queue = queue;
+    warmup->queue_capacity = capacity;
+  }
+  char* const copy = strdup( path );
+  if( NULL == copy ){
+    return -1;
+  }
+  warmup->queue[ warmup->queue_count++ ] = copy;
+  return 0;
+}
+
+static int exec_warmup_mark( struct exec_warmup* warmup , dev_t dev , ino_t ino )
+{
+  for( size_t i = 0 ; i < warmup->seen_count ; ++i ){
+    if( warmup->seen_dev[i] == dev && warmup->seen_ino[i] == ino ){
+      return 0;
+    }
+  }
+  if( warmup->seen_capacity <= warmup->seen_count ){
+    const size_t capacity = ( 0 < warmup->seen_capacity ) ? warmup->seen_capacity * 2 : 16;
+    dev_t* const seen_dev = realloc( warmup->seen_dev , sizeof( dev_t ) * capacity );
+    if( NULL == seen_dev ){
+      return -1;
+    }
+    warmup->seen_dev = seen_dev;
+    ino_t* const seen_ino = realloc( warmup->seen_ino , sizeof( ino_t ) * capacity );
+    if( NULL == seen_ino ){
+      return -1;
+    }
+    warmup->seen_ino = seen_ino;
+    warmup->seen_capacity = capacity;
+  }
+  warmup->seen_dev[ warmup->seen_count ] = dev;
+  warmup->seen_ino[ warmup->seen_count ] = ino;
+  ++(warmup->seen_count);
+  return 1;
+}
+
+static void exec_warmup_file( struct exec_warmup* warmup , const char* path )
+{
+  const int fd = open( path , O_RDONLY | O_CLOEXEC );
+  if( -1 == fd ){
+    return;
+  }
+  struct stat st;
+  if( 0 == fstat( fd , &st ) && S_ISREG( st.st_mode ) && 1 == exec_warmup_mark( warmup , st.st_dev , st.st_ino ) &&
+      0 == x_fadvise_cache( fd , !( warmup->flags & EXEC_WARMUP_EVICT ) ) ){
+    ++(warmup->stats.files);
+    warmup->stats.bytes += (unsigned long long)st.st_size;
+    if( !exec_warmup_script( warmup , fd ) ){
+#if defined( EXEC_WARMUP_HAVE_ELF )
+      ElfW(Ehdr) ehdr;
+      if( exec_warmup_read_ehdr( fd , &ehdr ) ){
+        exec_warmup_elf( warmup , fd , path , &ehdr );
+      }
+#endif /* defined( EXEC_WARMUP_HAVE_ELF ) */
+    }
+  }
+  VERIFY( 0 == close( fd ) );
+  return;
+}
+
+static int exec_warmup_script( struct exec_warmup* warmup , int fd )
+{
+  char line[PATH_MAX];
+  const ssize_t length = pread( fd , line , sizeof( line ) - 1 , 0 );
+  if( length < 2 || '#' != line[0] || '!' != line[1] ){
+    return 0;
+  }
+  line[length] = '\0';
+  char* interp = line + 2;
+  while( ' ' == *interp || '\t' == *interp ){
+    ++interp;
+  }
+  /* 引数と改行を除く 行が長すぎる場合は、途中までのパスを探しても仕方がないので積まない */
+  const size_t interp_length = strcspn( interp , " \t\n" );
+  if( '/' == *interp && ( '\0' != interp[interp_length] || length < (ssize_t)sizeof( line ) - 1 ) ){
+    interp[interp_length] = '\0';
+    (void)exec_warmup_push( warmup , interp );
+  }
+  return 1;
+}
+
+#if defined( EXEC_WARMUP_HAVE_ELF )
+
+/* link.h の ElfW は、このプロセスの ELF クラスの型を選ぶ */
+#if ( 8 == __SIZEOF_POINTER__ )
+#define EXEC_WARMUP_ELF_CLASS ELFCLASS64
+#else /* ( 8 == __SIZEOF_POINTER__ ) */
+#define EXEC_WARMUP_ELF_CLASS ELFCLASS32
+#endif /* ( 8 == __SIZEOF_POINTER__ ) */
+
+static int exec_warmup_read_ehdr( int fd , ElfW(Ehdr)* ehdr )
+{
+  static ElfW(Half) machine = EM_NONE;
+  if( EM_NONE == machine ){
+    /* このプロセス自身のマシンを、自分の実行ファイルから知る */
+    const int self = open( "/proc/self/exe" , O_RDONLY | O_CLOEXEC );
+    if( -1 != self ){
+      ElfW(Ehdr) own;
+      if( (ssize_t)sizeof( own ) == pread( self , &own , sizeof( own ) , 0 ) ){
+        machine = own.e_machine;
+      }
+      VERIFY( 0 == close( self ) );
+    }
+  }
+  if( (ssize_t)sizeof( *ehdr ) != pread( fd , ehdr , sizeof( *ehdr ) , 0 ) ){
+    return 0;
+  }
+  return ( 0 == memcmp( ehdr->e_ident , ELFMAG , SELFMAG ) &&
+           EXEC_WARMUP_ELF_CLASS == ehdr->e_ident[EI_CLASS] &&
+           ( EM_NONE == machine || machine == ehdr->e_machine ) &&
+           sizeof( ElfW(Phdr) ) == ehdr->e_phentsize &&
+           0 < ehdr->e_phnum && ehdr->e_phnum <= EXEC_WARMUP_MAX_PHNUM ) ? 1 : 0;
+}
+
+static void exec_warmup_elf( struct exec_warmup* warmup , int fd , const char* path , const ElfW(Ehdr)* ehdr )
+{
+  ElfW(Phdr) phdrs[EXEC_WARMUP_MAX_PHNUM];
+  const size_t phdrs_size = sizeof( ElfW(Phdr) ) * ehdr->e_phnum;
+  if( (ssize_t)phdrs_size != pread( fd , phdrs , phdrs_size , (off_t)ehdr->e_phoff ) ){
+    return;
+  }
+
+  const ElfW(Phdr)* dynamic = NULL;
+  for( size_t i = 0 ; i < ehdr->e_phnum ; ++i ){
+    const ElfW(Phdr)* const phdr = &phdrs[i];
+    if( PT_DYNAMIC == phdr->p_type ){
+      dynamic = phdr;
+    }else if( PT_INTERP == phdr->p_type && 0 < phdr->p_filesz && phdr->p_filesz < PATH_MAX ){
+      char interp[PATH_MAX];
+      if( (ssize_t)phdr->p_filesz == pread( fd , interp , phdr->p_filesz , (off_t)phdr->p_offset ) ){
+        interp[ phdr->p_filesz ] = '\0';
+        if( NULL == warmup->interp_dir ){
+          /* /lib64/ld-linux-x86-64.so.2 は、 multiarch のディレクトリへのシンボリックリンクのことがある */
+          char* const resolved = realpath( interp , NULL );
+          char* const slash = ( resolved ) ? strrchr( resolved , '/' ) : NULL;
+          if( slash ){
+            *slash = '\0';
+            warmup->interp_dir = resolved;
+          }else{
+            free( resolved );
+          }
+        }
+        (void)exec_warmup_push( warmup , interp );
+      }
+    }
+  }
+  if( NULL == dynamic ){
+    return; /* 静的リンク */
+  }
+
+  size_t dyn_count = dynamic->p_filesz / sizeof( ElfW(Dyn) );
+  if( EXEC_WARMUP_MAX_DYNAMIC < dyn_count ){
+    dyn_count = EXEC_WARMUP_MAX_DYNAMIC;
+  }
+  ElfW(Dyn)* const dyns = calloc( dyn_count , sizeof( ElfW(Dyn) ) );
+  if( NULL == dyns ){
+    return;
+  }
+  if( (ssize_t)( sizeof( ElfW(Dyn) ) * dyn_count ) !=
+      pread( fd , dyns , sizeof( ElfW(Dyn) ) * dyn_count , (off_t)dynamic->p_offset ) ){
+    free( dyns );
+    return;
+  }
+  ElfW(Addr) strtab_addr = 0;
+  size_t strtab_size = 0;
+  for( size_t i = 0 ; i < dyn_count && DT_NULL != dyns[i].d_tag ; ++i ){
+    if( DT_STRTAB == dyns[i].d_tag ){
+      strtab_addr = dyns[i].d_un.d_ptr;
+    }else if( DT_STRSZ == dyns[i].d_tag ){
+      strtab_size = dyns[i].d_un.d_val;
+    }
+  }
+  /* 仮想アドレスを、それを含む PT_LOAD のファイルのオフセットに直す */
+  off_t strtab_offset = -1;
+  for( size_t i = 0 ; i < ehdr->e_phnum ; ++i ){
+    const ElfW(Phdr)* const phdr = &phdrs[i];
+    if( PT_LOAD == phdr->p_type && phdr->p_vaddr <= strtab_addr && strtab_addr < phdr->p_vaddr + phdr->p_filesz ){
+      strtab_offset = (off_t)( strtab_addr - phdr->p_vaddr + phdr->p_offset );
+      break;
+    }
+  }
+  char* const strtab = ( -1 != strtab_offset && 0 < strtab_size && strtab_size <= EXEC_WARMUP_MAX_STRTAB ) ?
+    malloc( strtab_size + 1 ) : NULL;
+  if( NULL == strtab || (ssize_t)strtab_size != pread( fd , strtab , strtab_size , strtab_offset ) ){
+    free( strtab );
+    free( dyns );
+    return;
+  }
+  strtab[strtab_size] = '\0';
+
+  const char* rpath = NULL;
+  const char* runpath = NULL;
+  for( size_t i = 0 ; i < dyn_count && DT_NULL != dyns[i].d_tag ; ++i ){
+    if( DT_RPATH == dyns[i].d_tag && dyns[i].d_un.d_val < strtab_size ){
+      rpath = strtab + dyns[i].d_un.d_val;
+    }else if( DT_RUNPATH == dyns[i].d_tag && dyns[i].d_un.d_val < strtab_size ){
+      runpath = strtab + dyns[i].d_un.d_val;
+    }
+  }
+
+  /* $ORIGIN は、このファイルのあるディレクトリ */
+  char* const origin = strdup( path );
+  if( origin ){
+    char* const slash = strrchr( origin , '/' );
+    if( slash ){
+      *slash = '\0';
+    }else{
+      origin[0] = '.';
+      origin[1] = '\0';
+    }
+  }
+  const char* const search_dirs[] = { ( runpath ) ? NULL : rpath , getenv( "LD_LIBRARY_PATH" ) , runpath ,
+                                      warmup->interp_dir , exec_warmup_default_dirs };
+
+  for( size_t i = 0 ; origin && i < dyn_count && DT_NULL != dyns[i].d_tag ; ++i ){
+    if( DT_NEEDED != dyns[i].d_tag || strtab_size <= dyns[i].d_un.d_val ){
+      continue;
+    }
+    const char* const name = strtab + dyns[i].d_un.d_val;
+    int found = 0;
+    if( strchr( name , '/' ) ){
+      found = ( 0 == exec_warmup_push( warmup , name ) ) ? 1 : -1;
+    }else{
+      for( size_t j = 0 ; 0 == found && j < sizeof( search_dirs ) / sizeof( search_dirs[0] ) ; ++j ){
+        found = exec_warmup_search( warmup , name , search_dirs[j] , origin );
+      }
+    }
+    if( 0 == found ){
+      ++(warmup->stats.unresolved);
+    }
+  }
+  free( origin );
+  free( strtab );
+  free( dyns );
+  return;
+}
+
+static int exec_warmup_search( struct exec_warmup* warmup , const char* name , const char* dirs , const char* origin )
+{
+  if( NULL == dirs ){
+    return 0;
+  }
+  for( const char* p = dirs ; ; ){
+    const char* const end = strchrnul( p , ':' );
+    const int dir_length = (int)( end - p );
+    char candidate[PATH_MAX];
+    int length = -1;
+    if( 0 == strncmp( p , "$ORIGIN" , 7 ) && ( 7 == dir_length || '/' == p[7] ) ){
+      length = snprintf( candidate , sizeof( candidate ) , "%s%.*s/%s" , origin , dir_length - 7 , p + 7 , name );
+    }else if( 0 == strncmp( p , "${ORIGIN}" , 9 ) && ( 9 == dir_length || '/' == p[9] ) ){
+      length = snprintf( candidate , sizeof( candidate ) , "%s%.*s/%s" , origin , dir_length - 9 , p + 9 , name );
+    }else if( 0 < dir_length ){
+      length = snprintf( candidate , sizeof( candidate ) , "%.*s/%s" , dir_length , p , name );
+    }
+    if( 0 < length && length < (int)sizeof( candidate ) ){
+      /* 別の ELF クラス ( /lib の 32 ビット版など ) は、 ld.so(8) と同じように飛ばす */
+      const int fd = open( candidate , O_RDONLY | O_CLOEXEC );
+      if( -1 != fd ){
+        ElfW(Ehdr) ehdr;
+        const int matched = exec_warmup_read_ehdr( fd , &ehdr );
+        VERIFY( 0 == close( fd ) );
+        if( matched ){
+          return ( 0 == exec_warmup_push( warmup , candidate ) ) ? 1 : -1;
+        }
+      }
+    }
+    if( '\0' == *end ){
+      break;
+    }
+    p = end + 1;
+  }
+  return 0;
+}
+
+#endif /* defined( EXEC_WARMUP_HAVE_ELF ) */
@@ -0,0 +1,49 @@
+﻿#if ! defined( WARMUP_H_HEADER_GUARD )
+#define WARMUP_H_HEADER_GUARD 1
+
+/**
+   起動する前に、プログラムと共有ライブラリをページキャッシュへ先読みする
+
+   大きなプログラムのコールドスタートでは、 exec(3) した後のページフォールトで
+   プログラムと共有ライブラリを少しずつ読むのに時間が掛かる。
+   exec_warmup は、プログラムの ELF の PT_INTERP と動的セクションの DT_NEEDED を辿って
+   動的リンカと共有ライブラリ ( 依存するものも含む ) を見つけ、それぞれに
+   posix_fadvise( POSIX_FADV_WILLNEED ) で先読みを頼む。 先読みは読み終わるのを待たずに戻るので、
+   全てのファイルの読み込みが並んで進む。 "#!" で始まるスクリプトは、インタプリタを辿る。
+
+   ライブラリは、 ld.so(8) と同じように DT_RPATH ( DT_RUNPATH が無い場合 ) 、 LD_LIBRARY_PATH 、
+   DT_RUNPATH 、動的リンカのあるディレクトリ、 /lib64 /usr/lib64 /lib /usr/lib の順に探す。
+   ( $ORIGIN は展開し、 /etc/ld.so.cache は読まない ) 見つからないものは数えるだけで、
+   先読みはあくまで最善の努力で行う。 このプロセスと同じ ELF クラスとマシンのものだけを辿る。
+ */
+
+#include <sys/types.h>
+
+/** exec_warmup の flags */
+enum{
+  /** 先読みの代わりに、ページキャッシュから追い出す ( コールドスタートと比べるため execpath warmbench で使う ) */
+  EXEC_WARMUP_EVICT = 0x01
+};
+
+/** exec_warmup の統計 */
+struct exec_warmup_stats{
+  /** 先読みを頼んだ ( EXEC_WARMUP_EVICT では追い出した ) ファイルの数と、その大きさの合計 */
+  size_t files;
+  unsigned long long bytes;
+  /** 見つからなかった DT_NEEDED のライブラリの数 */
+  size_t unresolved;
+  /** 先読みを頼み終わるまでに掛かった時間 ( マイクロ秒 ) 読み終わるまでではない */
+  unsigned long long elapsed_us;
+};
+
+/**
+   paths のプログラムと、その動的リンカと共有ライブラリの先読みを頼む
+   同じファイル ( dev と inode ) は一度だけ先読みする。 PATH からは探さないので、解決したパスを渡すこと。
+   ( proc_spawn_executable_prepare の path など )
+   @return 一つ以上のファイルの先読みを頼めた場合は 0 そうでない場合は -1 を返し、理由を errno に保存する。
+   @param flags EXEC_WARMUP_EVICT の論理和
+   @param stats 統計を受け取る NULL でもよい
+ */
+int exec_warmup( const char* const* paths , size_t count , unsigned int flags , struct exec_warmup_stats* stats );
+
+#endif /* WARMUP_H_HEADER_GUARD */